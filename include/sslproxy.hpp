@@ -1,9 +1,36 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
 #ifdef BOOST_ASIO
 #include <boost/asio.hpp>
@@ -23,452 +50,10844 @@ namespace err = net;
 using net::ip::tcp;
 #endif
 
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 
-class ProxySession : public std::enable_shared_from_this<ProxySession>
+//SSLPROXY_COROUTINE_SESSIONS selects the session engine written with coroutines (CoroutineSession)
+#if defined(SSLPROXY_COROUTINE_SESSIONS) && !defined(BOOST_ASIO_HAS_CO_AWAIT) && !defined(ASIO_HAS_CO_AWAIT)
+#error "SSLPROXY_COROUTINE_SESSIONS needs C++20 coroutines, e.g. -std=c++20"
+#endif
+
+//Kernel TLS offload + splice() forwarding is only available on Linux
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/tls.h>)
+#define SSLPROXY_HAS_KTLS 1
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <linux/tls.h>
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
+#endif
+
+//io_uring for the socket I/O of the sessions (set_io_uring). The features it
+//needs (multishot accept, cancelling by descriptor) came with Linux 5.19
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_ACCEPT_MULTISHOT) && defined(IORING_ASYNC_CANCEL_FD)
+#define SSLPROXY_HAS_IO_URING 1
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#endif
+#endif
+
+//Keeps idle keep-alive connections to the target so that a session
+//doesn't need a new TCP handshake to the backend for every client.
+//Every io_context has its own pool, so it is only used by one thread.
+class UpstreamPool : public std::enable_shared_from_this<UpstreamPool>
 {
 
 public:
-	enum
+	UpstreamPool(std::size_t max_idle, std::chrono::steady_clock::duration max_age, bool health_check) :
+		max_idle_(max_idle),
+		max_age_(max_age),
+		health_check_(health_check),
+		idle_()
+	{}
+
+	//Moves an idle connection to target into socket.
+	//Returns false if there is no usable idle connection
+	bool acquire(const tcp::endpoint& target, tcp::socket& socket, std::chrono::steady_clock::time_point& connected_at)
 	{
-		max_length = 8192
-	};
+		for(std::size_t i = idle_.size(); i > 0;)
+		{
+			//Take the most recently used one, it is the least likely to be closed by the backend
+			if(idle_[--i]->target != target) continue;
 
-	ProxySession(net::io_context& io_context, tcp::endpoint target_endpoint, std::unique_ptr<ssl::stream<tcp::socket>> client_socket) :
-		client_socket_(std::move(client_socket)),
-		target_socket_(io_context),
-		target_endpoint_(std::move(target_endpoint)),
-		target_response_started_(false),
-		header_buffer_()
-	{}
+			std::shared_ptr<IdleConnection> connection = std::move(idle_[i]);
+			idle_.erase(idle_.begin() + static_cast<std::ptrdiff_t>(i));
 
-	void start() {
-		auto self = shared_from_this();
-		//std::cout << "DEBUG: [Session] ProxySession started. Connecting to target." << std::endl;
+			err::error_code ec;
+			connection->in_pool = false;
+			connection->socket.cancel(ec);
 
-		target_socket_.async_connect(target_endpoint_, [this, self](const err::error_code& ec)
-		{
-			if (!ec)
+			if(!is_usable(*connection))
 			{
-				//std::cout << "DEBUG: [Session] Target connected. Starting read/write cycles." << std::endl;
-				self->start_read_from_client();
-				self->start_read_from_target();
+				connection->socket.close(ec);
+				continue;
 			}
-			else
+
+			socket = std::move(connection->socket);
+			connected_at = connection->connected_at;
+			//std::cout << "DEBUG: [UpstreamPool] Reusing idle connection." << std::endl;
+			return true;
+		}
+
+		return false;
+	}
+
+	//Takes back a connection to target after a complete request/response exchange.
+	//If the pool is full, the connection which is idle the longest is closed
+	void release(const tcp::endpoint& target, tcp::socket socket, std::chrono::steady_clock::time_point connected_at)
+	{
+		err::error_code ec;
+
+		if(max_idle_ == 0 || std::chrono::steady_clock::now() - connected_at >= max_age_)
+		{
+			socket.close(ec);
+			return;
+		}
+
+		if(idle_.size() >= max_idle_)
+		{
+			std::shared_ptr<IdleConnection> oldest = idle_.front();
+			remove(oldest);
+		}
+
+		auto connection = std::make_shared<IdleConnection>(target, std::move(socket), connected_at);
+		idle_.push_back(connection);
+
+		//An idle connection must not become readable. If it does,
+		//the backend either closed it or sent garbage, so it is dropped
+		std::weak_ptr<UpstreamPool> weak_self = shared_from_this();
+		connection->socket.async_wait(tcp::socket::wait_read, [weak_self, connection](const err::error_code& wait_ec)
+		{
+			auto self = weak_self.lock();
+			if(!self || wait_ec == net::error::operation_aborted || !connection->in_pool)
 			{
-				//std::cerr << "ProxySession: Target connect error: " << ec.message() << std::endl;
-				self->close_all_resources();
+				return;
 			}
+
+			self->remove(connection);
 		});
 	}
 
+	std::size_t idle_count() const
+	{
+		return idle_.size();
+	}
+
+	//Closes all idle connections, e.g. before a pool which only lives as long as its owner is dropped
+	void clear()
+	{
+		while(!idle_.empty())
+		{
+			std::shared_ptr<IdleConnection> connection = idle_.back();
+			remove(connection);
+		}
+	}
+
 private:
-	std::unique_ptr<ssl::stream<tcp::socket>> client_socket_;
-	tcp::socket target_socket_;
-	tcp::endpoint target_endpoint_;
-	char client_data_[max_length];
-	char target_data_[max_length];
-	bool target_response_started_;
-	std::string header_buffer_;
-	std::string header_end_delimiter_ = "\r\n\r\n";
+	struct IdleConnection
+	{
+		IdleConnection(const tcp::endpoint& e, tcp::socket s, std::chrono::steady_clock::time_point t) :
+			target(e),
+			socket(std::move(s)),
+			connected_at(t),
+			in_pool(true)
+		{}
 
-	void start_read_from_client()
+		tcp::endpoint target;
+		tcp::socket socket;
+		std::chrono::steady_clock::time_point connected_at;
+		bool in_pool;
+	};
+
+	std::size_t max_idle_;
+	std::chrono::steady_clock::duration max_age_;
+	bool health_check_;
+	std::vector<std::shared_ptr<IdleConnection>> idle_;
+
+	bool is_usable(IdleConnection& connection)
 	{
-		auto self = shared_from_this();
-		//std::cout << "DEBUG: [ClientRead] Waiting for data from client (Browser)." << std::endl;
+		if(std::chrono::steady_clock::now() - connection.connected_at >= max_age_)
+		{
+			return false;
+		}
 
-		if (!client_socket_)
+		if(!health_check_)
 		{
-			close_sockets_only_target();
-			return;
+			return connection.socket.is_open();
+		}
+
+		//A healthy idle connection has nothing to read: would_block.
+		//EOF or pending data both mean it can't be used anymore
+		err::error_code ec;
+		char byte;
+		connection.socket.non_blocking(true, ec);
+		connection.socket.receive(net::buffer(&byte, 1), tcp::socket::message_peek, ec);
+		const bool healthy = (ec == net::error::would_block);
+		connection.socket.non_blocking(false, ec);
+
+		return healthy;
+	}
+
+	void remove(const std::shared_ptr<IdleConnection>& connection)
+	{
+		auto it = std::find(idle_.begin(), idle_.end(), connection);
+		if(it != idle_.end())
+		{
+			idle_.erase(it);
 		}
 
-		client_socket_->async_read_some(
-			net::buffer(client_data_, max_length),
-			[this, self](const err::error_code& ec, std::size_t length)
+		err::error_code ec;
+		connection->in_pool = false;
+		connection->socket.close(ec);
+		//std::cout << "DEBUG: [UpstreamPool] Idle connection closed by backend." << std::endl;
+	}
+
+}; //end class UpstreamPool
+
+//How a BackendGroup chooses the backend for a new session
+enum class LoadBalancing
+{
+	round_robin,
+	least_connections,
+	power_of_two_choices
+};
+
+//Failure detection and DNS settings of the backend groups of an SslProxy
+struct BackendSettings
+{
+	LoadBalancing policy = LoadBalancing::round_robin;
+
+	//Passive checks: after max_fails failed connects in a row a backend
+	//is skipped for fail_timeout
+	unsigned max_fails = 3;
+	std::chrono::steady_clock::duration fail_timeout = std::chrono::seconds(10);
+
+	//Active checks: every health_interval each backend gets a test connect. 0 disables them
+	std::chrono::steady_clock::duration health_interval = std::chrono::steady_clock::duration::zero();
+	std::chrono::steady_clock::duration health_timeout = std::chrono::seconds(2);
+
+	//The target host names are resolved again every resolve_interval. 0 disables it
+	std::chrono::steady_clock::duration resolve_interval = std::chrono::steady_clock::duration::zero();
+};
+
+//One resolved address of a target. The counters are shared by all threads
+struct Backend
+{
+	explicit Backend(const tcp::endpoint& e) :
+		endpoint(e),
+		active(0),
+		failures(0),
+		down_until(0),
+		probe_ok(true)
+	{}
+
+	bool available(std::int64_t now) const
+	{
+		return probe_ok.load(std::memory_order_relaxed) && down_until.load(std::memory_order_relaxed) <= now;
+	}
+
+	tcp::endpoint endpoint;
+	std::atomic<std::size_t> active;
+	std::atomic<unsigned> failures;
+	std::atomic<std::int64_t> down_until;
+	std::atomic<bool> probe_ok;
+};
+
+//The backends of one target list (the default target or an SNI route).
+//The list is immutable and replaced as a whole when DNS returns other addresses.
+//Each thread keeps its own reference to the list and only reloads it when the version
+//changes, so select() takes no lock. The health state lives in the shared Backend objects
+class BackendGroup : public std::enable_shared_from_this<BackendGroup>
+{
+
+public:
+	using Target = std::pair<std::string, unsigned short>;
+	using BackendList = std::vector<std::shared_ptr<Backend>>;
+
+	BackendGroup(std::vector<Target> targets, const std::vector<tcp::endpoint>& endpoints) :
+		targets_(std::move(targets)),
+		settings_(),
+		backends_(std::make_shared<const BackendList>(make_list(endpoints, BackendList()))),
+		version_(0),
+		views_(1),
+		started_(false),
+		resolve_timer_(),
+		probe_timer_(),
+		resolver_()
+	{}
+
+	BackendGroup(const BackendGroup&) = delete;
+	BackendGroup& operator=(const BackendGroup&) = delete;
+
+	//Resolves all targets, blocking. For the configuration before start()
+	static std::shared_ptr<BackendGroup> resolve(net::io_context& io_context, std::vector<Target> targets)
+	{
+		tcp::resolver resolver(io_context);
+		std::vector<tcp::endpoint> endpoints;
+
+		for(const Target& target : targets)
+		{
+			for(const auto& entry : resolver.resolve(target.first, std::to_string(target.second)))
 			{
-				if (!ec)
-				{
-					//std::cout << "DEBUG: Read " << length << " bytes from client (Encrypted)." << std::endl;
-					net::async_write(self->target_socket_, net::buffer(self->client_data_, length), [this, self](const err::error_code& write_ec, std::size_t /*written*/)
-					{
-						if(!write_ec)
-						{
-							self->start_read_from_client();
-						}
-						else
-						{
-							std::cerr << "ProxySession: Write to target error: " << write_ec.message() << std::endl;
-							self->do_shutdown();
-						}
-					});
-				}
-				else if (ec == net::error::eof)
-				{
-					//std::cout << "DEBUG: Client closed connection. Starting shutdown." << std::endl;
-					self->do_shutdown();
-				}
-				else if (ec != net::error::operation_aborted)
+				add_unique(endpoints, entry.endpoint());
+			}
+		}
+
+		if(endpoints.empty())
+		{
+			throw std::invalid_argument("BackendGroup: No target could be resolved");
+		}
+
+		return std::make_shared<BackendGroup>(std::move(targets), endpoints);
+	}
+
+	//Starts the health checks and DNS refresh on io_context.
+	//Needs to be called before any worker selects from the group, calling it again does nothing
+	void start(net::io_context& io_context, const BackendSettings& settings, std::size_t worker_count)
+	{
+		if(started_) return;
+		started_ = true;
+
+		settings_ = settings;
+		views_.assign(std::max<std::size_t>(worker_count, 1), WorkerView());
+
+		if(settings_.resolve_interval > std::chrono::steady_clock::duration::zero())
+		{
+			resolver_ = std::make_unique<tcp::resolver>(io_context);
+			resolve_timer_ = std::make_unique<net::steady_timer>(io_context);
+			schedule_resolve();
+		}
+
+		if(settings_.health_interval > std::chrono::steady_clock::duration::zero())
+		{
+			probe_timer_ = std::make_unique<net::steady_timer>(io_context);
+			schedule_probe();
+		}
+	}
+
+	//Chooses a backend for a new session. Only called from the thread of worker.
+	//If all backends are down, one of them is tried anyway
+	std::shared_ptr<Backend> select(std::size_t worker)
+	{
+		WorkerView& view = views_[worker];
+
+		const std::uint64_t version = version_.load(std::memory_order_acquire);
+		if(!view.backends || view.version != version)
+		{
+			view.backends = std::atomic_load(&backends_);
+			view.version = version;
+		}
+
+		const BackendList& list = *view.backends;
+		const std::int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+
+		switch(settings_.policy)
+		{
+		case LoadBalancing::least_connections:
+		{
+			const Backend* best = nullptr;
+			std::size_t best_index = 0;
+			for(std::size_t i = 0; i < list.size(); ++i)
+			{
+				if(!list[i]->available(now)) continue;
+				if(!best || list[i]->active.load(std::memory_order_relaxed) < best->active.load(std::memory_order_relaxed))
 				{
-					//std::cerr << "ProxySession: Read from client error: " << ec.message() << std::endl;
-					self->do_shutdown();
+					best = list[i].get();
+					best_index = i;
 				}
 			}
-		);
+			if(best) return list[best_index];
+			break;
+		}
+
+		case LoadBalancing::power_of_two_choices:
+		{
+			//Two random backends, the one with fewer sessions wins
+			std::uniform_int_distribution<std::size_t> distribution(0, list.size() - 1);
+			for(int attempt = 0; attempt < 4; ++attempt)
+			{
+				const std::shared_ptr<Backend>& first = list[distribution(view.random)];
+				const std::shared_ptr<Backend>& second = list[distribution(view.random)];
+				const bool first_ok = first->available(now);
+				const bool second_ok = second->available(now);
+
+				if(first_ok && second_ok) return first->active.load(std::memory_order_relaxed) <= second->active.load(std::memory_order_relaxed) ? first : second;
+				if(first_ok) return first;
+				if(second_ok) return second;
+			}
+			break;
+		}
+
+		case LoadBalancing::round_robin:
+			break;
+		}
+
+		//Round-robin, also the fallback if the policies above found nothing
+		for(std::size_t i = 0; i < list.size(); ++i)
+		{
+			const std::shared_ptr<Backend>& backend = list[view.next++ % list.size()];
+			if(backend->available(now)) return backend;
+		}
+
+		return list[view.next++ % list.size()];
+	}
+
+	void report_failure(Backend& backend)
+	{
+		if(backend.failures.fetch_add(1, std::memory_order_relaxed) + 1 >= settings_.max_fails)
+		{
+			const auto until = std::chrono::steady_clock::now() + settings_.fail_timeout;
+			backend.down_until.store(until.time_since_epoch().count(), std::memory_order_relaxed);
+		}
+	}
+
+	void report_success(Backend& backend)
+	{
+		//Only written if it changes, the counters are shared between the threads
+		if(backend.failures.load(std::memory_order_relaxed) != 0) backend.failures.store(0, std::memory_order_relaxed);
+		if(backend.down_until.load(std::memory_order_relaxed) != 0) backend.down_until.store(0, std::memory_order_relaxed);
+	}
+
+	std::shared_ptr<const BackendList> backends() const
+	{
+		return std::atomic_load(&backends_);
+	}
+
+	//Replaces the backends, the ones which stay keep their state
+	void update(const std::vector<tcp::endpoint>& endpoints)
+	{
+		std::shared_ptr<const BackendList> current = std::atomic_load(&backends_);
+
+		BackendList list = make_list(endpoints, *current);
+		if(list == *current) return;
+
+		std::atomic_store(&backends_, std::shared_ptr<const BackendList>(std::make_shared<const BackendList>(std::move(list))));
+		version_.fetch_add(1, std::memory_order_release);
+		//std::cout << "DEBUG: [BackendGroup] Backends changed, now " << endpoints.size() << std::endl;
+	}
+
+private:
+	struct WorkerView
+	{
+		std::shared_ptr<const BackendList> backends{};
+		std::uint64_t version = 0;
+		std::size_t next = 0;
+		std::minstd_rand random{std::random_device()()};
+	};
+
+	std::vector<Target> targets_;
+	BackendSettings settings_;
+	std::shared_ptr<const BackendList> backends_;
+	std::atomic<std::uint64_t> version_;
+	std::vector<WorkerView> views_;
+	bool started_;
+	std::unique_ptr<net::steady_timer> resolve_timer_;
+	std::unique_ptr<net::steady_timer> probe_timer_;
+	std::unique_ptr<tcp::resolver> resolver_;
+
+	static void add_unique(std::vector<tcp::endpoint>& endpoints, const tcp::endpoint& endpoint)
+	{
+		if(std::find(endpoints.begin(), endpoints.end(), endpoint) == endpoints.end()) endpoints.push_back(endpoint);
+	}
+
+	static BackendList make_list(const std::vector<tcp::endpoint>& endpoints, const BackendList& current)
+	{
+		BackendList list;
+		for(const tcp::endpoint& endpoint : endpoints)
+		{
+			auto existing = std::find_if(current.begin(), current.end(), [&endpoint](const std::shared_ptr<Backend>& backend)
+			{
+				return backend->endpoint == endpoint;
+			});
+			list.push_back(existing != current.end() ? *existing : std::make_shared<Backend>(endpoint));
+		}
+		return list;
+	}
+
+	void schedule_resolve()
+	{
+		std::weak_ptr<BackendGroup> weak_self = shared_from_this();
+		resolve_timer_->expires_after(settings_.resolve_interval);
+		resolve_timer_->async_wait([weak_self](const err::error_code& ec)
+		{
+			auto self = weak_self.lock();
+			if(self && !ec) self->resolve_targets();
+		});
+	}
+
+	//Resolves all targets asynchronously. If one of them fails, the old list stays
+	void resolve_targets()
+	{
+		struct Pending
+		{
+			std::vector<tcp::endpoint> endpoints{};
+			std::size_t remaining = 0;
+			bool failed = false;
+		};
+
+		auto pending = std::make_shared<Pending>();
+		pending->remaining = targets_.size();
+		std::weak_ptr<BackendGroup> weak_self = shared_from_this();
+
+		for(const Target& target : targets_)
+		{
+			resolver_->async_resolve(target.first, std::to_string(target.second), [weak_self, pending](const err::error_code& ec, tcp::resolver::results_type results)
+			{
+				auto self = weak_self.lock();
+				if(!self) return;
+
+				if(ec) pending->failed = true;
+				for(const auto& entry : results) add_unique(pending->endpoints, entry.endpoint());
+
+				if(--pending->remaining > 0) return;
+
+				if(!pending->failed && !pending->endpoints.empty()) self->update(pending->endpoints);
+				//else std::cerr << "BackendGroup: DNS refresh failed, keeping the old backends." << std::endl;
+
+				self->schedule_resolve();
+			});
+		}
+	}
+
+	void schedule_probe()
+	{
+		std::weak_ptr<BackendGroup> weak_self = shared_from_this();
+		probe_timer_->expires_after(settings_.health_interval);
+		probe_timer_->async_wait([weak_self](const err::error_code& ec)
+		{
+			auto self = weak_self.lock();
+			if(self && !ec) self->probe_backends();
+		});
+	}
+
+	//Connects to every backend, the ones which don't answer within health_timeout are skipped
+	void probe_backends()
+	{
+		std::shared_ptr<const BackendList> list = std::atomic_load(&backends_);
+		auto remaining = std::make_shared<std::size_t>(list->size());
+		std::weak_ptr<BackendGroup> weak_self = shared_from_this();
+		auto executor = probe_timer_->get_executor();
+
+		for(const std::shared_ptr<Backend>& backend : *list)
+		{
+			auto socket = std::make_shared<tcp::socket>(executor);
+			auto timeout = std::make_shared<net::steady_timer>(executor);
+
+			timeout->expires_after(settings_.health_timeout);
+			timeout->async_wait([socket](const err::error_code& ec)
+			{
+				err::error_code close_ec;
+				if(!ec) socket->close(close_ec);
+			});
+
+			socket->async_connect(backend->endpoint, [weak_self, backend, socket, timeout, remaining](const err::error_code& ec)
+			{
+				timeout->cancel();
+				err::error_code close_ec;
+				socket->close(close_ec);
+
+				auto self = weak_self.lock();
+				if(!self) return;
+
+				backend->probe_ok.store(!ec, std::memory_order_relaxed);
+				if(!ec) self->report_success(*backend);
+				//else std::cerr << "BackendGroup: Health check of " << backend->endpoint << " failed: " << ec.message() << std::endl;
+
+				if(--*remaining == 0) self->schedule_probe();
+			});
+		}
+
+		if(list->empty()) schedule_probe();
+	}
+
+}; //end class BackendGroup
+
+//The backend a session or an HTTP/2 stream is connected to. While it is held, the backend
+//counts it in active, which least_connections and power_of_two_choices compare
+class BackendLease
+{
+
+public:
+	BackendLease() :
+		backend_()
+	{}
+
+	BackendLease(const BackendLease&) = delete;
+	BackendLease& operator=(const BackendLease&) = delete;
+
+	~BackendLease()
+	{
+		release();
+	}
+
+	//Moves to the backend backends chooses for worker (e.g. after a failed connect), returns its endpoint
+	const tcp::endpoint& choose(BackendGroup& backends, std::size_t worker)
+	{
+		release();
+		backend_ = backends.select(worker);
+		backend_->active.fetch_add(1, std::memory_order_relaxed);
+		return backend_->endpoint;
+	}
+
+	void release()
+	{
+		if(backend_) backend_->active.fetch_sub(1, std::memory_order_relaxed);
+		backend_.reset();
+	}
+
+	explicit operator bool() const { return backend_ != nullptr; }
+	Backend& operator*() const { return *backend_; }
+
+private:
+	std::shared_ptr<Backend> backend_;
+
+}; //end class BackendLease
+
+//Snapshot of one target for SslProxy::get_backend_status
+struct BackendStatus
+{
+	std::string address;
+	std::size_t active_sessions;
+	bool available;
+};
+
+//Counters about TLS session resumption
+struct TlsResumptionStats
+{
+	std::uint64_t full_handshakes;
+	std::uint64_t resumed_handshakes;
+	std::uint64_t cache_hits;
+	std::uint64_t cache_misses;
+	std::uint64_t cache_evictions;
+	std::size_t cache_size;
+};
+
+//Server side cache for session id based resumption (TLS 1.2, and TLS 1.3 without tickets).
+//It replaces the internal OpenSSL cache, is bounded to max_size sessions
+//and evicts the least recently used one if it is full.
+//The cache is shared between all threads of an SslProxy
+class TlsSessionCache
+{
+
+public:
+	TlsSessionCache(std::size_t max_size, std::chrono::seconds timeout) :
+		max_size_(max_size),
+		timeout_(timeout),
+		mutex_(),
+		sessions_(),
+		index_(),
+		hits_(0),
+		misses_(0),
+		evictions_(0)
+	{}
+
+	TlsSessionCache(const TlsSessionCache&) = delete;
+	TlsSessionCache& operator=(const TlsSessionCache&) = delete;
+
+	~TlsSessionCache()
+	{
+		for(auto &entry : sessions_)
+		{
+			SSL_SESSION_free(entry.second);
+		}
+	}
+
+	void attach(SSL_CTX* ctx)
+	{
+		SSL_CTX_set_ex_data(ctx, ex_index(), this);
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+		SSL_CTX_set_timeout(ctx, static_cast<long>(timeout_.count()));
+		SSL_CTX_sess_set_new_cb(ctx, &TlsSessionCache::on_new_session);
+		SSL_CTX_sess_set_get_cb(ctx, &TlsSessionCache::on_get_session);
+		SSL_CTX_sess_set_remove_cb(ctx, &TlsSessionCache::on_remove_session);
+	}
+
+	//Changes the limits, surplus sessions are evicted. The timeout applies to the
+	//contexts attached afterwards, including the one of the next attach() call
+	void configure(std::size_t max_size, std::chrono::seconds timeout)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		max_size_ = max_size;
+		timeout_ = timeout;
+		evict(max_size_);
+	}
+
+	std::size_t size()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return sessions_.size();
+	}
+
+	std::uint64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+	std::uint64_t misses() const { return misses_.load(std::memory_order_relaxed); }
+	std::uint64_t evictions() const { return evictions_.load(std::memory_order_relaxed); }
+
+private:
+	using SessionList = std::list<std::pair<std::string, SSL_SESSION*>>;
+
+	std::size_t max_size_;
+	std::chrono::seconds timeout_;
+	std::mutex mutex_;
+	SessionList sessions_;
+	std::unordered_map<std::string, SessionList::iterator> index_;
+	std::atomic<std::uint64_t> hits_;
+	std::atomic<std::uint64_t> misses_;
+	std::atomic<std::uint64_t> evictions_;
+
+	static int ex_index()
+	{
+		static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+		return index;
+	}
+
+	//Removes the least recently used sessions until at most max_size are left, mutex_ is locked
+	void evict(std::size_t max_size)
+	{
+		while(sessions_.size() > max_size)
+		{
+			index_.erase(sessions_.back().first);
+			SSL_SESSION_free(sessions_.back().second);
+			sessions_.pop_back();
+			evictions_.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	static TlsSessionCache* from_ctx(SSL_CTX* ctx)
+	{
+		return static_cast<TlsSessionCache*>(SSL_CTX_get_ex_data(ctx, ex_index()));
+	}
+
+	static std::string session_key(const SSL_SESSION* session)
+	{
+		unsigned int length = 0;
+		const unsigned char* id = SSL_SESSION_get_id(session, &length);
+		return std::string(reinterpret_cast<const char*>(id), length);
+	}
+
+	static int on_new_session(SSL* ssl, SSL_SESSION* session)
+	{
+		TlsSessionCache* self = from_ctx(SSL_get_SSL_CTX(ssl));
+		if(!self) return 0;
+
+		std::string key = session_key(session);
+		std::lock_guard<std::mutex> lock(self->mutex_);
+		if(self->max_size_ == 0) return 0;
+
+		auto existing = self->index_.find(key);
+		if(existing != self->index_.end())
+		{
+			SSL_SESSION_free(existing->second->second);
+			self->sessions_.erase(existing->second);
+			self->index_.erase(existing);
+		}
+
+		self->evict(self->max_size_ - 1);
+
+		self->sessions_.emplace_front(std::move(key), session);
+		self->index_[self->sessions_.front().first] = self->sessions_.begin();
+
+		//Returning 1 keeps the reference OpenSSL passed to us
+		return 1;
+	}
+
+	static SSL_SESSION* on_get_session(SSL* ssl, const unsigned char* id, int length, int* copy)
+	{
+		*copy = 0;
+		TlsSessionCache* self = from_ctx(SSL_get_SSL_CTX(ssl));
+		if(!self) return nullptr;
+
+		std::lock_guard<std::mutex> lock(self->mutex_);
+
+		auto it = self->index_.find(std::string(reinterpret_cast<const char*>(id), static_cast<std::size_t>(length)));
+		if(it == self->index_.end())
+		{
+			self->misses_.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		SSL_SESSION* session = it->second->second;
+		if(SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < static_cast<long>(std::time(nullptr)))
+		{
+			SSL_SESSION_free(session);
+			self->sessions_.erase(it->second);
+			self->index_.erase(it);
+			self->misses_.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		//Most recently used sessions are kept at the front
+		self->sessions_.splice(self->sessions_.begin(), self->sessions_, it->second);
+		self->hits_.fetch_add(1, std::memory_order_relaxed);
+
+		SSL_SESSION_up_ref(session);
+		return session;
+	}
+
+	static void on_remove_session(SSL_CTX* ctx, SSL_SESSION* session)
+	{
+		TlsSessionCache* self = from_ctx(ctx);
+		if(!self) return;
+
+		std::lock_guard<std::mutex> lock(self->mutex_);
+
+		auto it = self->index_.find(session_key(session));
+		if(it != self->index_.end() && it->second->second == session)
+		{
+			SSL_SESSION_free(session);
+			self->sessions_.erase(it->second);
+			self->index_.erase(it);
+		}
+	}
+
+}; //end class TlsSessionCache
+
+//Keys for stateless session tickets, loaded from a file in the format used by nginx/haproxy.
+//Every key is either 48 bytes (16 bytes name, 16 bytes HMAC secret, 16 bytes AES-128 key)
+//or 80 bytes (16 bytes name, 32 bytes HMAC secret, 32 bytes AES-256 key).
+//The first key of the file issues new tickets, all of them are accepted.
+//To rotate the keys, prepend a new key to the file and load it again.
+//A file of several keys should state their length: 240 bytes are five 48 byte keys
+//as well as three 80 byte keys, such sizes are rejected without it
+class TlsTicketKeys
+{
+
+public:
+	TlsTicketKeys() :
+		keys_(std::make_shared<const std::vector<Key>>())
+	{}
+
+	TlsTicketKeys(const TlsTicketKeys&) = delete;
+	TlsTicketKeys& operator=(const TlsTicketKeys&) = delete;
+
+	enum { aes128_key_length = 48, aes256_key_length = 80 };
+
+	//key_length is 48, 80 or 0 to find it from the size of the file.
+	//Can be called at any time, handshakes in flight keep using the previous keys
+	void load(const std::string& key_file, std::size_t key_length = 0)
+	{
+		std::ifstream in(key_file, std::ios::binary);
+		if(!in)
+		{
+			throw std::runtime_error("Could not open session ticket key file " + key_file);
+		}
+
+		std::vector<unsigned char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+		if(key_length == 0)
+		{
+			const bool aes128 = !data.empty() && data.size() % aes128_key_length == 0;
+			const bool aes256 = !data.empty() && data.size() % aes256_key_length == 0;
+			if(aes128 && aes256) throw std::runtime_error("Ambiguous session ticket key file " + key_file + ": " + std::to_string(data.size()) + " bytes can be 48 or 80 byte keys, the key length needs to be given");
+			if(!aes128 && !aes256) throw std::runtime_error("Invalid session ticket key file " + key_file + ": expected a multiple of 48 or 80 bytes");
+			key_length = aes128 ? aes128_key_length : aes256_key_length;
+		}
+
+		if(key_length != aes128_key_length && key_length != aes256_key_length)
+			throw std::runtime_error("Invalid session ticket key length " + std::to_string(key_length) + ": expected 48 or 80 bytes");
+		if(data.empty() || data.size() % key_length != 0)
+			throw std::runtime_error("Invalid session ticket key file " + key_file + ": expected a multiple of " + std::to_string(key_length) + " bytes");
+
+		const std::size_t secret_length = (key_length - 16) / 2;
+		auto keys = std::make_shared<std::vector<Key>>();
+
+		for(std::size_t offset = 0; offset < data.size(); offset += key_length)
+		{
+			Key key;
+			std::memcpy(key.name, &data[offset], sizeof(key.name));
+			key.hmac_secret.assign(data.begin() + offset + 16, data.begin() + offset + 16 + secret_length);
+			key.aes_key.assign(data.begin() + offset + 16 + secret_length, data.begin() + offset + key_length);
+			keys->push_back(std::move(key));
+		}
+
+		std::atomic_store(&keys_, std::shared_ptr<const std::vector<Key>>(std::move(keys)));
+	}
+
+	void attach(SSL_CTX* ctx)
+	{
+		SSL_CTX_set_ex_data(ctx, ex_index(), this);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, &TlsTicketKeys::on_ticket);
+#else
+		SSL_CTX_set_tlsext_ticket_key_cb(ctx, &TlsTicketKeys::on_ticket);
+#endif
+	}
+
+	std::size_t size() const
+	{
+		return std::atomic_load(&keys_)->size();
+	}
+
+private:
+	struct Key
+	{
+		unsigned char name[16] = {};
+		std::vector<unsigned char> hmac_secret{};
+		std::vector<unsigned char> aes_key{};
+	};
+
+	std::shared_ptr<const std::vector<Key>> keys_;
+
+	static int ex_index()
+	{
+		static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+		return index;
+	}
+
+	static const EVP_CIPHER* cipher_for(const Key& key)
+	{
+		return key.aes_key.size() == 32 ? EVP_aes_256_cbc() : EVP_aes_128_cbc();
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	static int init_hmac(const Key& key, EVP_MAC_CTX* hmac_ctx)
+	{
+		char digest[] = "SHA256";
+		OSSL_PARAM params[] = {
+			OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+			OSSL_PARAM_construct_end()
+		};
+		return EVP_MAC_init(hmac_ctx, key.hmac_secret.data(), key.hmac_secret.size(), params);
+	}
+
+	static int on_ticket(SSL* ssl, unsigned char* key_name, unsigned char* iv, EVP_CIPHER_CTX* cipher_ctx, EVP_MAC_CTX* hmac_ctx, int encrypt)
+#else
+	static int init_hmac(const Key& key, HMAC_CTX* hmac_ctx)
+	{
+		return HMAC_Init_ex(hmac_ctx, key.hmac_secret.data(), static_cast<int>(key.hmac_secret.size()), EVP_sha256(), nullptr);
+	}
+
+	static int on_ticket(SSL* ssl, unsigned char* key_name, unsigned char* iv, EVP_CIPHER_CTX* cipher_ctx, HMAC_CTX* hmac_ctx, int encrypt)
+#endif
+	{
+		auto self = static_cast<TlsTicketKeys*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ex_index()));
+		if(!self) return -1;
+
+		std::shared_ptr<const std::vector<Key>> keys = std::atomic_load(&self->keys_);
+
+		if(encrypt)
+		{
+			if(keys->empty()) return -1;
+
+			const Key& key = keys->front();
+			const EVP_CIPHER* cipher = cipher_for(key);
+
+			if(RAND_bytes(iv, EVP_CIPHER_iv_length(cipher)) != 1) return -1;
+			std::memcpy(key_name, key.name, sizeof(key.name));
+
+			if(EVP_EncryptInit_ex(cipher_ctx, cipher, nullptr, key.aes_key.data(), iv) != 1) return -1;
+			if(init_hmac(key, hmac_ctx) != 1) return -1;
+
+			return 1;
+		}
+
+		for(std::size_t i = 0; i < keys->size(); ++i)
+		{
+			const Key& key = (*keys)[i];
+			if(std::memcmp(key_name, key.name, sizeof(key.name)) != 0) continue;
+
+			if(init_hmac(key, hmac_ctx) != 1) return -1;
+			if(EVP_DecryptInit_ex(cipher_ctx, cipher_for(key), nullptr, key.aes_key.data(), iv) != 1) return -1;
+
+			//2 tells OpenSSL to issue a new ticket with the current key
+			return i == 0 ? 1 : 2;
+		}
+
+		//Unknown key: fall back to a full handshake
+		return 0;
+	}
+
+}; //end class TlsTicketKeys
+
+//A virtual host of an SslProxy: the certificate for its SNI names
+//and the targets its connections are forwarded to
+struct SniRoute
+{
+	std::shared_ptr<ssl::context> context;
+	std::shared_ptr<BackendGroup> backends;
+};
+
+//Maps SNI host names to routes. Names are exact (www.example.com) or wildcards for one
+//label (*.example.com). A lookup is at most two hash lookups, independent of the number of names.
+//During the handshake the servername callback switches the connection to the SSL_CTX
+//of the route. A router isn't changed anymore once it is used by connections,
+//SslProxy publishes a copy with every configuration
+class SniRouter
+{
+
+public:
+	SniRouter() :
+		routes_()
+	{}
+
+	void add(const std::string& host_name, std::shared_ptr<SniRoute> route)
+	{
+		routes_[normalize(host_name)] = std::move(route);
+	}
+
+	bool empty() const
+	{
+		return routes_.empty();
+	}
+
+	std::size_t size() const
+	{
+		return routes_.size();
+	}
+
+	//Calls f for every distinct route (a route can have several names)
+	template <class Function>
+	void for_each_route(Function f) const
+	{
+		std::unordered_set<const SniRoute*> seen;
+		for(const auto& entry : routes_)
+		{
+			if(seen.insert(entry.second.get()).second) f(*entry.second);
+		}
+	}
+
+	//Returns nullptr if no route matches
+	std::shared_ptr<SniRoute> find(const char* host_name) const
+	{
+		if(!host_name || routes_.empty()) return nullptr;
+
+		std::string key = normalize(host_name);
+		auto it = routes_.find(key);
+		if(it != routes_.end()) return it->second;
+
+		const std::size_t dot = key.find('.');
+		if(dot == std::string::npos || dot == 0) return nullptr;
+
+		key.replace(0, dot, "*");
+		it = routes_.find(key);
+		return it != routes_.end() ? it->second : nullptr;
+	}
+
+	//Installs the servername callback on the default context
+	static void attach(SSL_CTX* ctx)
+	{
+		SSL_CTX_set_tlsext_servername_callback(ctx, &SniRouter::servername_callback);
+	}
+
+	//The router is set per connection and not per context, so a reload can
+	//replace the routes while handshakes with the old ones are still running.
+	//After the handshake it is reset with router = nullptr
+	static void bind(SSL* ssl, const SniRouter* router)
+	{
+		SSL_set_ex_data(ssl, ex_index(), const_cast<SniRouter*>(router));
+	}
+
+	//The route the handshake of ssl selected (nullptr for the default context)
+	std::shared_ptr<SniRoute> find(SSL* ssl) const
+	{
+		return find(SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name));
+	}
+
+private:
+	std::unordered_map<std::string, std::shared_ptr<SniRoute>> routes_;
+
+	static std::string normalize(std::string name)
+	{
+		if(!name.empty() && name.back() == '.') name.pop_back();
+		for(char& c : name) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+		return name;
+	}
+
+	static int ex_index()
+	{
+		static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+		return index;
+	}
+
+	static int servername_callback(SSL* ssl, int* /*alert*/, void* /*arg*/)
+	{
+		const SniRouter* router = static_cast<const SniRouter*>(SSL_get_ex_data(ssl, ex_index()));
+		if(!router) return SSL_TLSEXT_ERR_OK;
+
+		std::shared_ptr<SniRoute> route = router->find(ssl);
+
+		//Unknown or missing names get the default certificate
+		if(!route) return SSL_TLSEXT_ERR_OK;
+
+		SSL_set_SSL_CTX(ssl, route->context->native_handle());
+		return SSL_TLSEXT_ERR_OK;
+	}
+
+}; //end class SniRouter
+
+//Chooses the application protocol of a connection with ALPN: h2 if the client offers it
+//(see Http2Session), otherwise http/1.1. Without the callback nothing is selected
+//and every client speaks HTTP/1.x, which is the default
+class AlpnSelector
+{
+
+public:
+	//Installs the callback on ctx, or removes it if http2 is false
+	static void attach(SSL_CTX* ctx, bool http2)
+	{
+		if(http2) SSL_CTX_set_alpn_select_cb(ctx, &AlpnSelector::select_callback, nullptr);
+		else SSL_CTX_set_alpn_select_cb(ctx, nullptr, nullptr);
+	}
+
+	//True if the handshake of ssl selected h2
+	static bool is_http2(SSL* ssl)
+	{
+		const unsigned char* protocol = nullptr;
+		unsigned int length = 0;
+		SSL_get0_alpn_selected(ssl, &protocol, &length);
+		return length == 2 && std::memcmp(protocol, "h2", 2) == 0;
+	}
+
+private:
+	static int select_callback(SSL* /*ssl*/, const unsigned char** out, unsigned char* out_length, const unsigned char* in, unsigned int in_length, void* /*arg*/)
+	{
+		//In the order of preference, the first one the client offers as well wins
+		static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+
+		unsigned char* selected = nullptr;
+		if(SSL_select_next_proto(&selected, out_length, protocols, sizeof(protocols) - 1, in, in_length) != OPENSSL_NPN_NEGOTIATED)
+		{
+			return SSL_TLSEXT_ERR_NOACK;
+		}
+
+		*out = selected;
+		return SSL_TLSEXT_ERR_OK;
+	}
+
+}; //end class AlpnSelector
+
+#ifdef SSLPROXY_HAS_KTLS
+//Hands the TLS record encryption of an established connection over to the kernel (kTLS).
+//The asio ssl::stream works on memory BIOs, so OpenSSL can't enable kTLS on its own.
+//Instead the traffic keys are derived here and installed on the socket directly.
+//Afterwards the socket carries plaintext and can be used with splice().
+//Supported are AES-GCM cipher suites of TLS 1.2 and TLS 1.3
+class KtlsOffload
+{
+
+public:
+	//Needs to be called on the SSL_CTX so that the traffic secrets and
+	//record sequence numbers of every handshake are available to install()
+	static void prepare(SSL_CTX* ctx)
+	{
+		ex_index();
+		SSL_CTX_set_keylog_callback(ctx, &KtlsOffload::on_keylog);
+		SSL_CTX_set_msg_callback(ctx, &KtlsOffload::on_message);
+	}
+
+	//Installs the keys of the completed handshake on fd.
+	//Returns false if kTLS isn't possible, the connection then continues in userspace.
+	//If it returns true, the ssl stream must not be used for reading or writing anymore
+	static bool install(SSL* ssl, int fd)
+	{
+		State* state = static_cast<State*>(SSL_get_ex_data(ssl, ex_index()));
+		SSL_set_msg_callback(ssl, nullptr);
+
+		//Anything already buffered by OpenSSL would be lost for the kernel
+		if(!state || SSL_pending(ssl) > 0 || BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0 || BIO_ctrl_pending(SSL_get_wbio(ssl)) > 0)
+		{
+			return false;
+		}
+
+		const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl);
+		if(!cipher) return false;
+
+		const int cipher_nid = SSL_CIPHER_get_cipher_nid(cipher);
+		std::size_t key_length = 0;
+		if(cipher_nid == NID_aes_128_gcm) key_length = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+		else if(cipher_nid == NID_aes_256_gcm) key_length = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+		else return false;
+
+		Keys tx, rx;
+		const EVP_MD* digest = SSL_CIPHER_get_handshake_digest(cipher);
+		const int version = SSL_version(ssl);
+
+		if(version == TLS1_3_VERSION)
+		{
+			if(state->server_secret.empty() || state->client_secret.empty()) return false;
+			if(!derive_tls13(digest, state->server_secret, key_length, tx) || !derive_tls13(digest, state->client_secret, key_length, rx)) return false;
+			tx.sequence = state->written_since_secret;
+			rx.sequence = state->read_since_secret;
+		}
+		else if(version == TLS1_2_VERSION)
+		{
+			if(!derive_tls12(ssl, digest, key_length, tx, rx)) return false;
+			tx.sequence = state->written_since_ccs;
+			rx.sequence = state->read_since_ccs;
+		}
+		else
+		{
+			return false;
+		}
+
+		if(setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0)
+		{
+			//The tls kernel module isn't available
+			return false;
+		}
+
+		if(!set_crypto_info(fd, TLS_TX, version, tx) || !set_crypto_info(fd, TLS_RX, version, rx))
+		{
+			return false;
+		}
+
+		//OpenSSL would drop the session from the cache if it wasn't shut down by itself
+		SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+
+		return true;
+	}
+
+	//Sends a close_notify alert over a kTLS socket
+	static void send_close_notify(int fd)
+	{
+		unsigned char alert[2] = { 1, 0 };
+		char control[CMSG_SPACE(sizeof(unsigned char))];
+		std::memset(control, 0, sizeof(control));
+
+		iovec io;
+		io.iov_base = alert;
+		io.iov_len = sizeof(alert);
+
+		msghdr message;
+		std::memset(&message, 0, sizeof(message));
+		message.msg_iov = &io;
+		message.msg_iovlen = 1;
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+
+		cmsghdr* header = CMSG_FIRSTHDR(&message);
+		header->cmsg_level = SOL_TLS;
+		header->cmsg_type = TLS_SET_RECORD_TYPE;
+		header->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+		*CMSG_DATA(header) = 21; //alert
+
+		sendmsg(fd, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+
+	struct Keys
+	{
+		std::vector<unsigned char> key{};
+		std::vector<unsigned char> iv{}; //salt + implicit nonce
+		std::uint64_t sequence = 0;
+	};
+
+	//The traffic key and iv of a TLS 1.3 traffic secret (RFC 8446 7.3)
+	static bool derive_tls13(const EVP_MD* digest, const std::vector<unsigned char>& secret, std::size_t key_length, Keys& keys)
+	{
+		return hkdf_expand_label(digest, secret, "key", key_length, keys.key) && hkdf_expand_label(digest, secret, "iv", 12, keys.iv);
+	}
+
+private:
+	//Per connection data collected during the handshake
+	struct State
+	{
+		std::vector<unsigned char> server_secret{};
+		std::vector<unsigned char> client_secret{};
+		std::uint64_t written_since_secret = 0;
+		std::uint64_t read_since_secret = 0;
+		std::uint64_t written_since_ccs = 0;
+		std::uint64_t read_since_ccs = 0;
+	};
+
+	static void free_state(void* /*parent*/, void* ptr, CRYPTO_EX_DATA* /*ad*/, int /*index*/, long /*argl*/, void* /*argp*/)
+	{
+		delete static_cast<State*>(ptr);
+	}
+
+	static int ex_index()
+	{
+		static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, &KtlsOffload::free_state);
+		return index;
+	}
+
+	static State* state_of(const SSL* ssl)
+	{
+		SSL* mutable_ssl = const_cast<SSL*>(ssl);
+		State* state = static_cast<State*>(SSL_get_ex_data(mutable_ssl, ex_index()));
+		if(!state)
+		{
+			state = new State();
+			SSL_set_ex_data(mutable_ssl, ex_index(), state);
+		}
+		return state;
+	}
+
+	static void on_keylog(const SSL* ssl, const char* line)
+	{
+		//Format: <label> <client random> <secret>, all hex encoded
+		const std::string entry(line);
+		const std::size_t first_space = entry.find(' ');
+		const std::size_t second_space = entry.find(' ', first_space + 1);
+		if(second_space == std::string::npos) return;
+
+		const std::string label = entry.substr(0, first_space);
+		std::vector<unsigned char>* secret = nullptr;
+		State* state = state_of(ssl);
+
+		if(label == "SERVER_TRAFFIC_SECRET_0")
+		{
+			secret = &state->server_secret;
+			state->written_since_secret = 0;
+		}
+		else if(label == "CLIENT_TRAFFIC_SECRET_0")
+		{
+			secret = &state->client_secret;
+			state->read_since_secret = 0;
+		}
+		else
+		{
+			return;
+		}
+
+		secret->clear();
+		for(std::size_t i = second_space + 1; i + 1 < entry.length(); i += 2)
+		{
+			secret->push_back(static_cast<unsigned char>(std::stoi(entry.substr(i, 2), nullptr, 16)));
+		}
+	}
+
+	//Counts the records since the last key change, which gives the record sequence numbers
+	static void on_message(int write_p, int /*version*/, int content_type, const void* buf, size_t len, SSL* ssl, void* /*arg*/)
+	{
+		if(content_type != SSL3_RT_HEADER || len < 1) return;
+
+		State* state = state_of(ssl);
+
+		//The ChangeCipherSpec record itself doesn't count, TLS 1.2 starts the new epoch after it
+		const bool change_cipher_spec = static_cast<const unsigned char*>(buf)[0] == SSL3_RT_CHANGE_CIPHER_SPEC;
+
+		if(write_p)
+		{
+			if(change_cipher_spec) state->written_since_ccs = 0;
+			else ++state->written_since_ccs;
+			++state->written_since_secret;
+		}
+		else
+		{
+			if(change_cipher_spec) state->read_since_ccs = 0;
+			else ++state->read_since_ccs;
+			++state->read_since_secret;
+		}
+	}
+
+	static bool hkdf_expand_label(const EVP_MD* digest, const std::vector<unsigned char>& secret, const std::string& label, std::size_t length, std::vector<unsigned char>& out)
+	{
+		//HkdfLabel: length (2 bytes), "tls13 " + label (at most 255 bytes with a length byte), empty context
+		static const char prefix[] = "tls13 ";
+		const std::size_t label_length = sizeof(prefix) - 1 + label.length();
+		if(label_length > 255) return false;
+
+		std::array<unsigned char, 2 + 1 + 255 + 1> info{};
+		std::size_t info_length = 0;
+		info[info_length++] = static_cast<unsigned char>(length >> 8);
+		info[info_length++] = static_cast<unsigned char>(length & 0xff);
+		info[info_length++] = static_cast<unsigned char>(label_length);
+		std::memcpy(info.data() + info_length, prefix, sizeof(prefix) - 1);
+		info_length += sizeof(prefix) - 1;
+		std::memcpy(info.data() + info_length, label.data(), label.length());
+		info_length += label.length();
+		info[info_length++] = 0;
+
+		out.resize(length);
+		EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+		std::size_t out_length = length;
+		const bool ok = ctx &&
+			EVP_PKEY_derive_init(ctx) > 0 &&
+			EVP_PKEY_CTX_hkdf_mode(ctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+			EVP_PKEY_CTX_set_hkdf_md(ctx, digest) > 0 &&
+			EVP_PKEY_CTX_set1_hkdf_key(ctx, secret.data(), static_cast<int>(secret.size())) > 0 &&
+			EVP_PKEY_CTX_add1_hkdf_info(ctx, info.data(), static_cast<int>(info_length)) > 0 &&
+			EVP_PKEY_derive(ctx, out.data(), &out_length) > 0;
+		EVP_PKEY_CTX_free(ctx);
+
+		return ok && out_length == length;
+	}
+
+	static bool derive_tls12(SSL* ssl, const EVP_MD* digest, std::size_t key_length, Keys& server, Keys& client)
+	{
+		unsigned char master_secret[SSL_MAX_MASTER_KEY_LENGTH];
+		const std::size_t master_length = SSL_SESSION_get_master_key(SSL_get_session(ssl), master_secret, sizeof(master_secret));
+
+		//key expansion seed is server_random + client_random
+		unsigned char seed[2 * SSL3_RANDOM_SIZE];
+		SSL_get_server_random(ssl, seed, SSL3_RANDOM_SIZE);
+		SSL_get_client_random(ssl, seed + SSL3_RANDOM_SIZE, SSL3_RANDOM_SIZE);
+
+		//AEAD key block: client key, server key, client salt, server salt
+		std::vector<unsigned char> block(2 * key_length + 2 * 4);
+		std::size_t block_length = block.size();
+		const unsigned char label[] = "key expansion";
+
+		EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, nullptr);
+		const bool ok = ctx &&
+			EVP_PKEY_derive_init(ctx) > 0 &&
+			EVP_PKEY_CTX_set_tls1_prf_md(ctx, digest) > 0 &&
+			EVP_PKEY_CTX_set1_tls1_prf_secret(ctx, master_secret, static_cast<int>(master_length)) > 0 &&
+			EVP_PKEY_CTX_add1_tls1_prf_seed(ctx, label, static_cast<int>(sizeof(label) - 1)) > 0 &&
+			EVP_PKEY_CTX_add1_tls1_prf_seed(ctx, seed, static_cast<int>(sizeof(seed))) > 0 &&
+			EVP_PKEY_derive(ctx, block.data(), &block_length) > 0;
+		EVP_PKEY_CTX_free(ctx);
+		OPENSSL_cleanse(master_secret, sizeof(master_secret));
+
+		if(!ok) return false;
+
+		client.key.assign(block.begin(), block.begin() + key_length);
+		server.key.assign(block.begin() + key_length, block.begin() + 2 * key_length);
+		client.iv.assign(block.begin() + 2 * key_length, block.begin() + 2 * key_length + 4);
+		server.iv.assign(block.begin() + 2 * key_length + 4, block.end());
+		OPENSSL_cleanse(block.data(), block.size());
+
+		return true;
+	}
+
+	template<typename CryptoInfo>
+	static bool fill_crypto_info(CryptoInfo& info, int version, const Keys& keys, unsigned short cipher_type)
+	{
+		std::memset(&info, 0, sizeof(info));
+		info.info.version = version == TLS1_3_VERSION ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+		info.info.cipher_type = cipher_type;
+
+		if(keys.key.size() != sizeof(info.key)) return false;
+		std::memcpy(info.key, keys.key.data(), sizeof(info.key));
+		std::memcpy(info.salt, keys.iv.data(), sizeof(info.salt));
+
+		for(std::size_t i = 0; i < sizeof(info.rec_seq); ++i)
+		{
+			info.rec_seq[i] = static_cast<unsigned char>(keys.sequence >> (8 * (sizeof(info.rec_seq) - 1 - i)));
+		}
+
+		//TLS 1.3 uses the rest of the derived iv, TLS 1.2 sends an explicit
+		//nonce with every record which only needs to be unique
+		if(version == TLS1_3_VERSION) std::memcpy(info.iv, keys.iv.data() + sizeof(info.salt), sizeof(info.iv));
+		else std::memcpy(info.iv, info.rec_seq, sizeof(info.iv));
+
+		return true;
+	}
+
+	static bool set_crypto_info(int fd, int direction, int version, const Keys& keys)
+	{
+		if(keys.key.size() == TLS_CIPHER_AES_GCM_128_KEY_SIZE)
+		{
+			tls12_crypto_info_aes_gcm_128 info;
+			const bool ok = fill_crypto_info(info, version, keys, TLS_CIPHER_AES_GCM_128) && setsockopt(fd, SOL_TLS, direction, &info, sizeof(info)) == 0;
+			OPENSSL_cleanse(&info, sizeof(info));
+			return ok;
+		}
+
+		tls12_crypto_info_aes_gcm_256 info;
+		const bool ok = fill_crypto_info(info, version, keys, TLS_CIPHER_AES_GCM_256) && setsockopt(fd, SOL_TLS, direction, &info, sizeof(info)) == 0;
+		OPENSSL_cleanse(&info, sizeof(info));
+		return ok;
+	}
+
+}; //end class KtlsOffload
+
+//A pipe to move data from one socket to another with splice(),
+//so the data never gets copied to userspace
+class SplicePipe
+{
+
+public:
+	enum
+	{
+		max_chunk = 65536
+	};
+
+	SplicePipe() :
+		fds_{-1, -1},
+		buffered_(0)
+	{}
+
+	SplicePipe(const SplicePipe&) = delete;
+	SplicePipe& operator=(const SplicePipe&) = delete;
+
+	~SplicePipe()
+	{
+		close();
+	}
+
+	bool open()
+	{
+		return fds_[0] >= 0 || pipe2(fds_, O_NONBLOCK | O_CLOEXEC) == 0;
+	}
+
+	void close()
+	{
+		if(fds_[0] >= 0) ::close(fds_[0]);
+		if(fds_[1] >= 0) ::close(fds_[1]);
+		fds_[0] = fds_[1] = -1;
+		buffered_ = 0;
+	}
+
+	//Moves up to length bytes from the socket into the pipe.
+	//Returns the number of bytes, 0 on EOF or -1 with errno set
+	ssize_t fill(int socket_fd, std::size_t length)
+	{
+		ssize_t moved = splice(socket_fd, nullptr, fds_[1], nullptr, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(moved > 0) buffered_ += static_cast<std::size_t>(moved);
+		return moved;
+	}
+
+	//Moves the buffered bytes from the pipe into the socket
+	ssize_t drain(int socket_fd)
+	{
+		ssize_t moved = splice(fds_[0], nullptr, socket_fd, nullptr, buffered_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(moved > 0) buffered_ -= static_cast<std::size_t>(moved);
+		return moved;
+	}
+
+	std::size_t buffered() const
+	{
+		return buffered_;
+	}
+
+private:
+	int fds_[2];
+	std::size_t buffered_;
+
+}; //end class SplicePipe
+#endif
+
+//Pool of I/O buffers in power of two size classes from small_buffer to large_buffer.
+//The buffers are carved out of larger slabs and recycled through free lists.
+//Every io_context has its own pool, so it is only used by one thread.
+//Sessions only take a buffer while they actually move data
+class BufferPool
+{
+
+public:
+	enum
+	{
+		small_buffer = 4096,
+		tls_record_buffer = 16384,
+		large_buffer = 65536,
+		slab_size = 262144,
+		size_classes = 5
+	};
+
+	//Owns one buffer of the pool and gives it back on destruction
+	class Buffer
+	{
+
+	public:
+		Buffer() noexcept :
+			pool_(nullptr),
+			data_(nullptr),
+			capacity_(0)
+		{}
+
+		Buffer(const Buffer&) = delete;
+		Buffer& operator=(const Buffer&) = delete;
+
+		Buffer(Buffer&& other) noexcept :
+			pool_(other.pool_),
+			data_(other.data_),
+			capacity_(other.capacity_)
+		{
+			other.pool_ = nullptr;
+			other.data_ = nullptr;
+			other.capacity_ = 0;
+		}
+
+		Buffer& operator=(Buffer&& other) noexcept
+		{
+			if(this != &other)
+			{
+				reset();
+				std::swap(pool_, other.pool_);
+				std::swap(data_, other.data_);
+				std::swap(capacity_, other.capacity_);
+			}
+			return *this;
+		}
+
+		~Buffer()
+		{
+			reset();
+		}
+
+		char* data() const { return data_; }
+		std::size_t capacity() const { return capacity_; }
+		explicit operator bool() const { return data_ != nullptr; }
+
+		void reset()
+		{
+			if(pool_) pool_->release(data_, capacity_);
+			pool_ = nullptr;
+			data_ = nullptr;
+			capacity_ = 0;
+		}
+
+	private:
+		friend class BufferPool;
+
+		Buffer(BufferPool* pool, char* data, std::size_t capacity) :
+			pool_(pool),
+			data_(data),
+			capacity_(capacity)
+		{}
+
+		BufferPool* pool_;
+		char* data_;
+		std::size_t capacity_;
+
+	}; //end class Buffer
+
+	BufferPool() :
+		free_(),
+		slabs_(),
+		bytes_allocated_(0),
+		bytes_in_use_(0),
+		slab_observer_()
+	{}
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	//Returns a buffer with at least size bytes (at most large_buffer)
+	Buffer acquire(std::size_t size)
+	{
+		std::size_t size_class = 0;
+		while(size_class + 1 < size_classes && class_size(size_class) < size) ++size_class;
+
+		std::vector<char*>& free_list = free_[size_class];
+		if(free_list.empty())
+		{
+			allocate_slab(size_class);
+		}
+
+		char* data = free_list.back();
+		free_list.pop_back();
+		bytes_in_use_ += class_size(size_class);
+
+		return Buffer(this, data, class_size(size_class));
+	}
+
+	std::size_t bytes_allocated() const { return bytes_allocated_; }
+	std::size_t bytes_in_use() const { return bytes_in_use_; }
+
+	//Called with the memory of every slab, the existing ones right away.
+	//IoUring registers the slabs with the kernel this way
+	void set_slab_observer(std::function<void(char*, std::size_t)> observer)
+	{
+		slab_observer_ = std::move(observer);
+		if(!slab_observer_) return;
+
+		for(const Slab& slab : slabs_)
+		{
+			slab_observer_(slab.data.get(), slab.size);
+		}
+	}
+
+private:
+	struct Slab
+	{
+		std::unique_ptr<char[]> data;
+		std::size_t size;
+	};
+
+	std::array<std::vector<char*>, size_classes> free_;
+	std::vector<Slab> slabs_;
+	std::size_t bytes_allocated_;
+	std::size_t bytes_in_use_;
+	std::function<void(char*, std::size_t)> slab_observer_;
+
+	static std::size_t class_size(std::size_t size_class)
+	{
+		return static_cast<std::size_t>(small_buffer) << size_class;
+	}
+
+	void allocate_slab(std::size_t size_class)
+	{
+		const std::size_t buffer_size = class_size(size_class);
+		const std::size_t count = std::max<std::size_t>(1, slab_size / buffer_size);
+
+		slabs_.push_back(Slab{ std::unique_ptr<char[]>(new char[buffer_size * count]), buffer_size * count });
+		bytes_allocated_ += buffer_size * count;
+
+		char* slab = slabs_.back().data.get();
+		for(std::size_t i = 0; i < count; ++i)
+		{
+			free_[size_class].push_back(slab + i * buffer_size);
+		}
+		if(slab_observer_) slab_observer_(slab, buffer_size * count);
+	}
+
+	void release(char* data, std::size_t capacity)
+	{
+		std::size_t size_class = 0;
+		while(class_size(size_class) < capacity) ++size_class;
+
+		free_[size_class].push_back(data);
+		bytes_in_use_ -= capacity;
+	}
+
+}; //end class BufferPool
+
+//Counters of the io_uring data plane, see SslProxy::get_io_uring_stats()
+struct IoUringStats
+{
+	std::uint64_t submissions;	//Operations handed to the kernel
+	std::uint64_t enters;	//io_uring_enter() calls, the syscalls of the ring
+	std::uint64_t submit_failures;	//Failed submits, the entries stay queued for the next one
+	std::uint64_t completions;
+	std::uint64_t fixed_reads;	//Reads into registered buffers
+	std::uint64_t registered_slabs;
+};
+
+#ifdef SSLPROXY_HAS_IO_URING
+//A native io_uring (without liburing) for the socket I/O of the sessions of one io_context.
+//Starting an operation only fills a submission entry. The entries of all sessions are handed
+//to the kernel together, once per round of handlers (a posted flush, or at the end of reaping
+//the completions), so many reads and writes cost one io_uring_enter(). asio waits for the
+//ring descriptor to become readable, the completions are then reaped and their handlers run
+//on the thread of the io_context, like the handlers of asio.
+//The slabs of a BufferPool can be registered, reads into them use READ_FIXED. Writes are
+//sendmsg() with MSG_NOSIGNAL, a write() to a closed socket would raise SIGPIPE.
+//The operations are allocated with the associated allocator of their handler.
+//Needs Linux 5.19. Like the io_context it belongs to, it is only used by one thread
+class IoUring : public std::enable_shared_from_this<IoUring>
+{
+
+	//Base of all operations, the user_data of their submissions points to it.
+	//Pending operations are linked, so shutdown() can destroy them
+	struct Operation
+	{
+		using Complete = void (*)(Operation* operation, int result, unsigned flags, bool destroy);
+
+		explicit Operation(Complete complete_function) :
+			complete(complete_function),
+			prev(nullptr),
+			next(nullptr)
+		{}
+
+		Operation(const Operation&) = delete;
+		Operation& operator=(const Operation&) = delete;
+
+		Complete complete;
+		Operation* prev;
+		Operation* next;
+	};
+
+public:
+	enum
+	{
+		default_entries = 256,
+
+		//Completions a round of reaping handles before other handlers get their turn
+		max_reap = 256,
+
+		//Slabs of the buffer pool which can be registered (256 KB each)
+		max_registered_slabs = 1024,
+
+		//Buffers a single sendmsg() takes, more are written by the next one
+		max_iovecs = 16
+	};
+
+	explicit IoUring(net::io_context& io_context) :
+		io_context_(io_context),
+		descriptor_(io_context),
+		ring_fd_(-1),
+		ring_memory_(MAP_FAILED),
+		ring_memory_size_(0),
+		sqes_(static_cast<io_uring_sqe*>(MAP_FAILED)),
+		sqes_size_(0),
+		sq_entries_(0),
+		sq_head_(nullptr),
+		sq_tail_(nullptr),
+		sq_flags_(nullptr),
+		sq_mask_(0),
+		cq_head_(nullptr),
+		cq_tail_(nullptr),
+		cq_mask_(0),
+		cqes_(nullptr),
+		sq_queued_(0),
+		sq_submitted_(0),
+		pending_(nullptr),
+		pending_count_(0),
+		flush_posted_(false),
+		reap_posted_(false),
+		reaping_(false),
+		waiting_(false),
+		closed_(false),
+		buffer_pool_(),
+		regions_(),
+		registration_failed_(false),
+		submissions_(0),
+		enters_(0),
+		submit_failures_(0),
+		completions_(0),
+		fixed_reads_(0),
+		registered_slabs_(0)
+	{
+		pending_.prev = &pending_;
+		pending_.next = &pending_;
+	}
+
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(const IoUring&) = delete;
+
+	~IoUring()
+	{
+		shutdown();
+	}
+
+	//Returns nullptr if the kernel doesn't support what the ring needs or
+	//doesn't allow io_uring at all (e.g. a seccomp filter of a container)
+	static std::shared_ptr<IoUring> create(net::io_context& io_context, unsigned entries = default_entries)
+	{
+		auto ring = std::make_shared<IoUring>(io_context);
+		if(!ring->setup(entries)) return nullptr;
+
+		ring->wait();
+		return ring;
+	}
+
+	//Registers the slabs of pool with the kernel, the existing ones and all future ones
+	void register_buffers(std::shared_ptr<BufferPool> pool)
+	{
+		if(buffer_pool_) buffer_pool_->set_slab_observer(nullptr);
+		buffer_pool_ = std::move(pool);
+		if(buffer_pool_) buffer_pool_->set_slab_observer([this](char* data, std::size_t size) { register_slab(data, size); });
+	}
+
+	//Reads at most buffer.size() bytes. Completes with net::error::eof if the peer closed the connection
+	template <typename ReadHandler>
+	void async_read_some(int fd, const net::mutable_buffer& buffer, ReadHandler&& handler)
+	{
+		auto* operation = make_operation<ReadOperation<typename std::decay<ReadHandler>::type>>(std::forward<ReadHandler>(handler), buffer.size());
+		const int index = fixed_index(static_cast<const char*>(buffer.data()), buffer.size());
+
+		io_uring_sqe* sqe = prepare(index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_RECV, fd, operation);
+		sqe->addr = reinterpret_cast<std::uintptr_t>(buffer.data());
+		sqe->len = static_cast<std::uint32_t>(std::min<std::size_t>(buffer.size(), 0x7ffff000));
+		if(index >= 0)
+		{
+			sqe->buf_index = static_cast<std::uint16_t>(index);
+			fixed_reads_.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	//Writes all of buffers, like net::async_write
+	template <typename ConstBufferSequence, typename WriteHandler>
+	void async_write(int fd, const ConstBufferSequence& buffers, WriteHandler&& handler)
+	{
+		auto* operation = make_operation<WriteOperation<ConstBufferSequence, typename std::decay<WriteHandler>::type>>(std::forward<WriteHandler>(handler), *this, fd, buffers);
+		operation->submit_rest();
+	}
+
+	//Completes when fd is readable
+	template <typename WaitHandler>
+	void async_wait_readable(int fd, WaitHandler&& handler)
+	{
+		auto* operation = make_operation<WaitOperation<typename std::decay<WaitHandler>::type>>(std::forward<WaitHandler>(handler));
+
+		io_uring_sqe* sqe = prepare(IORING_OP_POLL_ADD, fd, operation);
+		sqe->poll32_events = POLLIN;
+	}
+
+	//Multishot accept: one submission accepts connections until it fails or is cancelled.
+	//handler(error_code, int fd, bool more) is called for every connection, more is
+	//false on the last call. The new descriptors belong to the handler
+	template <typename AcceptHandler>
+	void async_accept(int listen_fd, AcceptHandler&& handler)
+	{
+		auto* operation = make_operation<AcceptOperation<typename std::decay<AcceptHandler>::type>>(std::forward<AcceptHandler>(handler));
+
+		io_uring_sqe* sqe = prepare(IORING_OP_ACCEPT, listen_fd, operation);
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_CLOEXEC;
+	}
+
+	//Cancels all operations on fd, they complete with net::error::operation_aborted.
+	//Call it before fd is closed: the cancellation is submitted right away, so
+	//it can't hit a new connection which got the same descriptor number
+	void cancel(int fd)
+	{
+		if(closed_ || fd < 0) return;
+
+		io_uring_sqe* sqe = prepare(IORING_OP_ASYNC_CANCEL, fd, nullptr);
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+		submit();
+	}
+
+	//Cancels all operations and destroys their handlers without calling them.
+	//The ring can't be used anymore afterwards
+	void shutdown()
+	{
+		if(closed_) return;
+		closed_ = true;
+
+		if(buffer_pool_) buffer_pool_->set_slab_observer(nullptr);
+
+		if(ring_fd_ >= 0 && pending_count_ > 0)
+		{
+			io_uring_sqe* sqe = prepare(IORING_OP_ASYNC_CANCEL, -1, nullptr);
+			sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL;
+			submit();
+
+			//The kernel may write into the buffers until the cancelled reads completed
+			int idle_rounds = 0;
+			while(pending_count_ > 0 && idle_rounds < 10)
+			{
+				if(!drain_completions()) ++idle_rounds;
+			}
+		}
+
+		while(pending_.next != &pending_)
+		{
+			Operation* operation = pending_.next;
+			unlink(operation);
+			operation->complete(operation, -ECANCELED, 0, true);
+		}
+
+		err::error_code ec;
+		descriptor_.close(ec);
+		ring_fd_ = -1;
+
+		if(sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+		if(ring_memory_ != MAP_FAILED) munmap(ring_memory_, ring_memory_size_);
+		sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+		ring_memory_ = MAP_FAILED;
+	}
+
+	//Can be called from any thread
+	IoUringStats stats() const
+	{
+		IoUringStats stats{};
+		stats.submissions = submissions_.load(std::memory_order_relaxed);
+		stats.enters = enters_.load(std::memory_order_relaxed);
+		stats.submit_failures = submit_failures_.load(std::memory_order_relaxed);
+		stats.completions = completions_.load(std::memory_order_relaxed);
+		stats.fixed_reads = fixed_reads_.load(std::memory_order_relaxed);
+		stats.registered_slabs = registered_slabs_.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+private:
+	template <typename Handler>
+	class ReadOperation : public Operation
+	{
+
+	public:
+		ReadOperation(Handler handler, std::size_t size) :
+			Operation(&ReadOperation::complete),
+			handler_(std::move(handler)),
+			size_(size)
+		{}
+
+		static void complete(Operation* base, int result, unsigned /*flags*/, bool destroy)
+		{
+			ReadOperation* operation = static_cast<ReadOperation*>(base);
+			Handler handler(std::move(operation->handler_));
+			const std::size_t size = operation->size_;
+			destroy_operation(operation, handler);
+
+			if(destroy) return;
+			if(result < 0) handler(error(result), std::size_t(0));
+			else if(result == 0 && size > 0) handler(err::error_code(net::error::eof), std::size_t(0));
+			else handler(err::error_code(), static_cast<std::size_t>(result));
+		}
+
+	private:
+		Handler handler_;
+		std::size_t size_;
+
+	}; //end class ReadOperation
+
+	template <typename ConstBufferSequence, typename Handler>
+	class WriteOperation : public Operation
+	{
+
+	public:
+		WriteOperation(Handler handler, IoUring& ring, int fd, const ConstBufferSequence& buffers) :
+			Operation(&WriteOperation::complete),
+			handler_(std::move(handler)),
+			ring_(ring),
+			fd_(fd),
+			buffers_(buffers),
+			written_(0),
+			total_(net::buffer_size(buffers)),
+			iovecs_(),
+			message_()
+		{}
+
+		//Queues a sendmsg() for the bytes which aren't written yet
+		void submit_rest()
+		{
+			std::size_t skip = written_;
+			std::size_t count = 0;
+			for(auto it = net::buffer_sequence_begin(buffers_); it != net::buffer_sequence_end(buffers_) && count < max_iovecs; ++it)
+			{
+				net::const_buffer buffer(*it);
+				if(skip >= buffer.size())
+				{
+					skip -= buffer.size();
+					continue;
+				}
+
+				buffer += skip;
+				skip = 0;
+				iovecs_[count].iov_base = const_cast<void*>(buffer.data());
+				iovecs_[count].iov_len = buffer.size();
+				++count;
+			}
+
+			message_ = msghdr();
+			message_.msg_iov = iovecs_.data();
+			message_.msg_iovlen = count;
+
+			io_uring_sqe* sqe = ring_.prepare(IORING_OP_SENDMSG, fd_, this);
+			sqe->addr = reinterpret_cast<std::uintptr_t>(&message_);
+			sqe->len = 1;
+			sqe->msg_flags = MSG_NOSIGNAL;
+		}
+
+		static void complete(Operation* base, int result, unsigned /*flags*/, bool destroy)
+		{
+			WriteOperation* operation = static_cast<WriteOperation*>(base);
+
+			if(!destroy && result > 0)
+			{
+				operation->written_ += static_cast<std::size_t>(result);
+				if(operation->written_ < operation->total_)
+				{
+					operation->submit_rest();
+					return;
+				}
+			}
+
+			Handler handler(std::move(operation->handler_));
+			const std::size_t written = operation->written_;
+			destroy_operation(operation, handler);
+
+			if(destroy) return;
+			if(result < 0) handler(error(result), written);
+			else handler(err::error_code(), written);
+		}
+
+	private:
+		Handler handler_;
+		IoUring& ring_;
+		int fd_;
+		ConstBufferSequence buffers_;
+		std::size_t written_;
+		std::size_t total_;
+		std::array<iovec, max_iovecs> iovecs_;
+		msghdr message_;
+
+	}; //end class WriteOperation
+
+	template <typename Handler>
+	class WaitOperation : public Operation
+	{
+
+	public:
+		explicit WaitOperation(Handler handler) :
+			Operation(&WaitOperation::complete),
+			handler_(std::move(handler))
+		{}
+
+		static void complete(Operation* base, int result, unsigned /*flags*/, bool destroy)
+		{
+			WaitOperation* operation = static_cast<WaitOperation*>(base);
+			Handler handler(std::move(operation->handler_));
+			destroy_operation(operation, handler);
+
+			if(destroy) return;
+			handler(result < 0 ? error(result) : err::error_code());
+		}
+
+	private:
+		Handler handler_;
+
+	}; //end class WaitOperation
+
+	template <typename Handler>
+	class AcceptOperation : public Operation
+	{
+
+	public:
+		explicit AcceptOperation(Handler handler) :
+			Operation(&AcceptOperation::complete),
+			handler_(std::move(handler))
+		{}
+
+		static void complete(Operation* base, int result, unsigned flags, bool destroy)
+		{
+			AcceptOperation* operation = static_cast<AcceptOperation*>(base);
+
+			if(destroy)
+			{
+				if(result >= 0) ::close(result);
+				if(flags & IORING_CQE_F_MORE) return;
+			}
+			else if(flags & IORING_CQE_F_MORE)
+			{
+				//Still armed, the handler stays in the operation
+				operation->handler_(result < 0 ? error(result) : err::error_code(), result, true);
+				return;
+			}
+
+			Handler handler(std::move(operation->handler_));
+			destroy_operation(operation, handler);
+
+			if(destroy) return;
+			handler(result < 0 ? error(result) : err::error_code(), result, false);
+		}
+
+	private:
+		Handler handler_;
+
+	}; //end class AcceptOperation
+
+	//A registered slab, the index is its buf_index
+	struct Region
+	{
+		const char* begin;
+		const char* end;
+		int index;
+	};
+
+	net::io_context& io_context_;
+	net::posix::stream_descriptor descriptor_;
+	int ring_fd_;
+	void* ring_memory_;
+	std::size_t ring_memory_size_;
+	io_uring_sqe* sqes_;
+	std::size_t sqes_size_;
+
+	//The shared rings. Only the kernel writes sq_head_ and cq_tail_
+	unsigned sq_entries_;
+	unsigned* sq_head_;
+	unsigned* sq_tail_;
+	unsigned* sq_flags_;
+	unsigned sq_mask_;
+	unsigned* cq_head_;
+	unsigned* cq_tail_;
+	unsigned cq_mask_;
+	io_uring_cqe* cqes_;
+
+	//Entries which are filled, and the ones of them which the kernel already has
+	unsigned sq_queued_;
+	unsigned sq_submitted_;
+
+	Operation pending_;
+	std::size_t pending_count_;
+	bool flush_posted_;
+	bool reap_posted_;
+	bool reaping_;
+	bool waiting_;
+	bool closed_;
+
+	std::shared_ptr<BufferPool> buffer_pool_;
+	std::vector<Region> regions_;
+	bool registration_failed_;
+
+	std::atomic<std::uint64_t> submissions_;
+	std::atomic<std::uint64_t> enters_;
+	std::atomic<std::uint64_t> submit_failures_;
+	std::atomic<std::uint64_t> completions_;
+	std::atomic<std::uint64_t> fixed_reads_;
+	std::atomic<std::uint64_t> registered_slabs_;
+
+	static err::error_code error(int result)
+	{
+		return err::error_code(-result, err::system_category());
+	}
+
+	template <typename OperationType, typename Handler, typename... Args>
+	static OperationType* make_operation(Handler&& handler, Args&&... args)
+	{
+		using Allocator = typename std::allocator_traits<net::associated_allocator_t<typename std::decay<Handler>::type>>::template rebind_alloc<OperationType>;
+
+		Allocator allocator(net::get_associated_allocator(handler));
+		OperationType* operation = std::allocator_traits<Allocator>::allocate(allocator, 1);
+		return new (operation) OperationType(std::forward<Handler>(handler), std::forward<Args>(args)...);
+	}
+
+	//Frees the memory of operation, its handler was moved to handler before
+	template <typename OperationType, typename Handler>
+	static void destroy_operation(OperationType* operation, const Handler& handler)
+	{
+		using Allocator = typename std::allocator_traits<net::associated_allocator_t<Handler>>::template rebind_alloc<OperationType>;
+
+		Allocator allocator(net::get_associated_allocator(handler));
+		operation->~OperationType();
+		std::allocator_traits<Allocator>::deallocate(allocator, operation, 1);
+	}
+
+	int enter(unsigned to_submit, unsigned min_complete, unsigned flags, const void* argument = nullptr, std::size_t argument_size = 0)
+	{
+		enters_.fetch_add(1, std::memory_order_relaxed);
+		return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete, flags, argument, argument_size));
+	}
+
+	bool setup(unsigned entries)
+	{
+		io_uring_params params{};
+
+		//Every connection has a read waiting, so far more operations are
+		//pending than submitted at once. The kernel keeps completions which
+		//don't fit (IORING_FEAT_NODROP), reap() fetches them
+		params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+		params.cq_entries = entries * 16;
+
+		ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+		if(ring_fd_ < 0) return false;
+
+		err::error_code ec;
+		descriptor_.assign(ring_fd_, ec);
+		if(ec)
+		{
+			::close(ring_fd_);
+			ring_fd_ = -1;
+			return false;
+		}
+
+		if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) || !supports(IORING_OP_SOCKET))
+		{
+			//IORING_OP_SOCKET came with 5.19, like the multishot accept and cancelling by descriptor
+			return false;
+		}
+
+		ring_memory_size_ = std::max<std::size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+		ring_memory_ = mmap(nullptr, ring_memory_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+		if(ring_memory_ == MAP_FAILED) return false;
+
+		sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+		sqes_ = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+		if(sqes_ == MAP_FAILED) return false;
+
+		char* ring = static_cast<char*>(ring_memory_);
+		sq_entries_ = params.sq_entries;
+		sq_head_ = reinterpret_cast<unsigned*>(ring + params.sq_off.head);
+		sq_tail_ = reinterpret_cast<unsigned*>(ring + params.sq_off.tail);
+		sq_flags_ = reinterpret_cast<unsigned*>(ring + params.sq_off.flags);
+		sq_mask_ = *reinterpret_cast<unsigned*>(ring + params.sq_off.ring_mask);
+		cq_head_ = reinterpret_cast<unsigned*>(ring + params.cq_off.head);
+		cq_tail_ = reinterpret_cast<unsigned*>(ring + params.cq_off.tail);
+		cq_mask_ = *reinterpret_cast<unsigned*>(ring + params.cq_off.ring_mask);
+		cqes_ = reinterpret_cast<io_uring_cqe*>(ring + params.cq_off.cqes);
+
+		//The submission entries are always used in order
+		unsigned* array = reinterpret_cast<unsigned*>(ring + params.sq_off.array);
+		for(unsigned i = 0; i < sq_entries_; ++i) array[i] = i;
+		sq_queued_ = sq_submitted_ = *sq_tail_;
+
+		//An empty table, the slabs are put into it as the buffer pool allocates them
+		io_uring_rsrc_register table{};
+		table.nr = max_registered_slabs;
+		table.flags = IORING_RSRC_REGISTER_SPARSE;
+		registration_failed_ = syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS2, &table, sizeof(table)) < 0;
+
+		return true;
+	}
+
+	bool supports(unsigned opcode) const
+	{
+		std::vector<unsigned char> memory(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+		io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(memory.data());
+
+		if(syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+		return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	void register_slab(char* data, std::size_t size)
+	{
+		if(closed_ || registration_failed_ || regions_.size() >= max_registered_slabs) return;
+
+		iovec memory{ data, size };
+		io_uring_rsrc_update2 update{};
+		update.offset = static_cast<std::uint32_t>(regions_.size());
+		update.data = reinterpret_cast<std::uintptr_t>(&memory);
+		update.nr = 1;
+
+		//Fails e.g. above RLIMIT_MEMLOCK, the reads then just don't use the slab
+		if(syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) < 0)
+		{
+			registration_failed_ = true;
+			return;
+		}
+
+		const Region region{ data, data + size, static_cast<int>(regions_.size()) };
+		regions_.insert(std::upper_bound(regions_.begin(), regions_.end(), region, [](const Region& a, const Region& b) { return a.begin < b.begin; }), region);
+		registered_slabs_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	//The buf_index of a buffer in a registered slab, otherwise -1
+	int fixed_index(const char* data, std::size_t size) const
+	{
+		auto it = std::upper_bound(regions_.begin(), regions_.end(), data, [](const char* pointer, const Region& region) { return pointer < region.begin; });
+		if(it == regions_.begin()) return -1;
+
+		--it;
+		return data + size <= it->end ? it->index : -1;
+	}
+
+	//Fills the next submission entry. operation receives the completion (nullptr: none)
+	io_uring_sqe* prepare(std::uint8_t opcode, int fd, Operation* operation)
+	{
+		//Full: what is queued is submitted right away
+		while(sq_queued_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+		{
+			const unsigned submitted = sq_submitted_;
+			submit();
+
+			//The kernel takes nothing right now, wait until it completed something
+			if(sq_submitted_ == submitted) enter(0, 1, IORING_ENTER_GETEVENTS);
+		}
+
+		io_uring_sqe* sqe = &sqes_[sq_queued_ & sq_mask_];
+		++sq_queued_;
+
+		std::memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = opcode;
+		sqe->fd = fd;
+		sqe->user_data = reinterpret_cast<std::uintptr_t>(operation);
+
+		if(operation) link(operation);
+		schedule_flush();
+		return sqe;
+	}
+
+	void link(Operation* operation)
+	{
+		operation->prev = pending_.prev;
+		operation->next = &pending_;
+		pending_.prev->next = operation;
+		pending_.prev = operation;
+		++pending_count_;
+	}
+
+	void unlink(Operation* operation)
+	{
+		operation->prev->next = operation->next;
+		operation->next->prev = operation->prev;
+		operation->prev = nullptr;
+		operation->next = nullptr;
+		--pending_count_;
+	}
+
+	//The submissions of this round of handlers go to the kernel together
+	void schedule_flush()
+	{
+		if(reaping_ || flush_posted_ || closed_) return;
+
+		flush_posted_ = true;
+		auto self = shared_from_this();
+		net::post(io_context_, [this, self]
+		{
+			flush_posted_ = false;
+			submit();
+		});
+	}
+
+	//Hands the filled entries to the kernel with one io_uring_enter()
+	void submit()
+	{
+		while(sq_submitted_ != sq_queued_ && ring_fd_ >= 0)
+		{
+			__atomic_store_n(sq_tail_, sq_queued_, __ATOMIC_RELEASE);
+
+			const int submitted = enter(sq_queued_ - sq_submitted_, 0, 0);
+			if(submitted < 0 && errno == EINTR) continue;
+
+			if(submitted <= 0)
+			{
+				//EAGAIN or EBUSY: the kernel is short of memory for the requests or the
+				//completions. The entries stay queued, the next flush tries again.
+				//These happen under load, only other errors are logged
+				if(submitted < 0)
+				{
+					submit_failures_.fetch_add(1, std::memory_order_relaxed);
+					if(errno != EAGAIN && errno != EBUSY) std::cerr << "IoUring: Submit failed: " << std::strerror(errno) << std::endl;
+				}
+				if(!reaping_ && !closed_) post_reap();
+				return;
+			}
+
+			sq_submitted_ += static_cast<unsigned>(submitted);
+			submissions_.fetch_add(static_cast<std::uint64_t>(submitted), std::memory_order_relaxed);
+		}
+	}
+
+	bool completions_waiting() const
+	{
+		return *cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) ||
+			(__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW);
+	}
+
+	void wait()
+	{
+		if(waiting_ || closed_) return;
+
+		waiting_ = true;
+		auto self = shared_from_this();
+		descriptor_.async_wait(net::posix::stream_descriptor::wait_read, [this, self](const err::error_code& ec)
+		{
+			waiting_ = false;
+			if(!ec && !closed_) reap();
+		});
+
+		//Completions which arrived before the wait was queued don't wake it anymore
+		if(completions_waiting()) post_reap();
+	}
+
+	void post_reap()
+	{
+		if(reap_posted_) return;
+
+		reap_posted_ = true;
+		auto self = shared_from_this();
+		net::post(io_context_, [this, self]
+		{
+			reap_posted_ = false;
+			if(!closed_) reap();
+		});
+	}
+
+	//Runs the handlers of the completions, the operations they start are submitted together afterwards
+	void reap()
+	{
+		reaping_ = true;
+
+		for(std::size_t reaped = 0; reaped < max_reap && !closed_; ++reaped)
+		{
+			const unsigned head = *cq_head_;
+			if(head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+			{
+				//Completions which didn't fit into the queue wait in the kernel
+				if(!(__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)) break;
+
+				enter(0, 0, IORING_ENTER_GETEVENTS);
+				if(head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) break;
+				continue;
+			}
+
+			const io_uring_cqe cqe = cqes_[head & cq_mask_];
+			__atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+			completions_.fetch_add(1, std::memory_order_relaxed);
+
+			Operation* operation = reinterpret_cast<Operation*>(static_cast<std::uintptr_t>(cqe.user_data));
+			if(!operation) continue;
+
+			if(!(cqe.flags & IORING_CQE_F_MORE)) unlink(operation);
+			operation->complete(operation, cqe.res, cqe.flags, false);
+		}
+
+		reaping_ = false;
+		if(closed_) return;
+
+		submit();
+		if(completions_waiting()) post_reap();
+		else wait();
+	}
+
+	//Used by shutdown(): waits up to 100 ms for completions and destroys their operations.
+	//Returns false if none arrived
+	bool drain_completions()
+	{
+		__kernel_timespec timeout{};
+		timeout.tv_nsec = 100000000;
+
+		io_uring_getevents_arg argument{};
+		argument.ts = reinterpret_cast<std::uintptr_t>(&timeout);
+
+		enter(0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &argument, sizeof(argument));
+
+		bool drained = false;
+		while(*cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+		{
+			const io_uring_cqe cqe = cqes_[*cq_head_ & cq_mask_];
+			__atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+			drained = true;
+
+			Operation* operation = reinterpret_cast<Operation*>(static_cast<std::uintptr_t>(cqe.user_data));
+			if(!operation) continue;
+
+			if(!(cqe.flags & IORING_CQE_F_MORE)) unlink(operation);
+			operation->complete(operation, cqe.res, cqe.flags, true);
+		}
+		return drained;
+	}
+
+}; //end class IoUring
+#endif
+
+//Memory for the completion handlers of one session. asio allocates every pending
+//operation through the associated allocator of its handler (see ArenaHandler) and
+//the arena hands out one of its slots. A session only has a few operations pending
+//at once (a read and a write per socket), so steady-state proxying doesn't touch the heap.
+//Larger operations or more pending ones fall back to operator new.
+//Like the session it is only used by one thread
+class HandlerArena
+{
+
+public:
+	enum
+	{
+		slot_size = 768,
+		slot_count = 4
+	};
+
+	HandlerArena() :
+		slots_(),
+		used_(0)
+	{}
+
+	HandlerArena(const HandlerArena&) = delete;
+	HandlerArena& operator=(const HandlerArena&) = delete;
+
+	void* allocate(std::size_t size)
+	{
+		if(size <= slot_size)
+		{
+			for(std::size_t i = 0; i < slot_count; ++i)
+			{
+				if(!(used_ & (1u << i)))
+				{
+					used_ |= 1u << i;
+					return slots_[i].data;
+				}
+			}
+		}
+		return ::operator new(size);
+	}
+
+	void deallocate(void* pointer)
+	{
+		const unsigned char* data = static_cast<const unsigned char*>(pointer);
+		if(data >= slots_.front().data && data <= slots_.back().data)
+		{
+			used_ &= ~(1u << static_cast<std::size_t>((data - slots_.front().data) / sizeof(Slot)));
+			return;
+		}
+		::operator delete(pointer);
+	}
+
+private:
+	struct alignas(std::max_align_t) Slot
+	{
+		unsigned char data[slot_size];
+	};
+
+	std::array<Slot, slot_count> slots_;
+	unsigned used_;
+
+}; //end class HandlerArena
+
+//The associated allocator of an ArenaHandler
+template <typename T>
+class HandlerAllocator
+{
+
+public:
+	using value_type = T;
+
+	explicit HandlerAllocator(HandlerArena& arena) noexcept :
+		arena_(arena)
+	{}
+
+	template <typename U>
+	HandlerAllocator(const HandlerAllocator<U>& other) noexcept :
+		arena_(other.arena_)
+	{}
+
+	T* allocate(std::size_t count) const
+	{
+		return static_cast<T*>(arena_.allocate(sizeof(T) * count));
+	}
+
+	void deallocate(T* pointer, std::size_t /*count*/) const
+	{
+		arena_.deallocate(pointer);
+	}
+
+	template <typename U>
+	bool operator==(const HandlerAllocator<U>& other) const noexcept { return &arena_ == &other.arena_; }
+
+	template <typename U>
+	bool operator!=(const HandlerAllocator<U>& other) const noexcept { return &arena_ != &other.arena_; }
+
+private:
+	template <typename> friend class HandlerAllocator;
+
+	HandlerArena& arena_;
+
+}; //end class HandlerAllocator
+
+//A completion handler whose operations are allocated from a HandlerArena.
+//asio finds the allocator through allocator_type and get_allocator()
+template <typename Handler>
+class ArenaHandler
+{
+
+public:
+	using allocator_type = HandlerAllocator<Handler>;
+
+	ArenaHandler(HandlerArena& arena, Handler handler) :
+		arena_(arena),
+		handler_(std::move(handler))
+	{}
+
+	allocator_type get_allocator() const noexcept
+	{
+		return allocator_type(arena_);
+	}
+
+	template <typename... Args>
+	void operator()(Args&&... args)
+	{
+		handler_(std::forward<Args>(args)...);
+	}
+
+private:
+	HandlerArena& arena_;
+	Handler handler_;
+
+}; //end class ArenaHandler
+
+//Recycles the memory of the sessions of one thread (see SessionAllocator): blocks of
+//the size of the first allocation are kept in a free list, up to max_free of them.
+//Like BufferPool every io_context has its own pool, so it is only used by one thread
+class SessionPool
+{
+
+public:
+	explicit SessionPool(std::size_t max_free = 1024) :
+		free_(nullptr),
+		block_size_(0),
+		free_count_(0),
+		max_free_(max_free)
+	{}
+
+	SessionPool(const SessionPool&) = delete;
+	SessionPool& operator=(const SessionPool&) = delete;
+
+	~SessionPool()
+	{
+		while(free_)
+		{
+			FreeBlock* next = free_->next;
+			::operator delete(free_);
+			free_ = next;
+		}
+	}
+
+	void* allocate(std::size_t size)
+	{
+		if(block_size_ == 0) block_size_ = std::max(size, sizeof(FreeBlock));
+
+		if(size == block_size_ && free_)
+		{
+			FreeBlock* block = free_;
+			free_ = block->next;
+			--free_count_;
+			return block;
+		}
+		return ::operator new(std::max(size, sizeof(FreeBlock)));
+	}
+
+	void deallocate(void* pointer, std::size_t size)
+	{
+		if(size == block_size_ && free_count_ < max_free_)
+		{
+			free_ = new(pointer) FreeBlock{ free_ };
+			++free_count_;
+			return;
+		}
+		::operator delete(pointer);
+	}
+
+	std::size_t free_count() const
+	{
+		return free_count_;
+	}
+
+private:
+	struct FreeBlock
+	{
+		FreeBlock* next;
+	};
+
+	FreeBlock* free_;
+	std::size_t block_size_;
+	std::size_t free_count_;
+	std::size_t max_free_;
+
+}; //end class SessionPool
+
+//Allocator for std::allocate_shared which takes the memory from a SessionPool.
+//The shared_ptr keeps the pool alive until the last session of it is gone
+template <typename T>
+class SessionAllocator
+{
+
+public:
+	using value_type = T;
+
+	explicit SessionAllocator(std::shared_ptr<SessionPool> pool) noexcept :
+		pool_(std::move(pool))
+	{}
+
+	template <typename U>
+	SessionAllocator(const SessionAllocator<U>& other) noexcept :
+		pool_(other.pool_)
+	{}
+
+	T* allocate(std::size_t count)
+	{
+		return static_cast<T*>(pool_->allocate(sizeof(T) * count));
+	}
+
+	void deallocate(T* pointer, std::size_t count)
+	{
+		pool_->deallocate(pointer, sizeof(T) * count);
+	}
+
+	template <typename U>
+	bool operator==(const SessionAllocator<U>& other) const noexcept { return pool_ == other.pool_; }
+
+	template <typename U>
+	bool operator!=(const SessionAllocator<U>& other) const noexcept { return pool_ != other.pool_; }
+
+private:
+	template <typename> friend class SessionAllocator;
+
+	std::shared_ptr<SessionPool> pool_;
+
+}; //end class SessionAllocator
+
+//Chooses the read size of one direction: it grows while the reads fill the whole
+//buffer (bulk transfers) and shrinks again when only small messages arrive
+class AdaptiveReadSize
+{
+
+public:
+	explicit AdaptiveReadSize(std::size_t max_size) :
+		size_(BufferPool::small_buffer),
+		max_size_(max_size),
+		bulk_(false)
+	{}
+
+	std::size_t size() const { return size_; }
+
+	//In bulk mode more data is expected right away, otherwise the
+	//connection is likely to be idle for a while
+	bool bulk() const { return bulk_; }
+
+	void update(std::size_t length)
+	{
+		bulk_ = length >= size_;
+
+		if(bulk_) size_ = std::min(size_ * 2, max_size_);
+		else if(length < size_ / 4) size_ = std::max<std::size_t>(size_ / 2, BufferPool::small_buffer);
+	}
+
+private:
+	std::size_t size_;
+	std::size_t max_size_;
+	bool bulk_;
+
+}; //end class AdaptiveReadSize
+
+//Filled buffers of one direction which wait to be written.
+//All queued chunks (up to max_chunks) are written with one gather write
+class ChunkQueue
+{
+
+public:
+	enum
+	{
+		max_chunks = 8
+	};
+
+	//Buffer sequence for net::async_write which doesn't need any allocation
+	class GatherBuffers
+	{
+
+	public:
+		using value_type = net::const_buffer;
+		using const_iterator = const net::const_buffer*;
+
+		GatherBuffers() :
+			buffers_(),
+			count_(0)
+		{}
+
+		void add(const net::const_buffer& buffer) { buffers_[count_++] = buffer; }
+		const_iterator begin() const { return buffers_.data(); }
+		const_iterator end() const { return buffers_.data() + count_; }
+
+	private:
+		std::array<net::const_buffer, max_chunks> buffers_;
+		std::size_t count_;
+
+	}; //end class GatherBuffers
+
+	ChunkQueue() :
+		chunks_(),
+		head_(0),
+		count_(0),
+		in_flight_(0),
+		bytes_(0)
+	{}
+
+	bool empty() const { return count_ == in_flight_; }
+	bool full() const { return count_ == max_chunks; }
+	bool write_in_flight() const { return in_flight_ > 0; }
+
+	//Chunks which can still be pushed
+	std::size_t available() const { return max_chunks - count_; }
+
+	//Bytes which are queued or currently written
+	std::size_t bytes() const { return bytes_; }
+
+	void push(BufferPool::Buffer buffer, std::size_t length, std::size_t offset = 0)
+	{
+		Chunk& chunk = chunks_[(head_ + count_) % max_chunks];
+		chunk.buffer = std::move(buffer);
+		chunk.offset = offset;
+		chunk.length = length;
+		++count_;
+		bytes_ += length;
+	}
+
+	//Marks all queued chunks as in flight and returns their buffers
+	GatherBuffers prepare_write()
+	{
+		GatherBuffers buffers;
+		for(in_flight_ = 0; in_flight_ < count_; ++in_flight_)
+		{
+			const Chunk& chunk = chunks_[(head_ + in_flight_) % max_chunks];
+			buffers.add(net::const_buffer(chunk.buffer.data() + chunk.offset, chunk.length));
+		}
+		return buffers;
+	}
+
+	//Gives the buffers of the completed write back to the pool
+	void commit_write()
+	{
+		for(; in_flight_ > 0; --in_flight_, --count_)
+		{
+			Chunk& chunk = chunks_[head_];
+			bytes_ -= chunk.length;
+			chunk.buffer.reset();
+			head_ = (head_ + 1) % max_chunks;
+		}
+	}
+
+	void clear()
+	{
+		for(Chunk& chunk : chunks_) chunk.buffer.reset();
+		head_ = count_ = in_flight_ = bytes_ = 0;
+	}
+
+private:
+	struct Chunk
+	{
+		BufferPool::Buffer buffer{};
+		std::size_t offset = 0;
+		std::size_t length = 0;
+	};
+
+	std::array<Chunk, max_chunks> chunks_;
+	std::size_t head_;
+	std::size_t count_;
+	std::size_t in_flight_;
+	std::size_t bytes_;
+
+}; //end class ChunkQueue
+
+//Incremental parser for the head (start line and headers) of an HTTP/1.x response or request.
+//The bytes are passed in as they arrive, parsing continues where the previous call stopped,
+//so every byte is only looked at once. Lines are found with memchr, which libc scans with SIMD.
+//The parser neither copies nor allocates: the status line and the headers are
+//views into the buffer which holds the head. Names are compared case insensitive
+class HttpHeadParser
+{
+
+public:
+	enum class Kind
+	{
+		response,
+		request
+	};
+
+	enum class Result
+	{
+		incomplete,
+		complete,
+		error
+	};
+
+	enum
+	{
+		max_headers = 64,
+		max_head_size = 65535
+	};
+
+	struct Header
+	{
+		std::string_view name;
+		std::string_view value;
+	};
+
+	explicit HttpHeadParser(Kind kind = Kind::response) :
+		kind_(kind),
+		base_(nullptr),
+		state_(State::status_line),
+		scan_pos_(0),
+		line_start_(0),
+		head_length_(0),
+		version_minor_(0),
+		status_code_(0),
+		reason_(),
+		method_(),
+		target_(),
+		headers_(),
+		header_count_(0),
+		too_large_(false)
+	{}
+
+	void reset()
+	{
+		base_ = nullptr;
+		state_ = State::status_line;
+		scan_pos_ = 0;
+		line_start_ = 0;
+		head_length_ = 0;
+		version_minor_ = 0;
+		status_code_ = 0;
+		reason_ = Span();
+		method_ = Span();
+		target_ = Span();
+		header_count_ = 0;
+		too_large_ = false;
+	}
+
+	//data holds all bytes received so far, starting with the bytes of the previous calls.
+	//It may contain more than the head (e.g. the beginning of the body)
+	Result parse(const char* data, std::size_t length)
+	{
+		base_ = data;
+
+		while(state_ != State::done)
+		{
+			if(state_ == State::failed) return Result::error;
+
+			const std::size_t limit = std::min<std::size_t>(length, max_head_size);
+			const void* newline = scan_pos_ < limit ? std::memchr(data + scan_pos_, '\n', limit - scan_pos_) : nullptr;
+
+			if(!newline)
+			{
+				scan_pos_ = limit;
+				if(limit == max_head_size) state_ = State::failed;
+				if(limit == max_head_size) too_large_ = true;
+				return state_ == State::failed ? Result::error : Result::incomplete;
+			}
+
+			const std::size_t line_end = static_cast<std::size_t>(static_cast<const char*>(newline) - data);
+			std::size_t content_end = line_end;
+			if(content_end > line_start_ && data[content_end - 1] == '\r') --content_end;
+
+			if(!parse_line(line_start_, content_end))
+			{
+				state_ = State::failed;
+				return Result::error;
+			}
+
+			line_start_ = scan_pos_ = line_end + 1;
+		}
+
+		head_length_ = line_start_;
+		return Result::complete;
+	}
+
+	Kind kind() const { return kind_; }
+	bool complete() const { return state_ == State::done; }
+
+	//The head failed because it exceeds max_head_size or max_headers, not because it is malformed
+	bool too_large() const { return too_large_; }
+
+	//Bytes of the head including the empty line at the end
+	std::size_t head_length() const { return head_length_; }
+
+	int version_minor() const { return version_minor_; }
+	int status_code() const { return status_code_; }
+	std::string_view reason() const { return view(reason_); }
+
+	//Only for requests
+	std::string_view method() const { return view(method_); }
+	std::string_view target() const { return view(target_); }
+
+	std::size_t header_count() const { return header_count_; }
+
+	Header header(std::size_t index) const
+	{
+		return Header{ view(headers_[index].name), view(headers_[index].value) };
+	}
+
+	//Looks up the first header with the given name
+	bool find(std::string_view name, std::string_view& value) const
+	{
+		for(std::size_t i = 0; i < header_count_; ++i)
+		{
+			if(iequals(view(headers_[i].name), name))
+			{
+				value = view(headers_[i].value);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool has_header(std::string_view name) const
+	{
+		std::string_view value;
+		return find(name, value);
+	}
+
+	//True if the comma separated header contains the token, e.g. Connection: close
+	bool header_contains(std::string_view name, std::string_view token) const
+	{
+		for(std::size_t i = 0; i < header_count_; ++i)
+		{
+			if(iequals(view(headers_[i].name), name) && list_contains(view(headers_[i].value), token))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static bool iequals(std::string_view a, std::string_view b)
+	{
+		if(a.size() != b.size()) return false;
+
+		for(std::size_t i = 0; i < a.size(); ++i)
+		{
+			if(std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i]))) return false;
+		}
+		return true;
+	}
+
+	static bool list_contains(std::string_view list, std::string_view token)
+	{
+		while(!list.empty())
+		{
+			std::size_t comma = list.find(',');
+			std::string_view item = trim(list.substr(0, comma));
+			if(iequals(item, token)) return true;
+			if(comma == std::string_view::npos) break;
+			list.remove_prefix(comma + 1);
+		}
+		return false;
+	}
+
+	static std::string_view trim(std::string_view value)
+	{
+		while(!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+		while(!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+		return value;
+	}
+
+	static bool parse_length(std::string_view value, std::size_t& length)
+	{
+		if(value.empty() || value.size() > 18) return false;
+
+		std::size_t result = 0;
+		for(char c : value)
+		{
+			if(c < '0' || c > '9') return false;
+			result = result * 10 + static_cast<std::size_t>(c - '0');
+		}
+
+		length = result;
+		return true;
+	}
+
+private:
+	enum class State
+	{
+		status_line,
+		headers,
+		done,
+		failed
+	};
+
+	//Offsets into the head, it never gets larger than max_head_size
+	struct Span
+	{
+		std::uint16_t offset = 0;
+		std::uint16_t length = 0;
+	};
+
+	struct HeaderSpan
+	{
+		Span name{};
+		Span value{};
+	};
+
+	Kind kind_;
+	const char* base_;
+	State state_;
+	std::size_t scan_pos_;
+	std::size_t line_start_;
+	std::size_t head_length_;
+	int version_minor_;
+	int status_code_;
+	Span reason_;
+	Span method_;
+	Span target_;
+	std::array<HeaderSpan, max_headers> headers_;
+	std::size_t header_count_;
+	bool too_large_;
+
+	std::string_view view(const Span& span) const
+	{
+		return std::string_view(base_ + span.offset, span.length);
+	}
+
+	static Span span(std::size_t begin, std::size_t end)
+	{
+		Span result;
+		result.offset = static_cast<std::uint16_t>(begin);
+		result.length = static_cast<std::uint16_t>(end - begin);
+		return result;
+	}
+
+	bool parse_line(std::size_t begin, std::size_t end)
+	{
+		const char* line = base_ + begin;
+		const std::size_t length = end - begin;
+
+		if(state_ == State::status_line && kind_ == Kind::request)
+		{
+			//method SP target SP HTTP/1.x
+			const void* first_space = std::memchr(line, ' ', length);
+			if(!first_space || first_space == line || length < 10) return false;
+
+			const std::size_t method_end = static_cast<std::size_t>(static_cast<const char*>(first_space) - base_);
+			const std::size_t version_begin = end - 8;
+			if(version_begin <= method_end + 1 || base_[version_begin - 1] != ' ') return false;
+			if(std::memcmp(base_ + version_begin, "HTTP/1.", 7) != 0 || !std::isdigit(static_cast<unsigned char>(base_[end - 1]))) return false;
+
+			method_ = span(begin, method_end);
+			target_ = span(method_end + 1, version_begin - 1);
+			version_minor_ = base_[end - 1] - '0';
+			state_ = State::headers;
+			return true;
+		}
+
+		if(state_ == State::status_line)
+		{
+			//HTTP/1.x SP 3DIGIT [SP reason]
+			if(length < 12 || std::memcmp(line, "HTTP/1.", 7) != 0 || !std::isdigit(static_cast<unsigned char>(line[7])) || line[8] != ' ') return false;
+			if(!std::isdigit(static_cast<unsigned char>(line[9])) || !std::isdigit(static_cast<unsigned char>(line[10])) || !std::isdigit(static_cast<unsigned char>(line[11]))) return false;
+			if(length > 12 && line[12] != ' ') return false;
+
+			version_minor_ = line[7] - '0';
+			status_code_ = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+			reason_ = length > 13 ? span(begin + 13, end) : span(end, end);
+			state_ = State::headers;
+			return true;
+		}
+
+		if(length == 0)
+		{
+			state_ = State::done;
+			return true;
+		}
+
+		if(line[0] == ' ' || line[0] == '\t')
+		{
+			//obs-fold: the line continues the value of the previous header. Requests with
+			//it are rejected (RFC 9112 5.2), the next hop could read the fold differently
+			if(header_count_ == 0 || kind_ == Kind::request) return false;
+
+			std::size_t value_end = end;
+			while(value_end > begin && (base_[value_end - 1] == ' ' || base_[value_end - 1] == '\t')) --value_end;
+			HeaderSpan& previous = headers_[header_count_ - 1];
+			previous.value.length = static_cast<std::uint16_t>(value_end - previous.value.offset);
+			return true;
+		}
+
+		const void* colon = std::memchr(line, ':', length);
+		if(!colon || colon == line) return false;
+
+		if(header_count_ == max_headers)
+		{
+			too_large_ = true;
+			return false;
+		}
+
+		const std::size_t name_end = static_cast<std::size_t>(static_cast<const char*>(colon) - base_);
+		if(base_[name_end - 1] == ' ' || base_[name_end - 1] == '\t') return false;
+
+		std::size_t value_begin = name_end + 1;
+		std::size_t value_end = end;
+		while(value_begin < value_end && (base_[value_begin] == ' ' || base_[value_begin] == '\t')) ++value_begin;
+		while(value_end > value_begin && (base_[value_end - 1] == ' ' || base_[value_end - 1] == '\t')) --value_end;
+
+		headers_[header_count_].name = span(begin, name_end);
+		headers_[header_count_].value = span(value_begin, value_end);
+		++header_count_;
+
+		return true;
+	}
+
+}; //end class HttpHeadParser
+
+//Finds the end of an HTTP/1.x message body in the forwarded bytes without changing them.
+//Content-Length bodies are only counted. Of chunked bodies only the chunk size lines
+//and the trailer are looked at, the chunk data is skipped
+class HttpBodyFraming
+{
+
+public:
+	enum class Mode
+	{
+		none,
+		length,
+		chunked,
+		until_close
+	};
+
+	HttpBodyFraming() :
+		mode_(Mode::none),
+		remaining_(0),
+		chunk_state_(ChunkState::size),
+		size_digits_(0),
+		error_(false)
+	{}
+
+	void start(Mode mode, std::size_t length = 0)
+	{
+		mode_ = (mode == Mode::length && length == 0) ? Mode::none : mode;
+		remaining_ = length;
+		chunk_state_ = ChunkState::size;
+		size_digits_ = 0;
+		error_ = false;
+	}
+
+	Mode mode() const { return mode_; }
+
+	//The body is complete (or there is none)
+	bool done() const { return mode_ == Mode::none; }
+
+	//Invalid chunked encoding, the rest of the connection was passed through as it is
+	bool error() const { return error_; }
+
+	//Bytes which are still missing of a Content-Length body
+	std::size_t remaining() const { return remaining_; }
+
+	//Returns how many of the bytes belong to the body. If it is less
+	//than length, the body is complete and the rest is the next message
+	std::size_t consume(const char* data, std::size_t length)
+	{
+		switch(mode_)
+		{
+		case Mode::none:
+			return 0;
+
+		case Mode::until_close:
+			return length;
+
+		case Mode::length:
+		{
+			const std::size_t used = std::min(length, remaining_);
+			remaining_ -= used;
+			if(remaining_ == 0) mode_ = Mode::none;
+			return used;
+		}
+
+		case Mode::chunked:
+			return consume_chunked(data, length, nullptr, nullptr);
+		}
+
+		return 0;
+	}
+
+	//Like consume(), but also removes the chunked framing: the body bytes of the used
+	//part are moved to the front of data and decoded tells how many there are
+	std::size_t decode(char* data, std::size_t length, std::size_t& decoded)
+	{
+		decoded = 0;
+		if(mode_ != Mode::chunked)
+		{
+			decoded = consume(data, length);
+			return decoded;
+		}
+
+		return consume_chunked(data, length, data, &decoded);
+	}
+
+private:
+	enum class ChunkState
+	{
+		size,
+		extension,
+		data,
+		data_cr,
+		data_lf,
+		trailer_start,
+		trailer_line,
+		last_lf
+	};
+
+	Mode mode_;
+	std::size_t remaining_;
+	ChunkState chunk_state_;
+	std::size_t size_digits_;
+	bool error_;
+
+	static int hex_value(char c)
+	{
+		if(c >= '0' && c <= '9') return c - '0';
+		if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+		if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+		return -1;
+	}
+
+	//If out is set, the chunk data is copied there (it may be data itself)
+	std::size_t consume_chunked(const char* data, std::size_t length, char* out, std::size_t* decoded)
+	{
+		std::size_t pos = 0;
+
+		while(pos < length)
+		{
+			const char c = data[pos];
+
+			switch(chunk_state_)
+			{
+			case ChunkState::size:
+			{
+				const int digit = hex_value(c);
+				if(digit >= 0 && size_digits_ < 15)
+				{
+					remaining_ = remaining_ * 16 + static_cast<std::size_t>(digit);
+					++size_digits_;
+					++pos;
+				}
+				else if(size_digits_ > 0 && (c == ';' || c == ' ' || c == '\t' || c == '\r' || c == '\n'))
+				{
+					chunk_state_ = ChunkState::extension;
+				}
+				else
+				{
+					return fail(length);
+				}
+				break;
+			}
+
+			case ChunkState::extension:
+			{
+				const void* newline = std::memchr(data + pos, '\n', length - pos);
+				if(!newline) return length;
+
+				pos = static_cast<std::size_t>(static_cast<const char*>(newline) - data) + 1;
+				size_digits_ = 0;
+				chunk_state_ = remaining_ == 0 ? ChunkState::trailer_start : ChunkState::data;
+				break;
+			}
+
+			case ChunkState::data:
+			{
+				const std::size_t used = std::min(length - pos, remaining_);
+				if(out)
+				{
+					std::memmove(out + *decoded, data + pos, used);
+					*decoded += used;
+				}
+				pos += used;
+				remaining_ -= used;
+				if(remaining_ == 0) chunk_state_ = ChunkState::data_cr;
+				break;
+			}
+
+			case ChunkState::data_cr:
+				if(c == '\r') chunk_state_ = ChunkState::data_lf;
+				else if(c == '\n') chunk_state_ = ChunkState::size;
+				else return fail(length);
+				++pos;
+				break;
+
+			case ChunkState::data_lf:
+				if(c != '\n') return fail(length);
+				chunk_state_ = ChunkState::size;
+				++pos;
+				break;
+
+			case ChunkState::trailer_start:
+				if(c == '\r') chunk_state_ = ChunkState::last_lf;
+				else if(c == '\n') return finish(pos + 1);
+				else chunk_state_ = ChunkState::trailer_line;
+				++pos;
+				break;
+
+			case ChunkState::trailer_line:
+			{
+				const void* newline = std::memchr(data + pos, '\n', length - pos);
+				if(!newline) return length;
+
+				pos = static_cast<std::size_t>(static_cast<const char*>(newline) - data) + 1;
+				chunk_state_ = ChunkState::trailer_start;
+				break;
+			}
+
+			case ChunkState::last_lf:
+				if(c != '\n') return fail(length);
+				return finish(pos + 1);
+			}
+		}
+
+		return length;
+	}
+
+	std::size_t finish(std::size_t used)
+	{
+		mode_ = Mode::none;
+		return used;
+	}
+
+	//The message boundary is lost, so everything else belongs to this message
+	std::size_t fail(std::size_t length)
+	{
+		mode_ = Mode::until_close;
+		error_ = true;
+		return length;
+	}
+
+}; //end class HttpBodyFraming
+
+//The framing decisions of HTTP/1.1 (RFC 9112 6.3) the session engines share: how the
+//body after a head ends and whether the target connection can be reused afterwards.
+//Also the answers the proxy gives itself instead of the target
+class HttpMessageFraming
+{
+
+public:
+	//The request methods a response needs to know about
+	enum class Method : std::uint8_t
+	{
+		other,
+		head,
+		connect
+	};
+
+	//How a message continues after its head
+	struct Decision
+	{
+		//Nothing after the head is HTTP anymore (CONNECT, Upgrade or a body which
+		//can't be framed), the rest of the connection is forwarded as it is
+		bool tunnel = false;
+
+		//The target connection can be reused once the exchange is complete
+		bool reusable = true;
+
+		//The body length can't be determined safely (e.g. Content-Length and Transfer-Encoding
+		//together), two parsers could disagree where the request ends (request smuggling).
+		//It is answered with 400 and the connection is closed (RFC 9112 6.3)
+		bool invalid = false;
+	};
+
+	static Method method_of(std::string_view method)
+	{
+		if(method == "HEAD") return Method::head;
+		if(method == "CONNECT") return Method::connect;
+		return Method::other;
+	}
+
+	//Starts body for the request which was just parsed
+	static Decision start_request(const HttpHeadParser& head, HttpBodyFraming& body)
+	{
+		Decision decision;
+		const Method method = method_of(head.method());
+
+		if(head.version_minor() != 1 || head.header_contains("Connection", "close") ||
+			head.has_header("Upgrade") || method == Method::connect)
+		{
+			decision.reusable = false;
+		}
+
+		bool has_length = false;
+		bool has_coding = false;
+		bool chunked = false;
+		std::size_t body_length = 0;
+		const bool valid_length = content_length(head, has_length, body_length);
+		const bool valid_coding = transfer_coding(head, has_coding, chunked);
+
+		//A request body with transfer codings must end with chunked, HTTP/1.0 doesn't know them
+		if(!valid_length || !valid_coding || (has_coding && (has_length || !chunked || head.version_minor() != 1)))
+		{
+			decision.invalid = true;
+			decision.reusable = false;
+			body.start(HttpBodyFraming::Mode::until_close);
+			return decision;
+		}
+
+		if(has_coding) body.start(HttpBodyFraming::Mode::chunked);
+		else if(has_length) body.start(HttpBodyFraming::Mode::length, body_length);
+		else body.start(HttpBodyFraming::Mode::none);
+
+		//The connection becomes a tunnel, nothing after it is HTTP anymore
+		if(method == Method::connect) decision.tunnel = true;
+
+		if(decision.tunnel)
+		{
+			decision.reusable = false;
+			body.start(HttpBodyFraming::Mode::until_close);
+		}
+		return decision;
+	}
+
+	//Starts body for a final response (or 101) to a request with method
+	static Decision start_response(const HttpHeadParser& head, Method method, HttpBodyFraming& body)
+	{
+		Decision decision;
+		const int status = head.status_code();
+
+		bool has_length = false;
+		bool has_coding = false;
+		bool chunked = false;
+		std::size_t body_length = 0;
+		const bool valid_length = content_length(head, has_length, body_length);
+		const bool valid_coding = transfer_coding(head, has_coding, chunked);
+
+		if(status == 101 || (method == Method::connect && status < 300))
+		{
+			decision.tunnel = true;
+			body.start(HttpBodyFraming::Mode::until_close);
+		}
+		else if(method == Method::head || status == 204 || status == 304)
+		{
+			body.start(HttpBodyFraming::Mode::none);
+		}
+		else if(has_coding)
+		{
+			//Transfer-Encoding wins over Content-Length, other final codings end with the connection
+			if(valid_coding && chunked && head.version_minor() == 1) body.start(HttpBodyFraming::Mode::chunked);
+			else body.start(HttpBodyFraming::Mode::until_close);
+		}
+		else if(has_length && valid_length)
+		{
+			body.start(HttpBodyFraming::Mode::length, body_length);
+		}
+		else
+		{
+			body.start(HttpBodyFraming::Mode::until_close);
+		}
+
+		//A response with both lengths is not trusted for the next one
+		if(body.mode() == HttpBodyFraming::Mode::until_close || head.version_minor() != 1 ||
+			head.header_contains("Connection", "close") || (has_coding && has_length))
+		{
+			decision.reusable = false;
+		}
+		return decision;
+	}
+
+	//The complete answer of the proxy itself for status (400, 431 or 502, anything
+	//else is a 500). It has no body and closes the connection
+	static std::string_view error_response(int status)
+	{
+		static constexpr std::string_view bad_request = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		static constexpr std::string_view too_large = "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		static constexpr std::string_view bad_gateway = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		static constexpr std::string_view internal_error = "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+		switch(status)
+		{
+			case 400: return bad_request;
+			case 431: return too_large;
+			case 502: return bad_gateway;
+			default: return internal_error;
+		}
+	}
+
+private:
+	//Reads all Content-Length headers. Returns false if a value isn't a number or the
+	//values differ, repeated equal values (e.g. "5, 5") are one length (RFC 9110 8.6)
+	static bool content_length(const HttpHeadParser& head, bool& found, std::size_t& length)
+	{
+		found = false;
+		for(std::size_t i = 0; i < head.header_count(); ++i)
+		{
+			const HttpHeadParser::Header header = head.header(i);
+			if(!HttpHeadParser::iequals(header.name, "Content-Length")) continue;
+
+			std::string_view list = header.value;
+			while(true)
+			{
+				const std::size_t comma = list.find(',');
+				std::size_t value = 0;
+				if(!HttpHeadParser::parse_length(HttpHeadParser::trim(list.substr(0, comma)), value) || (found && value != length)) return false;
+
+				found = true;
+				length = value;
+				if(comma == std::string_view::npos) break;
+				list.remove_prefix(comma + 1);
+			}
+		}
+		return true;
+	}
+
+	//Reads the codings of all Transfer-Encoding headers, several headers form one list.
+	//Returns false if anything follows chunked, it has to be applied exactly once and last
+	static bool transfer_coding(const HttpHeadParser& head, bool& found, bool& chunked)
+	{
+		found = false;
+		chunked = false;
+		for(std::size_t i = 0; i < head.header_count(); ++i)
+		{
+			const HttpHeadParser::Header header = head.header(i);
+			if(!HttpHeadParser::iequals(header.name, "Transfer-Encoding")) continue;
+
+			found = true;
+			std::string_view list = header.value;
+			while(true)
+			{
+				const std::size_t comma = list.find(',');
+				const std::string_view coding = HttpHeadParser::trim(list.substr(0, comma));
+				if(!coding.empty())
+				{
+					if(chunked) return false;
+					chunked = HttpHeadParser::iequals(coding, "chunked");
+				}
+
+				if(comma == std::string_view::npos) break;
+				list.remove_prefix(comma + 1);
+			}
+		}
+		return true;
+	}
+
+}; //end class HttpMessageFraming
+
+//Changes a rewrite hook wants to make to a response head.
+//If there are any, the head is written anew, otherwise the original bytes are forwarded
+class HttpHeadRewrite
+{
+
+public:
+	HttpHeadRewrite() :
+		edits_()
+	{}
+
+	//Replaces the header (all of them if there are several) or adds it
+	void set_header(std::string_view name, std::string_view value)
+	{
+		edits_.push_back(Edit{ Edit::set, std::string(name), std::string(value) });
+	}
+
+	void remove_header(std::string_view name)
+	{
+		edits_.push_back(Edit{ Edit::remove, std::string(name), std::string() });
+	}
+
+	void add_header(std::string_view name, std::string_view value)
+	{
+		edits_.push_back(Edit{ Edit::add, std::string(name), std::string(value) });
+	}
+
+	bool empty() const
+	{
+		return edits_.empty();
+	}
+
+	void clear()
+	{
+		edits_.clear();
+	}
+
+	//Serializes the head with all changes applied
+	std::string apply(const HttpHeadParser& head) const
+	{
+		std::string out;
+		out.reserve(head.head_length() + 128);
+
+		if(head.kind() == HttpHeadParser::Kind::request)
+		{
+			out.append(head.method());
+			out.push_back(' ');
+			out.append(head.target());
+			out.append(" HTTP/1.");
+			out.push_back(static_cast<char>('0' + head.version_minor()));
+		}
+		else
+		{
+			out.append("HTTP/1.");
+			out.push_back(static_cast<char>('0' + head.version_minor()));
+			out.push_back(' ');
+			out.append(std::to_string(head.status_code()));
+			if(!head.reason().empty())
+			{
+				out.push_back(' ');
+				out.append(head.reason());
+			}
+		}
+		out.append("\r\n");
+
+		std::vector<bool> emitted(edits_.size(), false);
+
+		for(std::size_t i = 0; i < head.header_count(); ++i)
+		{
+			const HttpHeadParser::Header header = head.header(i);
+			const Edit* edit = last_edit(header.name);
+
+			if(!edit)
+			{
+				append_header(out, header.name, header.value);
+			}
+			else if(edit->kind == Edit::set && !emitted[static_cast<std::size_t>(edit - edits_.data())])
+			{
+				append_header(out, edit->name, edit->value);
+				emitted[static_cast<std::size_t>(edit - edits_.data())] = true;
+			}
+		}
+
+		for(std::size_t i = 0; i < edits_.size(); ++i)
+		{
+			const Edit& edit = edits_[i];
+			if((edit.kind == Edit::set && !emitted[i] && last_edit(edit.name) == &edit) || edit.kind == Edit::add)
+			{
+				append_header(out, edit.name, edit.value);
+			}
+		}
+
+		out.append("\r\n");
+		return out;
+	}
+
+private:
+	struct Edit
+	{
+		enum Kind { set, remove, add } kind;
+		std::string name;
+		std::string value;
+	};
+
+	std::vector<Edit> edits_;
+
+	//The last set/remove for a header wins, added headers never replace anything
+	const Edit* last_edit(std::string_view name) const
+	{
+		for(auto it = edits_.rbegin(); it != edits_.rend(); ++it)
+		{
+			if(it->kind != Edit::add && HttpHeadParser::iequals(it->name, name)) return &*it;
+		}
+		return nullptr;
+	}
+
+	static void append_header(std::string& out, std::string_view name, std::string_view value)
+	{
+		out.append(name);
+		out.append(": ");
+		out.append(value);
+		out.append("\r\n");
+	}
+
+}; //end class HttpHeadRewrite
+
+//Called for every response head from the target, before it is forwarded to the client
+using ResponseHeadHook = std::function<void(const HttpHeadParser& head, HttpHeadRewrite& rewrite)>;
+
+//The default hook: the target speaks plain HTTP, so absolute redirects
+//to http:// are changed to https:// for the client
+inline void rewrite_location_to_https(const HttpHeadParser& head, HttpHeadRewrite& rewrite)
+{
+	if(head.status_code() < 300 || head.status_code() > 399) return;
+
+	std::string_view location;
+	if(!head.find("Location", location) || location.size() < 7 || !HttpHeadParser::iequals(location.substr(0, 7), "http://")) return;
+
+	std::string https_location("https://");
+	https_location.append(location.substr(7));
+	rewrite.set_header("Location", https_location);
+}
+
+//Clients of a dual-stack listener have IPv4 mapped IPv6 addresses (::ffff:a.b.c.d),
+//they are turned back into the IPv4 address. Other addresses are returned unchanged
+inline net::ip::address unmap_address(const net::ip::address& address)
+{
+	if(address.is_v6() && address.to_v6().is_v4_mapped()) return net::ip::make_address_v4(net::ip::v4_mapped, address.to_v6());
+	return address;
+}
+
+//The client of a session as the forwarded headers name it: the address for X-Forwarded-For
+//and the node for Forwarded, where IPv6 addresses are quoted (RFC 7239)
+class ForwardedClient
+{
+
+public:
+	ForwardedClient() :
+		address_(),
+		node_()
+	{}
+
+	void set(const tcp::socket& socket)
+	{
+		err::error_code ec;
+		const net::ip::address address = unmap_address(socket.remote_endpoint(ec).address());
+		address_ = ec ? std::string("unknown") : address.to_string();
+
+		if(!ec && address.is_v6()) node_ = "for=\"[" + address_ + "]\"";
+		else node_ = "for=" + address_;
+	}
+
+	const std::string& address() const { return address_; }
+	const std::string& node() const { return node_; }
+
+	//Sets X-Forwarded-For, X-Forwarded-Proto and Forwarded for the request head
+	void add_headers(const HttpHeadParser& head, HttpHeadRewrite& rewrite) const
+	{
+		//Proxies before this one are kept, the client address is appended
+		std::string forwarded_for;
+		std::string forwarded;
+		for(std::size_t i = 0; i < head.header_count(); ++i)
+		{
+			const HttpHeadParser::Header header = head.header(i);
+			std::string* list = nullptr;
+			if(HttpHeadParser::iequals(header.name, "X-Forwarded-For")) list = &forwarded_for;
+			else if(HttpHeadParser::iequals(header.name, "Forwarded")) list = &forwarded;
+
+			if(list && !header.value.empty())
+			{
+				if(!list->empty()) list->append(", ");
+				list->append(header.value);
+			}
+		}
+
+		if(!forwarded_for.empty()) forwarded_for.append(", ");
+		forwarded_for.append(address_);
+
+		if(!forwarded.empty()) forwarded.append(", ");
+		forwarded.append(node_);
+		forwarded.append(";proto=https");
+
+		rewrite.set_header("X-Forwarded-For", forwarded_for);
+		rewrite.set_header("X-Forwarded-Proto", "https");
+		rewrite.set_header("Forwarded", forwarded);
+	}
+
+private:
+	std::string address_;
+	std::string node_;
+
+}; //end class ForwardedClient
+
+//Builds the binary PROXY protocol v2 header (see haproxy's proxy-protocol.txt). It is sent
+//first on a new target connection and tells the target the client address and the
+//TLS parameters (SNI, ALPN, version and cipher) without the target speaking TLS itself
+class ProxyProtocolHeader
+{
+
+public:
+	static std::string build(const tcp::endpoint& client, const tcp::endpoint& local, SSL* ssl)
+	{
+		static const char signature[] = "\x0D\x0A\x0D\x0A\x00\x0D\x0A\x51\x55\x49\x54\x0A";
+
+		std::string header(signature, sizeof(signature) - 1);
+		header.push_back('\x21'); //Version 2, PROXY command
+
+		//Both addresses need the same family, mapped IPv4 addresses are unmapped if possible
+		net::ip::address source = unmap_address(client.address());
+		net::ip::address destination = unmap_address(local.address());
+		if(source.is_v4() != destination.is_v4())
+		{
+			if(source.is_v4()) source = net::ip::make_address_v6(net::ip::v4_mapped, source.to_v4());
+			else destination = net::ip::make_address_v6(net::ip::v4_mapped, destination.to_v4());
+		}
+
+		std::string body;
+		if(source.is_v4())
+		{
+			header.push_back('\x11'); //TCP over IPv4
+			append(body, source.to_v4().to_bytes());
+			append(body, destination.to_v4().to_bytes());
+		}
+		else
+		{
+			header.push_back('\x21'); //TCP over IPv6
+			append(body, source.to_v6().to_bytes());
+			append(body, destination.to_v6().to_bytes());
+		}
+		append_uint16(body, client.port());
+		append_uint16(body, local.port());
+
+		if(ssl)
+		{
+			const unsigned char* alpn = nullptr;
+			unsigned int alpn_length = 0;
+			SSL_get0_alpn_selected(ssl, &alpn, &alpn_length);
+			if(alpn_length > 0) append_tlv(body, type_alpn, std::string(reinterpret_cast<const char*>(alpn), alpn_length));
+
+			const char* server_name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+			if(server_name) append_tlv(body, type_authority, server_name);
+
+			//client: the connection used TLS, verify: result of the client certificate check
+			std::string tls;
+			tls.push_back('\x01');
+			append_uint32(tls, static_cast<std::uint32_t>(SSL_get_verify_result(ssl)));
+			append_tlv(tls, subtype_ssl_version, SSL_get_version(ssl));
+			const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl);
+			if(cipher) append_tlv(tls, subtype_ssl_cipher, SSL_CIPHER_get_name(cipher));
+			append_tlv(body, type_ssl, tls);
+		}
+
+		append_uint16(header, static_cast<std::uint16_t>(body.length()));
+		header.append(body);
+		return header;
+	}
+
+private:
+	enum : unsigned char
+	{
+		type_alpn = 0x01,
+		type_authority = 0x02,
+		type_ssl = 0x20,
+		subtype_ssl_version = 0x21,
+		subtype_ssl_cipher = 0x23
+	};
+
+	template <class Bytes>
+	static void append(std::string& out, const Bytes& bytes)
+	{
+		out.append(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+	}
+
+	static void append_uint16(std::string& out, std::uint16_t value)
+	{
+		out.push_back(static_cast<char>(value >> 8));
+		out.push_back(static_cast<char>(value & 0xFF));
+	}
+
+	static void append_uint32(std::string& out, std::uint32_t value)
+	{
+		append_uint16(out, static_cast<std::uint16_t>(value >> 16));
+		append_uint16(out, static_cast<std::uint16_t>(value & 0xFFFF));
+	}
+
+	static void append_tlv(std::string& out, unsigned char type, const std::string& value)
+	{
+		out.push_back(static_cast<char>(type));
+		append_uint16(out, static_cast<std::uint16_t>(std::min<std::size_t>(value.length(), 0xFFFF)));
+		out.append(value, 0, 0xFFFF);
+	}
+
+}; //end class ProxyProtocolHeader
+
+//Counters of the request head stage (see SslProxy::set_forwarded_headers)
+struct RequestHeadStats
+{
+	std::uint64_t requests;
+	std::uint64_t head_bytes_in;
+	std::uint64_t head_bytes_out;
+	std::uint64_t nanoseconds;
+};
+
+//The counters of one thread. Only this thread writes them, so relaxed atomics are enough
+struct RequestHeadCounters
+{
+	std::atomic<std::uint64_t> requests{0};
+	std::atomic<std::uint64_t> head_bytes_in{0};
+	std::atomic<std::uint64_t> head_bytes_out{0};
+	std::atomic<std::uint64_t> nanoseconds{0};
+
+	void add(std::size_t bytes_in, std::size_t bytes_out, std::chrono::steady_clock::duration duration)
+	{
+		requests.store(requests.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		head_bytes_in.store(head_bytes_in.load(std::memory_order_relaxed) + bytes_in, std::memory_order_relaxed);
+		head_bytes_out.store(head_bytes_out.load(std::memory_order_relaxed) + bytes_out, std::memory_order_relaxed);
+		nanoseconds.store(nanoseconds.load(std::memory_order_relaxed) + static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()), std::memory_order_relaxed);
+	}
+};
+
+//Merged content of one or more LatencyHistograms
+struct HistogramSnapshot
+{
+	std::vector<std::uint64_t> counts{};
+	std::uint64_t count = 0;
+	std::uint64_t sum = 0;
+	std::uint64_t max = 0;
+
+	double mean() const
+	{
+		return count == 0 ? 0.0 : static_cast<double>(sum) / static_cast<double>(count);
+	}
+
+	//The value below which the fraction q (0..1) of the recorded values are,
+	//at the resolution of the buckets
+	std::uint64_t percentile(double q) const;
+};
+
+//Latency histogram with logarithmic buckets like HdrHistogram: every power of two
+//is split into sub_buckets linear buckets, so a value is kept with a relative error
+//of at most 1/sub_buckets. Values are microseconds. record() is lock free and
+//costs one atomic add, several threads may record into the same histogram
+class LatencyHistogram
+{
+
+public:
+	enum
+	{
+		sub_bucket_bits = 4,
+		sub_buckets = 1 << sub_bucket_bits,
+		bucket_count = (64 - sub_bucket_bits + 1) * sub_buckets
+	};
+
+	LatencyHistogram() :
+		counts_(),
+		sum_(0),
+		max_(0)
+	{}
+
+	LatencyHistogram(const LatencyHistogram&) = delete;
+	LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+	void record(std::chrono::steady_clock::duration duration)
+	{
+		const std::int64_t microseconds = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+		const std::uint64_t value = static_cast<std::uint64_t>(std::max<std::int64_t>(microseconds, 0));
+
+		counts_[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+		sum_.fetch_add(value, std::memory_order_relaxed);
+
+		std::uint64_t max = max_.load(std::memory_order_relaxed);
+		while(value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+	}
+
+	void add_to(HistogramSnapshot& snapshot) const
+	{
+		snapshot.counts.resize(bucket_count, 0);
+		for(std::size_t i = 0; i < bucket_count; ++i)
+		{
+			const std::uint64_t count = counts_[i].load(std::memory_order_relaxed);
+			snapshot.counts[i] += count;
+			snapshot.count += count;
+		}
+		snapshot.sum += sum_.load(std::memory_order_relaxed);
+		snapshot.max = std::max(snapshot.max, max_.load(std::memory_order_relaxed));
+	}
+
+	static std::size_t bucket_index(std::uint64_t value)
+	{
+		if(value < sub_buckets) return static_cast<std::size_t>(value);
+
+		const unsigned shift = highest_bit(value) - sub_bucket_bits;
+		return (shift + 1) * sub_buckets + static_cast<std::size_t>((value >> shift) - sub_buckets);
+	}
+
+	//The largest value which is recorded in bucket index
+	static std::uint64_t bucket_upper_bound(std::size_t index)
+	{
+		if(index < sub_buckets) return index;
+
+		const unsigned shift = static_cast<unsigned>(index / sub_buckets - 1);
+		const std::uint64_t lower = static_cast<std::uint64_t>(sub_buckets + index % sub_buckets) << shift;
+		return lower + ((std::uint64_t(1) << shift) - 1);
+	}
+
+private:
+	std::array<std::atomic<std::uint64_t>, bucket_count> counts_;
+	std::atomic<std::uint64_t> sum_;
+	std::atomic<std::uint64_t> max_;
+
+	static unsigned highest_bit(std::uint64_t value)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		return 63u - static_cast<unsigned>(__builtin_clzll(value));
+#else
+		unsigned bit = 0;
+		while(value >>= 1) ++bit;
+		return bit;
+#endif
+	}
+
+}; //end class LatencyHistogram
+
+inline std::uint64_t HistogramSnapshot::percentile(double q) const
+{
+	if(count == 0) return 0;
+
+	const double clamped = std::min(std::max(q, 0.0), 1.0);
+	const std::uint64_t rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(clamped * static_cast<double>(count) + 0.5));
+
+	std::uint64_t seen = 0;
+	for(std::size_t i = 0; i < counts.size(); ++i)
+	{
+		seen += counts[i];
+		if(seen >= rank) return std::min(LatencyHistogram::bucket_upper_bound(i), max);
+	}
+	return max;
+}
+
+//The metrics of one session thread. The counters are only written by this
+//thread, so relaxed atomics without read-modify-write are enough
+struct ThreadMetrics
+{
+	std::atomic<std::uint64_t> accepted{0};
+	std::atomic<std::uint64_t> sessions{0};
+	std::atomic<std::uint64_t> sessions_finished{0};
+	std::atomic<std::uint64_t> bytes_from_clients{0};
+	std::atomic<std::uint64_t> bytes_to_clients{0};
+	std::atomic<std::uint64_t> backend_connects{0};
+	std::atomic<std::uint64_t> backend_connect_failures{0};
+	std::atomic<std::uint64_t> idle_timeouts{0};
+	std::atomic<std::uint64_t> request_head_timeouts{0};
+	std::atomic<std::uint64_t> shutdown_timeouts{0};
+	std::atomic<std::uint64_t> http2_sessions{0};
+	std::atomic<std::uint64_t> http2_streams{0};
+
+	//From the first byte of the client to the first byte of the target
+	LatencyHistogram time_to_first_byte{};
+	LatencyHistogram session_duration{};
+	LatencyHistogram backend_connect_time{};
+
+	static void add(std::atomic<std::uint64_t>& counter, std::uint64_t value)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+};
+
+class ConnectionSlot;
+
+//Counts the open client connections of an SslProxy, in total and per client address,
+//and refuses new ones above the limits (0 means unlimited). Only the accepting thread
+//acquires slots, they are released on any thread when the connection ends.
+//The per address counts are kept under a mutex and only if that limit is set
+class ConnectionLimiter : public std::enable_shared_from_this<ConnectionLimiter>
+{
+
+public:
+	ConnectionLimiter() :
+		mutex_(),
+		per_address_(),
+		on_available_()
+	{}
+
+	void set_max_connections(std::size_t max_connections)
+	{
+		max_connections_.store(max_connections, std::memory_order_relaxed);
+	}
+
+	//Connections which are already open when this is set are not counted per address
+	void set_max_per_address(std::size_t max_per_address)
+	{
+		max_per_address_.store(max_per_address, std::memory_order_relaxed);
+	}
+
+	//acquire() only needs the client address if this is true
+	bool limits_addresses() const
+	{
+		return max_per_address_.load(std::memory_order_relaxed) != 0;
+	}
+
+	//Called on a release which brings the connections below max_connections again
+	void set_on_available(std::function<void()> on_available)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		on_available_ = std::move(on_available);
+	}
+
+	//Returns nullptr if one of the limits is reached. The slot is held until the connection ends
+	std::shared_ptr<ConnectionSlot> acquire(const net::ip::address& address);
+
+	//The accept loop pauses while this is true
+	bool full() const
+	{
+		const std::size_t max = max_connections_.load(std::memory_order_relaxed);
+		return max != 0 && connections_.load(std::memory_order_relaxed) >= max;
+	}
+
+	std::size_t connections() const { return connections_.load(std::memory_order_relaxed); }
+	std::uint64_t rejected_by_connection_limit() const { return rejected_by_connection_limit_.load(std::memory_order_relaxed); }
+	std::uint64_t rejected_by_address_limit() const { return rejected_by_address_limit_.load(std::memory_order_relaxed); }
+
+private:
+	friend class ConnectionSlot;
+
+	std::mutex mutex_;
+	std::unordered_map<std::string, std::size_t> per_address_;
+	std::function<void()> on_available_;
+	std::atomic<std::size_t> max_connections_{0};
+	std::atomic<std::size_t> max_per_address_{0};
+	std::atomic<std::size_t> connections_{0};
+	std::atomic<std::uint64_t> rejected_by_connection_limit_{0};
+	std::atomic<std::uint64_t> rejected_by_address_limit_{0};
+
+	void release(const std::string& address)
+	{
+		std::function<void()> on_available;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if(!address.empty())
+			{
+				auto it = per_address_.find(address);
+				if(it != per_address_.end() && --it->second == 0) per_address_.erase(it);
+			}
+
+			const std::size_t before = connections_.fetch_sub(1, std::memory_order_relaxed);
+			if(before == max_connections_.load(std::memory_order_relaxed)) on_available = on_available_;
+		}
+
+		if(on_available) on_available();
+	}
+
+}; //end class ConnectionLimiter
+
+//One open connection of a ConnectionLimiter, released by the destructor
+class ConnectionSlot
+{
+
+public:
+	ConnectionSlot(std::shared_ptr<ConnectionLimiter> limiter, std::string address) :
+		limiter_(std::move(limiter)),
+		address_(std::move(address))
+	{}
+
+	ConnectionSlot(const ConnectionSlot&) = delete;
+	ConnectionSlot& operator=(const ConnectionSlot&) = delete;
+
+	~ConnectionSlot()
+	{
+		limiter_->release(address_);
+	}
+
+private:
+	std::shared_ptr<ConnectionLimiter> limiter_;
+
+	//Empty if the connection isn't counted per address
+	std::string address_;
+
+}; //end class ConnectionSlot
+
+inline std::shared_ptr<ConnectionSlot> ConnectionLimiter::acquire(const net::ip::address& address)
+{
+	if(full())
+	{
+		rejected_by_connection_limit_.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	std::string key;
+	const std::size_t max_per_address = max_per_address_.load(std::memory_order_relaxed);
+	if(max_per_address != 0)
+	{
+		key = address.to_string();
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		std::size_t& count = per_address_[key];
+		if(count >= max_per_address)
+		{
+			rejected_by_address_limit_.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		++count;
+	}
+
+	connections_.fetch_add(1, std::memory_order_relaxed);
+	return std::make_shared<ConnectionSlot>(shared_from_this(), std::move(key));
+}
+
+//The timeouts of all connections of one thread on a single timer: a hashed timing wheel
+//with slot_count slots of one tick each. An Entry is linked into the slot of its deadline.
+//Arming it again with a later deadline, which is what every read and write does, only
+//stores the new deadline; the entry is moved when its old slot comes up. So activity
+//costs no timer heap operation and the timer only runs while entries are armed.
+//Deadlines are one tick late at most. Everything is used on the thread of io_context only
+class TimingWheel : public std::enable_shared_from_this<TimingWheel>
+{
+
+	struct Link
+	{
+		Link* prev;
+		Link* next;
+	};
+
+public:
+	enum
+	{
+		slot_count = 512
+	};
+
+	//A timeout, usually a member of the object it belongs to. The destructor cancels it.
+	//Without a wheel (nullptr) arm() does nothing
+	class Entry : private Link
+	{
+
+	public:
+		Entry(TimingWheel* wheel, std::function<void()> on_expired) :
+			Link{ nullptr, nullptr },
+			wheel_(wheel),
+			on_expired_(std::move(on_expired)),
+			deadline_(0),
+			expired_(false)
+		{}
+
+		Entry(const Entry&) = delete;
+		Entry& operator=(const Entry&) = delete;
+
+		~Entry()
+		{
+			cancel();
+		}
+
+		void arm(std::chrono::steady_clock::duration timeout)
+		{
+			if(wheel_) wheel_->arm(*this, timeout);
+		}
+
+		void cancel()
+		{
+			if(armed()) wheel_->cancel(*this);
+		}
+
+		bool armed() const
+		{
+			return next != nullptr;
+		}
+
+		//Set if the last arm() ended in the handler
+		bool expired() const
+		{
+			return expired_;
+		}
+
+	private:
+		friend class TimingWheel;
+
+		TimingWheel* wheel_;
+		std::function<void()> on_expired_;
+		std::uint64_t deadline_;
+		bool expired_;
+
+	}; //end class Entry
+
+	TimingWheel(net::io_context& io_context, std::chrono::milliseconds tick = std::chrono::milliseconds(100)) :
+		timer_(io_context),
+		tick_(tick),
+		slots_(slot_count),
+		now_(0),
+		armed_(0),
+		running_(false),
+		next_tick_()
+	{
+		for(Link& slot : slots_)
+		{
+			slot.prev = &slot;
+			slot.next = &slot;
+		}
+	}
+
+	std::size_t armed() const
+	{
+		return armed_;
+	}
+
+private:
+	net::steady_timer timer_;
+	std::chrono::steady_clock::duration tick_;
+	std::vector<Link> slots_;
+	std::uint64_t now_;
+	std::size_t armed_;
+	bool running_;
+	std::chrono::steady_clock::time_point next_tick_;
+
+	void arm(Entry& entry, std::chrono::steady_clock::duration timeout)
+	{
+		//The current tick is partly over, so the deadline is one tick further
+		const std::uint64_t ticks = static_cast<std::uint64_t>((std::max(timeout, tick_) + tick_ - std::chrono::steady_clock::duration(1)) / tick_);
+		const std::uint64_t deadline = now_ + ticks + 1;
+		entry.expired_ = false;
+
+		if(entry.armed())
+		{
+			if(deadline >= entry.deadline_)
+			{
+				entry.deadline_ = deadline;
+				return;
+			}
+			unlink(entry);
+		}
+		else
+		{
+			++armed_;
+		}
+
+		entry.deadline_ = deadline;
+		link(entry, slots_[deadline % slot_count]);
+		if(!running_) start();
+	}
+
+	void cancel(Entry& entry)
+	{
+		unlink(entry);
+		--armed_;
+	}
+
+	static void link(Link& node, Link& slot)
+	{
+		node.prev = slot.prev;
+		node.next = &slot;
+		slot.prev->next = &node;
+		slot.prev = &node;
+	}
+
+	static void unlink(Link& node)
+	{
+		node.prev->next = node.next;
+		node.next->prev = node.prev;
+		node.prev = nullptr;
+		node.next = nullptr;
+	}
+
+	void start()
+	{
+		running_ = true;
+		next_tick_ = std::chrono::steady_clock::now() + tick_;
+		wait();
+	}
+
+	void wait()
+	{
+		auto self = shared_from_this();
+		timer_.expires_at(next_tick_);
+		timer_.async_wait([this, self](const err::error_code& ec)
+		{
+			if(ec)
+			{
+				running_ = false;
+				return;
+			}
+
+			//Ticks which were missed because the thread was busy are caught up
+			std::uint64_t ticks = 1 + static_cast<std::uint64_t>(std::max(std::chrono::steady_clock::now() - next_tick_, std::chrono::steady_clock::duration::zero()) / tick_);
+			next_tick_ += tick_ * static_cast<std::chrono::steady_clock::duration::rep>(ticks);
+			if(ticks > slot_count)
+			{
+				//Every slot is visited anyway, the deadlines are compared with now_
+				now_ += ticks - slot_count;
+				ticks = slot_count;
+			}
+
+			while(ticks-- > 0) advance();
+
+			if(armed_ == 0)
+			{
+				running_ = false;
+				return;
+			}
+			wait();
+		});
+	}
+
+	void advance()
+	{
+		++now_;
+		Link& slot = slots_[now_ % slot_count];
+		if(slot.next == &slot) return;
+
+		//The handlers may arm, cancel or destroy any entry, also the ones of this slot
+		Link expiring{ slot.prev, slot.next };
+		expiring.next->prev = &expiring;
+		expiring.prev->next = &expiring;
+		slot.prev = &slot;
+		slot.next = &slot;
+
+		while(expiring.next != &expiring)
+		{
+			Entry& entry = static_cast<Entry&>(*expiring.next);
+			unlink(entry);
+
+			if(entry.deadline_ > now_)
+			{
+				//Pushed back since it was linked
+				link(entry, slots_[entry.deadline_ % slot_count]);
+				continue;
+			}
+
+			--armed_;
+			entry.expired_ = true;
+			entry.on_expired_();
+		}
+	}
+
+}; //end class TimingWheel
+
+//Socket options of the client or the target connections (see SslProxy::set_socket_options).
+//A buffer size of 0 keeps the default of the system and with it the automatic tuning
+struct SocketOptions
+{
+	//TCP_NODELAY: small writes (handshake messages, request and response heads) are sent at once
+	bool no_delay = true;
+
+	//TCP keepalive probes after this time without data (on systems without TCP_KEEPIDLE
+	//after the default time of the system). Zero disables them
+	std::chrono::seconds keep_alive = std::chrono::seconds(0);
+
+	//SO_RCVBUF and SO_SNDBUF in bytes
+	int receive_buffer_size = 0;
+	int send_buffer_size = 0;
+
+	//Errors are ignored, an option the system doesn't support must not cost the connection
+	void apply(tcp::socket& socket) const
+	{
+		err::error_code ec;
+		if(no_delay) socket.set_option(tcp::no_delay(true), ec);
+		if(keep_alive.count() > 0)
+		{
+			socket.set_option(net::socket_base::keep_alive(true), ec);
+#ifdef TCP_KEEPIDLE
+			socket.set_option(net::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPIDLE>(static_cast<int>(keep_alive.count())), ec);
+#endif
+		}
+		if(receive_buffer_size > 0) socket.set_option(net::socket_base::receive_buffer_size(receive_buffer_size), ec);
+		if(send_buffer_size > 0) socket.set_option(net::socket_base::send_buffer_size(send_buffer_size), ec);
+	}
+};
+
+//Settings which apply to every ProxySession of an SslProxy
+struct SessionOptions
+{
+	//Backpressure of the read pipelines: a direction stops reading if more than
+	//high_watermark bytes are waiting to be written and continues below low_watermark
+	std::size_t low_watermark = 64 * 1024;
+	std::size_t high_watermark = 256 * 1024;
+
+	//Response heads larger than this are answered with 502 Bad Gateway
+	std::size_t max_header_size = 16 * 1024;
+
+	//Hooks which may change the response heads
+	std::shared_ptr<const std::vector<ResponseHeadHook>> response_head_hooks = std::make_shared<const std::vector<ResponseHeadHook>>(1, &rewrite_location_to_https);
+
+	//Adds X-Forwarded-For, X-Forwarded-Proto and Forwarded to every request
+	bool forwarded_headers = false;
+
+	//Sends a PROXY protocol v2 header on every target connection. The data is not
+	//looked at anymore (no header rewrites, no upstream pool), it is a blind tunnel
+	bool proxy_protocol = false;
+
+	//Where the request head stage counts its work (set per thread by SslProxy)
+	std::shared_ptr<RequestHeadCounters> request_head_counters = nullptr;
+
+	//Where the session counts its connections and bytes (set per thread by SslProxy)
+	std::shared_ptr<ThreadMetrics> metrics = nullptr;
+
+	//Timeouts, zero disables one. idle: no read or write in either direction,
+	//request_head: from the start of the session or the first byte of a request head
+	//to its end, shutdown: waiting for the close_notify of the client
+	std::chrono::milliseconds idle_timeout = std::chrono::seconds(120);
+	std::chrono::milliseconds request_head_timeout = std::chrono::seconds(30);
+	std::chrono::milliseconds shutdown_timeout = std::chrono::seconds(5);
+
+	//The wheel which runs the timeouts (set per thread by SslProxy), without one there are none
+	std::shared_ptr<TimingWheel> timing_wheel = nullptr;
+
+	//Streams an HTTP/2 client may have open at the same time (see Http2Session)
+	std::uint32_t http2_max_concurrent_streams = 100;
+
+	//Set on the client socket after accept and on the target socket after connect
+	SocketOptions client_socket{};
+	SocketOptions target_socket{};
+
+#ifdef SSLPROXY_HAS_IO_URING
+	//The ring of the thread (set per thread by SslProxy if set_io_uring is enabled). ProxySession
+	//reads and writes the target and kTLS client sockets with it instead of the asio reactor
+	std::shared_ptr<IoUring> io_uring = nullptr;
+#endif
+};
+
+//The timeouts and metrics of the client connection of a session, the same for all engines.
+//Every read and write pushes the idle timeout back, the deadline limits a request head and
+//the TLS shutdown. expired runs if the idle timeout or the deadline of a request head is
+//reached, the session closes then. The session duration is recorded on destruction
+class SessionActivity
+{
+
+public:
+	//options are the ones of the session and live as long as it. With an arena, the
+	//handler of the TLS shutdown is allocated from it
+	SessionActivity(const SessionOptions& options, std::function<void()> expired, HandlerArena* arena = nullptr) :
+		options_(options),
+		expired_(std::move(expired)),
+		arena_(arena),
+		started_at_(std::chrono::steady_clock::now()),
+		first_request_at_(),
+		first_byte_counted_(false),
+		idle_timer_(options.timing_wheel.get(), [this] { on_idle_timeout(); }),
+		deadline_timer_(options.timing_wheel.get(), [this] { on_deadline_timeout(); }),
+		shutting_down_(nullptr)
+	{}
+
+	SessionActivity(const SessionActivity&) = delete;
+	SessionActivity& operator=(const SessionActivity&) = delete;
+
+	~SessionActivity()
+	{
+		if(options_.metrics)
+		{
+			options_.metrics->session_duration.record(std::chrono::steady_clock::now() - started_at_);
+			ThreadMetrics::add(options_.metrics->sessions_finished, 1);
+		}
+	}
+
+	void start()
+	{
+		if(options_.metrics) ThreadMetrics::add(options_.metrics->sessions, 1);
+		touch();
+	}
+
+	//During the shutdown only its own deadline counts
+	void touch()
+	{
+		if(options_.idle_timeout.count() != 0 && !shutting_down_) idle_timer_.arm(options_.idle_timeout);
+	}
+
+	void start_request_head_timeout()
+	{
+		if(options_.request_head_timeout.count() != 0) deadline_timer_.arm(options_.request_head_timeout);
+	}
+
+	void stop_request_head_timeout()
+	{
+		//During the shutdown the deadline is the one of the shutdown
+		if(!shutting_down_) deadline_timer_.cancel();
+	}
+
+	bool request_head_timeout_running() const
+	{
+		return deadline_timer_.armed();
+	}
+
+	void count_client_data(std::size_t length)
+	{
+		if(options_.metrics) ThreadMetrics::add(options_.metrics->bytes_from_clients, length);
+	}
+
+	//The time to first byte is measured from the first request
+	void count_request()
+	{
+		if(options_.metrics && first_request_at_ == std::chrono::steady_clock::time_point()) first_request_at_ = std::chrono::steady_clock::now();
+	}
+
+	//Only the first response of a session is measured. If the target talks first, nothing is recorded
+	void count_target_data()
+	{
+		if(first_byte_counted_ || !options_.metrics) return;
+
+		first_byte_counted_ = true;
+		if(first_request_at_ != std::chrono::steady_clock::time_point())
+		{
+			options_.metrics->time_to_first_byte.record(std::chrono::steady_clock::now() - first_request_at_);
+		}
+	}
+
+	//Sends the close_notify to the client, closed runs afterwards. With kTLS the kernel sends it and
+	//closed runs right away, otherwise the close_notify of the client is awaited until the deadline
+	template<typename Handler>
+	void shutdown(std::unique_ptr<ssl::stream<tcp::socket>> client, bool ktls, Handler closed)
+	{
+		//Nothing is forwarded anymore, only the shutdown itself has a timeout
+		idle_timer_.cancel();
+
+#ifdef SSLPROXY_HAS_KTLS
+		if(ktls)
+		{
+			//OpenSSL doesn't know about the records the kernel sent,
+			//so the close_notify alert is sent through the kernel as well
+			err::error_code ec;
+			KtlsOffload::send_close_notify(client->next_layer().native_handle());
+			client->next_layer().shutdown(tcp::socket::shutdown_send, ec);
+			client.reset();
+			closed();
+			return;
+		}
+#else
+		(void)ktls;
+#endif
+
+		ssl::stream<tcp::socket>& stream = *client;
+		shutting_down_ = &stream;
+		if(options_.shutdown_timeout.count() != 0) deadline_timer_.arm(options_.shutdown_timeout);
+		else deadline_timer_.cancel();
+
+		auto on_shutdown = [this, client = std::move(client), closed = std::move(closed)](const err::error_code& /*ec*/) mutable
+		{
+			shutting_down_ = nullptr;
+			deadline_timer_.cancel();
+			closed();
+		};
+
+		if(arena_) stream.async_shutdown(ArenaHandler<decltype(on_shutdown)>(*arena_, std::move(on_shutdown)));
+		else stream.async_shutdown(std::move(on_shutdown));
+	}
+
+private:
+	const SessionOptions& options_;
+	std::function<void()> expired_;
+	HandlerArena* arena_;
+
+	//Metrics: time to first byte and session duration
+	std::chrono::steady_clock::time_point started_at_;
+	std::chrono::steady_clock::time_point first_request_at_;
+	bool first_byte_counted_;
+
+	//Timeouts on the timing wheel of the thread
+	TimingWheel::Entry idle_timer_;
+	TimingWheel::Entry deadline_timer_;
+	ssl::stream<tcp::socket>* shutting_down_;
+
+	void on_idle_timeout()
+	{
+		//std::cout << "DEBUG: [Session] Idle timeout." << std::endl;
+		if(options_.metrics) ThreadMetrics::add(options_.metrics->idle_timeouts, 1);
+		expired_();
+	}
+
+	void on_deadline_timeout()
+	{
+		if(shutting_down_)
+		{
+			//The client doesn't answer the close_notify. Closing the socket aborts the shutdown
+			if(options_.metrics) ThreadMetrics::add(options_.metrics->shutdown_timeouts, 1);
+			err::error_code ec;
+			shutting_down_->next_layer().close(ec);
+			return;
+		}
+
+		if(options_.metrics) ThreadMetrics::add(options_.metrics->request_head_timeouts, 1);
+		expired_();
+	}
+
+}; //end class SessionActivity
+
+//The HTTP/1.1 state of a session, shared by ProxySession and CoroutineSession which only
+//differ in their I/O. The requests are followed to know where each one ends and which
+//response waits for which method; only their heads are copied. Response heads are read
+//into a buffer of their own and parsed there. From both it knows when the target
+//connection can be reused. If a request can't be followed, the rest of the connection
+//is passed through
+class Http1Exchange
+{
+
+public:
+	//What parse_request_head() found
+	enum class RequestHead
+	{
+		complete,	//The request started, its body follows
+		incomplete,	//The head continues in the next read
+		passthrough,	//Not HTTP, the rest of the connection is forwarded as it is
+		rejected,	//Malformed head or ambiguous framing, answered with 400
+		too_large	//Answered with 431
+	};
+
+	//A complete response head and the beginning of its body in buffer. rewritten
+	//replaces the head if one of the response head hooks changed it
+	struct ResponseHead
+	{
+		BufferPool::Buffer buffer;
+		std::size_t head_length;
+		std::size_t body_length;
+		std::string rewritten;
+	};
+
+	//options and buffer_pool are the ones of the session and live as long as it.
+	//reusable: the target connection may go back to an upstream pool
+	Http1Exchange(const SessionOptions& options, BufferPool& buffer_pool, bool reusable) :
+		options_(options),
+		buffer_pool_(buffer_pool),
+		forwarded_client_(),
+		request_head_(),
+		request_parser_(HttpHeadParser::Kind::request),
+		request_body_(),
+		request_tracking_(!options.proxy_protocol),
+		pending_requests_(),
+		request_head_time_(std::chrono::steady_clock::duration::zero()),
+		response_started_(false),
+		response_head_buffer_(),
+		response_head_filled_(0),
+		response_head_(),
+		response_body_(),
+		target_reusable_(reusable && !options.proxy_protocol)
+	{
+		if(options.proxy_protocol)
+		{
+			//Blind tunnel: the whole target connection is one response body
+			response_started_ = true;
+			response_body_.start(HttpBodyFraming::Mode::until_close);
+		}
+	}
+
+	Http1Exchange(const Http1Exchange&) = delete;
+	Http1Exchange& operator=(const Http1Exchange&) = delete;
+
+	//The client of the forwarded headers
+	void set_client(const tcp::socket& socket)
+	{
+		if(options_.forwarded_headers && !options_.proxy_protocol) forwarded_client_.set(socket);
+	}
+
+	bool tracking() const { return request_tracking_; }
+	const HttpBodyFraming& request_body() const { return request_body_; }
+	const HttpBodyFraming& response_body() const { return response_body_; }
+
+	//Follows bytes of the current request body, returns how many belong to it.
+	//A body which can't be decoded ends the tracking
+	std::size_t consume_request_body(const char* data, std::size_t length)
+	{
+		const std::size_t body_length = request_body_.consume(data, length);
+		if(request_body_.error()) stop_request_tracking();
+		return body_length;
+	}
+
+	//Parses the bytes from pos as (the rest of) a request head, up to max_header_size. Once the
+	//head is complete, pos is moved behind it and the request starts. With forwarded headers,
+	//rewritten_head gets the head to send instead
+	RequestHead parse_request_head(const char* data, std::size_t& pos, std::size_t end, std::string& rewritten_head)
+	{
+		const bool rewrite = options_.forwarded_headers;
+		const std::chrono::steady_clock::time_point parse_start = rewrite ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+		const std::size_t previous = request_head_.length();
+		const std::size_t limit = options_.max_header_size > previous ? options_.max_header_size - previous : 0;
+		request_head_.append(data + pos, std::min(end - pos, limit));
+
+		const HttpHeadParser::Result result = request_parser_.parse(request_head_.data(), request_head_.length());
+		const bool too_large = (result == HttpHeadParser::Result::incomplete && request_head_.length() >= options_.max_header_size) ||
+			(result == HttpHeadParser::Result::error && request_parser_.too_large());
+
+		if(result == HttpHeadParser::Result::error || too_large)
+		{
+			//Without a parsed head the forwarded headers can't be added. Otherwise only a malformed
+			//HTTP head is rejected (RFC 9112 5), bytes which aren't HTTP are forwarded as they are
+			if(rewrite || (!too_large && !request_parser_.method().empty()))
+			{
+				reject();
+				return too_large ? RequestHead::too_large : RequestHead::rejected;
+			}
+
+			stop_request_tracking();
+			return RequestHead::passthrough;
+		}
+
+		if(rewrite) request_head_time_ += std::chrono::steady_clock::now() - parse_start;
+		if(result == HttpHeadParser::Result::incomplete) return RequestHead::incomplete;
+
+		pos += request_parser_.head_length() - previous;
+		if(!start_request())
+		{
+			//Neither this head nor anything after it reaches the target
+			reject();
+			return RequestHead::rejected;
+		}
+
+		if(rewrite)
+		{
+			HttpHeadRewrite head_rewrite;
+			forwarded_client_.add_headers(request_parser_, head_rewrite);
+			rewritten_head = head_rewrite.apply(request_parser_);
+
+			request_head_time_ += std::chrono::steady_clock::now() - parse_start;
+			if(options_.request_head_counters) options_.request_head_counters->add(request_parser_.head_length(), rewritten_head.length(), request_head_time_);
+			request_head_time_ = std::chrono::steady_clock::duration::zero();
+		}
+
+		request_head_.clear();
+		request_parser_.reset();
+		return RequestHead::complete;
+	}
+
+	bool response_started() const { return response_started_; }
+	bool response_head_buffered() const { return response_head_filled_ > 0; }
+	bool has_response_head_buffer() const { return static_cast<bool>(response_head_buffer_); }
+
+	//A response is on its way, an answer of the proxy itself can't go in between
+	bool response_in_progress() const
+	{
+		return !pending_requests_.empty() || response_started_ || response_head_filled_ > 0;
+	}
+
+	//Where the next bytes of the response head are read to. The buffer is only taken
+	//here, so an idle connection doesn't hold one
+	net::mutable_buffer prepare_response_head()
+	{
+		if(!response_head_buffer_)
+		{
+			response_head_buffer_ = buffer_pool_.acquire(response_head_limit());
+			response_head_filled_ = 0;
+			response_head_.reset();
+		}
+
+		return net::buffer(response_head_buffer_.data() + response_head_filled_, response_head_buffer_.capacity() - response_head_filled_);
+	}
+
+	void commit_response_head(std::size_t length)
+	{
+		response_head_filled_ += length;
+	}
+
+	void drop_response_head()
+	{
+		response_head_buffer_.reset();
+		response_head_filled_ = 0;
+	}
+
+	//Parses the buffered response head. A head beyond the limit is an error, which drops the buffer
+	HttpHeadParser::Result parse_response_head()
+	{
+		HttpHeadParser::Result result = response_head_.parse(response_head_buffer_.data(), response_head_filled_);
+
+		if(result == HttpHeadParser::Result::incomplete && response_head_filled_ >= response_head_limit())
+		{
+			result = HttpHeadParser::Result::error;
+		}
+
+		//std::cerr << "Http1Exchange: Invalid or too large response head from target." << std::endl;
+		if(result == HttpHeadParser::Result::error) drop_response_head();
+		return result;
+	}
+
+	//Takes the complete response head with the body bytes which were read with it and runs
+	//the response head hooks on it. Bytes of the next response stay buffered
+	ResponseHead take_response_head()
+	{
+		start_response_body();
+
+		HttpHeadRewrite rewrite;
+		if(options_.response_head_hooks)
+		{
+			for(const ResponseHeadHook& hook : *options_.response_head_hooks)
+			{
+				hook(response_head_, rewrite);
+			}
+		}
+
+		std::string rewritten_head;
+		if(!rewrite.empty()) rewritten_head = rewrite.apply(response_head_);
+
+		const std::size_t head_length = response_head_.head_length();
+		const std::size_t available = response_head_filled_ - head_length;
+		const std::size_t body_length = response_body_.consume(response_head_buffer_.data() + head_length, available);
+		response_started_ = !response_body_.done();
+
+		BufferPool::Buffer head_buffer = std::move(response_head_buffer_);
+		response_head_filled_ = 0;
+
+		if(body_length < available)
+		{
+			keep_response_bytes(head_buffer.data() + head_length + body_length, available - body_length);
+		}
+
+		return ResponseHead{ std::move(head_buffer), head_length, body_length, std::move(rewritten_head) };
+	}
+
+	//Follows bytes of the current response body, returns how many belong to it. If the
+	//response ends within them, the rest is kept as the beginning of the next response
+	std::size_t consume_response_body(const char* data, std::size_t length)
+	{
+		const std::size_t body_length = response_body_.consume(data, length);
+		response_started_ = !response_body_.done();
+
+		if(body_length < length) keep_response_bytes(data + body_length, length - body_length);
+		return body_length;
+	}
+
+	bool target_reusable() const { return target_reusable_; }
+
+	void stop_reuse()
+	{
+		target_reusable_ = false;
+	}
+
+	//Every request on the target connection got its complete response
+	bool target_reuse_possible() const
+	{
+		return target_reusable_ && request_tracking_ && request_head_.empty() && request_body_.done() && pending_requests_.empty() &&
+			!response_started_ && response_head_filled_ == 0;
+	}
+
+private:
+	const SessionOptions& options_;
+	BufferPool& buffer_pool_;
+	ForwardedClient forwarded_client_;
+
+	//Framing of the requests and the methods which wait for their response
+	std::string request_head_;
+	HttpHeadParser request_parser_;
+	HttpBodyFraming request_body_;
+	bool request_tracking_;
+	std::deque<HttpMessageFraming::Method> pending_requests_;
+	std::chrono::steady_clock::duration request_head_time_;
+
+	//Framing of the responses: response_started_ is set while the body of a response
+	//is forwarded. Bytes of the next response head wait in response_head_buffer_
+	bool response_started_;
+	BufferPool::Buffer response_head_buffer_;
+	std::size_t response_head_filled_;
+	HttpHeadParser response_head_;
+	HttpBodyFraming response_body_;
+
+	//A target connection is only given back to the pool if every request on it got its complete response
+	bool target_reusable_;
+
+	std::size_t response_head_limit() const
+	{
+		return std::min<std::size_t>(options_.max_header_size, HttpHeadParser::max_head_size);
+	}
+
+	//Returns false if the request has to be rejected because its framing is ambiguous
+	bool start_request()
+	{
+		const HttpMessageFraming::Decision decision = HttpMessageFraming::start_request(request_parser_, request_body_);
+		if(decision.invalid) return false;
+
+		pending_requests_.push_back(HttpMessageFraming::method_of(request_parser_.method()));
+		if(!decision.reusable) target_reusable_ = false;
+		if(decision.tunnel) stop_request_tracking();
+		return true;
+	}
+
+	void stop_request_tracking()
+	{
+		request_tracking_ = false;
+		target_reusable_ = false;
+		request_head_ = std::string();
+		request_body_.start(HttpBodyFraming::Mode::until_close);
+	}
+
+	//The session answers the request itself and closes afterwards
+	void reject()
+	{
+		request_tracking_ = false;
+		target_reusable_ = false;
+		request_head_ = std::string();
+	}
+
+	//Chooses how the body of the response which was just parsed ends
+	void start_response_body()
+	{
+		const int status = response_head_.status_code();
+
+		//Interim responses (e.g. 100 Continue) are followed by the final response
+		if(status < 200 && status != 101)
+		{
+			response_body_.start(HttpBodyFraming::Mode::none);
+			return;
+		}
+
+		HttpMessageFraming::Method method = HttpMessageFraming::Method::other;
+		if(!pending_requests_.empty())
+		{
+			method = pending_requests_.front();
+			pending_requests_.pop_front();
+		}
+		else if(!request_tracking_)
+		{
+			//Unknown request, e.g. HEAD: the framing can't be trusted anymore
+			target_reusable_ = false;
+			response_body_.start(HttpBodyFraming::Mode::until_close);
+			return;
+		}
+
+		const HttpMessageFraming::Decision decision = HttpMessageFraming::start_response(response_head_, method, response_body_);
+		if(decision.tunnel) request_tracking_ = false;
+		if(!decision.reusable) target_reusable_ = false;
+	}
+
+	//Starts the next response head with bytes which were read together with the
+	//previous response. This only happens if the target sends responses back to back
+	void keep_response_bytes(const char* data, std::size_t length)
+	{
+		response_head_buffer_ = buffer_pool_.acquire(std::max(length, response_head_limit()));
+		std::memcpy(response_head_buffer_.data(), data, length);
+		response_head_filled_ = length;
+		response_head_.reset();
+	}
+
+}; //end class Http1Exchange
+
+class ProxySession : public std::enable_shared_from_this<ProxySession>
+{
+
+public:
+	enum
+	{
+		//Chunks one client read may need in to_target_ if request heads are rewritten
+		request_chunks = 4,
+
+		//Backends a session tries to connect to before it gives up
+		max_connect_attempts = 3
+	};
+
+	//If ktls is set, the kernel already does the TLS records of client_socket
+	//(see KtlsOffload) and the ssl stream is only used for its tcp socket
+	ProxySession(net::io_context& io_context, tcp::endpoint target_endpoint, std::unique_ptr<ssl::stream<tcp::socket>> client_socket, std::shared_ptr<UpstreamPool> upstream_pool = nullptr, bool ktls = false, std::shared_ptr<BufferPool> buffer_pool = nullptr, const SessionOptions& options = SessionOptions()) :
+		handler_arena_(),
+		client_socket_(std::move(client_socket)),
+		ktls_(ktls),
+		target_socket_(io_context),
+		target_endpoint_(std::move(target_endpoint)),
+		buffer_pool_(buffer_pool ? std::move(buffer_pool) : std::make_shared<BufferPool>()),
+		client_read_buffer_(),
+		target_read_buffer_(),
+		client_read_size_(ktls ? BufferPool::large_buffer : BufferPool::tls_record_buffer),
+		target_read_size_(BufferPool::large_buffer),
+		to_target_(),
+		to_client_(),
+		options_(options),
+		client_reading_(false),
+		client_read_paused_(false),
+		client_eof_(false),
+		target_reading_(false),
+		target_read_paused_(false),
+		target_eof_(false),
+		client_writing_(false),
+		client_pending_(),
+		client_pending_begin_(0),
+		client_pending_end_(0),
+		upstream_pool_(std::move(upstream_pool)),
+		target_connected_at_(),
+		target_parked_(false),
+		backends_(),
+		backend_(),
+		worker_(0),
+		connect_attempts_(0),
+		connect_started_at_(),
+		connection_slot_(),
+		exchange_(options_, *buffer_pool_, upstream_pool_ != nullptr),
+		activity_(options_, [this] { do_shutdown(); }, &handler_arena_)
+#ifdef SSLPROXY_HAS_KTLS
+		, client_pipe_()
+		, target_pipe_()
+#endif
+	{}
+
+	ProxySession(const ProxySession&) = delete;
+	ProxySession& operator=(const ProxySession&) = delete;
+
+	void start() {
+		auto self = shared_from_this();
+		activity_.start();
+		if(exchange_.tracking()) activity_.start_request_head_timeout();
+		exchange_.set_client(client_socket_->next_layer());
+
+		if(backends_) target_endpoint_ = backend_.choose(*backends_, worker_);
+
+		if(exchange_.target_reusable() && upstream_pool_->acquire(target_endpoint_, target_socket_, target_connected_at_))
+		{
+			start_read_from_client();
+			start_read_from_target();
+			return;
+		}
+
+		//std::cout << "DEBUG: [Session] ProxySession started. Connecting to target." << std::endl;
+		connect_target();
+	}
+
+	//Lets the session choose its target from a load balanced group instead of the
+	//target endpoint of the constructor. worker is the thread the session runs on
+	void set_backends(std::shared_ptr<BackendGroup> backends, std::size_t worker)
+	{
+		backends_ = std::move(backends);
+		worker_ = worker;
+	}
+
+	//Keeps slot for the lifetime of the session, see ConnectionLimiter
+	void set_connection_slot(std::shared_ptr<ConnectionSlot> slot)
+	{
+		connection_slot_ = std::move(slot);
+	}
+
+private:
+	//Declared first so it is destroyed last, after the sockets whose operations may still live in it
+	HandlerArena handler_arena_;
+	std::unique_ptr<ssl::stream<tcp::socket>> client_socket_;
+	bool ktls_;
+	tcp::socket target_socket_;
+	tcp::endpoint target_endpoint_;
+	std::shared_ptr<BufferPool> buffer_pool_;
+	BufferPool::Buffer client_read_buffer_;
+	BufferPool::Buffer target_read_buffer_;
+	AdaptiveReadSize client_read_size_;
+	AdaptiveReadSize target_read_size_;
+	ChunkQueue to_target_;
+	ChunkQueue to_client_;
+	SessionOptions options_;
+
+	//State of the two directions, each one can read while its previous chunks are written
+	bool client_reading_;
+	bool client_read_paused_;
+	bool client_eof_;
+	bool target_reading_;
+	bool target_read_paused_;
+	bool target_eof_;
+	bool client_writing_;
+
+	//Bytes of a read which wait for free chunks in to_target_ before their request heads are rewritten
+	BufferPool::Buffer client_pending_;
+	std::size_t client_pending_begin_;
+	std::size_t client_pending_end_;
+
+	//Upstream connection reuse, exchange_ knows if the target connection is clean
+	std::shared_ptr<UpstreamPool> upstream_pool_;
+	std::chrono::steady_clock::time_point target_connected_at_;
+	bool target_parked_;
+
+	//Load balancing: the group the target was chosen from
+	std::shared_ptr<BackendGroup> backends_;
+	BackendLease backend_;
+	std::size_t worker_;
+	unsigned connect_attempts_;
+
+	//Metrics: backend connect time
+	std::chrono::steady_clock::time_point connect_started_at_;
+
+	//Counts the connection in the limits of SslProxy until the session ends
+	std::shared_ptr<ConnectionSlot> connection_slot_;
+
+	//Framing of the requests and responses, and the timeouts and metrics of the client connection
+	Http1Exchange exchange_;
+	SessionActivity activity_;
+
+#ifdef SSLPROXY_HAS_KTLS
+	SplicePipe client_pipe_;
+	SplicePipe target_pipe_;
+#endif
+
+	//The sockets which carry plaintext (the target and a client with kTLS) use the
+	//io_uring of the thread if there is one, TLS records go through the ssl stream
+	template<typename ReadHandler>
+	void async_read_from_client(const net::mutable_buffer& buffer, ReadHandler&& handler)
+	{
+#ifdef SSLPROXY_HAS_IO_URING
+		if(ktls_ && options_.io_uring)
+		{
+			options_.io_uring->async_read_some(client_socket_->next_layer().native_handle(), buffer, std::forward<ReadHandler>(handler));
+			return;
+		}
+#endif
+		if(ktls_) client_socket_->next_layer().async_read_some(buffer, std::forward<ReadHandler>(handler));
+		else client_socket_->async_read_some(buffer, std::forward<ReadHandler>(handler));
+	}
+
+	//True if OpenSSL already holds data of the client, then
+	//waiting for the socket to become readable could block forever
+	bool client_data_buffered() const
+	{
+		if(ktls_) return false;
+
+		SSL* ssl = client_socket_->native_handle();
+		return SSL_pending(ssl) > 0 || BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0;
+	}
+
+	template<typename ConstBufferSequence, typename WriteHandler>
+	void async_write_to_client(const ConstBufferSequence& buffers, WriteHandler&& handler)
+	{
+#ifdef SSLPROXY_HAS_IO_URING
+		if(ktls_ && options_.io_uring)
+		{
+			options_.io_uring->async_write(client_socket_->next_layer().native_handle(), buffers, std::forward<WriteHandler>(handler));
+			return;
+		}
+#endif
+		if(ktls_) net::async_write(client_socket_->next_layer(), buffers, std::forward<WriteHandler>(handler));
+		else net::async_write(*client_socket_, buffers, std::forward<WriteHandler>(handler));
+	}
+
+	template<typename WaitHandler>
+	void async_wait_client_readable(WaitHandler&& handler)
+	{
+#ifdef SSLPROXY_HAS_IO_URING
+		if(ktls_ && options_.io_uring)
+		{
+			options_.io_uring->async_wait_readable(client_socket_->next_layer().native_handle(), std::forward<WaitHandler>(handler));
+			return;
+		}
+#endif
+		client_socket_->next_layer().async_wait(tcp::socket::wait_read, std::forward<WaitHandler>(handler));
+	}
+
+	template<typename ReadHandler>
+	void async_read_from_target(const net::mutable_buffer& buffer, ReadHandler&& handler)
+	{
+#ifdef SSLPROXY_HAS_IO_URING
+		if(options_.io_uring)
+		{
+			options_.io_uring->async_read_some(target_socket_.native_handle(), buffer, std::forward<ReadHandler>(handler));
+			return;
+		}
+#endif
+		target_socket_.async_read_some(buffer, std::forward<ReadHandler>(handler));
+	}
+
+	template<typename ConstBufferSequence, typename WriteHandler>
+	void async_write_to_target(const ConstBufferSequence& buffers, WriteHandler&& handler)
+	{
+#ifdef SSLPROXY_HAS_IO_URING
+		if(options_.io_uring)
+		{
+			options_.io_uring->async_write(target_socket_.native_handle(), buffers, std::forward<WriteHandler>(handler));
+			return;
+		}
+#endif
+		net::async_write(target_socket_, buffers, std::forward<WriteHandler>(handler));
+	}
+
+	template<typename WaitHandler>
+	void async_wait_target_readable(WaitHandler&& handler)
+	{
+#ifdef SSLPROXY_HAS_IO_URING
+		if(options_.io_uring)
+		{
+			options_.io_uring->async_wait_readable(target_socket_.native_handle(), std::forward<WaitHandler>(handler));
+			return;
+		}
+#endif
+		target_socket_.async_wait(tcp::socket::wait_read, std::forward<WaitHandler>(handler));
+	}
+
+	//Operations of the io_uring aren't cancelled by closing the socket, they keep
+	//the socket open in the kernel. Called before a socket of the session is closed
+	void cancel_io_uring(tcp::socket& socket)
+	{
+#ifdef SSLPROXY_HAS_IO_URING
+		if(options_.io_uring && socket.is_open()) options_.io_uring->cancel(socket.native_handle());
+#else
+		(void)socket;
+#endif
+	}
+
+	//Queues the PROXY protocol header, so it is the first thing the target gets
+	void send_proxy_header()
+	{
+		err::error_code ec;
+		const tcp::endpoint client = client_socket_->next_layer().remote_endpoint(ec);
+		const tcp::endpoint local = client_socket_->next_layer().local_endpoint(ec);
+
+		const std::string header = ProxyProtocolHeader::build(client, local, client_socket_->native_handle());
+
+		BufferPool::Buffer buffer = buffer_pool_->acquire(header.length());
+		const std::size_t length = std::min(header.length(), buffer.capacity());
+		std::memcpy(buffer.data(), header.data(), length);
+		to_target_.push(std::move(buffer), length);
+		write_to_target();
+	}
+
+	//The operation of handler is allocated from the arena of this session
+	template <typename Handler>
+	ArenaHandler<typename std::decay<Handler>::type> bind_arena(Handler&& handler)
+	{
+		return ArenaHandler<typename std::decay<Handler>::type>(handler_arena_, std::forward<Handler>(handler));
+	}
+
+	void connect_target()
+	{
+		auto self = shared_from_this();
+		if(options_.metrics) connect_started_at_ = std::chrono::steady_clock::now();
+
+		target_socket_.async_connect(target_endpoint_, bind_arena([this, self](const err::error_code& ec)
+		{
+			if(self->options_.metrics && ec != net::error::operation_aborted)
+			{
+				if(ec) ThreadMetrics::add(self->options_.metrics->backend_connect_failures, 1);
+				else
+				{
+					ThreadMetrics::add(self->options_.metrics->backend_connects, 1);
+					self->options_.metrics->backend_connect_time.record(std::chrono::steady_clock::now() - self->connect_started_at_);
+				}
+			}
+
+			if (!ec)
+			{
+				//std::cout << "DEBUG: [Session] Target connected. Starting read/write cycles." << std::endl;
+				if(self->backend_) self->backends_->report_success(*self->backend_);
+				self->options_.target_socket.apply(self->target_socket_);
+
+				self->target_connected_at_ = std::chrono::steady_clock::now();
+				if(self->options_.proxy_protocol) self->send_proxy_header();
+				self->start_read_from_client();
+				self->start_read_from_target();
+				return;
+			}
+
+			//std::cerr << "ProxySession: Target connect error: " << ec.message() << std::endl;
+			if(self->backend_ && ec != net::error::operation_aborted)
+			{
+				//Passive health check, then another backend gets a chance
+				self->backends_->report_failure(*self->backend_);
+
+				if(++self->connect_attempts_ < max_connect_attempts && self->client_socket_)
+				{
+					err::error_code close_ec;
+					self->target_socket_.close(close_ec);
+					self->target_endpoint_ = self->backend_.choose(*self->backends_, self->worker_);
+					self->connect_target();
+					return;
+				}
+			}
+
+			self->close_all_resources();
+		}));
+	}
+
+	//Forwards the bytes from the client and follows the requests in them to know where
+	//each one ends. With forwarded headers, every request head is replaced by its rewritten
+	//version. The body bytes are still forwarded from the read buffer itself; only if
+	//another request follows in the same buffer the bytes before it are copied
+	void forward_client_data(BufferPool::Buffer buffer, std::size_t begin, std::size_t end)
+	{
+		const bool rewrite = options_.forwarded_headers;
+		const char* data = buffer.data();
+		std::size_t pos = begin;
+		std::size_t unchanged_begin = begin;
+		BufferPool::Buffer copy;
+		std::size_t copy_length = 0;
+
+		std::string head;
+
+		while(exchange_.tracking() && pos < end)
+		{
+			if(!exchange_.request_body().done())
+			{
+				pos += exchange_.consume_request_body(data + pos, end - pos);
+				continue;
+			}
+
+			if(rewrite)
+			{
+				if(to_target_.available() < request_chunks)
+				{
+					//The rest waits until the target took some of the queued chunks
+					copy_to_target(data + unchanged_begin, pos - unchanged_begin, copy, copy_length);
+					if(copy_length > 0) to_target_.push(std::move(copy), copy_length);
+
+					client_pending_ = std::move(buffer);
+					client_pending_begin_ = pos;
+					client_pending_end_ = end;
+					client_read_paused_ = true;
+					return;
+				}
+
+				copy_to_target(data + unchanged_begin, pos - unchanged_begin, copy, copy_length);
+				unchanged_begin = pos;
+			}
+
+			const Http1Exchange::RequestHead result = exchange_.parse_request_head(data, pos, end, head);
+
+			if(result == Http1Exchange::RequestHead::incomplete)
+			{
+				//The head bytes are held back until the head is complete
+				unchanged_begin = end;
+
+				//A head which arrives byte by byte (slowloris) still has to be complete in time
+				if(!activity_.request_head_timeout_running()) activity_.start_request_head_timeout();
+				break;
+			}
+
+			activity_.stop_request_head_timeout();
+			if(result == Http1Exchange::RequestHead::passthrough) break;
+
+			if(result != Http1Exchange::RequestHead::complete)
+			{
+				//Neither this head nor anything after it reaches the target
+				if(copy_length > 0) to_target_.push(std::move(copy), copy_length);
+				reject_request(result == Http1Exchange::RequestHead::too_large);
+				return;
+			}
+
+			if(rewrite)
+			{
+				copy_to_target(head.data(), head.length(), copy, copy_length);
+				unchanged_begin = pos;
+			}
+		}
+
+		if(!rewrite)
+		{
+			to_target_.push(std::move(buffer), end - begin, begin);
+			return;
+		}
+
+		if(copy_length > 0) to_target_.push(std::move(copy), copy_length);
+		if(unchanged_begin < end) to_target_.push(std::move(buffer), end - unchanged_begin, unchanged_begin);
+	}
+
+	//Appends to the pooled copy buffer, full buffers are queued for the target
+	void copy_to_target(const char* data, std::size_t length, BufferPool::Buffer& copy, std::size_t& copy_length)
+	{
+		while(length > 0)
+		{
+			if(!copy)
+			{
+				copy = buffer_pool_->acquire(std::min<std::size_t>(length, BufferPool::large_buffer));
+				copy_length = 0;
+			}
+
+			const std::size_t part = std::min(length, copy.capacity() - copy_length);
+			std::memcpy(copy.data() + copy_length, data, part);
+			copy_length += part;
+			data += part;
+			length -= part;
+
+			if(copy_length == copy.capacity())
+			{
+				to_target_.push(std::move(copy), copy_length);
+				copy_length = 0;
+			}
+		}
+	}
+
+	//Answers a request which can't be parsed (or is too large) and closes the session
+	void reject_request(bool too_large)
+	{
+		//If a response is on its way, the answer can't go in between
+		if(exchange_.response_in_progress() || to_client_.full())
+		{
+			do_shutdown();
+			return;
+		}
+
+		//The target is not read anymore, the session ends once the answer is written
+		target_eof_ = true;
+		send_to_client(HttpMessageFraming::error_response(too_large ? 431 : 400));
+	}
+
+	void start_read_from_client()
+	{
+		auto self = shared_from_this();
+		//std::cout << "DEBUG: [ClientRead] Waiting for data from client (Browser)." << std::endl;
+
+		if (!client_socket_)
+		{
+			close_sockets_only_target();
+			return;
+		}
+
+		//After target_eof_ (or a rejected request) nothing more is forwarded
+		if(client_reading_ || client_eof_ || target_eof_) return;
+
+		if(client_pending_)
+		{
+			//Requests of a previous read which didn't fit into to_target_
+			client_read_paused_ = false;
+			forward_client_data(std::move(client_pending_), client_pending_begin_, client_pending_end_);
+			write_to_target();
+			if(client_pending_ || !client_socket_) return;
+		}
+
+#ifdef SSLPROXY_HAS_KTLS
+		if(ktls_ && (!exchange_.tracking() || exchange_.request_body().mode() == HttpBodyFraming::Mode::length))
+		{
+			//Request bodies (and connections which aren't followed anymore) don't
+			//need to be looked at, so they are spliced straight to the target.
+			//Chunks which were read before need to be written first
+			if(to_target_.write_in_flight())
+			{
+				client_read_paused_ = true;
+				return;
+			}
+
+			splice_forward(false);
+			return;
+		}
+#endif
+
+		//Backpressure: stop reading if the target doesn't keep up
+		if(to_target_.available() < (options_.forwarded_headers ? std::size_t(request_chunks) : 1) || to_target_.bytes() >= options_.high_watermark)
+		{
+			client_read_paused_ = true;
+			return;
+		}
+
+		client_reading_ = true;
+
+		if(client_read_size_.bulk() || client_data_buffered())
+		{
+			read_from_client();
+			return;
+		}
+
+		//The connection is probably idle, so no buffer is taken until the client sends something
+		async_wait_client_readable(bind_arena([this, self](const err::error_code& ec)
+		{
+			if(!ec)
+			{
+				self->read_from_client();
+			}
+			else if(ec != net::error::operation_aborted)
+			{
+				self->client_reading_ = false;
+				self->do_shutdown();
+			}
+		}));
+	}
+
+	void read_from_client()
+	{
+		auto self = shared_from_this();
+
+		if(!client_socket_)
+		{
+			client_reading_ = false;
+			close_sockets_only_target();
+			return;
+		}
+
+		client_read_buffer_ = buffer_pool_->acquire(client_read_size_.size());
+
+		async_read_from_client(
+			net::buffer(client_read_buffer_.data(), client_read_buffer_.capacity()),
+			bind_arena([this, self](const err::error_code& ec, std::size_t length)
+			{
+				self->client_reading_ = false;
+
+				if (!ec)
+				{
+					//std::cout << "DEBUG: Read " << length << " bytes from client (Encrypted)." << std::endl;
+					self->client_read_size_.update(length);
+					self->activity_.count_client_data(length);
+					self->activity_.count_request();
+					self->activity_.touch();
+					self->forward_client_data(std::move(self->client_read_buffer_), 0, length);
+
+					if(self->target_parked_ && self->client_socket_)
+					{
+						//Another request on the same connection, the target needs to be read again
+						self->target_parked_ = false;
+						self->start_read_from_target();
+					}
+
+					self->write_to_target();
+
+					//Keep reading while the write is in flight
+					self->start_read_from_client();
+				}
+				else if (ec == net::error::eof)
+				{
+					//std::cout << "DEBUG: Client closed connection. Starting shutdown." << std::endl;
+					self->client_read_buffer_.reset();
+					self->client_eof_ = true;
+
+					//Everything which was read needs to reach the target first
+					if(!self->to_target_.write_in_flight())
+					{
+						self->do_shutdown();
+					}
+				}
+				else if (ec != net::error::operation_aborted)
+				{
+					//std::cerr << "ProxySession: Read from client error: " << ec.message() << std::endl;
+					self->client_read_buffer_.reset();
+					self->do_shutdown();
+				}
+				else
+				{
+					self->client_read_buffer_.reset();
+				}
+			})
+		);
+	}
+
+	void write_to_target()
+	{
+		if(to_target_.write_in_flight() || to_target_.empty()) return;
+
+		if(!target_socket_.is_open())
+		{
+			to_target_.clear();
+			return;
+		}
+
+		auto self = shared_from_this();
+
+		async_write_to_target(to_target_.prepare_write(), bind_arena([this, self](const err::error_code& write_ec, std::size_t /*written*/)
+		{
+			self->to_target_.commit_write();
+
+			if(write_ec)
+			{
+				if(write_ec != net::error::operation_aborted)
+				{
+					std::cerr << "ProxySession: Write to target error: " << write_ec.message() << std::endl;
+				}
+				self->do_shutdown();
+				return;
+			}
+
+			self->activity_.touch();
+			if(!self->to_target_.empty())
+			{
+				self->write_to_target();
+			}
+			else if(self->client_eof_)
+			{
+				self->do_shutdown();
+				return;
+			}
+
+			if(self->client_read_paused_ && self->to_target_.bytes() <= self->options_.low_watermark)
+			{
+				self->client_read_paused_ = false;
+				self->start_read_from_client();
+			}
+		}));
+	}
+
+	void start_read_from_target()
+	{
+		auto self = shared_from_this();
+
+		if(!client_socket_ || !target_socket_.is_open())
+		{
+			self->do_shutdown();
+			return;
+		}
+
+		if(target_reading_ || target_eof_) return;
+
+		//Bytes of the next response which arrived together with the previous one
+		if(!exchange_.response_started() && exchange_.response_head_buffered() && !process_response_head()) return;
+
+		if(exchange_.target_reuse_possible())
+		{
+			//The exchange is complete. Don't read from the target anymore so that
+			//it is idle and can be given back to the pool when the client leaves
+			target_parked_ = true;
+			return;
+		}
+
+#ifdef SSLPROXY_HAS_KTLS
+		if(ktls_ && exchange_.response_started() && exchange_.response_body().mode() != HttpBodyFraming::Mode::chunked)
+		{
+			//The response headers are forwarded, the body is spliced to the client.
+			//Everything which is queued for the client needs to be written first
+			if(client_writing_)
+			{
+				target_read_paused_ = true;
+				return;
+			}
+
+			splice_forward(true);
+			return;
+		}
+#endif
+
+		//Backpressure: stop reading if the client doesn't keep up
+		if(to_client_.full() || to_client_.bytes() >= options_.high_watermark)
+		{
+			target_read_paused_ = true;
+			return;
+		}
+
+		target_reading_ = true;
+
+		if(target_read_size_.bulk())
+		{
+			read_from_target();
+			return;
+		}
+
+		//Wait until the target sends something before a buffer is taken
+		async_wait_target_readable(bind_arena([this, self](const err::error_code& ec)
+		{
+			if(!ec)
+			{
+				self->read_from_target();
+			}
+			else if(ec != net::error::operation_aborted)
+			{
+				self->target_reading_ = false;
+				self->do_shutdown();
+			}
+		}));
+	}
+
+	void read_from_target()
+	{
+		auto self = shared_from_this();
+
+		if(!client_socket_ || !target_socket_.is_open())
+		{
+			target_reading_ = false;
+			self->do_shutdown();
+			return;
+		}
+
+		if(!exchange_.response_started())
+		{
+			read_response_head();
+			return;
+		}
+
+		target_read_buffer_ = buffer_pool_->acquire(target_read_size_.size());
+
+		async_read_from_target(
+			net::buffer(target_read_buffer_.data(), target_read_buffer_.capacity()),
+			bind_arena([this, self](const err::error_code& ec, std::size_t length)
+			{
+				self->target_reading_ = false;
+
+				if(!ec)
+				{
+					//std::cout << "DEBUG: [TargetRead] Tunneling " << length << " bytes." << std::endl;
+					self->target_read_size_.update(length);
+					self->activity_.count_target_data();
+					self->activity_.touch();
+					self->forward_response_body(std::move(self->target_read_buffer_), length);
+					self->write_to_client();
+
+					//Keep reading while the write is in flight
+					self->start_read_from_target();
+				}
+				else
+				{
+					self->target_read_buffer_.reset();
+					self->on_target_read_error(ec);
+				}
+			})
+		);
+	}
+
+	//Reads the response head directly into its own buffer, which is parsed
+	//incrementally. Bytes after the head are the beginning of the body and are
+	//forwarded from the same buffer
+	void read_response_head()
+	{
+		auto self = shared_from_this();
+
+		async_read_from_target(
+			exchange_.prepare_response_head(),
+			bind_arena([this, self](const err::error_code& ec, std::size_t length)
+			{
+				self->target_reading_ = false;
+
+				if(ec)
+				{
+					self->exchange_.drop_response_head();
+					self->on_target_read_error(ec);
+					return;
+				}
+
+				self->exchange_.commit_response_head(length);
+				self->activity_.count_target_data();
+				self->activity_.touch();
+				self->start_read_from_target();
+			})
+		);
+	}
+
+	//Parses the buffered response head bytes and forwards each complete head together
+	//with the body bytes which follow it. Returns false if reading has to wait
+	bool process_response_head()
+	{
+		while(!exchange_.response_started() && exchange_.response_head_buffered())
+		{
+			//A rewritten head and the body bytes after it take two chunks
+			if(to_client_.available() < 2)
+			{
+				target_read_paused_ = true;
+				return false;
+			}
+
+			const HttpHeadParser::Result result = exchange_.parse_response_head();
+
+			if(result == HttpHeadParser::Result::error)
+			{
+				//std::cerr << "ProxySession: Invalid or too large response head from target." << std::endl;
+				send_bad_gateway();
+				return false;
+			}
+
+			if(result == HttpHeadParser::Result::incomplete) return true;
+
+			//std::cout << "DEBUG: [TargetRead] Header end found." << std::endl;
+			forward_response_head();
+		}
+
+		return true;
+	}
+
+	void forward_response_head()
+	{
+		Http1Exchange::ResponseHead head = exchange_.take_response_head();
+
+		if(head.rewritten.empty())
+		{
+			//Unchanged: head and the beginning of the body go out as they are
+			to_client_.push(std::move(head.buffer), head.head_length + head.body_length);
+		}
+		else
+		{
+			BufferPool::Buffer rewritten = buffer_pool_->acquire(head.rewritten.length());
+			const std::size_t rewritten_length = std::min(head.rewritten.length(), rewritten.capacity());
+			std::memcpy(rewritten.data(), head.rewritten.data(), rewritten_length);
+			to_client_.push(std::move(rewritten), rewritten_length);
+
+			if(head.body_length > 0) to_client_.push(std::move(head.buffer), head.body_length, head.head_length);
+		}
+
+		write_to_client();
+	}
+
+	//Forwards bytes of a response body. If the response ends within
+	//them, the rest is kept as the beginning of the next response
+	void forward_response_body(BufferPool::Buffer buffer, std::size_t length)
+	{
+		const std::size_t body_length = exchange_.consume_response_body(buffer.data(), length);
+		if(body_length > 0) to_client_.push(std::move(buffer), body_length);
+	}
+
+	void on_target_read_error(const err::error_code& ec)
+	{
+		if(ec == net::error::eof || ec == net::error::connection_reset)
+		{
+			target_eof_ = true;
+
+			//Everything which was read needs to reach the client first
+			if(!client_writing_)
+			{
+				do_shutdown();
+			}
+		}
+		else if (ec != net::error::operation_aborted)
+		{
+			//std::cerr << "ProxySession: Read from target error: " << ec.message() << std::endl;
+			do_shutdown();
+		}
+	}
+
+	//Answers the client with 502 and closes the session, e.g. if the target sent an invalid head
+	void send_bad_gateway()
+	{
+		//The target is not read anymore, it is closed once the answer is written
+		exchange_.stop_reuse();
+		target_eof_ = true;
+		send_to_client(HttpMessageFraming::error_response(502));
+	}
+
+	//Queues an answer of the proxy itself for the client
+	void send_to_client(std::string_view answer)
+	{
+		BufferPool::Buffer buffer = buffer_pool_->acquire(answer.size());
+		std::memcpy(buffer.data(), answer.data(), answer.size());
+		to_client_.push(std::move(buffer), answer.size());
+		write_to_client();
+	}
+
+	void write_to_client()
+	{
+		if(client_writing_) return;
+
+		if(!client_socket_)
+		{
+			to_client_.clear();
+			return;
+		}
+
+		if(to_client_.empty()) return;
+
+		auto self = shared_from_this();
+		client_writing_ = true;
+
+		async_write_to_client(to_client_.prepare_write(), bind_arena([this, self](const err::error_code& write_ec, std::size_t written)
+		{
+			self->to_client_.commit_write();
+			self->client_writing_ = false;
+			if(self->options_.metrics) ThreadMetrics::add(self->options_.metrics->bytes_to_clients, written);
+
+			if(write_ec)
+			{
+				self->to_client_.clear();
+				self->do_shutdown();
+				return;
+			}
+
+			self->activity_.touch();
+			if(!self->to_client_.empty())
+			{
+				self->write_to_client();
+			}
+			else if(self->target_eof_)
+			{
+				self->do_shutdown();
+				return;
+			}
+
+			if(self->target_read_paused_ && !self->client_writing_ && self->to_client_.bytes() <= self->options_.low_watermark)
+			{
+				self->target_read_paused_ = false;
+				self->start_read_from_target();
+			}
+		}));
+	}
+
+#ifdef SSLPROXY_HAS_KTLS
+	//Forwards from the target to the client (from_target) or the other way round with splice().
+	//Both sockets are plain tcp sockets for this because the kernel does the TLS records
+	void splice_forward(bool from_target)
+	{
+		if(!client_socket_ || !target_socket_.is_open())
+		{
+			do_shutdown();
+			return;
+		}
+
+		tcp::socket& source = from_target ? target_socket_ : client_socket_->next_layer();
+		tcp::socket& destination = from_target ? client_socket_->next_layer() : target_socket_;
+		SplicePipe& pipe = from_target ? target_pipe_ : client_pipe_;
+
+		err::error_code ec;
+		source.native_non_blocking(true, ec);
+		destination.native_non_blocking(true, ec);
+
+		if(ec || !pipe.open())
+		{
+			do_shutdown();
+			return;
+		}
+
+		auto self = shared_from_this();
+		auto resume = [this, self, from_target](const err::error_code& wait_ec)
+		{
+			if(!wait_ec) self->splice_forward(from_target);
+			else if(wait_ec != net::error::operation_aborted) self->do_shutdown();
+		};
+
+		//Don't let a single busy session starve the others on this thread
+		for(int round = 0; round < 16; ++round)
+		{
+			if(pipe.buffered() > 0)
+			{
+				if(pipe.drain(destination.native_handle()) < 0)
+				{
+					if(errno == EAGAIN || errno == EWOULDBLOCK) destination.async_wait(tcp::socket::wait_write, bind_arena(resume));
+					else do_shutdown();
+					return;
+				}
+				activity_.touch();
+				continue;
+			}
+
+			//Only take the rest of the current body, the next head goes the normal way
+			std::size_t limit = SplicePipe::max_chunk;
+			const HttpBodyFraming& framing = from_target ? exchange_.response_body() : exchange_.request_body();
+			const bool framed = from_target || exchange_.tracking();
+
+			if(framed && framing.mode() == HttpBodyFraming::Mode::length)
+			{
+				limit = std::min(limit, framing.remaining());
+			}
+			else if(framed && framing.mode() != HttpBodyFraming::Mode::until_close)
+			{
+				if(from_target) start_read_from_target();
+				else start_read_from_client();
+				return;
+			}
+
+			ssize_t moved = pipe.fill(source.native_handle(), limit);
+			if(moved == 0)
+			{
+				do_shutdown();
+				return;
+			}
+			else if(moved < 0)
+			{
+				//A kTLS socket also fails with EIO if the client sent an alert (e.g. close_notify)
+				if(errno == EAGAIN || errno == EWOULDBLOCK) source.async_wait(tcp::socket::wait_read, bind_arena(resume));
+				else do_shutdown();
+				return;
+			}
+
+			activity_.touch();
+			if(from_target)
+			{
+				activity_.count_target_data();
+				if(options_.metrics) ThreadMetrics::add(options_.metrics->bytes_to_clients, static_cast<std::uint64_t>(moved));
+			}
+			else
+			{
+				activity_.count_client_data(static_cast<std::size_t>(moved));
+				activity_.count_request();
+			}
+
+			if(from_target) exchange_.consume_response_body(nullptr, static_cast<std::size_t>(moved));
+			else if(framed) exchange_.consume_request_body(nullptr, static_cast<std::size_t>(moved));
+		}
+
+		net::post(target_socket_.get_executor(), bind_arena([this, self, from_target]
+		{
+			self->splice_forward(from_target);
+		}));
+	}
+#endif
+
+	void do_shutdown()
+	{
+		std::unique_ptr<ssl::stream<tcp::socket>> client_socket_moved = std::move(client_socket_);
+
+		if (!client_socket_moved)
+		{
+			//std::cerr << "DEBUG: Attempted SSL shutdown on null socket (after move)." << std::endl;
+			close_sockets_only_target();
+			return;
+		}
+
+		//The kernel sends the close_notify of a kTLS client, pending operations of the io_uring go first
+		if(ktls_) cancel_io_uring(client_socket_moved->next_layer());
+
+		auto self = shared_from_this();
+		activity_.shutdown(std::move(client_socket_moved), ktls_, [self]
+		{
+			self->close_sockets_only_target();
+		});
+	}
+
+	void close_sockets_only_target()
+	{
+		err::error_code ec;
+		if(target_parked_ && target_socket_.is_open() && exchange_.target_reuse_possible())
+		{
+			target_parked_ = false;
+			upstream_pool_->release(target_endpoint_, std::move(target_socket_), target_connected_at_);
+			//std::cout << "DEBUG: Target socket returned to pool." << std::endl;
+			return;
+		}
+
+		if (target_socket_.is_open())
+		{
+			cancel_io_uring(target_socket_);
+			target_socket_.shutdown(tcp::socket::shutdown_both, ec);
+			target_socket_.close(ec);
+			//std::cout << "DEBUG: Target socket closed." << std::endl;
+		}
+
+		//if (client_socket_)
+		//{
+		//	client_socket_.reset();
+		//	//std::cout << "DEBUG: Client SSL stream destroyed." << std::endl;
+		//}
+	}
+
+	void close_all_resources()
+	{
+		close_sockets_only_target();
+
+		if(client_socket_)
+		{
+			client_socket_.reset();
+			//std::cout << "DEBUG: Client SSL stream destroyed (by direct close)." << std::endl;
+		}
+	}
+
+}; //end class ProxySession
+
+#ifdef SSLPROXY_COROUTINE_SESSIONS
+//The same session as ProxySession, written with C++20 coroutines (asio awaitable and co_spawn).
+//Each direction is one coroutine which reads, forwards and waits for its write before it reads
+//again. There are no handler chains: the two coroutine frames hold the session, so the I/O
+//operations don't copy a shared_ptr. asio recycles the frames per thread.
+//SslProxy uses it instead of ProxySession if SSLPROXY_COROUTINE_SESSIONS is defined.
+//Sessions with kTLS read and write the tcp socket, there is no splice() path
+class CoroutineSession : public std::enable_shared_from_this<CoroutineSession>
+{
+
+public:
+	enum
+	{
+		//Backends a session tries to connect to before it gives up
+		max_connect_attempts = 3
+	};
+
+	CoroutineSession(net::io_context& io_context, tcp::endpoint target_endpoint, std::unique_ptr<ssl::stream<tcp::socket>> client_socket, std::shared_ptr<UpstreamPool> upstream_pool = nullptr, bool ktls = false, std::shared_ptr<BufferPool> buffer_pool = nullptr, const SessionOptions& options = SessionOptions()) :
+		client_socket_(std::move(client_socket)),
+		ktls_(ktls),
+		target_socket_(io_context),
+		target_endpoint_(std::move(target_endpoint)),
+		buffer_pool_(buffer_pool ? std::move(buffer_pool) : std::make_shared<BufferPool>()),
+		client_read_size_(ktls ? BufferPool::large_buffer : BufferPool::tls_record_buffer),
+		target_read_size_(BufferPool::large_buffer),
+		options_(options),
+		client_writing_(false),
+		target_waiting_(false),
+		rejected_(false),
+		rewritten_heads_(),
+		gather_(),
+		upstream_pool_(std::move(upstream_pool)),
+		target_connected_at_(),
+		backends_(),
+		backend_(),
+		worker_(0),
+		connect_attempts_(0),
+		connection_slot_(),
+		exchange_(options_, *buffer_pool_, upstream_pool_ != nullptr),
+		activity_(options_, [this] { do_shutdown(); })
+	{}
+
+	CoroutineSession(const CoroutineSession&) = delete;
+	CoroutineSession& operator=(const CoroutineSession&) = delete;
+
+	void start()
+	{
+		activity_.start();
+		if(exchange_.tracking()) activity_.start_request_head_timeout();
+		exchange_.set_client(client_socket_->next_layer());
+
+		net::co_spawn(target_socket_.get_executor(), run(shared_from_this()), net::detached);
+	}
+
+	//Lets the session choose its target from a load balanced group instead of the
+	//target endpoint of the constructor. worker is the thread the session runs on
+	void set_backends(std::shared_ptr<BackendGroup> backends, std::size_t worker)
+	{
+		backends_ = std::move(backends);
+		worker_ = worker;
+	}
+
+	//Keeps slot for the lifetime of the session, see ConnectionLimiter
+	void set_connection_slot(std::shared_ptr<ConnectionSlot> slot)
+	{
+		connection_slot_ = std::move(slot);
+	}
+
+private:
+	std::unique_ptr<ssl::stream<tcp::socket>> client_socket_;
+	bool ktls_;
+	tcp::socket target_socket_;
+	tcp::endpoint target_endpoint_;
+	std::shared_ptr<BufferPool> buffer_pool_;
+	AdaptiveReadSize client_read_size_;
+	AdaptiveReadSize target_read_size_;
+	SessionOptions options_;
+
+	//client_writing_ is set while the target coroutine writes to the client, target_waiting_ while
+	//it waits for the next response. rejected_ stops it, the client coroutine answers instead
+	bool client_writing_;
+	bool target_waiting_;
+	bool rejected_;
+
+	//Forwarded headers: the rewritten request heads of one read and
+	//the parts of the read which are written to the target with them
+	std::deque<std::string> rewritten_heads_;
+	std::vector<net::const_buffer> gather_;
+
+	//Upstream connection reuse, exchange_ knows if the target connection is clean
+	std::shared_ptr<UpstreamPool> upstream_pool_;
+	std::chrono::steady_clock::time_point target_connected_at_;
+
+	//Load balancing: the group the target was chosen from
+	std::shared_ptr<BackendGroup> backends_;
+	BackendLease backend_;
+	std::size_t worker_;
+	unsigned connect_attempts_;
+
+	//Counts the connection in the limits of SslProxy until the session ends
+	std::shared_ptr<ConnectionSlot> connection_slot_;
+
+	//The same framing, timeouts and metrics as in ProxySession
+	Http1Exchange exchange_;
+	SessionActivity activity_;
+
+	static net::redirect_error_t<net::use_awaitable_t<>> redirect(err::error_code& ec)
+	{
+		return net::redirect_error(net::use_awaitable, ec);
+	}
+
+	template<typename MutableBufferSequence>
+	net::awaitable<std::size_t> async_read_from_client(const MutableBufferSequence& buffers, err::error_code& ec)
+	{
+		if(ktls_) return client_socket_->next_layer().async_read_some(buffers, redirect(ec));
+		return client_socket_->async_read_some(buffers, redirect(ec));
+	}
+
+	//True if OpenSSL already holds data of the client, then
+	//waiting for the socket to become readable could block forever
+	bool client_data_buffered() const
+	{
+		if(ktls_) return false;
+
+		SSL* ssl = client_socket_->native_handle();
+		return SSL_pending(ssl) > 0 || BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0;
+	}
+
+	template<typename ConstBufferSequence>
+	net::awaitable<bool> write_to_client(const ConstBufferSequence& buffers)
+	{
+		err::error_code ec;
+		std::size_t written = 0;
+
+		client_writing_ = true;
+		if(ktls_) written = co_await net::async_write(client_socket_->next_layer(), buffers, redirect(ec));
+		else written = co_await net::async_write(*client_socket_, buffers, redirect(ec));
+		client_writing_ = false;
+
+		if(options_.metrics) ThreadMetrics::add(options_.metrics->bytes_to_clients, written);
+		if(ec) co_return false;
+
+		activity_.touch();
+		co_return true;
+	}
+
+	template<typename ConstBufferSequence>
+	net::awaitable<bool> write_to_target(const ConstBufferSequence& buffers)
+	{
+		err::error_code ec;
+		co_await net::async_write(target_socket_, buffers, redirect(ec));
+
+		if(ec)
+		{
+			if(ec != net::error::operation_aborted) std::cerr << "CoroutineSession: Write to target error: " << ec.message() << std::endl;
+			co_return false;
+		}
+
+		activity_.touch();
+		co_return true;
+	}
+
+	//The parameter keeps the session alive while the coroutine runs
+	net::awaitable<void> run(std::shared_ptr<CoroutineSession> self)
+	{
+		if(!co_await connect_target())
+		{
+			close_all_resources();
+			co_return;
+		}
+
+		if(options_.proxy_protocol)
+		{
+			//The PROXY protocol header is the first thing the target gets
+			err::error_code ec;
+			const tcp::endpoint client = client_socket_->next_layer().remote_endpoint(ec);
+			const tcp::endpoint local = client_socket_->next_layer().local_endpoint(ec);
+			const std::string header = ProxyProtocolHeader::build(client, local, client_socket_->native_handle());
+
+			if(!co_await write_to_target(net::buffer(header)))
+			{
+				do_shutdown();
+				co_return;
+			}
+		}
+
+		net::co_spawn(target_socket_.get_executor(), client_to_target(std::move(self)), net::detached);
+		co_await target_to_client();
+	}
+
+	net::awaitable<bool> connect_target()
+	{
+		if(backends_) target_endpoint_ = backend_.choose(*backends_, worker_);
+
+		if(exchange_.target_reusable() && upstream_pool_->acquire(target_endpoint_, target_socket_, target_connected_at_)) co_return true;
+
+		for(;;)
+		{
+			err::error_code ec;
+			const std::chrono::steady_clock::time_point connect_started = std::chrono::steady_clock::now();
+			co_await target_socket_.async_connect(target_endpoint_, redirect(ec));
+
+			if(options_.metrics && ec != net::error::operation_aborted)
+			{
+				if(ec) ThreadMetrics::add(options_.metrics->backend_connect_failures, 1);
+				else
+				{
+					ThreadMetrics::add(options_.metrics->backend_connects, 1);
+					options_.metrics->backend_connect_time.record(std::chrono::steady_clock::now() - connect_started);
+				}
+			}
+
+			//The session may have timed out in the meantime
+			if(!client_socket_) co_return false;
+
+			if(!ec)
+			{
+				if(backend_) backends_->report_success(*backend_);
+				options_.target_socket.apply(target_socket_);
+				target_connected_at_ = std::chrono::steady_clock::now();
+				co_return true;
+			}
+
+			//std::cerr << "CoroutineSession: Target connect error: " << ec.message() << std::endl;
+			if(!backend_ || ec == net::error::operation_aborted) co_return false;
+
+			//Passive health check, then another backend gets a chance
+			backends_->report_failure(*backend_);
+			if(++connect_attempts_ >= max_connect_attempts) co_return false;
+
+			err::error_code close_ec;
+			target_socket_.close(close_ec);
+			target_endpoint_ = backend_.choose(*backends_, worker_);
+		}
+	}
+
+	//Reads from the client and writes to the target until one of them ends.
+	//The parameter keeps the session alive while the coroutine runs
+	net::awaitable<void> client_to_target(std::shared_ptr<CoroutineSession> /*self*/)
+	{
+		err::error_code ec;
+
+		while(client_socket_ && !rejected_)
+		{
+			if(!client_read_size_.bulk() && !client_data_buffered())
+			{
+				//The connection is probably idle, so no buffer is taken until the client sends something
+				co_await client_socket_->next_layer().async_wait(tcp::socket::wait_read, redirect(ec));
+				if(ec || !client_socket_) break;
+			}
+
+			BufferPool::Buffer buffer = buffer_pool_->acquire(client_read_size_.size());
+			const std::size_t length = co_await async_read_from_client(net::buffer(buffer.data(), buffer.capacity()), ec);
+			if(ec || !client_socket_) break;
+
+			client_read_size_.update(length);
+			activity_.count_client_data(length);
+			activity_.count_request();
+			activity_.touch();
+
+			if(!co_await forward_client_data(buffer, length)) break;
+		}
+
+		//Also on eof: everything which was read already reached the target
+		if(ec != net::error::operation_aborted) do_shutdown();
+	}
+
+	//Writes the bytes from the client to the target and follows the requests in them to know
+	//where each one ends. With forwarded headers, every request head is replaced by its
+	//rewritten version, the other bytes are written from the read buffer itself
+	net::awaitable<bool> forward_client_data(const BufferPool::Buffer& buffer, std::size_t length)
+	{
+		const bool rewrite = options_.forwarded_headers;
+		const char* data = buffer.data();
+		std::size_t pos = 0;
+		std::size_t unchanged_begin = 0;
+
+		rewritten_heads_.clear();
+		gather_.clear();
+
+		while(exchange_.tracking() && pos < length)
+		{
+			if(!exchange_.request_body().done())
+			{
+				pos += exchange_.consume_request_body(data + pos, length - pos);
+				continue;
+			}
+
+			if(rewrite)
+			{
+				gather(data + unchanged_begin, pos - unchanged_begin);
+				unchanged_begin = pos;
+			}
+
+			std::string head;
+			const Http1Exchange::RequestHead result = exchange_.parse_request_head(data, pos, length, head);
+
+			if(result == Http1Exchange::RequestHead::incomplete)
+			{
+				//The head bytes are held back until the head is complete
+				unchanged_begin = length;
+
+				//A head which arrives byte by byte (slowloris) still has to be complete in time
+				if(!activity_.request_head_timeout_running()) activity_.start_request_head_timeout();
+				break;
+			}
+
+			activity_.stop_request_head_timeout();
+			if(result == Http1Exchange::RequestHead::passthrough) break;
+
+			if(result != Http1Exchange::RequestHead::complete)
+			{
+				//Neither this head nor anything after it reaches the target
+				if(!gather_.empty() && !co_await write_to_target(gather_)) co_return false;
+				co_await reject_request(result == Http1Exchange::RequestHead::too_large);
+				co_return false;
+			}
+
+			if(rewrite)
+			{
+				rewritten_heads_.push_back(std::move(head));
+				gather(rewritten_heads_.back().data(), rewritten_heads_.back().length());
+				unchanged_begin = pos;
+			}
+		}
+
+		if(!rewrite) co_return co_await write_to_target(net::buffer(data, length));
+
+		gather(data + unchanged_begin, length - unchanged_begin);
+		co_return gather_.empty() || co_await write_to_target(gather_);
+	}
+
+	void gather(const char* data, std::size_t length)
+	{
+		if(length > 0) gather_.push_back(net::buffer(data, length));
+	}
+
+	//Answers a request which can't be parsed (or is too large), the session closes afterwards
+	net::awaitable<void> reject_request(bool too_large)
+	{
+		//If a response is on its way, the answer can't go in between
+		if(!client_socket_ || exchange_.response_in_progress() || client_writing_) co_return;
+
+		//The target is not read anymore
+		rejected_ = true;
+		err::error_code ec;
+		target_socket_.close(ec);
+
+		const std::string_view answer = HttpMessageFraming::error_response(too_large ? 431 : 400);
+		co_await write_to_client(net::buffer(answer.data(), answer.size()));
+	}
+
+	//Reads from the target and writes to the client until one of them ends
+	net::awaitable<void> target_to_client()
+	{
+		err::error_code ec;
+
+		while(client_socket_ && !rejected_)
+		{
+			if(!exchange_.response_started())
+			{
+				if(!co_await forward_response_head(ec)) break;
+				continue;
+			}
+
+			if(!target_read_size_.bulk())
+			{
+				//Wait until the target sends something before a buffer is taken
+				co_await target_socket_.async_wait(tcp::socket::wait_read, redirect(ec));
+				if(ec || !client_socket_ || rejected_) break;
+			}
+
+			BufferPool::Buffer buffer = buffer_pool_->acquire(target_read_size_.size());
+			const std::size_t length = co_await target_socket_.async_read_some(net::buffer(buffer.data(), buffer.capacity()), redirect(ec));
+			if(ec || !client_socket_ || rejected_) break;
+
+			target_read_size_.update(length);
+			activity_.count_target_data();
+			activity_.touch();
+
+			//If the response ends within the bytes, the rest is the beginning of the next one
+			const std::size_t body_length = exchange_.consume_response_body(buffer.data(), length);
+
+			if(body_length > 0 && !co_await write_to_client(net::buffer(buffer.data(), body_length))) break;
+		}
+
+		//On eof everything which was read already reached the client
+		if(ec != net::error::operation_aborted && !rejected_) do_shutdown();
+	}
+
+	//Reads the next response head into its own buffer and forwards it together with the
+	//body bytes which were read with it. Returns false if the session ends
+	net::awaitable<bool> forward_response_head(err::error_code& ec)
+	{
+		for(;;)
+		{
+			if(exchange_.response_head_buffered())
+			{
+				const HttpHeadParser::Result result = exchange_.parse_response_head();
+
+				if(result == HttpHeadParser::Result::error)
+				{
+					//std::cerr << "CoroutineSession: Invalid or too large response head from target." << std::endl;
+					co_await send_bad_gateway();
+					co_return false;
+				}
+
+				if(result == HttpHeadParser::Result::complete) break;
+			}
+
+			if(!exchange_.has_response_head_buffer())
+			{
+				//Between the responses the connection is idle, no buffer is taken until the target sends
+				//something. If the session ends meanwhile, the connection can go back to the pool
+				target_waiting_ = true;
+				co_await target_socket_.async_wait(tcp::socket::wait_read, redirect(ec));
+				target_waiting_ = false;
+				if(ec || !client_socket_ || rejected_) co_return false;
+			}
+
+			const std::size_t length = co_await target_socket_.async_read_some(exchange_.prepare_response_head(), redirect(ec));
+
+			if(ec || !client_socket_ || rejected_)
+			{
+				exchange_.drop_response_head();
+				co_return false;
+			}
+
+			exchange_.commit_response_head(length);
+			activity_.count_target_data();
+			activity_.touch();
+		}
+
+		const Http1Exchange::ResponseHead head = exchange_.take_response_head();
+
+		if(head.rewritten.empty())
+		{
+			//Unchanged: head and the beginning of the body go out as they are
+			co_return co_await write_to_client(net::buffer(head.buffer.data(), head.head_length + head.body_length));
+		}
+
+		const std::array<net::const_buffer, 2> buffers = {
+			net::buffer(head.rewritten),
+			net::buffer(head.buffer.data() + head.head_length, head.body_length)
+		};
+		co_return co_await write_to_client(buffers);
+	}
+
+	//Answers the client with 502, e.g. if the target sent an invalid head. The session closes afterwards
+	net::awaitable<void> send_bad_gateway()
+	{
+		const std::string_view answer = HttpMessageFraming::error_response(502);
+
+		exchange_.stop_reuse();
+		co_await write_to_client(net::buffer(answer.data(), answer.size()));
+	}
+
+	void do_shutdown()
+	{
+		std::unique_ptr<ssl::stream<tcp::socket>> client_socket_moved = std::move(client_socket_);
+
+		if(!client_socket_moved)
+		{
+			close_sockets_only_target();
+			return;
+		}
+
+		auto self = shared_from_this();
+		activity_.shutdown(std::move(client_socket_moved), ktls_, [self]
+		{
+			self->close_sockets_only_target();
+		});
+	}
+
+	void close_sockets_only_target()
+	{
+		err::error_code ec;
+		if(target_waiting_ && target_socket_.is_open() && exchange_.target_reuse_possible())
+		{
+			//The wait of the target coroutine ends with operation_aborted
+			target_waiting_ = false;
+			target_socket_.cancel(ec);
+			upstream_pool_->release(target_endpoint_, std::move(target_socket_), target_connected_at_);
+			return;
+		}
+
+		if(target_socket_.is_open())
+		{
+			target_socket_.shutdown(tcp::socket::shutdown_both, ec);
+			target_socket_.close(ec);
+		}
+	}
+
+	void close_all_resources()
+	{
+		close_sockets_only_target();
+		client_socket_.reset();
+	}
+
+}; //end class CoroutineSession
+#endif
+
+//HPACK, the header compression of HTTP/2 (RFC 7541). decode() keeps the dynamic table
+//the client builds up. Encoding has no state: every header is a literal which isn't
+//indexed, its name is taken from the static table where there is one
+class Hpack
+{
+
+public:
+	struct Header
+	{
+		std::string name;
+		std::string value;
+	};
+
+	enum
+	{
+		static_table_size = 61,
+
+		//The size of the dynamic table, the default of SETTINGS_HEADER_TABLE_SIZE
+		table_size = 4096,
+
+		//What an entry costs in the table in addition to its name and value
+		entry_overhead = 32
+	};
+
+	Hpack() :
+		dynamic_(),
+		dynamic_size_(0),
+		max_dynamic_size_(table_size)
+	{}
+
+	//Decodes a complete header block. Returns false on a compression error, the connection
+	//can't be used anymore then. Headers beyond max_list_size (name, value and 32 bytes each)
+	//still update the dynamic table but aren't stored, too_large is set instead
+	bool decode(const char* data, std::size_t length, std::vector<Header>& headers, std::size_t max_list_size, bool& too_large)
+	{
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+		const unsigned char* end = p + length;
+		std::size_t list_size = 0;
+		too_large = false;
+
+		while(p != end)
+		{
+			const unsigned char first = *p;
+			std::size_t index = 0;
+			std::string_view name;
+			std::string_view value;
+			std::string name_literal;
+			std::string value_literal;
+			bool indexing = false;
+
+			if(first & 0x80)
+			{
+				//Indexed header field
+				if(!decode_integer(p, end, 7, index) || !lookup(index, name, value)) return false;
+			}
+			else if((first & 0xe0) == 0x20)
+			{
+				//Dynamic table size update
+				std::size_t size = 0;
+				if(!decode_integer(p, end, 5, size) || size > table_size) return false;
+				max_dynamic_size_ = size;
+				evict(0);
+				continue;
+			}
+			else
+			{
+				//Literal with incremental indexing (01), without indexing (0000) or never indexed (0001)
+				indexing = (first & 0xc0) == 0x40;
+				if(!decode_integer(p, end, indexing ? 6 : 4, index)) return false;
+
+				std::string_view unused;
+				if(index != 0 ? !lookup(index, name, unused) : !decode_string(p, end, name_literal)) return false;
+				if(!decode_string(p, end, value_literal)) return false;
+
+				if(index == 0) name = name_literal;
+				value = value_literal;
+			}
+
+			list_size += name.size() + value.size() + entry_overhead;
+			if(list_size > max_list_size) too_large = true;
+			else headers.push_back(Header{ std::string(name), std::string(value) });
+
+			//Copied first, the name may be an entry which the insert evicts
+			if(indexing) insert(Header{ std::string(name), std::string(value) });
+		}
+
+		return true;
+	}
+
+	//Appends a header as a literal without indexing. The name needs to be lower case
+	static void encode(std::string& out, std::string_view name, std::string_view value)
+	{
+		std::size_t index = 0;
+		for(std::size_t i = 1; i <= static_table_size && index == 0; ++i)
+		{
+			if(name == static_entry(i).name) index = i;
+		}
+
+		if(index != 0)
+		{
+			encode_integer(out, index, 4, 0x00);
+		}
+		else
+		{
+			out.push_back('\0');
+			encode_string(out, name);
+		}
+		encode_string(out, value);
+	}
+
+	static void encode_status(std::string& out, int status)
+	{
+		const std::string value = std::to_string(status);
+
+		//The static table has 200, 204, 206, 304, 400, 404 and 500
+		for(std::size_t i = 8; i <= 14; ++i)
+		{
+			if(value == static_entry(i).value)
+			{
+				encode_integer(out, i, 7, 0x80);
+				return;
+			}
+		}
+
+		encode_integer(out, 8, 4, 0x00);
+		encode_string(out, value);
+	}
+
+private:
+	struct StaticEntry
+	{
+		const char* name;
+		const char* value;
+	};
+
+	//The canonical Huffman code of appendix B, rebuilt from its code lengths
+	struct HuffmanTable
+	{
+		std::array<std::uint32_t, 31> first{};
+		std::array<std::uint16_t, 31> count{};
+		std::array<std::uint16_t, 31> offset{};
+		std::array<std::uint16_t, 257> symbols{};
+	};
+
+	std::deque<Header> dynamic_;
+	std::size_t dynamic_size_;
+	std::size_t max_dynamic_size_;
+
+	static const StaticEntry& static_entry(std::size_t index)
+	{
+		static const StaticEntry table[static_table_size] = {
+			{ ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+			{ ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+			{ ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+			{ ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+			{ "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+			{ "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+			{ "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+			{ "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+			{ "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+			{ "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+			{ "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+			{ "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+			{ "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+			{ "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+			{ "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+			{ "www-authenticate", "" }
+		};
+		return table[index - 1];
+	}
+
+	//Index 1 to 61 is the static table, the dynamic table follows with the newest entry first
+	bool lookup(std::size_t index, std::string_view& name, std::string_view& value) const
+	{
+		if(index == 0) return false;
+
+		if(index <= static_table_size)
+		{
+			name = static_entry(index).name;
+			value = static_entry(index).value;
+			return true;
+		}
+
+		index -= static_table_size + 1;
+		if(index >= dynamic_.size()) return false;
+
+		name = dynamic_[index].name;
+		value = dynamic_[index].value;
+		return true;
+	}
+
+	void insert(Header header)
+	{
+		const std::size_t size = header.name.size() + header.value.size() + entry_overhead;
+		evict(size);
+
+		//An entry larger than the table only empties it
+		if(size > max_dynamic_size_) return;
+
+		dynamic_size_ += size;
+		dynamic_.push_front(std::move(header));
+	}
+
+	//Removes the oldest entries until room more bytes fit
+	void evict(std::size_t room)
+	{
+		while(!dynamic_.empty() && dynamic_size_ + room > max_dynamic_size_)
+		{
+			dynamic_size_ -= dynamic_.back().name.size() + dynamic_.back().value.size() + entry_overhead;
+			dynamic_.pop_back();
+		}
+	}
+
+	static bool decode_integer(const unsigned char*& p, const unsigned char* end, unsigned prefix_bits, std::size_t& value)
+	{
+		if(p == end) return false;
+
+		const std::size_t max_prefix = (std::size_t(1) << prefix_bits) - 1;
+		value = *p++ & max_prefix;
+		if(value < max_prefix) return true;
+
+		for(unsigned shift = 0; p != end && shift <= 28; shift += 7)
+		{
+			const unsigned char byte = *p++;
+			value += static_cast<std::size_t>(byte & 0x7f) << shift;
+			if(!(byte & 0x80)) return true;
+		}
+		return false;
+	}
+
+	static void encode_integer(std::string& out, std::size_t value, unsigned prefix_bits, unsigned char flags)
+	{
+		const std::size_t max_prefix = (std::size_t(1) << prefix_bits) - 1;
+		if(value < max_prefix)
+		{
+			out.push_back(static_cast<char>(flags | value));
+			return;
+		}
+
+		out.push_back(static_cast<char>(flags | max_prefix));
+		for(value -= max_prefix; value >= 0x80; value >>= 7)
+		{
+			out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+		}
+		out.push_back(static_cast<char>(value));
+	}
+
+	static bool decode_string(const unsigned char*& p, const unsigned char* end, std::string& out)
+	{
+		if(p == end) return false;
+
+		const bool huffman = (*p & 0x80) != 0;
+		std::size_t length = 0;
+		if(!decode_integer(p, end, 7, length) || length > static_cast<std::size_t>(end - p)) return false;
+
+		const unsigned char* data = p;
+		p += length;
+
+		if(!huffman)
+		{
+			out.assign(reinterpret_cast<const char*>(data), length);
+			return true;
+		}
+		return huffman_decode(data, length, out);
+	}
+
+	static void encode_string(std::string& out, std::string_view value)
+	{
+		encode_integer(out, value.size(), 7, 0x00);
+		out.append(value);
+	}
+
+	//Bit by bit: in a canonical code the codes of one length are consecutive numbers
+	static bool huffman_decode(const unsigned char* data, std::size_t length, std::string& out)
+	{
+		const HuffmanTable& table = huffman_table();
+		std::uint32_t code = 0;
+		std::size_t code_length = 0;
+
+		out.clear();
+		out.reserve(length * 8 / 5);
+
+		for(std::size_t i = 0; i < length; ++i)
+		{
+			for(int bit = 7; bit >= 0; --bit)
+			{
+				code = (code << 1) | ((data[i] >> bit) & 1u);
+				if(++code_length > 30) return false;
+
+				const std::uint32_t index = code - table.first[code_length];
+				if(index < table.count[code_length])
+				{
+					const std::uint16_t symbol = table.symbols[table.offset[code_length] + index];
+					if(symbol == 256) return false;
+
+					out.push_back(static_cast<char>(symbol));
+					code = 0;
+					code_length = 0;
+				}
+			}
+		}
+
+		//The padding is the beginning of EOS: at most 7 bits, all of them ones
+		return code_length <= 7 && code == (std::uint32_t(1) << code_length) - 1;
+	}
+
+	static const HuffmanTable& huffman_table()
+	{
+		static const HuffmanTable table = build_huffman_table();
+		return table;
+	}
+
+	static HuffmanTable build_huffman_table()
+	{
+		//Code length of every symbol, 256 is EOS
+		static const std::uint8_t lengths[257] = {
+			13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+			28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+			6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+			5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+			13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+			7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+			15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+			6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+			20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+			24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+			22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+			21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+			26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+			19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+			20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+			26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+			30
+		};
+
+		HuffmanTable table;
+		for(std::size_t symbol = 0; symbol < 257; ++symbol) ++table.count[lengths[symbol]];
+
+		std::uint32_t code = 0;
+		std::uint16_t offset = 0;
+		for(std::size_t length = 1; length <= 30; ++length)
+		{
+			table.first[length] = code;
+			table.offset[length] = offset;
+			offset = static_cast<std::uint16_t>(offset + table.count[length]);
+			code = (code + table.count[length]) << 1;
+		}
+
+		std::array<std::uint16_t, 31> next = table.offset;
+		for(std::size_t symbol = 0; symbol < 257; ++symbol)
+		{
+			table.symbols[next[lengths[symbol]]++] = static_cast<std::uint16_t>(symbol);
+		}
+		return table;
+	}
+
+}; //end class Hpack
+
+//A client connection which negotiated HTTP/2 (ALPN h2, RFC 9113). Its streams are
+//demultiplexed: every request becomes an HTTP/1.1 request on a target connection of its
+//own, which comes from the upstream pool and goes back there after the response. So a
+//browser needs one TLS connection and one session instead of up to six.
+//Response heads go through the response head hooks like in ProxySession (e.g. the Location
+//rewrite), the forwarded headers are added the same way. Not supported are server push,
+//priorities, trailers and CONNECT. Everything runs on the thread of the io_context
+class Http2Session : public std::enable_shared_from_this<Http2Session>
+{
+
+public:
+	enum
+	{
+		frame_header_size = 9,
+		preface_size = 24,
+
+		//The largest frame the client may send, the default of SETTINGS_MAX_FRAME_SIZE
+		max_frame_size = 16384,
+
+		//Limit of a header block together with its CONTINUATION frames
+		max_header_block = 65536,
+
+		//The receive window of the connection. Request bodies which wait for their target share it
+		connection_window = 1024 * 1024,
+
+		//Windows before SETTINGS change them
+		default_window = 65535,
+
+		//Backends a stream tries to connect to before it answers 502
+		max_connect_attempts = 3
+	};
+
+	Http2Session(net::io_context& io_context, tcp::endpoint target_endpoint, std::unique_ptr<ssl::stream<tcp::socket>> client_socket, std::shared_ptr<UpstreamPool> upstream_pool = nullptr, bool ktls = false, std::shared_ptr<BufferPool> buffer_pool = nullptr, const SessionOptions& options = SessionOptions()) :
+		io_context_(io_context),
+		client_socket_(std::move(client_socket)),
+		ktls_(ktls),
+		target_endpoint_(std::move(target_endpoint)),
+		own_upstream_pool_(!upstream_pool),
+		upstream_pool_(upstream_pool ? std::move(upstream_pool) : std::make_shared<UpstreamPool>(options.http2_max_concurrent_streams, std::chrono::seconds(60), true)),
+		buffer_pool_(buffer_pool ? std::move(buffer_pool) : std::make_shared<BufferPool>()),
+		options_(options),
+		backends_(),
+		worker_(0),
+		read_buffer_(),
+		input_(),
+		output_(),
+		writing_(),
+		client_reading_(false),
+		client_read_paused_(false),
+		client_read_closed_(false),
+		client_writing_(false),
+		preface_received_(false),
+		closing_(false),
+		hpack_(),
+		streams_(),
+		last_stream_id_(0),
+		header_block_stream_(0),
+		header_block_end_stream_(false),
+		header_block_(),
+		send_window_(default_window),
+		stream_send_window_(default_window),
+		stream_receive_window_(static_cast<std::int64_t>(std::min<std::size_t>(options.high_watermark, 0x7fffffff))),
+		receive_window_(connection_window),
+		peer_max_frame_size_(max_frame_size),
+		forwarded_client_(),
+		connection_slot_(),
+		activity_(options_, [this] { close_connection(ErrorCode::no_error); })
+	{}
+
+	Http2Session(const Http2Session&) = delete;
+	Http2Session& operator=(const Http2Session&) = delete;
+
+	void start()
+	{
+		activity_.start();
+		if(options_.metrics) ThreadMetrics::add(options_.metrics->http2_sessions, 1);
+		if(options_.forwarded_headers) forwarded_client_.set(client_socket_->next_layer());
+
+		//The server side of the connection preface
+		send_settings();
+		flush();
+		start_read_from_client();
+	}
+
+	//Lets the streams choose their target from a load balanced group instead of the
+	//target endpoint of the constructor. worker is the thread the session runs on
+	void set_backends(std::shared_ptr<BackendGroup> backends, std::size_t worker)
+	{
+		backends_ = std::move(backends);
+		worker_ = worker;
+	}
+
+	//Keeps slot for the lifetime of the session, see ConnectionLimiter
+	void set_connection_slot(std::shared_ptr<ConnectionSlot> slot)
+	{
+		connection_slot_ = std::move(slot);
+	}
+
+	~Http2Session()
+	{
+		close_streams();
+		if(own_upstream_pool_) upstream_pool_->clear();
+	}
+
+private:
+	enum class FrameType : std::uint8_t
+	{
+		data = 0x0,
+		headers = 0x1,
+		priority = 0x2,
+		rst_stream = 0x3,
+		settings = 0x4,
+		push_promise = 0x5,
+		ping = 0x6,
+		goaway = 0x7,
+		window_update = 0x8,
+		continuation = 0x9
+	};
+
+	enum : std::uint8_t
+	{
+		flag_end_stream = 0x1,
+		flag_ack = 0x1,
+		flag_end_headers = 0x4,
+		flag_padded = 0x8,
+		flag_priority = 0x20
+	};
+
+	enum class ErrorCode : std::uint32_t
+	{
+		no_error = 0x0,
+		protocol_error = 0x1,
+		internal_error = 0x2,
+		flow_control_error = 0x3,
+		stream_closed = 0x5,
+		frame_size_error = 0x6,
+		refused_stream = 0x7,
+		compression_error = 0x9,
+		enhance_your_calm = 0xb
+	};
+
+	//One request and its target connection
+	struct Stream
+	{
+		Stream(net::io_context& io_context, std::uint32_t stream_id, std::int64_t initial_send_window, std::int64_t initial_receive_window) :
+			id(stream_id),
+			socket(io_context),
+			endpoint(),
+			backend(),
+			connected_at(),
+			connect_attempts(0),
+			connected(false),
+			closed(false),
+			to_target(),
+			writing(),
+			target_writing(false),
+			chunked_request(false),
+			request_done(false),
+			head_request(false),
+			length_known(false),
+			remaining_length(0),
+			window_credit(0),
+			writing_credit(0),
+			receive_window(initial_receive_window),
+			read_buffer(),
+			target_reading(false),
+			target_read_paused(false),
+			response_head(),
+			parser(),
+			body(),
+			head_parsed(false),
+			response_done(false),
+			reusable(true),
+			headers_sent(false),
+			end_stream_sent(false),
+			pending(),
+			pending_offset(0),
+			send_window(initial_send_window)
+		{}
+
+		Stream(const Stream&) = delete;
+		Stream& operator=(const Stream&) = delete;
+
+		std::size_t pending_size() const { return pending.size() - pending_offset; }
+
+		std::uint32_t id;
+		tcp::socket socket;
+		tcp::endpoint endpoint;
+		BackendLease backend;
+		std::chrono::steady_clock::time_point connected_at;
+		unsigned connect_attempts;
+		bool connected;
+		bool closed;
+
+		//The request head and body bytes for the target. A body without a length is sent chunked.
+		//The credits are the DATA bytes the client may send again once they are written
+		std::string to_target;
+		std::string writing;
+		bool target_writing;
+		bool chunked_request;
+		bool request_done;
+		bool head_request;
+
+		//The content-length of the request, the DATA frames have to add up to it (RFC 9113 8.1.1)
+		bool length_known;
+		std::size_t remaining_length;
+
+		std::size_t window_credit;
+		std::size_t writing_credit;
+		std::int64_t receive_window;
+
+		//The response from the target, its body without the chunked framing waits
+		//in pending until the flow control windows of the client allow to send it
+		BufferPool::Buffer read_buffer;
+		bool target_reading;
+		bool target_read_paused;
+		std::string response_head;
+		HttpHeadParser parser;
+		HttpBodyFraming body;
+		bool head_parsed;
+		bool response_done;
+		bool reusable;
+		bool headers_sent;
+		bool end_stream_sent;
+		std::string pending;
+		std::size_t pending_offset;
+		std::int64_t send_window;
+	};
+
+	net::io_context& io_context_;
+	std::unique_ptr<ssl::stream<tcp::socket>> client_socket_;
+	bool ktls_;
+	tcp::endpoint target_endpoint_;
+
+	//Without an upstream pool of the thread the session keeps its idle target connections itself
+	bool own_upstream_pool_;
+	std::shared_ptr<UpstreamPool> upstream_pool_;
+	std::shared_ptr<BufferPool> buffer_pool_;
+	SessionOptions options_;
+	std::shared_ptr<BackendGroup> backends_;
+	std::size_t worker_;
+
+	//The bytes from and to the client. closing_ is set once a GOAWAY was sent or received,
+	//the session ends when the last stream is done
+	BufferPool::Buffer read_buffer_;
+	std::string input_;
+	std::string output_;
+	std::string writing_;
+	bool client_reading_;
+	bool client_read_paused_;
+	bool client_read_closed_;
+	bool client_writing_;
+	bool preface_received_;
+	bool closing_;
+
+	//HTTP/2 state: streams by id, the header block which continues in CONTINUATION frames
+	//(header_block_stream_ is 0 if there is none) and the flow control windows
+	Hpack hpack_;
+	std::map<std::uint32_t, std::shared_ptr<Stream>> streams_;
+	std::uint32_t last_stream_id_;
+	std::uint32_t header_block_stream_;
+	bool header_block_end_stream_;
+	std::string header_block_;
+	std::int64_t send_window_;
+	std::int64_t stream_send_window_;
+	std::int64_t stream_receive_window_;
+	std::int64_t receive_window_;
+	std::size_t peer_max_frame_size_;
+
+	ForwardedClient forwarded_client_;
+
+	std::shared_ptr<ConnectionSlot> connection_slot_;
+
+	//The idle timeout of the connection, reads and writes of the targets push it back as well,
+	//the timeout of the TLS shutdown and the metrics of the session
+	SessionActivity activity_;
+
+	template<typename MutableBufferSequence, typename ReadHandler>
+	void async_read_from_client(const MutableBufferSequence& buffers, ReadHandler&& handler)
+	{
+		if(ktls_) client_socket_->next_layer().async_read_some(buffers, std::forward<ReadHandler>(handler));
+		else client_socket_->async_read_some(buffers, std::forward<ReadHandler>(handler));
+	}
+
+	template<typename ConstBufferSequence, typename WriteHandler>
+	void async_write_to_client(const ConstBufferSequence& buffers, WriteHandler&& handler)
+	{
+		if(ktls_) net::async_write(client_socket_->next_layer(), buffers, std::forward<WriteHandler>(handler));
+		else net::async_write(*client_socket_, buffers, std::forward<WriteHandler>(handler));
+	}
+
+	bool client_data_buffered() const
+	{
+		if(ktls_) return false;
+
+		SSL* ssl = client_socket_->native_handle();
+		return SSL_pending(ssl) > 0 || BIO_ctrl_pending(SSL_get_rbio(ssl)) > 0;
+	}
+
+	static std::uint32_t read_uint32(const char* data)
+	{
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+		return (std::uint32_t(p[0]) << 24) | (std::uint32_t(p[1]) << 16) | (std::uint32_t(p[2]) << 8) | std::uint32_t(p[3]);
+	}
+
+	void append_uint32(std::uint32_t value)
+	{
+		output_.push_back(static_cast<char>((value >> 24) & 0xff));
+		output_.push_back(static_cast<char>((value >> 16) & 0xff));
+		output_.push_back(static_cast<char>((value >> 8) & 0xff));
+		output_.push_back(static_cast<char>(value & 0xff));
+	}
+
+	void write_frame_header(std::size_t length, FrameType type, std::uint8_t flags, std::uint32_t stream_id)
+	{
+		output_.push_back(static_cast<char>((length >> 16) & 0xff));
+		output_.push_back(static_cast<char>((length >> 8) & 0xff));
+		output_.push_back(static_cast<char>(length & 0xff));
+		output_.push_back(static_cast<char>(type));
+		output_.push_back(static_cast<char>(flags));
+		append_uint32(stream_id & 0x7fffffff);
+	}
+
+	void send_settings()
+	{
+		//SETTINGS_MAX_CONCURRENT_STREAMS and SETTINGS_INITIAL_WINDOW_SIZE
+		write_frame_header(12, FrameType::settings, 0, 0);
+		output_.append("\x00\x03", 2);
+		append_uint32(options_.http2_max_concurrent_streams);
+		output_.append("\x00\x04", 2);
+		append_uint32(static_cast<std::uint32_t>(stream_receive_window_));
+
+		send_window_update(0, connection_window - default_window);
+	}
+
+	void send_window_update(std::uint32_t stream_id, std::size_t increment)
+	{
+		if(increment == 0) return;
+
+		write_frame_header(4, FrameType::window_update, 0, stream_id);
+		append_uint32(static_cast<std::uint32_t>(increment));
+	}
+
+	void send_rst_stream(std::uint32_t stream_id, ErrorCode code)
+	{
+		write_frame_header(4, FrameType::rst_stream, 0, stream_id);
+		append_uint32(static_cast<std::uint32_t>(code));
+	}
+
+	void send_goaway(ErrorCode code)
+	{
+		write_frame_header(8, FrameType::goaway, 0, 0);
+		append_uint32(last_stream_id_);
+		append_uint32(static_cast<std::uint32_t>(code));
+	}
+
+	//A header block larger than the frame size of the client continues in CONTINUATION frames
+	void send_headers(std::uint32_t stream_id, const std::string& block, bool end_stream)
+	{
+		std::size_t pos = 0;
+		do
+		{
+			const std::size_t length = std::min(block.size() - pos, peer_max_frame_size_);
+			const bool last = pos + length == block.size();
+			const std::uint8_t flags = static_cast<std::uint8_t>((last ? flag_end_headers : 0) | (pos == 0 && end_stream ? flag_end_stream : 0));
+
+			write_frame_header(length, pos == 0 ? FrameType::headers : FrameType::continuation, flags, stream_id);
+			output_.append(block, pos, length);
+			pos += length;
+		}
+		while(pos < block.size());
+	}
+
+	//Answers a request without the target, e.g. with 431 or 502
+	void send_local_response(std::uint32_t stream_id, int status, bool request_done)
+	{
+		std::string block;
+		Hpack::encode_status(block, status);
+		Hpack::encode(block, "content-length", "0");
+		send_headers(stream_id, block, true);
+
+		//The rest of the request body isn't needed anymore
+		if(!request_done) send_rst_stream(stream_id, ErrorCode::no_error);
+	}
+
+	void start_read_from_client()
+	{
+		if(client_reading_ || client_read_closed_ || !client_socket_) return;
+
+		//Backpressure: a client which doesn't read its responses doesn't get more of them
+		if(output_.size() >= options_.high_watermark)
+		{
+			client_read_paused_ = true;
+			return;
+		}
+
+		client_reading_ = true;
+
+		if(client_data_buffered())
+		{
+			read_from_client();
+			return;
+		}
+
+		//The connection is probably idle, so no buffer is taken until the client sends something
+		auto self = shared_from_this();
+		client_socket_->next_layer().async_wait(tcp::socket::wait_read, [this, self](const err::error_code& ec)
+		{
+			if(!ec && self->client_socket_)
+			{
+				self->read_from_client();
+				return;
+			}
+
+			self->client_reading_ = false;
+			if(ec != net::error::operation_aborted) self->close_connection_now();
+		});
+	}
+
+	void read_from_client()
+	{
+		auto self = shared_from_this();
+		read_buffer_ = buffer_pool_->acquire(BufferPool::tls_record_buffer);
+
+		async_read_from_client(net::buffer(read_buffer_.data(), read_buffer_.capacity()), [this, self](const err::error_code& ec, std::size_t length)
+		{
+			self->client_reading_ = false;
+
+			if(ec)
+			{
+				//std::cerr << "Http2Session: Read from client error: " << ec.message() << std::endl;
+				self->read_buffer_.reset();
+				if(ec != net::error::operation_aborted) self->close_connection_now();
+				return;
+			}
+
+			self->activity_.touch();
+			self->activity_.count_client_data(length);
+
+			self->input_.append(self->read_buffer_.data(), length);
+			self->read_buffer_.reset();
+
+			self->process_frames();
+			self->pump();
+			self->flush();
+			self->start_read_from_client();
+		});
+	}
+
+	//Handles all complete frames in input_
+	void process_frames()
+	{
+		std::size_t pos = 0;
+
+		if(!preface_received_)
+		{
+			static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+			if(input_.size() < preface_size)
+			{
+				if(input_.compare(0, input_.size(), preface, input_.size()) != 0) connection_error(ErrorCode::protocol_error);
+				return;
+			}
+			if(input_.compare(0, preface_size, preface, preface_size) != 0)
+			{
+				connection_error(ErrorCode::protocol_error);
+				return;
+			}
+
+			preface_received_ = true;
+			pos = preface_size;
+		}
+
+		while(!client_read_closed_ && input_.size() - pos >= frame_header_size)
+		{
+			const unsigned char* header = reinterpret_cast<const unsigned char*>(input_.data() + pos);
+			const std::size_t length = (std::size_t(header[0]) << 16) | (std::size_t(header[1]) << 8) | header[2];
+			const FrameType type = static_cast<FrameType>(header[3]);
+			const std::uint8_t flags = header[4];
+			const std::uint32_t stream_id = read_uint32(input_.data() + pos + 5) & 0x7fffffff;
+
+			if(length > max_frame_size)
+			{
+				connection_error(ErrorCode::frame_size_error);
+				return;
+			}
+
+			if(input_.size() - pos - frame_header_size < length) break;
+
+			const char* payload = input_.data() + pos + frame_header_size;
+			pos += frame_header_size + length;
+
+			//A header block must not be interrupted by other frames
+			if(header_block_stream_ != 0 && (type != FrameType::continuation || stream_id != header_block_stream_))
+			{
+				connection_error(ErrorCode::protocol_error);
+				return;
+			}
+
+			switch(type)
+			{
+			case FrameType::data: on_data(flags, stream_id, payload, length); break;
+			case FrameType::headers: on_headers(flags, stream_id, payload, length); break;
+			case FrameType::continuation: on_continuation(flags, stream_id, payload, length); break;
+			case FrameType::settings: on_settings(flags, stream_id, payload, length); break;
+			case FrameType::ping: on_ping(flags, stream_id, payload, length); break;
+			case FrameType::window_update: on_window_update(stream_id, payload, length); break;
+			case FrameType::rst_stream: on_rst_stream(stream_id, length); break;
+			case FrameType::goaway: on_goaway(stream_id); break;
+			case FrameType::push_promise: connection_error(ErrorCode::protocol_error); break;
+
+			//Priorities are ignored, unknown frames as well
+			case FrameType::priority:
+			default:
+				break;
+			}
+		}
+
+		input_.erase(0, pos);
+
+		//An idle connection doesn't keep a large buffer
+		if(input_.empty() && input_.capacity() > BufferPool::tls_record_buffer) std::string().swap(input_);
+	}
+
+	//Removes the padding (and the priority of HEADERS) around the payload of a frame
+	bool strip_padding(std::uint8_t flags, std::size_t priority_size, const char*& payload, std::size_t& length)
+	{
+		std::size_t padding = 0;
+		if(flags & flag_padded)
+		{
+			if(length == 0) return false;
+			padding = static_cast<unsigned char>(payload[0]);
+			++payload;
+			--length;
+		}
+
+		if(padding + priority_size > length) return false;
+
+		payload += priority_size;
+		length -= padding + priority_size;
+		return true;
+	}
+
+	void on_data(std::uint8_t flags, std::uint32_t stream_id, const char* payload, std::size_t length)
+	{
+		if(stream_id == 0)
+		{
+			connection_error(ErrorCode::protocol_error);
+			return;
+		}
+
+		//Padding counts for the flow control as well
+		const std::size_t frame_length = length;
+		receive_window_ -= static_cast<std::int64_t>(frame_length);
+		if(receive_window_ < 0)
+		{
+			connection_error(ErrorCode::flow_control_error);
+			return;
+		}
+
+		if(!strip_padding(flags, 0, payload, length))
+		{
+			connection_error(ErrorCode::protocol_error);
+			return;
+		}
+
+		auto it = streams_.find(stream_id);
+		if(it == streams_.end() || it->second->request_done)
+		{
+			//A stream which is gone (e.g. reset): the data is dropped and given back to the window
+			credit_connection(frame_length);
+			if(stream_id > last_stream_id_) connection_error(ErrorCode::protocol_error);
+			else if(it != streams_.end()) reset_stream(it->second, ErrorCode::stream_closed);
+			return;
+		}
+
+		const std::shared_ptr<Stream> stream = it->second;
+		stream->receive_window -= static_cast<std::int64_t>(frame_length);
+		if(stream->receive_window < 0)
+		{
+			credit_connection(frame_length);
+			reset_stream(stream, ErrorCode::flow_control_error);
+			return;
+		}
+
+		if(stream->length_known && length > stream->remaining_length)
+		{
+			credit_connection(frame_length);
+			reset_stream(stream, ErrorCode::protocol_error);
+			return;
+		}
+		if(stream->length_known) stream->remaining_length -= length;
+
+		if(length > 0)
+		{
+			if(stream->chunked_request)
+			{
+				char size[20];
+				const int size_length = std::snprintf(size, sizeof(size), "%zx\r\n", length);
+				stream->to_target.append(size, static_cast<std::size_t>(size_length));
+			}
+			stream->to_target.append(payload, length);
+			if(stream->chunked_request) stream->to_target.append("\r\n");
+		}
+		stream->window_credit += frame_length;
+
+		if((flags & flag_end_stream) && !end_request(*stream))
+		{
+			reset_stream(stream, ErrorCode::protocol_error);
+			return;
+		}
+		write_to_target(stream);
+	}
+
+	void on_headers(std::uint8_t flags, std::uint32_t stream_id, const char* payload, std::size_t length)
+	{
+		if(stream_id == 0 || stream_id % 2 == 0 || !strip_padding(flags, (flags & flag_priority) ? 5 : 0, payload, length))
+		{
+			connection_error(ErrorCode::protocol_error);
+			return;
+		}
+
+		header_block_.assign(payload, length);
+		header_block_end_stream_ = (flags & flag_end_stream) != 0;
+
+		if(flags & flag_end_headers) on_header_block(stream_id);
+		else header_block_stream_ = stream_id;
+	}
+
+	void on_continuation(std::uint8_t flags, std::uint32_t stream_id, const char* payload, std::size_t length)
+	{
+		if(stream_id == 0 || stream_id != header_block_stream_)
+		{
+			connection_error(ErrorCode::protocol_error);
+			return;
+		}
+
+		if(header_block_.size() + length > max_header_block)
+		{
+			connection_error(ErrorCode::enhance_your_calm);
+			return;
+		}
+
+		header_block_.append(payload, length);
+		if(flags & flag_end_headers)
+		{
+			header_block_stream_ = 0;
+			on_header_block(stream_id);
+		}
+	}
+
+	void on_header_block(std::uint32_t stream_id)
+	{
+		std::vector<Hpack::Header> headers;
+		bool too_large = false;
+
+		//Decoded even if the stream is refused, the dynamic table has to stay in sync with the client
+		const bool decoded = hpack_.decode(header_block_.data(), header_block_.size(), headers, options_.max_header_size, too_large);
+		header_block_.clear();
+
+		if(!decoded)
+		{
+			connection_error(ErrorCode::compression_error);
+			return;
+		}
+
+		if(stream_id <= last_stream_id_)
+		{
+			//Trailers end the request body, the fields themselves are dropped
+			auto it = streams_.find(stream_id);
+			if(it == streams_.end() || it->second->request_done) return;
+
+			if(header_block_end_stream_ && end_request(*it->second))
+			{
+				write_to_target(it->second);
+			}
+			else
+			{
+				reset_stream(it->second, ErrorCode::protocol_error);
+			}
+			return;
+		}
+
+		//After a GOAWAY no new streams are started
+		if(closing_) return;
+		last_stream_id_ = stream_id;
+
+		if(streams_.size() >= options_.http2_max_concurrent_streams)
+		{
+			send_rst_stream(stream_id, ErrorCode::refused_stream);
+			return;
+		}
+
+		if(options_.metrics) ThreadMetrics::add(options_.metrics->http2_streams, 1);
+		activity_.count_request();
+
+		if(too_large)
+		{
+			send_local_response(stream_id, 431, header_block_end_stream_);
+			return;
+		}
+
+		start_stream(stream_id, headers, header_block_end_stream_);
+	}
+
+	void on_settings(std::uint8_t flags, std::uint32_t stream_id, const char* payload, std::size_t length)
+	{
+		if(stream_id != 0)
+		{
+			connection_error(ErrorCode::protocol_error);
+			return;
+		}
+
+		if(flags & flag_ack)
+		{
+			if(length != 0) connection_error(ErrorCode::frame_size_error);
+			return;
+		}
+
+		if(length % 6 != 0)
+		{
+			connection_error(ErrorCode::frame_size_error);
+			return;
+		}
+
+		for(std::size_t pos = 0; pos < length; pos += 6)
+		{
+			const unsigned identifier = (unsigned(static_cast<unsigned char>(payload[pos])) << 8) | static_cast<unsigned char>(payload[pos + 1]);
+			const std::uint32_t value = read_uint32(payload + pos + 2);
+
+			if(identifier == 0x2 && value > 1)
+			{
+				connection_error(ErrorCode::protocol_error);
+				return;
+			}
+			else if(identifier == 0x4)
+			{
+				//SETTINGS_INITIAL_WINDOW_SIZE changes the windows of the open streams as well
+				if(value > 0x7fffffff)
+				{
+					connection_error(ErrorCode::flow_control_error);
+					return;
+				}
+
+				const std::int64_t delta = static_cast<std::int64_t>(value) - stream_send_window_;
+				stream_send_window_ = value;
+				for(auto& entry : streams_) entry.second->send_window += delta;
+			}
+			else if(identifier == 0x5)
+			{
+				if(value < max_frame_size || value > 0xffffff)
+				{
+					connection_error(ErrorCode::protocol_error);
+					return;
+				}
+				peer_max_frame_size_ = value;
+			}
+
+			//The header table size doesn't matter, the responses don't use the dynamic table
+		}
+
+		write_frame_header(0, FrameType::settings, flag_ack, 0);
+	}
+
+	void on_ping(std::uint8_t flags, std::uint32_t stream_id, const char* payload, std::size_t length)
+	{
+		if(stream_id != 0 || length != 8)
+		{
+			connection_error(stream_id != 0 ? ErrorCode::protocol_error : ErrorCode::frame_size_error);
+			return;
+		}
+
+		if(flags & flag_ack) return;
+
+		write_frame_header(8, FrameType::ping, flag_ack, 0);
+		output_.append(payload, 8);
+	}
+
+	void on_window_update(std::uint32_t stream_id, const char* payload, std::size_t length)
+	{
+		if(length != 4)
+		{
+			connection_error(ErrorCode::frame_size_error);
+			return;
+		}
+
+		const std::int64_t increment = read_uint32(payload) & 0x7fffffff;
+
+		if(stream_id == 0)
+		{
+			send_window_ += increment;
+			if(increment == 0 || send_window_ > 0x7fffffff) connection_error(increment == 0 ? ErrorCode::protocol_error : ErrorCode::flow_control_error);
+			return;
+		}
+
+		auto it = streams_.find(stream_id);
+		if(it == streams_.end()) return;
+
+		it->second->send_window += increment;
+		if(increment == 0 || it->second->send_window > 0x7fffffff) reset_stream(it->second, increment == 0 ? ErrorCode::protocol_error : ErrorCode::flow_control_error);
+	}
+
+	void on_rst_stream(std::uint32_t stream_id, std::size_t length)
+	{
+		if(stream_id == 0 || length != 4)
+		{
+			connection_error(stream_id == 0 ? ErrorCode::protocol_error : ErrorCode::frame_size_error);
+			return;
+		}
+
+		//The client cancelled the request, the target connection can't be reused
+		auto it = streams_.find(stream_id);
+		if(it != streams_.end()) close_stream(it->second, false);
+	}
+
+	void on_goaway(std::uint32_t stream_id)
+	{
+		if(stream_id != 0)
+		{
+			connection_error(ErrorCode::protocol_error);
+			return;
+		}
+
+		//The running streams are finished, the session ends after them
+		closing_ = true;
+		finish_if_idle();
+	}
+
+	//Header names of HTTP/2 are lower case. Nothing may break the HTTP/1.1 head it is written to
+	static bool valid_field(std::string_view name, std::string_view value)
+	{
+		if(name.empty()) return false;
+
+		for(char c : name)
+		{
+			if(c <= ' ' || c == ':' || c == 0x7f || (c >= 'A' && c <= 'Z')) return false;
+		}
+		return value.find_first_of(std::string_view("\r\n\0", 3)) == std::string_view::npos;
+	}
+
+	//Connection specific headers don't exist in HTTP/2 and aren't forwarded in either direction
+	static bool is_connection_header(std::string_view name)
+	{
+		return HttpHeadParser::iequals(name, "connection") || HttpHeadParser::iequals(name, "keep-alive") ||
+			HttpHeadParser::iequals(name, "proxy-connection") || HttpHeadParser::iequals(name, "transfer-encoding") ||
+			HttpHeadParser::iequals(name, "upgrade");
+	}
+
+	static void append_header(std::string& out, std::string_view name, std::string_view value)
+	{
+		out.append(name);
+		out.append(": ");
+		out.append(value);
+		out.append("\r\n");
+	}
+
+	static void append_list(std::string& list, std::string_view value, std::string_view separator)
+	{
+		if(!list.empty()) list.append(separator);
+		list.append(value);
+	}
+
+	//Writes the HTTP/1.1 head of a new stream and connects it to its target
+	void start_stream(std::uint32_t stream_id, const std::vector<Hpack::Header>& headers, bool end_stream)
+	{
+		std::string_view method;
+		std::string_view path;
+		std::string_view authority;
+
+		for(const Hpack::Header& header : headers)
+		{
+			if(header.name.empty() || header.name[0] != ':') continue;
+
+			if(header.name == ":method") method = header.value;
+			else if(header.name == ":path") path = header.value;
+			else if(header.name == ":authority") authority = header.value;
+			else if(header.name != ":scheme")
+			{
+				send_rst_stream(stream_id, ErrorCode::protocol_error);
+				return;
+			}
+
+			if(!valid_field(header.name.substr(1), header.value) || header.value.find(' ') != std::string::npos)
+			{
+				send_rst_stream(stream_id, ErrorCode::protocol_error);
+				return;
+			}
+		}
+
+		//The path is origin-form, only OPTIONS may ask for the server itself with * (RFC 9113 8.3.1)
+		if(method.empty() || path.empty() || (path[0] != '/' && !(method == "OPTIONS" && path == "*")))
+		{
+			send_rst_stream(stream_id, ErrorCode::protocol_error);
+			return;
+		}
+
+		if(method == "CONNECT")
+		{
+			send_local_response(stream_id, 501, end_stream);
+			return;
+		}
+
+		auto stream = std::make_shared<Stream>(io_context_, stream_id, stream_send_window_, stream_receive_window_);
+		stream->head_request = method == "HEAD";
+		stream->request_done = end_stream;
+
+		std::string& head = stream->to_target;
+		head.append(method);
+		head.push_back(' ');
+		head.append(path);
+		head.append(" HTTP/1.1\r\n");
+		if(!authority.empty()) append_header(head, "host", authority);
+
+		std::string cookie;
+		std::string forwarded_for;
+		std::string forwarded;
+		bool has_length = false;
+		std::size_t request_length = 0;
+
+		for(const Hpack::Header& header : headers)
+		{
+			if(header.name[0] == ':') continue;
+
+			if(!valid_field(header.name, header.value))
+			{
+				send_rst_stream(stream_id, ErrorCode::protocol_error);
+				return;
+			}
+
+			if(header.name == "host")
+			{
+				if(authority.empty()) append_header(head, header.name, header.value);
+			}
+			else if(header.name == "cookie")
+			{
+				//The client may split the cookies into several fields
+				append_list(cookie, header.value, "; ");
+			}
+			else if(options_.forwarded_headers && header.name == "x-forwarded-for")
+			{
+				append_list(forwarded_for, header.value, ", ");
+			}
+			else if(options_.forwarded_headers && header.name == "forwarded")
+			{
+				append_list(forwarded, header.value, ", ");
+			}
+			else if(!is_connection_header(header.name) && header.name != "te" && !(options_.forwarded_headers && header.name == "x-forwarded-proto"))
+			{
+				if(header.name == "content-length")
+				{
+					//Exactly one content-length, a number which the DATA frames are checked against
+					if(has_length || !HttpHeadParser::parse_length(header.value, request_length))
+					{
+						send_rst_stream(stream_id, ErrorCode::protocol_error);
+						return;
+					}
+					has_length = true;
+				}
+				append_header(head, header.name, header.value);
+			}
+		}
+
+		if(has_length && end_stream && request_length > 0)
+		{
+			send_rst_stream(stream_id, ErrorCode::protocol_error);
+			return;
+		}
+		stream->length_known = has_length;
+		stream->remaining_length = request_length;
+
+		if(!cookie.empty()) append_header(head, "cookie", cookie);
+
+		if(options_.forwarded_headers)
+		{
+			//Proxies before this one are kept, the client address is appended
+			append_list(forwarded_for, forwarded_client_.address(), ", ");
+			append_list(forwarded, forwarded_client_.node() + ";proto=https", ", ");
+			append_header(head, "X-Forwarded-For", forwarded_for);
+			append_header(head, "X-Forwarded-Proto", "https");
+			append_header(head, "Forwarded", forwarded);
+		}
+
+		if(!has_length && !end_stream)
+		{
+			head.append("Transfer-Encoding: chunked\r\n");
+			stream->chunked_request = true;
+		}
+		else if(!has_length && (method == "POST" || method == "PUT" || method == "PATCH"))
+		{
+			head.append("Content-Length: 0\r\n");
+		}
+		head.append("\r\n");
+
+		streams_[stream_id] = stream;
+		connect_target(stream);
+	}
+
+	//Returns false if the DATA frames fell short of the content-length of the request
+	bool end_request(Stream& stream)
+	{
+		stream.request_done = true;
+		if(stream.chunked_request) stream.to_target.append("0\r\n\r\n");
+		return !stream.length_known || stream.remaining_length == 0;
+	}
+
+	void connect_target(const std::shared_ptr<Stream>& stream)
+	{
+		if(backends_) stream->endpoint = stream->backend.choose(*backends_, worker_);
+		else stream->endpoint = target_endpoint_;
+
+		if(upstream_pool_->acquire(stream->endpoint, stream->socket, stream->connected_at))
+		{
+			on_target_connected(stream);
+			return;
+		}
+
+		auto self = shared_from_this();
+		const auto connect_started = std::chrono::steady_clock::now();
+
+		stream->socket.async_connect(stream->endpoint, [this, self, stream, connect_started](const err::error_code& ec)
+		{
+			if(stream->closed) return;
+
+			if(self->options_.metrics)
+			{
+				if(ec) ThreadMetrics::add(self->options_.metrics->backend_connect_failures, 1);
+				else
+				{
+					ThreadMetrics::add(self->options_.metrics->backend_connects, 1);
+					self->options_.metrics->backend_connect_time.record(std::chrono::steady_clock::now() - connect_started);
+				}
+			}
+
+			if(!ec)
+			{
+				if(stream->backend) self->backends_->report_success(*stream->backend);
+				self->options_.target_socket.apply(stream->socket);
+				stream->connected_at = std::chrono::steady_clock::now();
+				self->on_target_connected(stream);
+				return;
+			}
+
+			//std::cerr << "Http2Session: Target connect error: " << ec.message() << std::endl;
+			if(stream->backend)
+			{
+				//Passive health check, then another backend gets a chance
+				self->backends_->report_failure(*stream->backend);
+
+				if(++stream->connect_attempts < max_connect_attempts)
+				{
+					err::error_code close_ec;
+					stream->socket.close(close_ec);
+					self->connect_target(stream);
+					return;
+				}
+			}
+
+			self->fail_stream(stream);
+		});
+	}
+
+	void on_target_connected(const std::shared_ptr<Stream>& stream)
+	{
+		stream->connected = true;
+		write_to_target(stream);
+		start_read_from_target(stream);
+	}
+
+	void write_to_target(const std::shared_ptr<Stream>& stream)
+	{
+		if(stream->closed || !stream->connected || stream->target_writing || stream->to_target.empty()) return;
+
+		auto self = shared_from_this();
+		stream->writing.swap(stream->to_target);
+		stream->to_target.clear();
+		stream->writing_credit = stream->window_credit;
+		stream->window_credit = 0;
+		stream->target_writing = true;
+
+		net::async_write(stream->socket, net::buffer(stream->writing), [this, self, stream](const err::error_code& ec, std::size_t /*written*/)
+		{
+			stream->target_writing = false;
+			stream->writing.clear();
+			if(stream->closed) return;
+
+			if(ec)
+			{
+				self->fail_stream(stream);
+				return;
+			}
+
+			//The client may send as much again
+			const std::size_t credit = stream->writing_credit;
+			stream->writing_credit = 0;
+			self->credit_connection(credit);
+			if(!stream->request_done)
+			{
+				stream->receive_window += static_cast<std::int64_t>(credit);
+				self->send_window_update(stream->id, credit);
+			}
+
+			self->activity_.touch();
+			self->write_to_target(stream);
+			self->finish_if_done(stream);
+			self->flush();
+		});
+	}
+
+	void credit_connection(std::size_t credit)
+	{
+		receive_window_ += static_cast<std::int64_t>(credit);
+		send_window_update(0, credit);
+	}
+
+	void start_read_from_target(const std::shared_ptr<Stream>& stream)
+	{
+		if(stream->closed || stream->target_reading || stream->response_done) return;
+
+		//Backpressure: the client or this stream's window doesn't keep up
+		if(stream->pending_size() >= options_.high_watermark || output_.size() >= options_.high_watermark)
+		{
+			stream->target_read_paused = true;
+			return;
+		}
+
+		auto self = shared_from_this();
+		stream->target_reading = true;
+
+		//Wait until the target sends something before a buffer is taken
+		stream->socket.async_wait(tcp::socket::wait_read, [this, self, stream](const err::error_code& ec)
+		{
+			if(stream->closed)
+			{
+				stream->target_reading = false;
+				return;
+			}
+
+			if(ec)
+			{
+				stream->target_reading = false;
+				self->on_target_read_error(stream, ec);
+				return;
+			}
+
+			self->read_from_target(stream);
+		});
+	}
+
+	void read_from_target(const std::shared_ptr<Stream>& stream)
+	{
+		auto self = shared_from_this();
+		stream->read_buffer = buffer_pool_->acquire(BufferPool::large_buffer);
+
+		stream->socket.async_read_some(net::buffer(stream->read_buffer.data(), stream->read_buffer.capacity()), [this, self, stream](const err::error_code& ec, std::size_t length)
+		{
+			stream->target_reading = false;
+
+			if(stream->closed || ec)
+			{
+				stream->read_buffer.reset();
+				if(!stream->closed) self->on_target_read_error(stream, ec);
+				return;
+			}
+
+			self->activity_.touch();
+			self->activity_.count_target_data();
+			self->process_target_data(stream, length);
+			stream->read_buffer.reset();
+
+			self->pump();
+			self->flush();
+			self->start_read_from_target(stream);
+		});
+	}
+
+	std::size_t response_head_limit() const
+	{
+		return std::min<std::size_t>(options_.max_header_size, HttpHeadParser::max_head_size);
+	}
+
+	//Parses the response head and decodes the body in the read buffer of stream
+	void process_target_data(const std::shared_ptr<Stream>& stream, std::size_t length)
+	{
+		char* data = stream->read_buffer.data();
+		std::size_t pos = 0;
+
+		while(pos < length && !stream->response_done)
+		{
+			if(!stream->head_parsed)
+			{
+				const std::size_t previous = stream->response_head.size();
+				const std::size_t limit = response_head_limit();
+				const std::size_t part = std::min(length - pos, limit > previous ? limit - previous : 0);
+				stream->response_head.append(data + pos, part);
+
+				HttpHeadParser::Result result = stream->parser.parse(stream->response_head.data(), stream->response_head.size());
+				if(result == HttpHeadParser::Result::incomplete && stream->response_head.size() >= limit) result = HttpHeadParser::Result::error;
+
+				if(result == HttpHeadParser::Result::error || (result == HttpHeadParser::Result::complete && stream->parser.status_code() == 101))
+				{
+					//std::cerr << "Http2Session: Invalid or too large response head from target." << std::endl;
+					fail_stream(stream);
+					return;
+				}
+
+				if(result == HttpHeadParser::Result::incomplete)
+				{
+					pos += part;
+					continue;
+				}
+
+				pos += stream->parser.head_length() - previous;
+
+				//Interim responses (e.g. 100 Continue) are dropped, the final response follows
+				if(stream->parser.status_code() >= 200) start_response(*stream);
+				stream->response_head.clear();
+				stream->parser.reset();
+				continue;
+			}
+
+			//The chunked framing is removed, DATA frames have their own
+			std::size_t decoded = 0;
+			const std::size_t used = stream->body.decode(data + pos, length - pos, decoded);
+			stream->pending.append(data + pos, decoded);
+			pos += used;
+
+			if(stream->body.error())
+			{
+				//std::cerr << "Http2Session: Invalid chunked encoding from target." << std::endl;
+				fail_stream(stream);
+				return;
+			}
+			stream->response_done = stream->body.done();
+		}
+
+		//Bytes after the response: the connection is out of step and not reused
+		if(pos < length) stream->reusable = false;
+	}
+
+	//Chooses how the body of the response ends and sends its HEADERS
+	void start_response(Stream& stream)
+	{
+		const HttpHeadParser& parser = stream.parser;
+		const HttpMessageFraming::Method method = stream.head_request ? HttpMessageFraming::Method::head : HttpMessageFraming::Method::other;
+		if(!HttpMessageFraming::start_response(parser, method, stream.body).reusable) stream.reusable = false;
+
+		stream.head_parsed = true;
+		stream.response_done = stream.body.done();
+
+		HttpHeadRewrite rewrite;
+		if(options_.response_head_hooks)
+		{
+			for(const ResponseHeadHook& hook : *options_.response_head_hooks)
+			{
+				hook(parser, rewrite);
+			}
+		}
+
+		//The hooks work on HTTP/1.1 heads, so a rewritten head is parsed again
+		std::string rewritten;
+		HttpHeadParser rewritten_parser;
+		const HttpHeadParser* head = &parser;
+		if(!rewrite.empty())
+		{
+			rewritten = rewrite.apply(parser);
+			if(rewritten_parser.parse(rewritten.data(), rewritten.size()) == HttpHeadParser::Result::complete) head = &rewritten_parser;
+		}
+
+		std::string block;
+		std::string name;
+		std::string value;
+		Hpack::encode_status(block, parser.status_code());
+
+		for(std::size_t i = 0; i < head->header_count(); ++i)
+		{
+			const HttpHeadParser::Header header = head->header(i);
+			if(is_connection_header(header.name) || head->header_contains("Connection", header.name)) continue;
+
+			name.assign(header.name);
+			for(char& c : name) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+
+			//Folded lines are joined, HTTP/2 doesn't allow line breaks in values
+			value.assign(header.value);
+			for(char& c : value) if(c == '\r' || c == '\n') c = ' ';
+			Hpack::encode(block, name, value);
+		}
+
+		send_headers(stream.id, block, stream.response_done);
+		stream.headers_sent = true;
+		stream.end_stream_sent = stream.response_done;
+	}
+
+	void on_target_read_error(const std::shared_ptr<Stream>& stream, const err::error_code& ec)
+	{
+		if(ec == net::error::operation_aborted) return;
+
+		if(stream->head_parsed && stream->body.mode() == HttpBodyFraming::Mode::until_close && (ec == net::error::eof || ec == net::error::connection_reset))
+		{
+			//The end of the connection is the end of the body
+			stream->reusable = false;
+			stream->response_done = true;
+			pump();
+			flush();
+			return;
+		}
+
+		//std::cerr << "Http2Session: Read from target error: " << ec.message() << std::endl;
+		fail_stream(stream);
+	}
+
+	//The target failed: 502 if nothing was sent yet, otherwise the stream is reset
+	void fail_stream(const std::shared_ptr<Stream>& stream)
+	{
+		if(stream->closed) return;
+
+		if(!stream->headers_sent) send_local_response(stream->id, 502, stream->request_done);
+		else send_rst_stream(stream->id, ErrorCode::internal_error);
+
+		close_stream(stream, false);
+		flush();
+	}
+
+	void reset_stream(const std::shared_ptr<Stream>& stream, ErrorCode code)
+	{
+		send_rst_stream(stream->id, code);
+		close_stream(stream, false);
+	}
+
+	//Moves response bodies into DATA frames as far as the flow control windows allow
+	void pump()
+	{
+		for(auto it = streams_.begin(); it != streams_.end() && output_.size() < options_.high_watermark;)
+		{
+			//finish_if_done() may remove the stream
+			const std::shared_ptr<Stream> stream = it->second;
+			++it;
+
+			send_data(*stream);
+			finish_if_done(stream);
+
+			if(!stream->closed && stream->target_read_paused && stream->pending_size() <= options_.low_watermark)
+			{
+				stream->target_read_paused = false;
+				start_read_from_target(stream);
+			}
+		}
+	}
+
+	void send_data(Stream& stream)
+	{
+		while(stream.headers_sent && !stream.end_stream_sent && output_.size() < options_.high_watermark)
+		{
+			const std::size_t available = stream.pending_size();
+			if(available == 0 && !stream.response_done) break;
+
+			std::size_t length = std::min(available, peer_max_frame_size_);
+			if(length > 0)
+			{
+				const std::int64_t window = std::min(send_window_, stream.send_window);
+				if(window <= 0) break;
+				length = std::min(length, static_cast<std::size_t>(window));
+			}
+
+			const bool last = stream.response_done && length == available;
+			write_frame_header(length, FrameType::data, last ? flag_end_stream : 0, stream.id);
+			output_.append(stream.pending, stream.pending_offset, length);
+
+			stream.pending_offset += length;
+			send_window_ -= static_cast<std::int64_t>(length);
+			stream.send_window -= static_cast<std::int64_t>(length);
+			stream.end_stream_sent = last;
+
+			if(stream.pending_offset == stream.pending.size())
+			{
+				stream.pending.clear();
+				stream.pending_offset = 0;
+			}
+			else if(stream.pending_offset > stream.pending.size() / 2)
+			{
+				stream.pending.erase(0, stream.pending_offset);
+				stream.pending_offset = 0;
+			}
+		}
+	}
+
+	//Ends a stream once the client has the complete response
+	void finish_if_done(const std::shared_ptr<Stream>& stream)
+	{
+		if(stream->closed || !stream->end_stream_sent) return;
+
+		if(!stream->request_done)
+		{
+			//The response came before the whole request body, the rest of it isn't needed
+			send_rst_stream(stream->id, ErrorCode::no_error);
+			close_stream(stream, false);
+			return;
+		}
+
+		//The request is still written to the target
+		if(stream->target_writing || !stream->to_target.empty()) return;
+
+		close_stream(stream, stream->reusable);
+	}
+
+	//The target connection goes back to the pool if reuse is set and it is clean
+	void close_stream(const std::shared_ptr<Stream>& stream, bool reuse)
+	{
+		if(stream->closed) return;
+		stream->closed = true;
+
+		stream->backend.release();
+
+		//Request body bytes which never reach the target are given back to the connection window
+		credit_connection(stream->window_credit + stream->writing_credit);
+		stream->window_credit = stream->writing_credit = 0;
+
+		err::error_code ec;
+		if(reuse && stream->connected && !stream->target_reading && !stream->target_writing && stream->socket.is_open())
+		{
+			upstream_pool_->release(stream->endpoint, std::move(stream->socket), stream->connected_at);
+		}
+		else
+		{
+			stream->socket.shutdown(tcp::socket::shutdown_both, ec);
+			stream->socket.close(ec);
+		}
+
+		streams_.erase(stream->id);
+		finish_if_idle();
+	}
+
+	void close_streams()
+	{
+		while(!streams_.empty())
+		{
+			std::shared_ptr<Stream> stream = streams_.begin()->second;
+			stream->closed = true;
+			stream->backend.release();
+
+			err::error_code ec;
+			stream->socket.close(ec);
+			streams_.erase(streams_.begin());
+		}
+	}
+
+	//Sends everything in output_, one write at a time
+	void flush()
+	{
+		if(client_writing_ || output_.empty() || !client_socket_) return;
+
+		auto self = shared_from_this();
+		writing_.swap(output_);
+		output_.clear();
+		client_writing_ = true;
+
+		async_write_to_client(net::buffer(writing_), [this, self](const err::error_code& ec, std::size_t written)
+		{
+			self->client_writing_ = false;
+			if(self->options_.metrics) ThreadMetrics::add(self->options_.metrics->bytes_to_clients, written);
+
+			//An idle connection doesn't keep a large buffer
+			if(self->writing_.capacity() > BufferPool::large_buffer) std::string().swap(self->writing_);
+			else self->writing_.clear();
+
+			if(ec)
+			{
+				self->output_.clear();
+				self->close_connection_now();
+				return;
+			}
+
+			self->activity_.touch();
+			self->pump();
+			self->flush();
+
+			if(self->client_read_paused_ && self->output_.size() < self->options_.high_watermark)
+			{
+				self->client_read_paused_ = false;
+				self->start_read_from_client();
+			}
+
+			self->finish_if_idle();
+		});
+	}
+
+	//A protocol error of the client: GOAWAY, then the connection is closed
+	void connection_error(ErrorCode code)
+	{
+		//std::cerr << "Http2Session: Connection error " << static_cast<std::uint32_t>(code) << std::endl;
+		close_connection(code);
+	}
+
+	//Ends the session after a GOAWAY with code, the running streams are cancelled
+	void close_connection(ErrorCode code)
+	{
+		if(client_read_closed_) return;
+
+		send_goaway(code);
+		closing_ = true;
+		client_read_closed_ = true;
+		input_.clear();
+		close_streams();
+		flush();
+		finish_if_idle();
+	}
+
+	//Without a client connection nothing can be answered anymore
+	void close_connection_now()
+	{
+		client_read_closed_ = true;
+		closing_ = true;
+		close_streams();
+		do_shutdown();
+	}
+
+	//After a GOAWAY the session ends once all streams are done and written
+	void finish_if_idle()
+	{
+		if(closing_ && streams_.empty() && !client_writing_ && output_.empty()) do_shutdown();
+	}
+
+	void do_shutdown()
+	{
+		std::unique_ptr<ssl::stream<tcp::socket>> client_socket_moved = std::move(client_socket_);
+		if(!client_socket_moved) return;
+
+		client_read_closed_ = true;
+
+		//The handler keeps the session alive until the client answered the close_notify
+		auto self = shared_from_this();
+		activity_.shutdown(std::move(client_socket_moved), ktls_, [self] {});
+	}
+
+}; //end class Http2Session
+
+//Counters about the TLS handshakes, see SslProxy::set_handshake_threads
+struct HandshakeStats
+{
+	std::uint64_t handshakes;
+	std::uint64_t failed_handshakes;
+
+	//Running handshakes and accepted connections waiting for their thread
+	std::uint64_t in_progress;
+
+	//Wall time from the start to the end of the completed handshakes,
+	//including the round trips to the client
+	std::uint64_t nanoseconds;
+};
+
+//How late the threads which move the session data run their handlers
+struct DataPlaneStats
+{
+	std::uint64_t samples;
+	std::uint64_t lag_nanoseconds;
+	std::uint64_t max_lag_nanoseconds;
+};
+
+//Measures the latency of an io_context: a timer expires every interval and
+//records how much later than requested its handler runs. A long handshake or
+//any other blocking handler on the thread shows up as lag
+class LoopLagProbe : public std::enable_shared_from_this<LoopLagProbe>
+{
+
+public:
+	LoopLagProbe(net::io_context& io_context, std::chrono::milliseconds interval) :
+		timer_(io_context),
+		interval_(interval),
+		expected_(),
+		samples_(0),
+		lag_nanoseconds_(0),
+		max_lag_nanoseconds_(0)
+	{}
+
+	void start()
+	{
+		expected_ = std::chrono::steady_clock::now() + interval_;
+		timer_.expires_at(expected_);
+
+		std::weak_ptr<LoopLagProbe> weak_self = shared_from_this();
+		timer_.async_wait([weak_self](const err::error_code& ec)
+		{
+			auto self = weak_self.lock();
+			if(!self || ec) return;
+
+			self->record(std::chrono::steady_clock::now() - self->expected_);
+			self->start();
+		});
+	}
+
+	//Only the thread of the probe writes, relaxed atomics are enough
+	void add_to(DataPlaneStats& stats) const
+	{
+		stats.samples += samples_.load(std::memory_order_relaxed);
+		stats.lag_nanoseconds += lag_nanoseconds_.load(std::memory_order_relaxed);
+		stats.max_lag_nanoseconds = std::max(stats.max_lag_nanoseconds, max_lag_nanoseconds_.load(std::memory_order_relaxed));
+	}
+
+private:
+	net::steady_timer timer_;
+	std::chrono::milliseconds interval_;
+	std::chrono::steady_clock::time_point expected_;
+	std::atomic<std::uint64_t> samples_;
+	std::atomic<std::uint64_t> lag_nanoseconds_;
+	std::atomic<std::uint64_t> max_lag_nanoseconds_;
+
+	void record(std::chrono::steady_clock::duration lag)
+	{
+		const std::uint64_t nanoseconds = static_cast<std::uint64_t>(std::max<std::int64_t>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(lag).count()));
+
+		samples_.store(samples_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		lag_nanoseconds_.store(lag_nanoseconds_.load(std::memory_order_relaxed) + nanoseconds, std::memory_order_relaxed);
+		if(nanoseconds > max_lag_nanoseconds_.load(std::memory_order_relaxed)) max_lag_nanoseconds_.store(nanoseconds, std::memory_order_relaxed);
+	}
+
+}; //end class LoopLagProbe
+
+//Why a TLS handshake failed
+enum class HandshakeFailure : std::uint8_t
+{
+	client_closed,
+	plain_http,
+	unsupported_protocol,
+	no_shared_cipher,
+	tls_error,
+	timeout,
+	other,
+	count
+};
+
+inline const char* handshake_failure_name(HandshakeFailure failure)
+{
+	switch(failure)
+	{
+	case HandshakeFailure::client_closed: return "client_closed";
+	case HandshakeFailure::plain_http: return "plain_http";
+	case HandshakeFailure::unsupported_protocol: return "unsupported_protocol";
+	case HandshakeFailure::no_shared_cipher: return "no_shared_cipher";
+	case HandshakeFailure::tls_error: return "tls_error";
+	case HandshakeFailure::timeout: return "timeout";
+	default: return "other";
+	}
+}
+
+inline HandshakeFailure classify_handshake_error(const err::error_code& ec)
+{
+	if(ec == net::error::eof || ec == net::error::connection_reset || ec == ssl::error::stream_truncated) return HandshakeFailure::client_closed;
+	if(ec.category() != net::error::get_ssl_category()) return HandshakeFailure::other;
+
+	switch(ERR_GET_REASON(static_cast<unsigned long>(ec.value())))
+	{
+	case SSL_R_HTTP_REQUEST:
+	case SSL_R_HTTPS_PROXY_REQUEST:
+		return HandshakeFailure::plain_http;
+	case SSL_R_UNSUPPORTED_PROTOCOL:
+	case SSL_R_WRONG_VERSION_NUMBER:
+	case SSL_R_VERSION_TOO_LOW:
+		return HandshakeFailure::unsupported_protocol;
+	case SSL_R_NO_SHARED_CIPHER:
+		return HandshakeFailure::no_shared_cipher;
+	default:
+		return HandshakeFailure::tls_error;
+	}
+}
+
+//Everything SslProxy::get_metrics() reports. Durations are microseconds
+struct ProxyMetrics
+{
+	std::uint64_t accepted_connections = 0;
+	std::uint64_t open_connections = 0;
+	std::uint64_t rejected_by_connection_limit = 0;
+	std::uint64_t rejected_by_address_limit = 0;
+	std::uint64_t rejected_by_handshake_queue = 0;
+	std::uint64_t accept_pauses = 0;
+	std::uint64_t handshakes = 0;
+	std::uint64_t resumed_handshakes = 0;
+	std::array<std::uint64_t, static_cast<std::size_t>(HandshakeFailure::count)> handshake_failures{};
+	std::uint64_t sessions = 0;
+	std::uint64_t active_sessions = 0;
+	std::uint64_t bytes_from_clients = 0;
+	std::uint64_t bytes_to_clients = 0;
+	std::uint64_t backend_connects = 0;
+	std::uint64_t backend_connect_failures = 0;
+	std::uint64_t idle_timeouts = 0;
+	std::uint64_t request_head_timeouts = 0;
+	std::uint64_t shutdown_timeouts = 0;
+	std::uint64_t http2_sessions = 0;
+	std::uint64_t http2_streams = 0;
+	HistogramSnapshot handshake_time{};
+	HistogramSnapshot time_to_first_byte{};
+	HistogramSnapshot session_duration{};
+	HistogramSnapshot backend_connect_time{};
+
+	//Text exposition format of Prometheus, the histograms are summaries with quantiles
+	std::string to_prometheus() const
+	{
+		std::ostringstream out;
+
+		auto counter = [&out](const char* name, const char* help, std::uint64_t value)
+		{
+			out << "# HELP sslproxy_" << name << " " << help << "\n# TYPE sslproxy_" << name << " counter\nsslproxy_" << name << " " << value << "\n";
+		};
+		auto summary = [&out](const char* name, const char* help, const HistogramSnapshot& histogram)
+		{
+			out << "# HELP sslproxy_" << name << "_seconds " << help << "\n# TYPE sslproxy_" << name << "_seconds summary\n";
+			for(double q : { 0.5, 0.9, 0.99, 0.999 })
+			{
+				out << "sslproxy_" << name << "_seconds{quantile=\"" << q << "\"} " << static_cast<double>(histogram.percentile(q)) / 1e6 << "\n";
+			}
+			out << "sslproxy_" << name << "_seconds_sum " << static_cast<double>(histogram.sum) / 1e6 << "\n";
+			out << "sslproxy_" << name << "_seconds_count " << histogram.count << "\n";
+		};
+
+		counter("accepted_connections_total", "Accepted TCP connections", accepted_connections);
+		out << "# HELP sslproxy_open_connections Client connections which are open, handshakes included\n# TYPE sslproxy_open_connections gauge\nsslproxy_open_connections " << open_connections << "\n";
+		out << "# HELP sslproxy_rejected_connections_total Connections closed right after accept by reason\n# TYPE sslproxy_rejected_connections_total counter\n";
+		out << "sslproxy_rejected_connections_total{reason=\"connection_limit\"} " << rejected_by_connection_limit << "\n";
+		out << "sslproxy_rejected_connections_total{reason=\"address_limit\"} " << rejected_by_address_limit << "\n";
+		out << "sslproxy_rejected_connections_total{reason=\"handshake_queue\"} " << rejected_by_handshake_queue << "\n";
+		counter("accept_pauses_total", "Times the accept loop paused at the connection limit or the file descriptor limit", accept_pauses);
+		counter("handshakes_total", "Completed TLS handshakes", handshakes);
+		counter("resumed_handshakes_total", "Completed TLS handshakes which resumed a session", resumed_handshakes);
+
+		out << "# HELP sslproxy_handshake_failures_total Failed TLS handshakes by reason\n# TYPE sslproxy_handshake_failures_total counter\n";
+		for(std::size_t i = 0; i < handshake_failures.size(); ++i)
+		{
+			out << "sslproxy_handshake_failures_total{reason=\"" << handshake_failure_name(static_cast<HandshakeFailure>(i)) << "\"} " << handshake_failures[i] << "\n";
+		}
+
+		counter("sessions_total", "Proxy sessions", sessions);
+		out << "# HELP sslproxy_active_sessions Proxy sessions which are running\n# TYPE sslproxy_active_sessions gauge\nsslproxy_active_sessions " << active_sessions << "\n";
+		counter("client_received_bytes_total", "Bytes received from the clients (decrypted)", bytes_from_clients);
+		counter("client_sent_bytes_total", "Bytes sent to the clients (before encryption)", bytes_to_clients);
+		counter("backend_connects_total", "Connections opened to the targets", backend_connects);
+		counter("backend_connect_failures_total", "Failed connects to the targets", backend_connect_failures);
+
+		out << "# HELP sslproxy_session_timeouts_total Sessions closed by a timeout\n# TYPE sslproxy_session_timeouts_total counter\n";
+		out << "sslproxy_session_timeouts_total{timeout=\"idle\"} " << idle_timeouts << "\n";
+		out << "sslproxy_session_timeouts_total{timeout=\"request_head\"} " << request_head_timeouts << "\n";
+		out << "sslproxy_session_timeouts_total{timeout=\"shutdown\"} " << shutdown_timeouts << "\n";
+		counter("http2_sessions_total", "Sessions which negotiated HTTP/2 (also counted in sessions_total)", http2_sessions);
+		counter("http2_streams_total", "Requests received on HTTP/2 sessions", http2_streams);
+
+		summary("handshake", "TLS handshake time", handshake_time);
+		summary("time_to_first_byte", "Time from the first client byte to the first target byte", time_to_first_byte);
+		summary("session_duration", "Duration of the proxy sessions", session_duration);
+		summary("backend_connect", "Time to connect to a target", backend_connect_time);
+
+		return out.str();
+	}
+};
+
+//Plaintext HTTP endpoint for Prometheus: answers GET /metrics with the
+//output of metrics() and every other path with 404. One request per connection
+class MetricsEndpoint : public std::enable_shared_from_this<MetricsEndpoint>
+{
+
+public:
+	MetricsEndpoint(net::io_context& io_context, const tcp::endpoint& endpoint, std::function<std::string()> metrics) :
+		acceptor_(io_context, endpoint),
+		metrics_(std::move(metrics))
+	{}
+
+	void start()
+	{
+		auto self = shared_from_this();
+		acceptor_.async_accept([this, self](const err::error_code& ec, tcp::socket socket)
+		{
+			if(ec == net::error::operation_aborted) return;
+			if(!ec) serve(std::make_shared<tcp::socket>(std::move(socket)));
+			start();
+		});
+	}
+
+	void stop()
+	{
+		err::error_code ec;
+		acceptor_.close(ec);
+	}
+
+	unsigned short port() const
+	{
+		err::error_code ec;
+		return acceptor_.local_endpoint(ec).port();
+	}
+
+private:
+	tcp::acceptor acceptor_;
+	std::function<std::string()> metrics_;
+
+	void serve(std::shared_ptr<tcp::socket> socket)
+	{
+		auto self = shared_from_this();
+		auto request = std::make_shared<std::string>();
+
+		net::async_read_until(*socket, net::dynamic_buffer(*request, 8192), "\r\n\r\n", [this, self, socket, request](const err::error_code& ec, std::size_t)
+		{
+			if(ec) return;
+
+			const bool found = request->compare(0, 13, "GET /metrics ") == 0 || request->compare(0, 13, "GET /metrics?") == 0;
+			const std::string body = found ? metrics_() : std::string("Not Found\n");
+
+			auto response = std::make_shared<std::string>(std::string(found ? "HTTP/1.1 200 OK\r\n" : "HTTP/1.1 404 Not Found\r\n") +
+				"Content-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.length()) + "\r\nConnection: close\r\n\r\n" + body);
+
+			net::async_write(*socket, net::buffer(*response), [socket, response](const err::error_code&, std::size_t)
+			{
+				err::error_code close_ec;
+				socket->shutdown(tcp::socket::shutdown_both, close_ec);
+				socket->close(close_ec);
+			});
+		});
+	}
+
+}; //end class MetricsEndpoint
+
+//How the plain HTTP listener of an SslProxy answers (see SslProxy::enable_http_redirect)
+struct HttpRedirectSettings
+{
+	//The port of the https URLs, 443 isn't written into them
+	unsigned short https_port = 443;
+
+	//Requests whose path starts with one of these are forwarded to the target instead
+	std::vector<std::string> passthrough_prefixes{ "/.well-known/acme-challenge/" };
+
+	//From accept to the response (or the end of the request head of a passthrough),
+	//and without data in either direction of a passthrough. Zero disables one
+	std::chrono::milliseconds request_head_timeout = std::chrono::seconds(30);
+	std::chrono::milliseconds idle_timeout = std::chrono::seconds(120);
+};
+
+struct HttpRedirectStats
+{
+	std::uint64_t redirects;
+	std::uint64_t passthroughs;
+	std::uint64_t bad_requests;
+};
+
+//Plaintext HTTP listener: every request is answered with a 301 to the same host and
+//path on https, without asking the target. Requests for paths below one of the passthrough
+//prefixes (e.g. the ACME HTTP-01 challenges) are forwarded to the target with their body
+//and Connection: close. Runs on the accepting thread, one request per connection
+class HttpRedirectEndpoint : public std::enable_shared_from_this<HttpRedirectEndpoint>
+{
+
+public:
+	HttpRedirectEndpoint(net::io_context& io_context, const tcp::endpoint& endpoint, HttpRedirectSettings settings, std::shared_ptr<TimingWheel> timing_wheel,
+		std::shared_ptr<ConnectionLimiter> connection_limiter, std::function<std::shared_ptr<BackendGroup>()> backends) :
+		acceptor_(io_context, endpoint),
+		settings_(std::move(settings)),
+		port_suffix_(settings_.https_port == 443 ? std::string() : ":" + std::to_string(settings_.https_port)),
+		timing_wheel_(std::move(timing_wheel)),
+		connection_limiter_(std::move(connection_limiter)),
+		backends_(std::move(backends)),
+		redirects_(0),
+		passthroughs_(0),
+		bad_requests_(0)
+	{}
+
+	HttpRedirectEndpoint(const HttpRedirectEndpoint&) = delete;
+	HttpRedirectEndpoint& operator=(const HttpRedirectEndpoint&) = delete;
+
+	void start()
+	{
+		auto self = shared_from_this();
+		acceptor_.async_accept([this, self](const err::error_code& ec, tcp::socket socket)
+		{
+			if(ec == net::error::operation_aborted) return;
+			if(!ec) serve(std::move(socket));
+			start();
+		});
+	}
+
+	void stop()
+	{
+		err::error_code ec;
+		acceptor_.close(ec);
+	}
+
+	unsigned short port() const
+	{
+		err::error_code ec;
+		return acceptor_.local_endpoint(ec).port();
+	}
+
+	HttpRedirectStats stats() const
+	{
+		return HttpRedirectStats{
+			redirects_.load(std::memory_order_relaxed),
+			passthroughs_.load(std::memory_order_relaxed),
+			bad_requests_.load(std::memory_order_relaxed)
+		};
+	}
+
+	const HttpRedirectSettings& settings() const { return settings_; }
+
+	//":port" for the Location, empty for 443
+	const std::string& port_suffix() const { return port_suffix_; }
+
+	TimingWheel* timing_wheel() const { return timing_wheel_.get(); }
+
+	std::shared_ptr<BackendGroup> backends() const { return backends_(); }
+
+	void count_redirect() { redirects_.fetch_add(1, std::memory_order_relaxed); }
+	void count_passthrough() { passthroughs_.fetch_add(1, std::memory_order_relaxed); }
+	void count_bad_request() { bad_requests_.fetch_add(1, std::memory_order_relaxed); }
+
+private:
+	tcp::acceptor acceptor_;
+	HttpRedirectSettings settings_;
+	std::string port_suffix_;
+	std::shared_ptr<TimingWheel> timing_wheel_;
+	std::shared_ptr<ConnectionLimiter> connection_limiter_;
+	std::function<std::shared_ptr<BackendGroup>()> backends_;
+	std::atomic<std::uint64_t> redirects_;
+	std::atomic<std::uint64_t> passthroughs_;
+	std::atomic<std::uint64_t> bad_requests_;
+
+	//The connections count for the limits of the proxy, above them they are reset
+	void serve(tcp::socket socket);
+
+}; //end class HttpRedirectEndpoint
+
+//One connection of the HttpRedirectEndpoint
+class HttpRedirectSession : public std::enable_shared_from_this<HttpRedirectSession>
+{
+
+public:
+	HttpRedirectSession(std::shared_ptr<HttpRedirectEndpoint> endpoint, tcp::socket socket, std::shared_ptr<ConnectionSlot> slot) :
+		endpoint_(std::move(endpoint)),
+		client_socket_(std::move(socket)),
+		target_socket_(client_socket_.get_executor()),
+		slot_(std::move(slot)),
+		parser_(HttpHeadParser::Kind::request),
+		request_(),
+		received_(0),
+		body_(),
+		forwarded_head_(),
+		response_(),
+		timeout_(endpoint_->timing_wheel(), [this] { close(); })
+	{}
+
+	HttpRedirectSession(const HttpRedirectSession&) = delete;
+	HttpRedirectSession& operator=(const HttpRedirectSession&) = delete;
+
+	void start()
+	{
+		arm(endpoint_->settings().request_head_timeout);
+		read_request();
+	}
+
+private:
+	enum { max_request_size = 8 * 1024, relay_buffer_size = 16 * 1024 };
+
+	//The response is written from these and the Host and path of the request, nothing is built per request
+	static constexpr std::string_view redirect_head = "HTTP/1.1 301 Moved Permanently\r\nLocation: https://";
+	static constexpr std::string_view redirect_tail = "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+	std::shared_ptr<HttpRedirectEndpoint> endpoint_;
+	tcp::socket client_socket_;
+	tcp::socket target_socket_;
+	std::shared_ptr<ConnectionSlot> slot_;
+	HttpHeadParser parser_;
+	std::array<char, max_request_size> request_;
+	std::size_t received_;
+	HttpBodyFraming body_;
+	std::string forwarded_head_;
+	std::vector<char> response_;
+	TimingWheel::Entry timeout_;
+
+	void arm(std::chrono::milliseconds timeout)
+	{
+		if(timeout.count() != 0) timeout_.arm(timeout);
+	}
+
+	void read_request()
+	{
+		auto self = shared_from_this();
+		client_socket_.async_read_some(net::buffer(request_.data() + received_, request_.size() - received_), [this, self](const err::error_code& ec, std::size_t length)
+		{
+			if(ec)
+			{
+				close();
+				return;
+			}
+
+			received_ += length;
+			const HttpHeadParser::Result result = parser_.parse(request_.data(), received_);
+			if(result == HttpHeadParser::Result::complete) handle_request();
+			else if(result == HttpHeadParser::Result::incomplete && received_ < request_.size()) read_request();
+			else reject();
+		});
+	}
+
+	void handle_request()
+	{
+		const std::string_view target = parser_.target();
+		if(target.empty() || target[0] != '/' || !printable(target))
+		{
+			reject();
+			return;
+		}
+
+		for(const auto& prefix : endpoint_->settings().passthrough_prefixes)
+		{
+			if(target.substr(0, prefix.length()) != prefix) continue;
+
+			//Only this request reaches the target (see passthrough), so its path is all that needs
+			//checking: nothing outside the prefix, e.g. no /.well-known/acme-challenge/../admin
+			if(target.find("..") != std::string_view::npos || target.find('%') != std::string_view::npos) reject();
+			else passthrough();
+			return;
+		}
+
+		std::string_view host;
+		if(!parser_.find("Host", host) || !valid_host(host))
+		{
+			reject();
+			return;
+		}
+
+		//The port of the plain listener is replaced by the https port
+		const std::size_t port_start = host.rfind(':');
+		if(port_start != std::string_view::npos && host.find(']', port_start) == std::string_view::npos) host = host.substr(0, port_start);
+
+		endpoint_->count_redirect();
+
+		const std::array<net::const_buffer, 5> response = {
+			net::buffer(redirect_head.data(), redirect_head.size()),
+			net::buffer(host.data(), host.size()),
+			net::buffer(endpoint_->port_suffix()),
+			net::buffer(target.data(), target.size()),
+			net::buffer(redirect_tail.data(), redirect_tail.size())
+		};
+
+		auto self = shared_from_this();
+		net::async_write(client_socket_, response, [this, self](const err::error_code& ec, std::size_t)
+		{
+			if(ec) close();
+			else linger();
+		});
+	}
+
+	void reject()
+	{
+		endpoint_->count_bad_request();
+		respond(HttpMessageFraming::error_response(400));
+	}
+
+	void respond(std::string_view response)
+	{
+		auto self = shared_from_this();
+		net::async_write(client_socket_, net::buffer(response.data(), response.size()), [this, self](const err::error_code& ec, std::size_t)
+		{
+			if(ec) close();
+			else linger();
+		});
+	}
+
+	//The client gets the FIN after the response, the socket is closed when the client
+	//closes too (or at the timeout). Closing with unread data would send a reset,
+	//which may destroy the response before the client read it
+	void linger()
+	{
+		err::error_code ec;
+		client_socket_.shutdown(tcp::socket::shutdown_send, ec);
+		discard();
+	}
+
+	void discard()
+	{
+		auto self = shared_from_this();
+		client_socket_.async_read_some(net::buffer(request_), [this, self](const err::error_code& ec, std::size_t)
+		{
+			if(ec) close();
+			else discard();
+		});
+	}
+
+	//Forwards the request and its body, but nothing the client sent after it: a pipelined
+	//request must not reach the target without the prefix check. Connection: close makes
+	//the target end the connection after its response, which is relayed to the client
+	void passthrough()
+	{
+		const HttpMessageFraming::Decision decision = HttpMessageFraming::start_request(parser_, body_);
+		if(decision.invalid || decision.tunnel)
+		{
+			reject();
+			return;
+		}
+
+		endpoint_->count_passthrough();
+
+		HttpHeadRewrite rewrite;
+		rewrite.remove_header("Upgrade");
+		rewrite.remove_header("Keep-Alive");
+		rewrite.set_header("Connection", "close");
+		forwarded_head_ = rewrite.apply(parser_);
+
+		std::shared_ptr<BackendGroup> backends = endpoint_->backends();
+		std::shared_ptr<Backend> backend = backends->select(0);
+
+		timeout_.cancel();
+		arm(endpoint_->settings().idle_timeout);
+
+		auto self = shared_from_this();
+		target_socket_.async_connect(backend->endpoint, [this, self, backends, backend](const err::error_code& ec)
+		{
+			if(ec == net::error::operation_aborted) return;
+			if(ec)
+			{
+				backends->report_failure(*backend);
+				respond(HttpMessageFraming::error_response(502));
+				return;
+			}
+			backends->report_success(*backend);
+
+			err::error_code option_ec;
+			target_socket_.set_option(tcp::no_delay(true), option_ec);
+
+			//The part of the body which came with the head goes along, the rest is dropped
+			char* body_start = request_.data() + parser_.head_length();
+			const std::size_t body_length = body_.consume(body_start, received_ - parser_.head_length());
+			if(body_.error())
+			{
+				close();
+				return;
+			}
+
+			const std::array<net::const_buffer, 2> request = {
+				net::buffer(forwarded_head_),
+				net::buffer(body_start, body_length)
+			};
+			net::async_write(target_socket_, request, [this, self](const err::error_code& write_ec, std::size_t)
+			{
+				if(write_ec) close();
+				else if(!body_.done()) forward_body();
+			});
+
+			response_.resize(relay_buffer_size);
+			relay_response();
+		});
+	}
+
+	//Copies the rest of the request body to the target, up to where it ends
+	void forward_body()
+	{
+		auto self = shared_from_this();
+		client_socket_.async_read_some(net::buffer(request_), [this, self](const err::error_code& ec, std::size_t length)
+		{
+			if(ec)
+			{
+				close();
+				return;
+			}
+
+			arm(endpoint_->settings().idle_timeout);
+			const std::size_t used = body_.consume(request_.data(), length);
+			if(body_.error())
+			{
+				close();
+				return;
+			}
+
+			net::async_write(target_socket_, net::buffer(request_.data(), used), [this, self](const err::error_code& write_ec, std::size_t)
+			{
+				if(write_ec) close();
+				else if(!body_.done()) forward_body();
+			});
+		});
+	}
+
+	//Copies the response to the client until the target closes
+	void relay_response()
+	{
+		auto self = shared_from_this();
+		target_socket_.async_read_some(net::buffer(response_), [this, self](const err::error_code& ec, std::size_t length)
+		{
+			if(ec)
+			{
+				//If the target answered before the whole body arrived, the client is still
+				//sending it, lingering would only discard it. The connection is closed then
+				if(ec == net::error::eof && body_.done()) linger();
+				else close();
+				return;
+			}
+
+			arm(endpoint_->settings().idle_timeout);
+			net::async_write(client_socket_, net::buffer(response_.data(), length), [this, self](const err::error_code& write_ec, std::size_t)
+			{
+				if(write_ec) close();
+				else relay_response();
+			});
+		});
+	}
+
+	void close()
+	{
+		timeout_.cancel();
+
+		err::error_code ec;
+		client_socket_.close(ec);
+		target_socket_.close(ec);
+	}
+
+	static bool printable(std::string_view text)
+	{
+		return std::all_of(text.begin(), text.end(), [](char c) { return static_cast<unsigned char>(c) > 0x20 && c != 0x7f; });
+	}
+
+	//A name, an IPv4 address or an [IPv6] address, each with an optional port. Nothing else
+	//ends up in the Location header
+	static bool valid_host(std::string_view host)
+	{
+		if(host.empty() || host.length() > 255) return false;
+		return std::all_of(host.begin(), host.end(), [](char c)
+		{
+			return std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '.' || c == '_' || c == ':' || c == '[' || c == ']';
+		});
+	}
+
+}; //end class HttpRedirectSession
+
+inline void HttpRedirectEndpoint::serve(tcp::socket socket)
+{
+	net::ip::address address;
+	err::error_code ec;
+	if(connection_limiter_->limits_addresses()) address = unmap_address(socket.remote_endpoint(ec).address());
+
+	std::shared_ptr<ConnectionSlot> slot = ec ? nullptr : connection_limiter_->acquire(address);
+	if(!slot)
+	{
+		socket.set_option(tcp::socket::linger(true, 0), ec);
+		socket.close(ec);
+		return;
+	}
+
+	std::make_shared<HttpRedirectSession>(shared_from_this(), std::move(socket), std::move(slot))->start();
+}
+
+//The listening socket of an SslProxy (see SslProxy::set_listener_options)
+struct ListenerOptions
+{
+	//Connections the kernel keeps ready for accept, e.g. during a burst or while accepting pauses
+	int backlog = net::socket_base::max_listen_connections;
+
+	//SO_REUSEPORT: several processes can listen on the same port, the kernel spreads the connections
+	bool reuse_port = false;
+
+	//TCP_DEFER_ACCEPT (Linux): a connection is only handed to accept once its first data
+	//(the ClientHello) arrived, the kernel drops it if nothing comes in this time.
+	//Clients which never send anything then don't cost an accept, a session and a timeout. Zero disables it
+	std::chrono::seconds defer_accept = std::chrono::seconds(0);
+
+	//Connections taken from the backlog per wakeup of the accept loop, the ones after the
+	//first with a non-blocking accept instead of another round through the reactor
+	std::size_t accept_batch = 16;
+};
+
+//What a new connection of an SslProxy is set up with. SslProxy::apply_config
+//publishes a new snapshot atomically, a snapshot itself is never changed.
+//Connections keep the snapshot they were accepted with until they close
+struct ProxyConfig
+{
+	std::shared_ptr<ssl::context> context{};
+	std::shared_ptr<const SniRouter> router{};
+	std::shared_ptr<BackendGroup> backends{};
+	SessionOptions options{};
+
+	//One pool of idle target connections per thread, nullptr without set_upstream_pool
+	std::vector<std::shared_ptr<UpstreamPool>> upstream_pools{};
+};
+
+class SslProxy
+{
+
+public:
+	SslProxy(unsigned short source_port, const std::string& target_host, unsigned short target_port, const std::string& cert_file, const std::string& key_file, const std::string &key_password="") :
+		io_context_ptr_(std::make_unique<net::io_context>()),
+		io_context_(*io_context_ptr_),
+		worker_contexts_(),
+		worker_guards_(),
+		worker_threads_(),
+		next_worker_(0),
+		upstream_pools_(1),
+		buffer_pools_(1),
+		request_head_counters_(1, std::make_shared<RequestHeadCounters>()),
+		thread_metrics_(1, std::make_shared<ThreadMetrics>()),
+		timing_wheels_(1, std::make_shared<TimingWheel>(io_context_)),
+		session_pools_(1, std::make_shared<SessionPool>()),
+		session_options_(),
+		session_cache_(),
+		session_ticket_keys_(),
+		sni_router_(),
+		handshake_time_(),
+		metrics_endpoint_(),
+		http_redirect_(),
+		handshake_context_(),
+		handshake_guard_(),
+		latency_probes_(),
+		connection_limiter_(std::make_shared<ConnectionLimiter>()),
+		accept_retry_timer_(io_context_),
+		accept_pause_guard_(),
+		ssl_context_(std::make_shared<ssl::context>(ssl::context::sslv23_server)),
+		listeners_(),
+		target_endpoint_(),
+		backends_(),
+		backend_settings_(),
+		config_(),
+		proxy_thread_(),
+		reload_context_(),
+		reload_signals_(),
+		reload_thread_(),
+		certificate_file(cert_file),
+		private_key_file(key_file),
+		private_key_password(key_password)
+#ifdef SSLPROXY_HAS_IO_URING
+		, io_urings_(1)
+#endif
+	{
+		add_listener(tcp::endpoint(tcp::v4(), source_port));
+
+		try
+		{
+			//All addresses of the target are used, see set_load_balancing
+			backends_ = BackendGroup::resolve(io_context_, { { target_host, target_port } });
+			target_endpoint_ = backends_->backends()->front()->endpoint;
+
+			std::cout << "Proxy configured: SSL Port " << source_port
+				<< " -> Target " << target_host << " ("
+				<< target_endpoint_.address().to_string() << ":" << target_port << ")" << std::endl;
+
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << "FATAL: Could not resolve target host '" << target_host << "': " << e.what() << std::endl;
+			throw;
+		}
+
+		load_certificates();
+		configure_context(*ssl_context_);
+
+		connection_limiter_->set_on_available([this]
+		{
+			net::post(io_context_, [this] { resume_accept(); });
+		});
+	}
+
+	~SslProxy()
+	{
+		stop_reload_thread();
+		stop();
+		join_thread();
+
+		//Sessions which are destroyed with their io_context must not post anymore
+		connection_limiter_->set_on_available(nullptr);
+
+#ifdef SSLPROXY_HAS_IO_URING
+		//The pending operations of the rings hold sessions, they are
+		//destroyed here while everything the sessions use still exists
+		for(auto &ring : io_urings_)
+		{
+			if(ring) ring->shutdown();
+		}
+#endif
+	}
+
+	void start()
+	{
+		//std::cout << "SSL Proxy listening on " << listeners_.size() << " addresses..." << std::endl;
+		apply_config();
+		start_latency_probes();
+		accept_all();
+	}
+
+	void restart_context()
+	{
+		io_context_.restart();
+		for(auto &worker_context : worker_contexts_)
+		{
+			worker_context->restart();
+		}
+		if(handshake_context_) handshake_context_->restart();
+		//std::cout << "DEBUG: [Proxy] io_context restarted." << std::endl;
+		accept_paused_ = false;
+		accept_pause_guard_.reset();
+		accept_all();
+	}
+
+	//Sets the number of threads which handle the proxy sessions.
+	//The accepting io_context is always one of them, every additional
+	//thread gets its own io_context. Accepted connections are handed out
+	//round-robin and stay on their io_context for their whole lifetime,
+	//so sessions don't need any strands or locks.
+	//A thread_count of 0 uses one thread per hardware core.
+	//This needs to be called before run_block() or start_thread()
+	void set_thread_count(std::size_t thread_count)
+	{
+		if(thread_count == 0)
+		{
+			thread_count = std::max(1u, std::thread::hardware_concurrency());
+		}
+
+		upstream_pools_.clear();
+		worker_guards_.clear();
+		worker_contexts_.clear();
+		next_worker_ = 0;
+
+		for(std::size_t i = 1; i < thread_count; ++i)
+		{
+			worker_contexts_.push_back(std::make_unique<net::io_context>(1));
+			worker_guards_.push_back(net::make_work_guard(*worker_contexts_.back()));
+		}
+
+		upstream_pools_.resize(thread_count);
+		create_upstream_pools();
+		buffer_pools_.resize(thread_count);
+
+		//Created here, because get_request_head_stats() reads them from any thread
+		request_head_counters_.clear();
+		thread_metrics_.clear();
+		timing_wheels_.clear();
+		session_pools_.clear();
+		for(std::size_t i = 0; i < thread_count; ++i)
+		{
+			request_head_counters_.push_back(std::make_shared<RequestHeadCounters>());
+			thread_metrics_.push_back(std::make_shared<ThreadMetrics>());
+			timing_wheels_.push_back(std::make_shared<TimingWheel>(context_at(i)));
+			session_pools_.push_back(std::make_shared<SessionPool>());
+		}
+
+#ifdef SSLPROXY_HAS_IO_URING
+		create_io_urings();
+#endif
+	}
+
+	//Runs the TLS handshakes on a separate pool of thread_count threads. The sockets stay
+	//on their session thread, only the handshake steps (the expensive private key
+	//operations) run on the pool. The established connection is handed back to
+	//the session thread, so handshake storms don't delay the data of running sessions.
+	//0 (the default) does the handshakes on the session threads.
+	//This needs to be called before run_block() or start_thread()
+	void set_handshake_threads(std::size_t thread_count)
+	{
+		handshake_thread_count_ = thread_count;
+		handshake_guard_.reset();
+		handshake_context_.reset();
+
+		if(thread_count == 0) return;
+
+		handshake_context_ = std::make_unique<net::io_context>(static_cast<int>(thread_count));
+		handshake_guard_ = std::make_unique<net::executor_work_guard<net::io_context::executor_type>>(net::make_work_guard(*handshake_context_));
+	}
+
+	//Limits the open client connections, handshakes included. 0 (the default) means unlimited.
+	//At the limit the accept loop pauses: new connections wait in the listen backlog
+	//of the kernel until a connection ends, instead of costing a TLS handshake.
+	//Can be called while running, open connections are never closed by it
+	void set_max_connections(std::size_t max_connections)
+	{
+		connection_limiter_->set_max_connections(max_connections);
+
+		//A higher limit ends a pause
+		net::post(io_context_, [this] { resume_accept(); });
+	}
+
+	//Opens the listening sockets again with these options (backlog, SO_REUSEPORT,
+	//TCP_DEFER_ACCEPT, accepts per wakeup), listeners added later get them too.
+	//Needs to be called before start(). Throws if a port can't be bound again, like the constructor
+	void set_listener_options(const ListenerOptions& options)
+	{
+		listener_options_ = options;
+		listener_options_.accept_batch = std::max<std::size_t>(options.accept_batch, 1);
+		for(auto &listener : listeners_)
+		{
+			open_listener(*listener, listener_options_);
+		}
+	}
+
+	//Listens on another address, e.g. a second port or IPv6. All listeners share the
+	//certificates, routes, targets, threads and connection limits of the proxy.
+	//An IPv6 listener also accepts IPv4 clients (dual-stack) unless v6_only is set, so
+	//tcp::endpoint(tcp::v6(), 443) after clear_listeners() serves both on port 443.
+	//Needs to be called before start(). Throws if the address can't be bound, like the constructor
+	void add_listener(const tcp::endpoint& endpoint, bool v6_only = false)
+	{
+		auto listener = std::make_unique<Listener>(io_context_, endpoint, v6_only);
+		open_listener(*listener, listener_options_);
+		listeners_.push_back(std::move(listener));
+	}
+
+	//The same with an address like "::", "0.0.0.0" or "192.168.1.10"
+	void add_listener(const std::string& address, unsigned short port, bool v6_only = false)
+	{
+		add_listener(tcp::endpoint(net::ip::make_address(address), port), v6_only);
+	}
+
+	//Closes all listeners, the one of the constructor included, so it can be replaced
+	//(e.g. by a dual-stack or a specific address on the same port). Needs to be called before start()
+	void clear_listeners()
+	{
+		listeners_.clear();
+	}
+
+	//The addresses the proxy listens on, with the port the system chose if it was 0
+	std::vector<tcp::endpoint> get_listen_endpoints() const
+	{
+		std::vector<tcp::endpoint> endpoints;
+		for(const auto &listener : listeners_)
+		{
+			endpoints.push_back(listener->endpoint);
+		}
+		return endpoints;
+	}
+
+	//The socket options of the client connections and of the target connections
+	//(TCP_NODELAY, keepalive, buffer sizes). By default both only set TCP_NODELAY.
+	//After start() it takes effect for new connections with apply_config()
+	void set_socket_options(const SocketOptions& client, const SocketOptions& target)
+	{
+		session_options_.client_socket = client;
+		session_options_.target_socket = target;
+	}
+
+	void set_socket_options(const SocketOptions& options)
+	{
+		set_socket_options(options, options);
+	}
+
+	//Closes the connections of a client address above max_connections right after
+	//accept, so a single client can't take all connections. 0 (the default) means unlimited
+	void set_max_connections_per_address(std::size_t max_connections)
+	{
+		connection_limiter_->set_max_per_address(max_connections);
+	}
+
+	//Closes new connections right after accept while max_pending TLS handshakes are
+	//running or waiting for their thread. 0 (the default) means unlimited.
+	//A handshake flood then costs an accept and a reset instead of a private key operation
+	void set_max_pending_handshakes(std::size_t max_pending)
+	{
+		max_pending_handshakes_.store(max_pending, std::memory_order_relaxed);
+	}
+
+	//Measures the handler latency of every session thread every interval,
+	//see get_data_plane_stats(). This needs to be called before start()
+	void set_latency_probe(std::chrono::milliseconds interval)
+	{
+		latency_probe_interval_ = interval;
+	}
+
+	//Enables reuse of keep-alive connections to the target.
+	//Each thread keeps at most max_idle idle connections, a connection is
+	//not reused anymore if it is older than max_age.
+	//If health_check is set, every idle connection is checked for EOF before it is reused.
+	//A max_idle of 0 disables the pool
+	void set_upstream_pool(std::size_t max_idle, std::chrono::seconds max_age = std::chrono::seconds(60), bool health_check = true)
+	{
+		upstream_max_idle_ = max_idle;
+		upstream_max_age_ = max_age;
+		upstream_health_check_ = health_check;
+		create_upstream_pools();
+	}
+
+	std::size_t get_thread_count() const
+	{
+		return worker_contexts_.size() + 1;
+	}
+
+	//Enables the session cache for session id based resumption.
+	//At most max_sessions are kept, the least recently used one is evicted first.
+	//Calling it again changes the limits of the same cache: every SSL context of the
+	//proxy (see reload_certificates) refers to it, so it lives as long as the proxy
+	void enable_session_cache(std::size_t max_sessions, std::chrono::seconds timeout = std::chrono::seconds(300))
+	{
+		if(session_cache_) session_cache_->configure(max_sessions, timeout);
+		else session_cache_ = std::make_unique<TlsSessionCache>(max_sessions, timeout);
+		session_cache_->attach(ssl_context_->native_handle());
+	}
+
+	//Loads the keys for stateless session tickets (see TlsTicketKeys for the format).
+	//key_length is 48 (AES-128) or 80 (AES-256), 0 finds it from the file size if that is unambiguous.
+	//Calling it again with an updated file rotates the keys.
+	//Without a key file OpenSSL uses a random key per process
+	void load_session_ticket_keys(const std::string& key_file, std::size_t key_length = 0)
+	{
+		session_ticket_keys_.load(key_file, key_length);
+		session_ticket_keys_.attach(ssl_context_->native_handle());
+	}
+
+	//Session tickets are enabled by default
+	void set_session_tickets(bool enabled)
+	{
+		session_tickets_ = enabled;
+		if(enabled) SSL_CTX_clear_options(ssl_context_->native_handle(), SSL_OP_NO_TICKET);
+		else SSL_CTX_set_options(ssl_context_->native_handle(), SSL_OP_NO_TICKET);
+	}
+
+	//Sets the backpressure limits of the session pipelines (see SessionOptions)
+	void set_pipeline_watermarks(std::size_t low_watermark, std::size_t high_watermark)
+	{
+		session_options_.low_watermark = std::min(low_watermark, high_watermark);
+		session_options_.high_watermark = high_watermark;
+	}
+
+	//Response heads larger than this are answered with 502 Bad Gateway (at most 64 KB)
+	void set_max_header_size(std::size_t max_header_size)
+	{
+		session_options_.max_header_size = std::min<std::size_t>(max_header_size, HttpHeadParser::max_head_size);
+	}
+
+	//Adds a hook which can rewrite the response heads from the target.
+	//The hooks are called in the order they were added, the first one rewrites
+	//http:// redirects to https://. After start() it takes effect with apply_config()
+	void add_response_head_hook(ResponseHeadHook hook)
+	{
+		auto hooks = std::make_shared<std::vector<ResponseHeadHook>>(*session_options_.response_head_hooks);
+		hooks->push_back(std::move(hook));
+		session_options_.response_head_hooks = std::move(hooks);
+	}
+
+	//From accept to the end of the TLS handshake (10 seconds by default), zero disables it
+	void set_handshake_timeout(std::chrono::milliseconds timeout)
+	{
+		handshake_timeout_ = timeout;
+	}
+
+	//The timeouts of the sessions (see SessionOptions), zero disables one. By default
+	//idle is 120 seconds, request_head 30 seconds and shutdown 5 seconds.
+	//All timeouts run on one timing wheel per thread, not one timer per connection.
+	//After start() it takes effect for new connections with apply_config()
+	void set_timeouts(std::chrono::milliseconds idle, std::chrono::milliseconds request_head, std::chrono::milliseconds shutdown)
+	{
+		session_options_.idle_timeout = idle;
+		session_options_.request_head_timeout = request_head;
+		session_options_.shutdown_timeout = shutdown;
+	}
+
+	//Adds X-Forwarded-For, X-Forwarded-Proto: https and Forwarded to every request,
+	//so the target knows the client address. Requests which can't be parsed are
+	//answered with 400 (or 431 if the head is larger than max_header_size)
+	void set_forwarded_headers(bool enabled)
+	{
+		session_options_.forwarded_headers = enabled;
+	}
+
+	//What the forwarded headers cost: the number of rewritten request heads,
+	//their size before and after and the time spent parsing and rewriting them
+	RequestHeadStats get_request_head_stats() const
+	{
+		RequestHeadStats stats{};
+		for(const auto& counters : request_head_counters_)
+		{
+			stats.requests += counters->requests.load(std::memory_order_relaxed);
+			stats.head_bytes_in += counters->head_bytes_in.load(std::memory_order_relaxed);
+			stats.head_bytes_out += counters->head_bytes_out.load(std::memory_order_relaxed);
+			stats.nanoseconds += counters->nanoseconds.load(std::memory_order_relaxed);
+		}
+		return stats;
+	}
+
+	//Sends a PROXY protocol v2 header with the client address, SNI, ALPN, TLS version
+	//and cipher to the target when a session connects. The sessions are then plain
+	//tunnels: set_forwarded_headers, the response head hooks and the upstream pool don't apply
+	void set_proxy_protocol(bool enabled)
+	{
+		session_options_.proxy_protocol = enabled;
+		configure_alpn_everywhere();
+	}
+
+	//Offers HTTP/2 with ALPN. The streams of an HTTP/2 connection are forwarded as
+	//HTTP/1.1 requests on pooled target connections, see Http2Session. max_concurrent_streams
+	//limits the requests a connection may have open at the same time.
+	//Not with set_proxy_protocol, those sessions stay tunnels of HTTP/1.1
+	void set_http2(bool enabled, std::uint32_t max_concurrent_streams = 100)
+	{
+		http2_enabled_ = enabled;
+		session_options_.http2_max_concurrent_streams = std::max<std::uint32_t>(max_concurrent_streams, 1);
+		configure_alpn_everywhere();
+	}
+
+	//Moves the socket I/O of the sessions to io_uring (Linux 5.19 or newer). Every thread gets
+	//a ring with entries submission entries (see IoUring): the reads and writes of all its
+	//sessions are submitted together with one io_uring_enter() per round, reads go into
+	//registered buffers of the buffer pool and the listener uses a multishot accept.
+	//Only the plaintext sockets go through the ring, the target connections and, with
+	//set_ktls, the client connections. TLS records of the clients stay with OpenSSL and
+	//the asio reactor, as do the HTTP/2 and coroutine sessions.
+	//Returns false if io_uring isn't available, the sessions then stay on the asio reactor.
+	//This needs to be called before start()
+	bool set_io_uring(bool enabled, unsigned entries = 256)
+	{
+#ifdef SSLPROXY_HAS_IO_URING
+		io_uring_enabled_ = enabled;
+		io_uring_entries_ = std::max(entries, 8u);
+		if(create_io_urings()) return true;
+
+		io_uring_enabled_ = false;
+		create_io_urings();
+		return false;
+#else
+		(void)enabled;
+		(void)entries;
+		return false;
+#endif
+	}
+
+	//Counters of the rings of all threads, all zero without set_io_uring()
+	IoUringStats get_io_uring_stats() const
+	{
+		IoUringStats stats{};
+#ifdef SSLPROXY_HAS_IO_URING
+		for(const auto& ring : io_urings_)
+		{
+			if(!ring) continue;
+
+			const IoUringStats ring_stats = ring->stats();
+			stats.submissions += ring_stats.submissions;
+			stats.enters += ring_stats.enters;
+			stats.submit_failures += ring_stats.submit_failures;
+			stats.completions += ring_stats.completions;
+			stats.fixed_reads += ring_stats.fixed_reads;
+			stats.registered_slabs += ring_stats.registered_slabs;
+		}
+#endif
+		return stats;
+	}
+
+	//Removes all response head hooks including the default Location rewrite
+	void clear_response_head_hooks()
+	{
+		session_options_.response_head_hooks = std::make_shared<const std::vector<ResponseHeadHook>>();
+	}
+
+	//Enables kernel TLS offload: after the handshake the traffic keys are handed
+	//to the kernel and response bodies are forwarded with splice().
+	//If the kernel or the negotiated cipher doesn't support it, the
+	//connection silently stays on the normal path.
+	//Returns false if kTLS isn't available on this platform
+	bool set_ktls(bool enabled)
+	{
+#ifdef SSLPROXY_HAS_KTLS
+		ktls_enabled_ = enabled;
+		configure_ktls(ssl_context_->native_handle());
+
+		//The keys are logged by the context the SNI callback switched to
+		sni_router_.for_each_route([this](SniRoute& route)
+		{
+			configure_ktls(route.context->native_handle());
+		});
+		return true;
+#else
+		(void)enabled;
+		return false;
+#endif
+	}
+
+	//Adds a virtual host: connections whose SNI host name matches one of host_names get
+	//the certificate from cert_file and are forwarded to one of the targets (round-robin).
+	//A name can be a wildcard for one label, e.g. *.example.com; exact names win.
+	//Connections without a matching name use the certificate and target of the constructor.
+	//The targets are load balanced like the default targets (see set_load_balancing).
+	//After start() it takes effect with apply_config()
+	void add_route(const std::vector<std::string>& host_names, const std::string& cert_file, const std::string& key_file, const std::vector<BackendGroup::Target>& targets, const std::string& key_password = "")
+	{
+		auto context = std::make_shared<ssl::context>(ssl::context::sslv23_server);
+		std::shared_ptr<BackendGroup> backends;
+
+		try
+		{
+			context->set_password_callback([key_password](std::size_t, ssl::context_base::password_purpose)
+			{
+				return key_password;
+			});
+			context->use_certificate_chain_file(cert_file);
+			context->use_private_key_file(key_file, ssl::context::pem);
+
+			backends = BackendGroup::resolve(io_context_, targets);
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << "FATAL: Could not add route for '" << (host_names.empty() ? std::string() : host_names.front()) << "': " << e.what() << std::endl;
+			throw;
+		}
+
+		configure_context(*context);
+		configure_alpn(context->native_handle());
+#ifdef SSLPROXY_HAS_KTLS
+		configure_ktls(context->native_handle());
+#endif
+
+		auto route = std::make_shared<SniRoute>(SniRoute{ std::move(context), std::move(backends) });
+		for(const std::string& host_name : host_names)
+		{
+			sni_router_.add(host_name, route);
+		}
+
+		SniRouter::attach(ssl_context_->native_handle());
+	}
+
+	void add_route(const std::string& host_name, const std::string& cert_file, const std::string& key_file, const std::string& target_host, unsigned short target_port, const std::string& key_password = "")
+	{
+		add_route(std::vector<std::string>{ host_name }, cert_file, key_file, { { target_host, target_port } }, key_password);
+	}
+
+	//Removes all routes added with add_route, e.g. to add the new ones on a reload
+	void clear_routes()
+	{
+		sni_router_ = SniRouter();
+	}
+
+	//Loads a new certificate for the connections without a matching route. The new
+	//context is built on the calling thread, after start() it takes effect with apply_config()
+	void reload_certificates(const std::string& cert_file, const std::string& key_file, const std::string& key_password = "")
+	{
+		auto context = std::make_shared<ssl::context>(ssl::context::sslv23_server);
+
+		try
+		{
+			context->set_password_callback([key_password](std::size_t, ssl::context_base::password_purpose)
+			{
+				return key_password;
+			});
+			context->use_certificate_chain_file(cert_file);
+			context->use_private_key_file(key_file, ssl::context::pem);
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << "Could not reload certificate '" << cert_file << "': " << e.what() << std::endl;
+			throw;
+		}
+
+		//Everything the setters did to the previous context
+		configure_context(*context);
+		if(session_cache_) session_cache_->attach(context->native_handle());
+		if(session_ticket_keys_.size() > 0) session_ticket_keys_.attach(context->native_handle());
+		if(!session_tickets_) SSL_CTX_set_options(context->native_handle(), SSL_OP_NO_TICKET);
+		configure_alpn(context->native_handle());
+#ifdef SSLPROXY_HAS_KTLS
+		configure_ktls(context->native_handle());
+#endif
+		if(!sni_router_.empty()) SniRouter::attach(context->native_handle());
+
+		ssl_context_ = std::move(context);
+	}
+
+#ifndef _WIN32
+	//Reloads the certificate on signal_number (e.g. SIGHUP after it was renewed) and applies it.
+	//Running connections are not dropped, only new ones get the new certificate. If the files
+	//can't be loaded, the old certificate is kept. The reload runs on its own thread, so the
+	//proxy threads are never blocked by it, and it is the one thread which may call the
+	//configuration setters. Calling it again replaces the files and the signal
+	void reload_on_signal(const std::string& cert_file, const std::string& key_file, const std::string& key_password = "", int signal_number = SIGHUP)
+	{
+		stop_reload_thread();
+
+		reload_context_ = std::make_unique<net::io_context>(1);
+		reload_signals_ = std::make_unique<net::signal_set>(*reload_context_, signal_number);
+		wait_for_reload(cert_file, key_file, key_password);
+
+		net::io_context *context = reload_context_.get();
+		reload_thread_ = std::thread([context] {
+			context->run();
+		});
+	}
+#endif
+
+	//Hot reload: once the proxy runs, the configuration setters (reload_certificates,
+	//add_route, clear_routes, set_targets, set_forwarded_headers, add_response_head_hook, ...)
+	//only prepare the next configuration. apply_config() swaps it in atomically for new
+	//connections, running sessions keep the old one until they close.
+	//The setters and apply_config() must not be called from the proxy threads
+	//and not from several threads at the same time (e.g. use one reload thread)
+	void apply_config()
+	{
+		start_backends();
+
+		auto config = std::make_shared<ProxyConfig>();
+		config->context = ssl_context_;
+		config->router = std::make_shared<const SniRouter>(sni_router_);
+		config->backends = backends_;
+		config->options = session_options_;
+		config->upstream_pools = upstream_pools_;
+
+		std::atomic_store(&config_, std::shared_ptr<const ProxyConfig>(std::move(config)));
+	}
+
+	//Replaces the targets of the constructor. All addresses of all targets are used
+	void set_targets(const std::vector<BackendGroup::Target>& targets)
+	{
+		backends_ = BackendGroup::resolve(io_context_, targets);
+	}
+
+	//How the target of a new session is chosen: round-robin, the one with the
+	//least sessions, or the better one of two random choices
+	void set_load_balancing(LoadBalancing policy)
+	{
+		backend_settings_.policy = policy;
+	}
+
+	//Passive health check: a target is skipped for fail_timeout after max_fails
+	//failed connects in a row. A session tries up to 3 targets before it gives up
+	void set_passive_health_check(unsigned max_fails, std::chrono::milliseconds fail_timeout)
+	{
+		backend_settings_.max_fails = std::max(1u, max_fails);
+		backend_settings_.fail_timeout = fail_timeout;
+	}
+
+	//Active health check: every interval each target gets a test connect,
+	//targets which don't accept it within timeout are skipped
+	void set_active_health_check(std::chrono::milliseconds interval, std::chrono::milliseconds timeout = std::chrono::milliseconds(2000))
+	{
+		backend_settings_.health_interval = interval;
+		backend_settings_.health_timeout = timeout;
+	}
+
+	//Resolves the target host names again every interval (asynchronously)
+	void set_dns_refresh(std::chrono::seconds interval)
+	{
+		backend_settings_.resolve_interval = interval;
+	}
+
+	//Current targets of the default group and all routes
+	std::vector<BackendStatus> get_backend_status() const
+	{
+		std::vector<BackendStatus> status;
+		const std::int64_t now = std::chrono::steady_clock::now().time_since_epoch().count();
+
+		auto add_group = [&status, now](const BackendGroup& group)
+		{
+			for(const std::shared_ptr<Backend>& backend : *group.backends())
+			{
+				std::ostringstream address;
+				address << backend->endpoint;
+				status.push_back(BackendStatus{ address.str(), backend->active.load(std::memory_order_relaxed), backend->available(now) });
+			}
+		};
+
+		add_group(*backends_);
+		sni_router_.for_each_route([&add_group](const SniRoute& route)
+		{
+			add_group(*route.backends);
+		});
+		return status;
+	}
+
+	std::size_t get_route_count() const
+	{
+		return sni_router_.size();
+	}
+
+	//Number of sessions which run with kernel TLS
+	std::uint64_t get_ktls_session_count() const
+	{
+		return ktls_sessions_.load(std::memory_order_relaxed);
+	}
+
+	TlsResumptionStats get_resumption_stats() const
+	{
+		TlsResumptionStats stats;
+		stats.full_handshakes = full_handshakes_.load(std::memory_order_relaxed);
+		stats.resumed_handshakes = resumed_handshakes_.load(std::memory_order_relaxed);
+		stats.cache_hits = session_cache_ ? session_cache_->hits() : 0;
+		stats.cache_misses = session_cache_ ? session_cache_->misses() : 0;
+		stats.cache_evictions = session_cache_ ? session_cache_->evictions() : 0;
+		stats.cache_size = session_cache_ ? session_cache_->size() : 0;
+		return stats;
+	}
+
+	//The handshake rate is the difference of handshakes between two calls
+	HandshakeStats get_handshake_stats() const
+	{
+		HandshakeStats stats;
+		stats.handshakes = full_handshakes_.load(std::memory_order_relaxed) + resumed_handshakes_.load(std::memory_order_relaxed);
+		stats.failed_handshakes = failed_handshakes_.load(std::memory_order_relaxed);
+		stats.in_progress = handshakes_in_progress_.load(std::memory_order_relaxed);
+		stats.nanoseconds = handshake_nanoseconds_.load(std::memory_order_relaxed);
+		return stats;
+	}
+
+	//All counters and histograms, merged over the threads. Can be called from any thread
+	ProxyMetrics get_metrics() const
+	{
+		ProxyMetrics metrics;
+		metrics.open_connections = connection_limiter_->connections();
+		metrics.rejected_by_connection_limit = connection_limiter_->rejected_by_connection_limit();
+		metrics.rejected_by_address_limit = connection_limiter_->rejected_by_address_limit();
+		metrics.rejected_by_handshake_queue = rejected_by_handshake_queue_.load(std::memory_order_relaxed);
+		metrics.accept_pauses = accept_pauses_.load(std::memory_order_relaxed);
+		metrics.handshakes = full_handshakes_.load(std::memory_order_relaxed) + resumed_handshakes_.load(std::memory_order_relaxed);
+		metrics.resumed_handshakes = resumed_handshakes_.load(std::memory_order_relaxed);
+		for(std::size_t i = 0; i < handshake_failures_.size(); ++i)
+		{
+			metrics.handshake_failures[i] = handshake_failures_[i].load(std::memory_order_relaxed);
+		}
+		handshake_time_.add_to(metrics.handshake_time);
+
+		std::uint64_t sessions_finished = 0;
+		for(const auto& thread : thread_metrics_)
+		{
+			metrics.accepted_connections += thread->accepted.load(std::memory_order_relaxed);
+			metrics.sessions += thread->sessions.load(std::memory_order_relaxed);
+			sessions_finished += thread->sessions_finished.load(std::memory_order_relaxed);
+			metrics.bytes_from_clients += thread->bytes_from_clients.load(std::memory_order_relaxed);
+			metrics.bytes_to_clients += thread->bytes_to_clients.load(std::memory_order_relaxed);
+			metrics.backend_connects += thread->backend_connects.load(std::memory_order_relaxed);
+			metrics.backend_connect_failures += thread->backend_connect_failures.load(std::memory_order_relaxed);
+			metrics.idle_timeouts += thread->idle_timeouts.load(std::memory_order_relaxed);
+			metrics.request_head_timeouts += thread->request_head_timeouts.load(std::memory_order_relaxed);
+			metrics.shutdown_timeouts += thread->shutdown_timeouts.load(std::memory_order_relaxed);
+			metrics.http2_sessions += thread->http2_sessions.load(std::memory_order_relaxed);
+			metrics.http2_streams += thread->http2_streams.load(std::memory_order_relaxed);
+			thread->time_to_first_byte.add_to(metrics.time_to_first_byte);
+			thread->session_duration.add_to(metrics.session_duration);
+			thread->backend_connect_time.add_to(metrics.backend_connect_time);
+		}
+
+		//Read without a lock, a session which just ended may be missing in sessions
+		metrics.active_sessions = metrics.sessions > sessions_finished ? metrics.sessions - sessions_finished : 0;
+		return metrics;
+	}
+
+	//Serves get_metrics() in the Prometheus text format on http://address:port/metrics.
+	//The endpoint is plain HTTP and runs on the accepting thread; bind it to an
+	//address which is not reachable from outside. Port 0 chooses a free port.
+	//Returns the port. This needs to be called before run_block() or start_thread()
+	unsigned short enable_metrics_endpoint(unsigned short port, const std::string& address = "127.0.0.1")
+	{
+		if(metrics_endpoint_) metrics_endpoint_->stop();
+
+		metrics_endpoint_ = std::make_shared<MetricsEndpoint>(io_context_, tcp::endpoint(net::ip::make_address(address), port), [this]
+		{
+			return get_metrics().to_prometheus();
+		});
+		metrics_endpoint_->start();
+		return metrics_endpoint_->port();
+	}
+
+	//Listens for plain HTTP on address:port and answers every request with a 301 to the same
+	//host and path on https, on the port of the first listener. The target is not asked, except
+	//for paths below one of passthrough_prefixes (by default the ACME HTTP-01 challenges
+	//in /.well-known/acme-challenge/), which are forwarded to the targets of the proxy.
+	//The connections count for set_max_connections, the timeouts are the request head and idle
+	//timeouts of set_timeouts(). Port 0 chooses a free port. Returns the port.
+	//This needs to be called before run_block() or start_thread()
+	unsigned short enable_http_redirect(unsigned short port = 80, const std::vector<std::string>& passthrough_prefixes = HttpRedirectSettings().passthrough_prefixes, const std::string& address = "0.0.0.0")
+	{
+		HttpRedirectSettings settings;
+		settings.https_port = listeners_.empty() ? 443 : listeners_.front()->endpoint.port();
+		settings.passthrough_prefixes = passthrough_prefixes;
+		settings.request_head_timeout = session_options_.request_head_timeout;
+		settings.idle_timeout = session_options_.idle_timeout;
+		return enable_http_redirect(tcp::endpoint(net::ip::make_address(address), port), std::move(settings));
+	}
+
+	//The same with all settings, e.g. another https port if something in front of the proxy maps the ports
+	unsigned short enable_http_redirect(const tcp::endpoint& endpoint, HttpRedirectSettings settings)
+	{
+		if(http_redirect_) http_redirect_->stop();
+
+		http_redirect_ = std::make_shared<HttpRedirectEndpoint>(io_context_, endpoint, std::move(settings), timing_wheels_[0], connection_limiter_, [this]
+		{
+			return std::atomic_load(&config_)->backends;
+		});
+		http_redirect_->start();
+		return http_redirect_->port();
+	}
+
+	//Requests of the plain HTTP listener, all zero without enable_http_redirect()
+	HttpRedirectStats get_http_redirect_stats() const
+	{
+		return http_redirect_ ? http_redirect_->stats() : HttpRedirectStats{};
+	}
+
+	//Handler latency of the session threads, all zero without set_latency_probe()
+	DataPlaneStats get_data_plane_stats() const
+	{
+		DataPlaneStats stats{};
+		for(const auto& probe : latency_probes_)
+		{
+			probe->add_to(stats);
+		}
+		return stats;
+	}
+
+	void start_thread()
+	{
+		if(proxy_thread_.joinable()) return;
+
+		proxy_thread_ = std::thread([this] {
+			//std::cout << "DEBUG: [Proxy Thread] Starting io_context::run()." << std::endl;
+			this->run_block();
+			//std::cout << "DEBUG: [Proxy Thread] Finished." << std::endl;
+		});
+	}
+
+	void join_thread()
+	{
+		if(proxy_thread_.joinable())
+		{
+			proxy_thread_.join();
+		}
+	}
+
+	void run_block()
+	{
+		for(auto &worker_context : worker_contexts_)
+		{
+			net::io_context *context = worker_context.get();
+			worker_threads_.emplace_back([context] {
+				context->run();
+			});
+		}
+
+		for(std::size_t i = 0; i < handshake_thread_count_; ++i)
+		{
+			net::io_context *context = handshake_context_.get();
+			worker_threads_.emplace_back([context] {
+				context->run();
+			});
+		}
+
+		io_context_.run();
+
+		//The workers are kept alive by their work guards,
+		//so they need to be stopped explicitly once the acceptor is gone
+		for(auto &worker_context : worker_contexts_)
+		{
+			worker_context->stop();
+		}
+		if(handshake_context_) handshake_context_->stop();
+
+		for(auto &worker_thread : worker_threads_)
+		{
+			if(worker_thread.joinable())
+			{
+				worker_thread.join();
+			}
+		}
+		worker_threads_.clear();
+	}
+
+	void stop()
+	{
+		io_context_.stop();
+		for(auto &worker_context : worker_contexts_)
+		{
+			worker_context->stop();
+		}
+		if(handshake_context_) handshake_context_->stop();
+	}
+
+	net::io_context& get_context()
+	{
+		return io_context_;
+	}
+
+private:
+	//A listening socket. All listeners accept on the accepting thread and hand
+	//the connections out to the same workers
+	struct Listener
+	{
+		Listener(net::io_context& context, const tcp::endpoint& e, bool v6) :
+			acceptor(context),
+			endpoint(e),
+			v6_only(v6)
+		{}
+
+		tcp::acceptor acceptor;
+		tcp::endpoint endpoint;
+		bool v6_only;
+
+		//An accept is pending, of asio or the multishot accept of the ring
+		bool accepting = false;
+	};
+
+	std::unique_ptr<net::io_context> io_context_ptr_;
+	net::io_context& io_context_;
+	std::vector<std::unique_ptr<net::io_context>> worker_contexts_;
+	std::vector<net::executor_work_guard<net::io_context::executor_type>> worker_guards_;
+	std::vector<std::thread> worker_threads_;
+	std::size_t next_worker_;
+	std::vector<std::shared_ptr<UpstreamPool>> upstream_pools_;
+	std::vector<std::shared_ptr<BufferPool>> buffer_pools_;
+	std::vector<std::shared_ptr<RequestHeadCounters>> request_head_counters_;
+	std::vector<std::shared_ptr<ThreadMetrics>> thread_metrics_;
+	std::vector<std::shared_ptr<TimingWheel>> timing_wheels_;
+	std::vector<std::shared_ptr<SessionPool>> session_pools_;
+	std::chrono::milliseconds handshake_timeout_ = std::chrono::seconds(10);
+	SessionOptions session_options_;
+	std::size_t upstream_max_idle_ = 0;
+	std::chrono::seconds upstream_max_age_ = std::chrono::seconds(60);
+	bool upstream_health_check_ = true;
+	std::unique_ptr<TlsSessionCache> session_cache_;
+	TlsTicketKeys session_ticket_keys_;
+	SniRouter sni_router_;
+	std::atomic<std::uint64_t> full_handshakes_{0};
+	std::atomic<std::uint64_t> resumed_handshakes_{0};
+	std::atomic<std::uint64_t> failed_handshakes_{0};
+	std::atomic<std::uint64_t> handshakes_in_progress_{0};
+	std::atomic<std::uint64_t> handshake_nanoseconds_{0};
+	std::array<std::atomic<std::uint64_t>, static_cast<std::size_t>(HandshakeFailure::count)> handshake_failures_{};
+	LatencyHistogram handshake_time_;
+	std::shared_ptr<MetricsEndpoint> metrics_endpoint_;
+	std::shared_ptr<HttpRedirectEndpoint> http_redirect_;
+	std::unique_ptr<net::io_context> handshake_context_;
+	std::unique_ptr<net::executor_work_guard<net::io_context::executor_type>> handshake_guard_;
+	std::size_t handshake_thread_count_ = 0;
+	std::chrono::milliseconds latency_probe_interval_ = std::chrono::milliseconds(0);
+	std::vector<std::shared_ptr<LoopLagProbe>> latency_probes_;
+	std::shared_ptr<ConnectionLimiter> connection_limiter_;
+	std::atomic<std::size_t> max_pending_handshakes_{0};
+	std::atomic<std::uint64_t> rejected_by_handshake_queue_{0};
+	std::atomic<std::uint64_t> accept_pauses_{0};
+	bool accept_paused_ = false;
+	net::steady_timer accept_retry_timer_;
+	std::unique_ptr<net::executor_work_guard<net::io_context::executor_type>> accept_pause_guard_;
+	ListenerOptions listener_options_{};
+	bool ktls_enabled_ = false;
+	std::atomic<std::uint64_t> ktls_sessions_{0};
+	bool http2_enabled_ = false;
+	bool session_tickets_ = true;
+	std::shared_ptr<ssl::context> ssl_context_;
+	std::vector<std::unique_ptr<Listener>> listeners_;
+	tcp::endpoint target_endpoint_;
+	std::shared_ptr<BackendGroup> backends_;
+	BackendSettings backend_settings_;
+	std::shared_ptr<const ProxyConfig> config_;
+	std::thread proxy_thread_;
+	std::unique_ptr<net::io_context> reload_context_;
+	std::unique_ptr<net::signal_set> reload_signals_;
+	std::thread reload_thread_;
+	std::string certificate_file;
+	std::string private_key_file;
+	std::string private_key_password;
+	bool io_uring_enabled_ = false;
+	unsigned io_uring_entries_ = 256;
+#ifdef SSLPROXY_HAS_IO_URING
+	std::vector<std::shared_ptr<IoUring>> io_urings_;
+#endif
+
+	void start_latency_probes()
+	{
+		if(latency_probe_interval_ <= std::chrono::milliseconds(0) || !latency_probes_.empty()) return;
+
+		for(std::size_t worker = 0; worker < worker_contexts_.size() + 1; ++worker)
+		{
+			latency_probes_.push_back(std::make_shared<LoopLagProbe>(context_at(worker), latency_probe_interval_));
+			latency_probes_.back()->start();
+		}
+	}
+
+	//Starts the groups which are new in the configuration, the others ignore it
+	void start_backends()
+	{
+		const std::size_t worker_count = worker_contexts_.size() + 1;
+		backends_->start(io_context_, backend_settings_, worker_count);
+		sni_router_.for_each_route([this, worker_count](SniRoute& route)
+		{
+			route.backends->start(io_context_, backend_settings_, worker_count);
+		});
+	}
+
+	void configure_context(ssl::context& context)
+	{
+		context.set_options(
+			net::ssl::context::default_workarounds |
+			net::ssl::context::no_sslv2 |
+			net::ssl::context::no_sslv3 |
+			net::ssl::context::single_dh_use
+		);
+
+		//The same for all contexts, so sessions stay resumable when SNI switches the context
+		const unsigned char session_id_context[] = "sslproxy";
+		SSL_CTX_set_session_id_context(context.native_handle(), session_id_context, sizeof(session_id_context) - 1);
+	}
+
+	void configure_alpn(SSL_CTX* ctx)
+	{
+		AlpnSelector::attach(ctx, http2_enabled_ && !session_options_.proxy_protocol);
+	}
+
+	//The contexts of the routes are selected by SNI, ALPN is negotiated on them
+	void configure_alpn_everywhere()
+	{
+		configure_alpn(ssl_context_->native_handle());
+		sni_router_.for_each_route([this](SniRoute& route)
+		{
+			configure_alpn(route.context->native_handle());
+		});
+	}
+
+#ifdef SSLPROXY_HAS_KTLS
+	void configure_ktls(SSL_CTX* ctx)
+	{
+		if(ktls_enabled_)
+		{
+			KtlsOffload::prepare(ctx);
+		}
+		else
+		{
+			SSL_CTX_set_keylog_callback(ctx, nullptr);
+			SSL_CTX_set_msg_callback(ctx, nullptr);
+		}
+	}
+#endif
+
+	void load_certificates()
+	{
+		try
+		{
+			ssl_context_->set_password_callback(
+				std::bind(&SslProxy::on_password_needed, this,
+				std::placeholders::_1, std::placeholders::_2)
+			);
+
+			ssl_context_->use_certificate_chain_file(certificate_file);
+			ssl_context_->use_private_key_file(private_key_file, ssl::context::pem);
+
+			//std::cout << "Certificates loaded successfully." << std::endl;
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << "FATAL: Failed to load SSL files: " << e.what() << std::endl;
+			throw;
+		}
+	}
+
+	std::string on_password_needed(std::size_t max_length, net::ssl::context_base::password_purpose purpose)
+	{
+		(void)purpose;
+		(void)max_length;
+
+		return private_key_password;
+	}
+
+#ifndef _WIN32
+	void wait_for_reload(const std::string& cert_file, const std::string& key_file, const std::string& key_password)
+	{
+		reload_signals_->async_wait([this, cert_file, key_file, key_password](const err::error_code& ec, int)
+		{
+			if(ec) return;
+
+			try
+			{
+				reload_certificates(cert_file, key_file, key_password);
+				apply_config();
+				std::cerr << "Certificate reloaded" << std::endl;
+			}
+			catch(const std::exception& e)
+			{
+				std::cerr << "Keeping the old certificate: " << e.what() << std::endl;
+			}
+
+			wait_for_reload(cert_file, key_file, key_password);
+		});
 	}
+#endif
 
-	void start_read_from_target()
+	void stop_reload_thread()
 	{
-		auto self = shared_from_this();
+		if(reload_context_) reload_context_->stop();
+		if(reload_thread_.joinable()) reload_thread_.join();
+		reload_signals_.reset();
+		reload_context_.reset();
+	}
 
-		if(!client_socket_ || !target_socket_.is_open())
+	void create_upstream_pools()
+	{
+		for(auto &pool : upstream_pools_)
 		{
-			self->do_shutdown();
-			return;
+			pool = upstream_max_idle_ == 0 ? nullptr : std::make_shared<UpstreamPool>(upstream_max_idle_, upstream_max_age_, upstream_health_check_);
+		}
+	}
+
+	std::size_t next_worker()
+	{
+		//Only called from the accepting thread, so no synchronization needed
+		const std::size_t index = next_worker_;
+		next_worker_ = (next_worker_ + 1) % (worker_contexts_.size() + 1);
+
+		return index;
+	}
+
+	std::shared_ptr<BufferPool> buffer_pool_at(std::size_t worker)
+	{
+		if(!buffer_pools_[worker]) buffer_pools_[worker] = std::make_shared<BufferPool>();
+		return buffer_pools_[worker];
+	}
+
+	net::io_context& context_at(std::size_t worker)
+	{
+		return worker == 0 ? io_context_ : *worker_contexts_[worker - 1];
+	}
+
+#ifdef SSLPROXY_HAS_IO_URING
+	//One ring per thread if set_io_uring is enabled. Returns false if a ring can't be created
+	bool create_io_urings()
+	{
+		for(auto &ring : io_urings_)
+		{
+			if(ring) ring->shutdown();
+		}
+		io_urings_.assign(worker_contexts_.size() + 1, nullptr);
+		for(auto &listener : listeners_)
+		{
+			listener->accepting = false;
 		}
 
-		target_socket_.async_read_some(
-			net::buffer(target_data_, max_length),
-			[this, self](const err::error_code& ec, std::size_t length)
+		if(!io_uring_enabled_) return true;
+
+		for(std::size_t worker = 0; worker < io_urings_.size(); ++worker)
+		{
+			io_urings_[worker] = IoUring::create(context_at(worker), io_uring_entries_);
+			if(!io_urings_[worker])
 			{
-				if(!ec)
-				{
-					if(self->target_response_started_)
-					{
-						//std::cout << "DEBUG: [TargetRead] Tunneling " << length << " bytes." << std::endl;
-
-						net::async_write(*self->client_socket_, net::buffer(self->target_data_, length), [this, self, length](const err::error_code& write_ec, std::size_t /*written*/)
-						{
-							if(!write_ec)
-							{
-								self->start_read_from_target();
-							}
-							else
-							{
-								self->do_shutdown();
-							}
-						});
-					}
-					else
-					{
-						self->header_buffer_.append(self->target_data_, length);
-
-						std::size_t header_end_pos = self->header_buffer_.find(self->header_end_delimiter_);
-
-						if(header_end_pos != std::string::npos)
-						{
-							//std::cout << "DEBUG: [TargetRead] Header end found." << std::endl;
-							self->target_response_started_ = true;
-
-							if(self->header_buffer_.length() >= 10 && self->header_buffer_.substr(0, 9) == "HTTP/1.1 " && self->header_buffer_.substr(9, 1) == "3")
-							{
-								std::string search_location = "Location:";
-								std::string search_http = "http://";
-								std::string replace_https = "https://";
-
-								std::size_t location_start = self->header_buffer_.find(search_location, 0);
-
-
-								if(location_start != std::string::npos && location_start < header_end_pos)
-								{
-									std::size_t search_start = location_start + search_location.length();
-
-									std::size_t http_pos = self->header_buffer_.find(search_http, search_start);
-
-									if(http_pos != std::string::npos && http_pos < header_end_pos)
-									{
-										self->header_buffer_.replace(http_pos, search_http.length(), replace_https);
-										//std::cout << "DEBUG: [TargetRead] Location: HTTP found and replaced with HTTPS." << std::endl;
-									}
-									else
-									{
-										//std::cout << "DEBUG: [TargetRead] Location header found, but 'http://' not found or not absolute. No replacement." << std::endl;
-									}
-								}
-								else
-								{
-									//std::cout << "DEBUG: [TargetRead] Redirect (3xx) found, but 'Location:' header not found. No replacement." << std::endl;
-								}
-							}
-
-							auto buffer_ptr = std::make_shared<std::string>(std::move(self->header_buffer_));
-
-							net::async_write(
-								*self->client_socket_,
-								net::buffer(*buffer_ptr),
-								[self, buffer_ptr](const err::error_code& write_ec, std::size_t /*written*/)
-								{
-									if(!write_ec)
-									{
-										self->start_read_from_target();
-									}
-									else
-									{
-										self->do_shutdown();
-									}
-								}
-							);
-						}
-						else
-						{
-							self->start_read_from_target();
-						}
-					}
-				}
-				else if(ec == net::error::eof || ec == net::error::connection_reset)
-				{
-					self->do_shutdown();
-				}
-				else if (ec != net::error::operation_aborted)
+				std::cerr << "io_uring is not available, the sessions use the asio reactor" << std::endl;
+				for(auto &ring : io_urings_)
 				{
-					//std::cerr << "ProxySession: Read from target error: " << ec.message() << std::endl;
-					self->do_shutdown();
+					if(ring) ring->shutdown();
 				}
+				io_urings_.assign(io_urings_.size(), nullptr);
+				return false;
 			}
-		);
+
+			io_urings_[worker]->register_buffers(buffer_pool_at(worker));
+		}
+		return true;
 	}
+#endif
 
-	void do_shutdown()
+	//Starts accepting on the listeners which aren't accepting already
+	void accept_all()
 	{
-		std::unique_ptr<ssl::stream<tcp::socket>> client_socket_moved = std::move(client_socket_);
+		for(auto &listener : listeners_)
+		{
+			if(!listener->accepting) do_accept(*listener);
+		}
+	}
 
-		if (!client_socket_moved)
+	void do_accept(Listener& listener)
+	{
+#ifdef SSLPROXY_HAS_IO_URING
+		if(io_urings_[0])
 		{
-			//std::cerr << "DEBUG: Attempted SSL shutdown on null socket (after move)." << std::endl;
-			close_sockets_only_target();
+			accept_with_io_uring(listener);
 			return;
 		}
+#endif
 
-		auto self = shared_from_this();
+		const std::size_t worker = next_worker();
+		net::io_context &session_context = context_at(worker);
 
-		client_socket_moved->async_shutdown(
-			[self, client_socket_moved = std::move(client_socket_moved)](const err::error_code& ec)
-			{
-				if(ec)
-				{
-					//std::cerr << "DEBUG: SSL Shutdown error (ignored): " << ec.message() << std::endl;
-				}
-				else
-				{
-					//std::cout << "DEBUG: SSL Shutdown complete." << std::endl;
-				}
+		//std::cout << "DEBUG: [SslProxy] Listening for new connection." << std::endl;
 
-				self->close_sockets_only_target(); 
+		listener.accepting = true;
+		listener.acceptor.async_accept(session_context, [this, &listener, worker](const err::error_code& ec, tcp::socket socket)
+		{
+			listener.accepting = false;
+			if(ec == net::error::operation_aborted)
+			{
+				//Cancelled by pause_accept(), which may have been resumed before this handler ran
+				if(!accept_paused_ && listener.acceptor.is_open()) do_accept(listener);
+				return;
 			}
-		);
+
+			//Another listener may have paused accepting in the meantime
+			if(accepted(ec, worker, std::move(socket)) && !accept_paused_ && accept_waiting(listener)) do_accept(listener);
+		});
 	}
 
-	void close_sockets_only_target()
+	//Accepts the connections which are already in the backlog, up to accept_batch with
+	//the one of the wakeup. Returns false if accepting pauses (see pause_accept)
+	bool accept_waiting(Listener& listener)
 	{
-		err::error_code ec;
-		if (target_socket_.is_open())
+		for(std::size_t accepted_count = 1; accepted_count < listener_options_.accept_batch; ++accepted_count)
 		{
-			target_socket_.shutdown(tcp::socket::shutdown_both, ec);
-			target_socket_.close(ec);
-			//std::cout << "DEBUG: Target socket closed." << std::endl;
-		}
+			//The worker only moves on for a connection which was actually accepted
+			const std::size_t worker = next_worker_;
 
-		//if (client_socket_)
-		//{
-		//	client_socket_.reset();
-		//	//std::cout << "DEBUG: Client SSL stream destroyed." << std::endl;
-		//}
+			err::error_code ec;
+			tcp::socket socket = listener.acceptor.accept(context_at(worker), ec);
+			if(ec == net::error::would_block || ec == net::error::try_again) break;
+
+			if(!ec) next_worker();
+			if(!accepted(ec, worker, std::move(socket))) return false;
+		}
+		return true;
 	}
 
-	void close_all_resources()
+	//The acceptor is non-blocking, so accept_waiting() stops at an empty backlog.
+	//A port 0 is replaced by the one the system chose, so opening it again keeps it
+	static void open_listener(Listener& listener, const ListenerOptions& options)
 	{
-		close_sockets_only_target();
+		tcp::acceptor &acceptor = listener.acceptor;
+		if(acceptor.is_open()) acceptor.close();
 
-		if(client_socket_)
+		acceptor.open(listener.endpoint.protocol());
+		acceptor.set_option(tcp::acceptor::reuse_address(true));
+		if(listener.endpoint.address().is_v6()) acceptor.set_option(net::ip::v6_only(listener.v6_only));
+		if(options.reuse_port)
 		{
-			client_socket_.reset();
-			//std::cout << "DEBUG: Client SSL stream destroyed (by direct close)." << std::endl;
+#ifdef SO_REUSEPORT
+			acceptor.set_option(net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#else
+			std::cerr << "SO_REUSEPORT is not supported on this system" << std::endl;
+#endif
+		}
+		acceptor.bind(listener.endpoint);
+		acceptor.listen(options.backlog);
+		if(options.defer_accept.count() > 0)
+		{
+#ifdef TCP_DEFER_ACCEPT
+			acceptor.set_option(net::detail::socket_option::integer<IPPROTO_TCP, TCP_DEFER_ACCEPT>(static_cast<int>(options.defer_accept.count())));
+#else
+			std::cerr << "TCP_DEFER_ACCEPT is not supported on this system" << std::endl;
+#endif
 		}
+		acceptor.non_blocking(true);
+		listener.endpoint = acceptor.local_endpoint();
 	}
 
-}; //end class ProxySession
+#ifdef SSLPROXY_HAS_IO_URING
+	//A multishot accept on the ring of the accepting thread replaces the accept loop:
+	//one submission accepts until pause_accept() cancels it
+	void accept_with_io_uring(Listener& listener)
+	{
+		if(listener.accepting) return;
 
-class SslProxy
-{
+		const tcp protocol = listener.endpoint.protocol();
 
-public:
-	SslProxy(unsigned short source_port, const std::string& target_host, unsigned short target_port, const std::string& cert_file, const std::string& key_file, const std::string &key_password="") :
-		io_context_ptr_(std::make_unique<net::io_context>()),
-		io_context_(*io_context_ptr_),
-		ssl_context_(ssl::context::sslv23_server),
-		acceptor_(io_context_, tcp::endpoint(tcp::v4(), source_port)),
-		target_endpoint_(),
-		proxy_thread_(),
-		certificate_file(cert_file),
-		private_key_file(key_file),
-		private_key_password(key_password)
+		listener.accepting = true;
+		io_urings_[0]->async_accept(listener.acceptor.native_handle(), [this, &listener, protocol](const err::error_code& accept_ec, int fd, bool more)
+		{
+			if(!more) listener.accepting = false;
+
+			if(accept_ec != net::error::operation_aborted)
+			{
+				const std::size_t worker = accept_ec ? 0 : next_worker();
+				tcp::socket socket(context_at(worker));
+
+				err::error_code assign_ec;
+				if(!accept_ec) socket.assign(protocol, fd, assign_ec);
+
+				if(assign_ec) ::close(fd);
+				else accepted(accept_ec, worker, std::move(socket));
+			}
+
+			//The kernel ends a multishot accept e.g. after an error
+			if(!more && !accept_paused_) accept_with_io_uring(listener);
+		});
+	}
+#endif
+
+	//Hands a new connection over to the thread of worker.
+	//Returns false if accepting pauses (see pause_accept)
+	bool accepted(const err::error_code& ec, std::size_t worker, tcp::socket socket)
 	{
-		try
+		if(!ec)
 		{
-			tcp::resolver resolver(io_context_);
-			auto endpoints = resolver.resolve(target_host, std::to_string(target_port));
-			target_endpoint_ = *endpoints.begin();
+			std::shared_ptr<ConnectionSlot> slot = admit(socket);
+			if(slot)
+			{
+				//std::cout << "DEBUG: [SslProxy] TCP connection accepted. Starting handshake." << std::endl;
 
-			std::cout << "Proxy configured: SSL Port " << source_port
-				<< " -> Target " << target_host << " ("
-				<< target_endpoint_.address().to_string() << ":" << target_port << ")" << std::endl;
+				//Counted from here, the handshakes waiting for their thread are part of the queue
+				handshakes_in_progress_.fetch_add(1, std::memory_order_relaxed);
 
+				if(worker == 0)
+				{
+					handle_handshake(worker, std::move(socket), std::move(slot));
+				}
+				else
+				{
+					//Hand the connection over to the thread owning its io_context
+					net::post(context_at(worker), [this, worker, socket = std::move(socket), slot = std::move(slot)]() mutable
+					{
+						handle_handshake(worker, std::move(socket), std::move(slot));
+					});
+				}
+			}
 		}
-		catch (const std::exception& e)
+		else if(is_resource_error(ec))
 		{
-			std::cerr << "FATAL: Could not resolve target host '" << target_host << "': " << e.what() << std::endl;
-			throw;
+			//Accepting again right away would fail the same way until descriptors are free
+			std::cerr << "Accept paused: " << ec.message() << std::endl;
+			pause_accept();
+			accept_retry_timer_.expires_after(accept_retry_delay);
+			accept_retry_timer_.async_wait([this](const err::error_code& timer_ec)
+			{
+				if(!timer_ec) resume_accept();
+			});
+			return false;
+		}
+		else
+		{
+			std::cerr << "Accept error: " << ec.message() << std::endl;
 		}
 
-		load_certificates();
+		if(connection_limiter_->full())
+		{
+			//Resumed by the connection limiter when a connection ends
+			pause_accept();
+			return false;
+		}
 
-		ssl_context_.set_options(
-			net::ssl::context::default_workarounds |
-			net::ssl::context::no_sslv2 |
-			net::ssl::context::no_sslv3 |
-			net::ssl::context::single_dh_use
-		);
+		return true;
 	}
 
-	~SslProxy()
-	{
-		stop();
-		join_thread();
-	}
+	static constexpr std::chrono::milliseconds accept_retry_delay{100};
 
-	void start()
+	static bool is_resource_error(const err::error_code& ec)
 	{
-		//std::cout << "SSL Proxy listening on port " << acceptor_.local_endpoint().port() << "..." << std::endl;
-		do_accept();
+		return ec == net::error::no_descriptors ||
+			ec == err::error_code(ENFILE, err::system_category()) ||
+			ec == net::error::no_buffer_space ||
+			ec == net::error::no_memory;
 	}
 
-	void restart_context()
+	//Runs on the accepting thread, like resume_accept(). The pending accepts of all
+	//listeners are cancelled, not only the one which hit the limit. Without them the
+	//accepting io_context may have no work left, the guard keeps run() from returning
+	void pause_accept()
 	{
-		io_context_.restart();
-		//std::cout << "DEBUG: [Proxy] io_context restarted." << std::endl;
-		do_accept();
+		accept_paused_ = true;
+		accept_pauses_.fetch_add(1, std::memory_order_relaxed);
+		if(!accept_pause_guard_) accept_pause_guard_ = std::make_unique<net::executor_work_guard<net::io_context::executor_type>>(net::make_work_guard(io_context_));
+
+		for(auto &listener : listeners_)
+		{
+			if(!listener->accepting) continue;
+
+#ifdef SSLPROXY_HAS_IO_URING
+			if(io_urings_[0])
+			{
+				io_urings_[0]->cancel(listener->acceptor.native_handle());
+				continue;
+			}
+#endif
+			err::error_code ec;
+			listener->acceptor.cancel(ec);
+		}
 	}
 
-	void start_thread()
+	void resume_accept()
 	{
-		if(proxy_thread_.joinable()) return;
+		if(!accept_paused_ || connection_limiter_->full()) return;
 
-		proxy_thread_ = std::thread([this] {
-			//std::cout << "DEBUG: [Proxy Thread] Starting io_context::run()." << std::endl;
-			this->run_block();
-			//std::cout << "DEBUG: [Proxy Thread] Finished." << std::endl;
-		});
+		accept_paused_ = false;
+		accept_pause_guard_.reset();
+		accept_retry_timer_.cancel();
+		accept_all();
 	}
 
-	void join_thread()
+	//Returns the slot of a new connection, or closes it if one of the limits is reached
+	std::shared_ptr<ConnectionSlot> admit(tcp::socket& socket)
 	{
-		if(proxy_thread_.joinable())
+		const std::size_t max_pending = max_pending_handshakes_.load(std::memory_order_relaxed);
+		if(max_pending != 0 && handshakes_in_progress_.load(std::memory_order_relaxed) >= max_pending)
 		{
-			proxy_thread_.join();
+			rejected_by_handshake_queue_.fetch_add(1, std::memory_order_relaxed);
+			reject(socket);
+			return nullptr;
 		}
-	}
 
-	void run_block()
-        {
-                io_context_.run();
-        }
+		net::ip::address address;
+		if(connection_limiter_->limits_addresses())
+		{
+			err::error_code ec;
+			address = unmap_address(socket.remote_endpoint(ec).address());
+			if(ec)
+			{
+				reject(socket);
+				return nullptr;
+			}
+		}
 
-	void stop()
-	{
-		io_context_.stop();
+		std::shared_ptr<ConnectionSlot> slot = connection_limiter_->acquire(address);
+		if(!slot) reject(socket);
+		return slot;
 	}
 
-	net::io_context& get_context()
+	//A reset instead of a FIN: the client fails fast and no TIME_WAIT is left behind
+	static void reject(tcp::socket& socket)
 	{
-		return io_context_;
+		err::error_code ec;
+		socket.set_option(tcp::socket::linger(true, 0), ec);
+		socket.close(ec);
 	}
 
-private:
-	std::unique_ptr<net::io_context> io_context_ptr_;
-	net::io_context& io_context_;
-	ssl::context ssl_context_;
-	tcp::acceptor acceptor_;
-	tcp::endpoint target_endpoint_;
-	std::thread proxy_thread_;
-	std::string certificate_file;
-	std::string private_key_file;
-	std::string private_key_password;
-
-	void load_certificates()
+	void handle_handshake(std::size_t worker, tcp::socket tcp_socket, std::shared_ptr<ConnectionSlot> slot)
 	{
-		try
+		//One snapshot for the whole connection, even if a reload happens during the handshake
+		std::shared_ptr<const ProxyConfig> config = std::atomic_load(&config_);
+		config->options.client_socket.apply(tcp_socket);
+
+		auto ssl_stream_ptr = std::make_unique<ssl::stream<tcp::socket>>(std::move(tcp_socket), *config->context);
+		if(!config->router->empty()) SniRouter::bind(ssl_stream_ptr->native_handle(), config->router.get());
+
+		ssl::stream<tcp::socket>& ssl_stream = *ssl_stream_ptr;
+		const auto handshake_started = std::chrono::steady_clock::now();
+		ThreadMetrics::add(thread_metrics_[worker]->accepted, 1);
+
+		//A client which doesn't finish the handshake in time gets its socket shut down, the
+		//handshake then fails. The timeout runs on this thread; shutdown() only uses the
+		//descriptor, so it doesn't get in the way of handshake steps on the handshake pool
+		auto timeout = std::make_unique<TimingWheel::Entry>(handshake_timeout_.count() != 0 ? timing_wheels_[worker].get() : nullptr, [&ssl_stream]
 		{
-			ssl_context_.set_password_callback(
-				std::bind(&SslProxy::on_password_needed, this,
-				std::placeholders::_1, std::placeholders::_2)
-			);
+			err::error_code ec;
+			ssl_stream.next_layer().shutdown(tcp::socket::shutdown_both, ec);
+		});
+		timeout->arm(handshake_timeout_);
 
-			ssl_context_.use_certificate_chain_file(certificate_file);
-			ssl_context_.use_private_key_file(private_key_file, ssl::context::pem);
+		//A failed handshake releases the slot with the handler
+		auto on_handshake = [this, worker, config, handshake_started, ssl_stream_ptr = std::move(ssl_stream_ptr), slot = std::move(slot), timeout = std::move(timeout)](const err::error_code& ec) mutable
+		{
+			const auto handshake_time = std::chrono::steady_clock::now() - handshake_started;
 
-			//std::cout << "Certificates loaded successfully." << std::endl;
+			if(!handshake_context_)
+			{
+				finish_handshake(worker, ec, handshake_time, config, std::move(ssl_stream_ptr), std::move(slot), std::move(timeout));
+				return;
+			}
+
+			//Back to the session thread, the socket and its timeout belong to it
+			net::post(context_at(worker), [this, worker, ec, handshake_time, config, ssl_stream_ptr = std::move(ssl_stream_ptr), slot = std::move(slot), timeout = std::move(timeout)]() mutable
+			{
+				finish_handshake(worker, ec, handshake_time, config, std::move(ssl_stream_ptr), std::move(slot), std::move(timeout));
+			});
+		};
+
+		//std::cout << "DEBUG: [Handshake] async_handshake initiated." << std::endl;
+		if(handshake_context_)
+		{
+			//The socket stays on the session thread, but every step of the handshake
+			//(the intermediate handlers of the ssl stream) runs on the handshake pool
+			ssl_stream.async_handshake(ssl::stream_base::server, net::bind_executor(*handshake_context_, std::move(on_handshake)));
 		}
-		catch (const std::exception& e)
+		else
 		{
-			std::cerr << "FATAL: Failed to load SSL files: " << e.what() << std::endl;
-			throw;
+			ssl_stream.async_handshake(ssl::stream_base::server, std::move(on_handshake));
 		}
 	}
 
-	std::string on_password_needed(std::size_t max_length, net::ssl::context_base::password_purpose purpose)
+	//Runs on the thread of worker
+	void finish_handshake(std::size_t worker, const err::error_code& ec, std::chrono::steady_clock::duration handshake_time, const std::shared_ptr<const ProxyConfig>& config,
+		std::unique_ptr<ssl::stream<tcp::socket>> ssl_stream_ptr, std::shared_ptr<ConnectionSlot> slot, std::unique_ptr<TimingWheel::Entry> timeout)
 	{
-		(void)purpose;
-		(void)max_length;
+		const bool timed_out = timeout->expired();
+		timeout.reset();
 
-		return private_key_password;
-	}
+		//A renegotiation must not use the router anymore, the session doesn't keep it
+		SniRouter::bind(ssl_stream_ptr->native_handle(), nullptr);
+		handshakes_in_progress_.fetch_sub(1, std::memory_order_relaxed);
 
-	void do_accept()
-	{
-		auto socket_ptr = std::make_shared<tcp::socket>(io_context_);
+		if (ec)
+		{
+			const HandshakeFailure failure = timed_out ? HandshakeFailure::timeout : classify_handshake_error(ec);
+			failed_handshakes_.fetch_add(1, std::memory_order_relaxed);
+			handshake_failures_[static_cast<std::size_t>(failure)].fetch_add(1, std::memory_order_relaxed);
+			if(timed_out) std::cerr << "SSL Handshake error: timeout" << std::endl;
+			else std::cerr << "SSL Handshake error: " << ec.message() << std::endl;
+			return;
+		}
 
-		//std::cout << "DEBUG: [SslProxy] Listening for new connection." << std::endl;
+		//std::cout << "DEBUG: [Handshake] SSL Handshake completed successfully. Starting ProxySession." << std::endl;
+		if(SSL_session_reused(ssl_stream_ptr->native_handle())) resumed_handshakes_.fetch_add(1, std::memory_order_relaxed);
+		else full_handshakes_.fetch_add(1, std::memory_order_relaxed);
+		handshake_nanoseconds_.fetch_add(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(handshake_time).count()), std::memory_order_relaxed);
+		handshake_time_.record(handshake_time);
 
-		acceptor_.async_accept(*socket_ptr, [this, socket_ptr](const err::error_code& ec)
+		bool ktls = false;
+#ifdef SSLPROXY_HAS_KTLS
+		if(ktls_enabled_)
 		{
-			if(!ec)
-			{
-				//std::cout << "DEBUG: [SslProxy] TCP connection accepted. Starting handshake." << std::endl;
-
-				handle_handshake(std::make_unique<tcp::socket>(std::move(*socket_ptr)));
-			}
-			else
-			{
-				std::cerr << "Accept error: " << ec.message() << std::endl;
-			}
+			ktls = KtlsOffload::install(ssl_stream_ptr->native_handle(), ssl_stream_ptr->next_layer().native_handle());
+			if(ktls) ktls_sessions_.fetch_add(1, std::memory_order_relaxed);
+			//else std::cout << "DEBUG: [Handshake] kTLS not available, staying in userspace." << std::endl;
+		}
+#endif
 
-			do_accept();
-		});
+		start_session(worker, config, std::move(ssl_stream_ptr), ktls, std::move(slot));
 	}
 
-	void handle_handshake(std::unique_ptr<tcp::socket> tcp_socket)
+	//Runs on the thread of worker
+	void start_session(std::size_t worker, const std::shared_ptr<const ProxyConfig>& config, std::unique_ptr<ssl::stream<tcp::socket>> ssl_stream_ptr, bool ktls, std::shared_ptr<ConnectionSlot> slot)
 	{
-		auto ssl_stream_ptr = std::make_unique<ssl::stream<tcp::socket>>(std::move(*tcp_socket), ssl_context_);
+		SessionOptions options = config->options;
+		if(options.forwarded_headers) options.request_head_counters = request_head_counters_[worker];
+		options.metrics = thread_metrics_[worker];
+		options.timing_wheel = timing_wheels_[worker];
+#ifdef SSLPROXY_HAS_IO_URING
+		options.io_uring = io_urings_[worker];
+#endif
 
-		//std::cout << "DEBUG: [Handshake] async_handshake initiated." << std::endl;
-		ssl_stream_ptr->async_handshake(
-			ssl::stream_base::server,
-			[this, ssl_stream_ptr = std::move(ssl_stream_ptr)](const err::error_code& ec) mutable
-			{
-				if (!ec)
-				{
-					//std::cout << "DEBUG: [Handshake] SSL Handshake completed successfully. Starting ProxySession." << std::endl;
-					std::make_shared<ProxySession>(
-						io_context_,
-						target_endpoint_,
-						std::move(ssl_stream_ptr)
-					)->start();
-				}
-				else
-				{
-					std::cerr << "SSL Handshake error: " << ec.message() << std::endl;
-				}
-			}
+		//The route the SNI callback chose, otherwise the default targets
+		std::shared_ptr<SniRoute> route = config->router->find(ssl_stream_ptr->native_handle());
+
+		if(!options.proxy_protocol && AlpnSelector::is_http2(ssl_stream_ptr->native_handle()))
+		{
+			auto http2_session = std::make_shared<Http2Session>(
+				context_at(worker),
+				target_endpoint_,
+				std::move(ssl_stream_ptr),
+				config->upstream_pools[worker],
+				ktls,
+				buffer_pool_at(worker),
+				options
+			);
+			http2_session->set_backends(route ? route->backends : config->backends, worker);
+			http2_session->set_connection_slot(std::move(slot));
+			http2_session->start();
+			return;
+		}
+
+#ifdef SSLPROXY_COROUTINE_SESSIONS
+		using Session = CoroutineSession;
+#else
+		using Session = ProxySession;
+#endif
+
+		//The session memory is recycled per thread, the session is destroyed on this thread as well
+		auto session = std::allocate_shared<Session>(
+			SessionAllocator<Session>(session_pools_[worker]),
+			context_at(worker),
+			target_endpoint_,
+			std::move(ssl_stream_ptr),
+			config->upstream_pools[worker],
+			ktls,
+			buffer_pool_at(worker),
+			options
 		);
+		session->set_backends(route ? route->backends : config->backends, worker);
+		session->set_connection_slot(std::move(slot));
+		session->start();
 	}
 
 }; //end class SslProxy
@@ -0,0 +1,1009 @@
+//Benchmark and load generator for SslProxy.
+//It starts a local plaintext HTTP backend and an SslProxy in front of it, runs the
+//scenarios with a multi-threaded TLS client and prints the results as JSON, so
+//they can be compared between two versions of the proxy.
+//
+//The CMake target defines BOOST_ASIO if Boost was found, otherwise standalone asio is used.
+//sslproxy_bench_coroutines is the same benchmark with SSLPROXY_COROUTINE_SESSIONS, so
+//the two session engines can be compared
+#include "../include/sslproxy.hpp"
+
+#include <iostream>
+#include <cerrno>
+#include <cstdlib>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+using std::cout;
+using std::endl;
+using std::string;
+
+#ifdef SSLPROXY_COROUTINE_SESSIONS
+const char session_engine[] = "coroutines";
+#else
+const char session_engine[] = "callbacks";
+#endif
+
+struct BenchOptions
+{
+	string scenario = "all";
+	double duration = 5.0;
+	std::size_t threads = 2;
+	std::size_t connections = 32;
+	std::size_t proxy_threads = 1;
+	std::size_t handshake_threads = 0;
+	bool ktls = false;
+	bool io_uring = false;
+	std::size_t accept_batch = ListenerOptions().accept_batch;
+	unsigned defer_accept = 0;
+	std::size_t idle_connections = 1000;
+	std::size_t request_size = 64;
+	std::size_t bulk_size = 64 * 1024 * 1024;
+	unsigned short port = 18443;
+	string json_file = "";
+	string cert_file = "cert.pem";
+	string priv_key = "key.pem";
+	string priv_password = "1234";
+};
+
+int printHelp(const string &programName);
+
+//Heap allocations of the proxy threads. The threads of the benchmark itself (main, backend
+//and load generator) call exclude_from_allocation_count(), every other thread is the proxy's.
+//With glibc malloc itself is counted, so the allocations of OpenSSL are included
+std::atomic<std::uint64_t> proxy_allocations{0};
+thread_local bool bench_thread = false;
+
+void exclude_from_allocation_count()
+{
+	bench_thread = true;
+}
+
+#ifdef __GLIBC__
+extern "C"
+{
+void* __libc_malloc(std::size_t size);
+void* __libc_calloc(std::size_t count, std::size_t size);
+void* __libc_realloc(void* pointer, std::size_t size);
+void* __libc_memalign(std::size_t alignment, std::size_t size);
+
+void* malloc(std::size_t size) noexcept
+{
+	if(!bench_thread) proxy_allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+void* calloc(std::size_t count, std::size_t size) noexcept
+{
+	if(!bench_thread) proxy_allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, std::size_t size) noexcept
+{
+	if(!bench_thread) proxy_allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_realloc(pointer, size);
+}
+
+void* memalign(std::size_t alignment, std::size_t size) noexcept
+{
+	if(!bench_thread) proxy_allocations.fetch_add(1, std::memory_order_relaxed);
+	return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(std::size_t alignment, std::size_t size) noexcept
+{
+	return memalign(alignment, size);
+}
+
+int posix_memalign(void** pointer, std::size_t alignment, std::size_t size) noexcept
+{
+	*pointer = memalign(alignment, size);
+	return *pointer || size == 0 ? 0 : ENOMEM;
+}
+}
+#endif
+
+//Resident memory of this process, 0 if it isn't known
+std::size_t resident_bytes()
+{
+#ifdef __linux__
+	std::ifstream statm("/proc/self/statm");
+	std::size_t pages = 0, resident = 0;
+	if(statm >> pages >> resident) return resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#endif
+	return 0;
+}
+
+//Every idle connection takes four file descriptors in this process
+void raise_file_limit()
+{
+#ifdef __linux__
+	rlimit limit;
+	if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+#endif
+}
+
+std::size_t file_limit()
+{
+#ifdef __linux__
+	rlimit limit;
+	if(getrlimit(RLIMIT_NOFILE, &limit) == 0) return static_cast<std::size_t>(limit.rlim_cur);
+#endif
+	return 1024;
+}
+
+//Finds the value of a header in a response head, the name is lower case
+bool find_header(const string &head, const char *name, string &value)
+{
+	const std::size_t name_length = std::strlen(name);
+	std::size_t line = head.find("\r\n");
+
+	while(line != string::npos && line + 2 < head.length())
+	{
+		line += 2;
+		std::size_t i = 0;
+		while(i < name_length && line + i < head.length() && std::tolower(static_cast<unsigned char>(head[line + i])) == name[i]) ++i;
+
+		if(i == name_length && line + i < head.length() && head[line + i] == ':')
+		{
+			std::size_t begin = line + i + 1;
+			while(begin < head.length() && head[begin] == ' ') ++begin;
+			value = head.substr(begin, head.find("\r\n", begin) - begin);
+			return true;
+		}
+		line = head.find("\r\n", line);
+	}
+
+	return false;
+}
+
+//Plaintext HTTP/1.1 backend with keep-alive:
+//GET /bytes/N answers N bytes, GET /redirect a 301 to an http:// URL
+//(the path which the proxy rewrites) and POST /echo returns the body
+class BenchBackend
+{
+
+public:
+	BenchBackend() :
+		io_context_(),
+		guard_(net::make_work_guard(io_context_)),
+		acceptor_(io_context_, tcp::endpoint(net::ip::make_address("127.0.0.1"), 0)),
+		thread_(),
+		payload_(std::make_shared<const string>(1024 * 1024, 'x'))
+	{}
+
+	~BenchBackend()
+	{
+		stop();
+	}
+
+	unsigned short port() const
+	{
+		return acceptor_.local_endpoint().port();
+	}
+
+	void start()
+	{
+		do_accept();
+		thread_ = std::thread([this]
+		{
+			exclude_from_allocation_count();
+			io_context_.run();
+		});
+	}
+
+	void stop()
+	{
+		io_context_.stop();
+		if(thread_.joinable()) thread_.join();
+	}
+
+private:
+	class Connection : public std::enable_shared_from_this<Connection>
+	{
+
+	public:
+		Connection(tcp::socket socket, std::shared_ptr<const string> payload) :
+			socket_(std::move(socket)),
+			buffer_(16 * 1024),
+			request_(),
+			response_(),
+			payload_(std::move(payload)),
+			body_remaining_(0)
+		{}
+
+		void start()
+		{
+			err::error_code ec;
+			socket_.set_option(tcp::no_delay(true), ec);
+			read();
+		}
+
+	private:
+		tcp::socket socket_;
+		std::vector<char> buffer_;
+		string request_;
+		string response_;
+		std::shared_ptr<const string> payload_;
+		std::size_t body_remaining_;
+
+		void read()
+		{
+			auto self = shared_from_this();
+			socket_.async_read_some(net::buffer(buffer_), [this, self](const err::error_code &ec, std::size_t length)
+			{
+				if(ec) return;
+
+				request_.append(buffer_.data(), length);
+				handle_request();
+			});
+		}
+
+		void handle_request()
+		{
+			const std::size_t head_end = request_.find("\r\n\r\n");
+			if(head_end == string::npos)
+			{
+				read();
+				return;
+			}
+
+			const string head = request_.substr(0, head_end + 2);
+			string content_length;
+			const std::size_t body_length = find_header(head, "content-length", content_length) ? std::strtoull(content_length.c_str(), nullptr, 10) : 0;
+
+			if(request_.length() < head_end + 4 + body_length)
+			{
+				read();
+				return;
+			}
+
+			const string body = request_.substr(head_end + 4, body_length);
+			request_.erase(0, head_end + 4 + body_length);
+
+			body_remaining_ = 0;
+			if(head.compare(0, 11, "GET /bytes/") == 0)
+			{
+				body_remaining_ = std::strtoull(head.c_str() + 11, nullptr, 10);
+				response_ = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body_remaining_) + "\r\n\r\n";
+			}
+			else if(head.compare(0, 14, "GET /redirect ") == 0)
+			{
+				response_ = "HTTP/1.1 301 Moved Permanently\r\nLocation: http://bench.local/redirected\r\nContent-Length: 0\r\n\r\n";
+			}
+			else if(head.compare(0, 11, "POST /echo ") == 0)
+			{
+				response_ = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body.length()) + "\r\n\r\n" + body;
+			}
+			else
+			{
+				response_ = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+			}
+
+			write_head();
+		}
+
+		void write_head()
+		{
+			auto self = shared_from_this();
+			net::async_write(socket_, net::buffer(response_), [this, self](const err::error_code &ec, std::size_t)
+			{
+				if(!ec) write_body();
+			});
+		}
+
+		void write_body()
+		{
+			if(body_remaining_ == 0)
+			{
+				handle_request();
+				return;
+			}
+
+			const std::size_t length = std::min(body_remaining_, payload_->length());
+			body_remaining_ -= length;
+
+			auto self = shared_from_this();
+			net::async_write(socket_, net::buffer(payload_->data(), length), [this, self](const err::error_code &ec, std::size_t)
+			{
+				if(!ec) write_body();
+			});
+		}
+
+	};
+
+	net::io_context io_context_;
+	net::executor_work_guard<net::io_context::executor_type> guard_;
+	tcp::acceptor acceptor_;
+	std::thread thread_;
+	std::shared_ptr<const string> payload_;
+
+	void do_accept()
+	{
+		acceptor_.async_accept([this](const err::error_code &ec, tcp::socket socket)
+		{
+			if(ec == net::error::operation_aborted) return;
+			if(!ec) std::make_shared<Connection>(std::move(socket), payload_)->start();
+			do_accept();
+		});
+	}
+
+};
+
+//What the connections of one scenario share
+struct ScenarioState
+{
+	enum class Mode
+	{
+		handshake,
+		request,
+		idle
+	};
+
+	Mode mode = Mode::request;
+	string request{};
+	std::chrono::steady_clock::time_point deadline{};
+	LatencyHistogram latency{};
+	std::atomic<std::uint64_t> operations{0};
+	std::atomic<std::uint64_t> bytes{0};
+	std::atomic<std::uint64_t> errors{0};
+	std::atomic<std::uint64_t> https_locations{0};
+	std::atomic<std::uint64_t> established{0};
+};
+
+//One client connection of the load generator. In handshake mode it connects,
+//handshakes and closes again, in request mode it sends one request after the
+//other on a keep-alive connection and in idle mode it only waits
+class LoadConnection : public std::enable_shared_from_this<LoadConnection>
+{
+
+public:
+	LoadConnection(net::io_context &io_context, ssl::context &context, tcp::endpoint endpoint, std::shared_ptr<ScenarioState> state) :
+		io_context_(io_context),
+		context_(context),
+		endpoint_(std::move(endpoint)),
+		state_(std::move(state)),
+		stream_(),
+		buffer_(state_->mode == ScenarioState::Mode::idle ? 256 : 64 * 1024),
+		head_(),
+		body_remaining_(0),
+		started_()
+	{}
+
+	void start()
+	{
+		stream_ = std::make_unique<ssl::stream<tcp::socket>>(io_context_, context_);
+		started_ = std::chrono::steady_clock::now();
+
+		auto self = shared_from_this();
+		stream_->next_layer().async_connect(endpoint_, [this, self](const err::error_code &ec)
+		{
+			if(ec) return fail();
+
+			err::error_code option_ec;
+			stream_->next_layer().set_option(tcp::no_delay(true), option_ec);
+
+			stream_->async_handshake(ssl::stream_base::client, [this, self](const err::error_code &handshake_ec)
+			{
+				if(handshake_ec) return fail();
+				on_established();
+			});
+		});
+	}
+
+	void close()
+	{
+		if(!stream_) return;
+
+		err::error_code ec;
+		stream_->next_layer().close(ec);
+	}
+
+private:
+	net::io_context &io_context_;
+	ssl::context &context_;
+	tcp::endpoint endpoint_;
+	std::shared_ptr<ScenarioState> state_;
+	std::unique_ptr<ssl::stream<tcp::socket>> stream_;
+	std::vector<char> buffer_;
+	string head_;
+	std::size_t body_remaining_;
+	std::chrono::steady_clock::time_point started_;
+
+	bool time_left() const
+	{
+		return std::chrono::steady_clock::now() < state_->deadline;
+	}
+
+	void fail()
+	{
+		state_->errors.fetch_add(1, std::memory_order_relaxed);
+		close();
+	}
+
+	void on_established()
+	{
+		state_->established.fetch_add(1, std::memory_order_relaxed);
+
+		switch(state_->mode)
+		{
+		case ScenarioState::Mode::handshake:
+			state_->latency.record(std::chrono::steady_clock::now() - started_);
+			state_->operations.fetch_add(1, std::memory_order_relaxed);
+			close();
+			if(time_left()) start();
+			break;
+
+		case ScenarioState::Mode::request:
+			send_request();
+			break;
+
+		case ScenarioState::Mode::idle:
+			wait_idle();
+			break;
+		}
+	}
+
+	void wait_idle()
+	{
+		auto self = shared_from_this();
+		stream_->async_read_some(net::buffer(buffer_), [this, self](const err::error_code &ec, std::size_t)
+		{
+			//Nothing is expected, the connection just stays open until it is closed
+			if(!ec) wait_idle();
+		});
+	}
+
+	void send_request()
+	{
+		if(!time_left())
+		{
+			close();
+			return;
+		}
+
+		head_.clear();
+		body_remaining_ = 0;
+		started_ = std::chrono::steady_clock::now();
+
+		auto self = shared_from_this();
+		net::async_write(*stream_, net::buffer(state_->request), [this, self](const err::error_code &ec, std::size_t)
+		{
+			if(ec) return fail();
+			read_response(false);
+		});
+	}
+
+	void read_response(bool in_body)
+	{
+		auto self = shared_from_this();
+		stream_->async_read_some(net::buffer(buffer_), [this, self, in_body](const err::error_code &ec, std::size_t length)
+		{
+			if(ec) return fail();
+
+			state_->bytes.fetch_add(length, std::memory_order_relaxed);
+
+			if(in_body)
+			{
+				body_remaining_ -= std::min(body_remaining_, length);
+			}
+			else
+			{
+				head_.append(buffer_.data(), length);
+
+				const std::size_t head_end = head_.find("\r\n\r\n");
+				if(head_end == string::npos)
+				{
+					read_response(false);
+					return;
+				}
+
+				string value;
+				if(find_header(head_, "content-length", value)) body_remaining_ = std::strtoull(value.c_str(), nullptr, 10);
+				if(find_header(head_, "location", value) && value.compare(0, 8, "https://") == 0) state_->https_locations.fetch_add(1, std::memory_order_relaxed);
+
+				body_remaining_ -= std::min(body_remaining_, head_.length() - head_end - 4);
+			}
+
+			if(body_remaining_ > 0)
+			{
+				read_response(true);
+				return;
+			}
+
+			state_->latency.record(std::chrono::steady_clock::now() - started_);
+			state_->operations.fetch_add(1, std::memory_order_relaxed);
+			send_request();
+		});
+	}
+
+};
+
+//Runs the connections of a scenario on a number of threads, each with its own io_context
+class LoadGenerator
+{
+
+public:
+	LoadGenerator(std::size_t threads, unsigned short port) :
+		threads_(std::max<std::size_t>(threads, 1)),
+		endpoint_(net::ip::make_address("127.0.0.1"), port),
+		context_(ssl::context::tls_client)
+	{
+		context_.set_verify_mode(ssl::verify_none);
+	}
+
+	//Runs count connections until the deadline of state is reached
+	void run(const std::shared_ptr<ScenarioState> &state, std::size_t count)
+	{
+		std::vector<std::unique_ptr<net::io_context>> contexts;
+		for(std::size_t i = 0; i < threads_; ++i) contexts.push_back(std::make_unique<net::io_context>(1));
+
+		for(std::size_t i = 0; i < count; ++i)
+		{
+			std::make_shared<LoadConnection>(*contexts[i % threads_], context_, endpoint_, state)->start();
+		}
+
+		std::vector<std::thread> threads;
+		for(auto &context : contexts)
+		{
+			net::io_context *io_context = context.get();
+			threads.emplace_back([io_context]
+			{
+				exclude_from_allocation_count();
+				io_context->run();
+			});
+		}
+		for(auto &thread : threads) thread.join();
+	}
+
+	//Opens count connections which stay idle on their own thread until close_idle()
+	void open_idle(const std::shared_ptr<ScenarioState> &state, std::size_t count)
+	{
+		idle_context_ = std::make_unique<net::io_context>(1);
+		idle_guard_ = std::make_unique<net::executor_work_guard<net::io_context::executor_type>>(net::make_work_guard(*idle_context_));
+
+		for(std::size_t i = 0; i < count; ++i)
+		{
+			idle_connections_.push_back(std::make_shared<LoadConnection>(*idle_context_, context_, endpoint_, state));
+			idle_connections_.back()->start();
+		}
+
+		net::io_context *io_context = idle_context_.get();
+		idle_thread_ = std::thread([io_context]
+		{
+			exclude_from_allocation_count();
+			io_context->run();
+		});
+
+		//Wait until all of them finished their handshakes (or failed)
+		while(state->established.load() + state->errors.load() < count)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+
+	void close_idle()
+	{
+		if(!idle_context_) return;
+
+		net::post(*idle_context_, [this]
+		{
+			for(auto &connection : idle_connections_) connection->close();
+		});
+		idle_guard_.reset();
+		idle_thread_.join();
+
+		idle_connections_.clear();
+		idle_context_.reset();
+	}
+
+private:
+	std::size_t threads_;
+	tcp::endpoint endpoint_;
+	ssl::context context_;
+	std::unique_ptr<net::io_context> idle_context_ = nullptr;
+	std::unique_ptr<net::executor_work_guard<net::io_context::executor_type>> idle_guard_ = nullptr;
+	std::vector<std::shared_ptr<LoadConnection>> idle_connections_ = {};
+	std::thread idle_thread_ = std::thread();
+};
+
+//Samples the proxy allocations while all connections of a scenario are established,
+//so the handshakes at the start and the closes at the end are not part of it
+class AllocationSampler
+{
+
+public:
+	AllocationSampler(std::shared_ptr<ScenarioState> state, std::size_t connections) :
+		state_(std::move(state)),
+		allocations_(0),
+		operations_(0),
+		bytes_(0),
+		thread_()
+	{
+		thread_ = std::thread([this, connections]
+		{
+			exclude_from_allocation_count();
+			sample(connections);
+		});
+	}
+
+	AllocationSampler(const AllocationSampler&) = delete;
+	AllocationSampler& operator=(const AllocationSampler&) = delete;
+
+	~AllocationSampler()
+	{
+		if(thread_.joinable()) thread_.join();
+	}
+
+	//Waits for the end of the sample and returns its JSON fields
+	string json()
+	{
+		if(thread_.joinable()) thread_.join();
+
+		std::ostringstream out;
+		out << "\"steady_allocations\": " << allocations_
+			<< ", \"allocations_per_request\": " << (operations_ > 0 ? static_cast<double>(allocations_) / static_cast<double>(operations_) : 0.0)
+			<< ", \"allocations_per_megabyte\": " << (bytes_ > 0 ? static_cast<double>(allocations_) * 1048576.0 / static_cast<double>(bytes_) : 0.0);
+		return out.str();
+	}
+
+private:
+	std::shared_ptr<ScenarioState> state_;
+	std::uint64_t allocations_;
+	std::uint64_t operations_;
+	std::uint64_t bytes_;
+	std::thread thread_;
+
+	void sample(std::size_t connections)
+	{
+		const auto margin = std::chrono::milliseconds(200);
+		while(state_->established.load() < connections && std::chrono::steady_clock::now() + 2 * margin < state_->deadline)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		}
+		std::this_thread::sleep_for(margin);
+
+		const std::uint64_t allocations = proxy_allocations.load();
+		const std::uint64_t operations = state_->operations.load();
+		const std::uint64_t bytes = state_->bytes.load();
+
+		std::this_thread::sleep_until(state_->deadline - margin);
+		if(std::chrono::steady_clock::now() >= state_->deadline) return;
+
+		allocations_ = proxy_allocations.load() - allocations;
+		operations_ = state_->operations.load() - operations;
+		bytes_ = state_->bytes.load() - bytes;
+	}
+
+}; //end class AllocationSampler
+
+string latency_json(const ScenarioState &state)
+{
+	HistogramSnapshot snapshot;
+	state.latency.add_to(snapshot);
+
+	std::ostringstream out;
+	out << "{\"mean\": " << snapshot.mean()
+		<< ", \"p50\": " << snapshot.percentile(0.5)
+		<< ", \"p90\": " << snapshot.percentile(0.9)
+		<< ", \"p99\": " << snapshot.percentile(0.99)
+		<< ", \"p999\": " << snapshot.percentile(0.999)
+		<< ", \"max\": " << snapshot.max << "}";
+	return out.str();
+}
+
+std::shared_ptr<ScenarioState> make_state(ScenarioState::Mode mode, const string &request, double seconds)
+{
+	auto state = std::make_shared<ScenarioState>();
+	state->mode = mode;
+	state->request = request;
+	state->deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+	return state;
+}
+
+string bytes_request(std::size_t size)
+{
+	return "GET /bytes/" + std::to_string(size) + " HTTP/1.1\r\nHost: bench.local\r\n\r\n";
+}
+
+//Full handshakes per second: every connection handshakes, closes and starts again
+string run_handshake(LoadGenerator &generator, const BenchOptions &options)
+{
+	auto state = make_state(ScenarioState::Mode::handshake, string(), options.duration);
+
+	const std::uint64_t allocations = proxy_allocations.load();
+	const auto started = std::chrono::steady_clock::now();
+	generator.run(state, options.connections);
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	const std::uint64_t handshakes = std::max<std::uint64_t>(state->operations.load(), 1);
+
+	std::ostringstream out;
+	out << "{\"name\": \"handshake\", \"connections\": " << options.connections << ", \"seconds\": " << seconds
+		<< ", \"handshakes\": " << state->operations.load()
+		<< ", \"handshakes_per_second\": " << static_cast<double>(state->operations.load()) / seconds
+		<< ", \"allocations_per_handshake\": " << static_cast<double>(proxy_allocations.load() - allocations) / static_cast<double>(handshakes)
+		<< ", \"errors\": " << state->errors.load()
+		<< ", \"latency_us\": " << latency_json(*state) << "}";
+	return out.str();
+}
+
+//Small keep-alive requests, one after the other on every connection
+string run_requests(LoadGenerator &generator, const BenchOptions &options, const char *name, const string &request)
+{
+	auto state = make_state(ScenarioState::Mode::request, request, options.duration);
+
+	AllocationSampler sampler(state, options.connections);
+	const auto started = std::chrono::steady_clock::now();
+	generator.run(state, options.connections);
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+	std::ostringstream out;
+	out << "{\"name\": \"" << name << "\", \"connections\": " << options.connections << ", \"seconds\": " << seconds
+		<< ", \"requests\": " << state->operations.load()
+		<< ", \"requests_per_second\": " << static_cast<double>(state->operations.load()) / seconds
+		<< ", \"bytes\": " << state->bytes.load()
+		<< ", \"https_locations\": " << state->https_locations.load()
+		<< ", " << sampler.json()
+		<< ", \"errors\": " << state->errors.load()
+		<< ", \"latency_us\": " << latency_json(*state) << "}";
+	return out.str();
+}
+
+//Large responses on a few connections
+string run_bulk(LoadGenerator &generator, const BenchOptions &options)
+{
+	auto state = make_state(ScenarioState::Mode::request, bytes_request(options.bulk_size), options.duration);
+	const std::size_t connections = std::min<std::size_t>(options.connections, 4);
+
+	AllocationSampler sampler(state, connections);
+	const auto started = std::chrono::steady_clock::now();
+	generator.run(state, connections);
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+	std::ostringstream out;
+	out << "{\"name\": \"bulk\", \"connections\": " << connections << ", \"seconds\": " << seconds
+		<< ", \"responses\": " << state->operations.load()
+		<< ", \"bytes\": " << state->bytes.load()
+		<< ", \"gigabytes_per_second\": " << static_cast<double>(state->bytes.load()) / seconds / 1e9
+		<< ", " << sampler.json()
+		<< ", \"errors\": " << state->errors.load()
+		<< ", \"latency_us\": " << latency_json(*state) << "}";
+	return out.str();
+}
+
+//Small requests while many other connections are open but idle
+string run_idle(LoadGenerator &generator, const BenchOptions &options)
+{
+	//Client, proxy client side, proxy target side and backend: four descriptors per connection
+	std::size_t count = options.idle_connections;
+	const std::size_t limit = file_limit() > 256 ? (file_limit() - 256) / 4 : 0;
+	if(count > limit)
+	{
+		std::cerr << "Only " << limit << " idle connections fit into the file descriptor limit" << endl;
+		count = limit;
+	}
+
+	auto idle_state = make_state(ScenarioState::Mode::idle, string(), 0);
+	const std::size_t memory_before = resident_bytes();
+	const auto opening = std::chrono::steady_clock::now();
+	generator.open_idle(idle_state, count);
+	const double open_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - opening).count();
+
+	//Let the proxy connect all of them to the backend
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	const std::size_t memory_after = resident_bytes();
+
+	auto state = make_state(ScenarioState::Mode::request, bytes_request(options.request_size), options.duration);
+	const auto started = std::chrono::steady_clock::now();
+	generator.run(state, options.connections);
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+	generator.close_idle();
+
+	const std::uint64_t established = idle_state->established.load();
+
+	std::ostringstream out;
+	out << "{\"name\": \"idle\", \"idle_connections\": " << established
+		<< ", \"idle_errors\": " << idle_state->errors.load()
+		<< ", \"open_seconds\": " << open_seconds
+		<< ", \"resident_bytes_per_idle_connection\": " << (established > 0 && memory_after > memory_before ? (memory_after - memory_before) / established : 0)
+		<< ", \"connections\": " << options.connections << ", \"seconds\": " << seconds
+		<< ", \"requests\": " << state->operations.load()
+		<< ", \"requests_per_second\": " << static_cast<double>(state->operations.load()) / seconds
+		<< ", \"errors\": " << state->errors.load()
+		<< ", \"latency_us\": " << latency_json(*state) << "}";
+	return out.str();
+}
+
+string proxy_metrics_json(const SslProxy &proxy)
+{
+	const ProxyMetrics metrics = proxy.get_metrics();
+
+	std::ostringstream out;
+	out << "{\"accepted_connections\": " << metrics.accepted_connections
+		<< ", \"handshakes\": " << metrics.handshakes
+		<< ", \"sessions\": " << metrics.sessions
+		<< ", \"bytes_to_clients\": " << metrics.bytes_to_clients
+		<< ", \"handshake_p99_us\": " << metrics.handshake_time.percentile(0.99)
+		<< ", \"time_to_first_byte_p99_us\": " << metrics.time_to_first_byte.percentile(0.99)
+		<< ", \"backend_connect_p99_us\": " << metrics.backend_connect_time.percentile(0.99);
+
+	const IoUringStats io_uring = proxy.get_io_uring_stats();
+	out << ", \"io_uring\": {\"submissions\": " << io_uring.submissions
+		<< ", \"enters\": " << io_uring.enters
+		<< ", \"submit_failures\": " << io_uring.submit_failures
+		<< ", \"completions\": " << io_uring.completions
+		<< ", \"fixed_reads\": " << io_uring.fixed_reads
+		<< ", \"registered_slabs\": " << io_uring.registered_slabs << "}}";
+	return out.str();
+}
+
+bool parse_arguments(int argc, char *args[], BenchOptions &options)
+{
+	for(int i = 1; i < argc; ++i)
+	{
+		const string argument = args[i];
+		if(argument == "--help") return false;
+		if(i + 1 >= argc)
+		{
+			std::cerr << "Missing value for " << argument << endl;
+			return false;
+		}
+
+		const string value = args[++i];
+		if(argument == "--scenario") options.scenario = value;
+		else if(argument == "--duration") options.duration = std::atof(value.c_str());
+		else if(argument == "--threads") options.threads = std::strtoull(value.c_str(), nullptr, 10);
+		else if(argument == "--connections") options.connections = std::strtoull(value.c_str(), nullptr, 10);
+		else if(argument == "--proxy-threads") options.proxy_threads = std::strtoull(value.c_str(), nullptr, 10);
+		else if(argument == "--handshake-threads") options.handshake_threads = std::strtoull(value.c_str(), nullptr, 10);
+		else if(argument == "--ktls") options.ktls = value == "1";
+		else if(argument == "--io-uring") options.io_uring = value == "1";
+		else if(argument == "--accept-batch") options.accept_batch = std::strtoull(value.c_str(), nullptr, 10);
+		else if(argument == "--defer-accept") options.defer_accept = static_cast<unsigned>(std::strtoul(value.c_str(), nullptr, 10));
+		else if(argument == "--idle") options.idle_connections = std::strtoull(value.c_str(), nullptr, 10);
+		else if(argument == "--request-size") options.request_size = std::strtoull(value.c_str(), nullptr, 10);
+		else if(argument == "--bulk-size") options.bulk_size = std::strtoull(value.c_str(), nullptr, 10);
+		else if(argument == "--port") options.port = static_cast<unsigned short>(std::atoi(value.c_str()));
+		else if(argument == "--json") options.json_file = value;
+		else if(argument == "--cert") options.cert_file = value;
+		else if(argument == "--key") options.priv_key = value;
+		else if(argument == "--password") options.priv_password = value;
+		else
+		{
+			std::cerr << "Unknown argument " << argument << endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int main(int argc, char *args[])
+{
+	BenchOptions options;
+	if(!parse_arguments(argc, args, options))
+		return printHelp(args[0]);
+
+	exclude_from_allocation_count();
+	raise_file_limit();
+
+	BenchBackend backend;
+	backend.start();
+
+	//The proxy logs its configuration to stdout, which is reserved for the JSON
+	std::streambuf *cout_buffer = cout.rdbuf(std::cerr.rdbuf());
+	SslProxy proxy(options.port, "127.0.0.1", backend.port(), options.cert_file, options.priv_key, options.priv_password);
+	cout.rdbuf(cout_buffer);
+	proxy.set_thread_count(options.proxy_threads);
+	proxy.set_handshake_threads(options.handshake_threads);
+	ListenerOptions listener;
+	listener.accept_batch = options.accept_batch;
+	listener.defer_accept = std::chrono::seconds(options.defer_accept);
+	proxy.set_listener_options(listener);
+	if(options.ktls) options.ktls = proxy.set_ktls(true);
+	if(options.io_uring) options.io_uring = proxy.set_io_uring(true);
+	proxy.start();
+	proxy.start_thread();
+
+	LoadGenerator generator(options.threads, options.port);
+	std::vector<string> results;
+
+	auto selected = [&options](const char *name)
+	{
+		return options.scenario == "all" || options.scenario == name;
+	};
+
+	if(selected("handshake")) results.push_back(run_handshake(generator, options));
+	if(selected("rps")) results.push_back(run_requests(generator, options, "rps", bytes_request(options.request_size)));
+	if(selected("bulk")) results.push_back(run_bulk(generator, options));
+	if(selected("idle")) results.push_back(run_idle(generator, options));
+	if(selected("redirect")) results.push_back(run_requests(generator, options, "redirect", "GET /redirect HTTP/1.1\r\nHost: bench.local\r\n\r\n"));
+
+	std::ostringstream json;
+	json << "{\n  \"config\": {\"engine\": \"" << session_engine << "\", \"duration\": " << options.duration << ", \"threads\": " << options.threads
+		<< ", \"connections\": " << options.connections << ", \"proxy_threads\": " << options.proxy_threads
+		<< ", \"handshake_threads\": " << options.handshake_threads << ", \"ktls\": " << (options.ktls ? "true" : "false")
+		<< ", \"io_uring\": " << (options.io_uring ? "true" : "false") << ", \"accept_batch\": " << options.accept_batch
+		<< ", \"defer_accept\": " << options.defer_accept << ", \"request_size\": " << options.request_size
+		<< ", \"bulk_size\": " << options.bulk_size << "},\n  \"scenarios\": [";
+	for(std::size_t i = 0; i < results.size(); ++i)
+	{
+		json << (i == 0 ? "\n    " : ",\n    ") << results[i];
+	}
+	json << "\n  ],\n  \"proxy\": " << proxy_metrics_json(proxy) << "\n}\n";
+
+	proxy.stop();
+	proxy.join_thread();
+	backend.stop();
+
+	if(options.json_file.empty())
+	{
+		cout << json.str();
+	}
+	else
+	{
+		std::ofstream out(options.json_file);
+		out << json.str();
+	}
+
+	return 0;
+}
+
+int printHelp(const string &programName)
+{
+	cout<<"Usage:"<<endl;
+	cout<<programName<<" [--scenario all] [--duration 5] [--threads 2] [--connections 32] [--json file] ..."<<endl;
+	cout<<endl;
+	cout<<"\t--scenario:"<<endl;
+	cout<<"\t\tall, handshake (full handshakes per second), rps (small requests per second),"<<endl;
+	cout<<"\t\tbulk (large responses), idle (requests while many connections are idle)"<<endl;
+	cout<<"\t\tor redirect (responses whose Location the proxy rewrites)"<<endl;
+	cout<<"\t\tWith glibc the heap allocations of the proxy threads are counted: per handshake,"<<endl;
+	cout<<"\t\tand per request and megabyte while all connections are established"<<endl;
+	cout<<endl;
+	cout<<"\t--duration:"<<endl;
+	cout<<"\t\tSeconds per scenario"<<endl;
+	cout<<endl;
+	cout<<"\t--threads, --connections:"<<endl;
+	cout<<"\t\tThreads and concurrent connections of the load generator"<<endl;
+	cout<<endl;
+	cout<<"\t--proxy-threads, --handshake-threads:"<<endl;
+	cout<<"\t\tset_thread_count() and set_handshake_threads() of the proxy"<<endl;
+	cout<<endl;
+	cout<<"\t--ktls, --io-uring:"<<endl;
+	cout<<"\t\t1 enables set_ktls() or set_io_uring() of the proxy (0). The config in the results"<<endl;
+	cout<<"\t\tshows if they are available, the io_uring counters are part of the proxy metrics"<<endl;
+	cout<<endl;
+	cout<<"\t--accept-batch, --defer-accept:"<<endl;
+	cout<<"\t\tConnections accepted per wakeup (16) and TCP_DEFER_ACCEPT in seconds (0), see ListenerOptions"<<endl;
+	cout<<endl;
+	cout<<"\t--idle, --request-size, --bulk-size:"<<endl;
+	cout<<"\t\tIdle connections of the idle scenario (1000), response size of the small requests (64)"<<endl;
+	cout<<"\t\tand of the bulk scenario (64 MB). The memory per idle connection includes"<<endl;
+	cout<<"\t\tthe client and the backend, they run in the same process"<<endl;
+	cout<<endl;
+	cout<<"\t--port, --cert, --key, --password:"<<endl;
+	cout<<"\t\tSSL port of the proxy (18443) and its certificate (cert.pem, key.pem, 1234)"<<endl;
+	cout<<endl;
+	cout<<"\t--json:"<<endl;
+	cout<<"\t\tWrites the results to this file instead of stdout"<<endl;
+
+	return 0;
+}
@@ -34,8 +34,17 @@ int main(int argc, char *args[])
 
 	//Create and start SSL proxy
 	SslProxy proxy(ssl_port, proxy_host, proxy_port, cert_file, priv_key, priv_password);
+
+	//If you want to distribute the connections on multiple threads (0 = one per core)
+	//proxy.set_thread_count(0);
+
 	proxy.start();
 
+#ifndef _WIN32
+	//Reloads the certificate on SIGHUP (e.g. after it was renewed) without dropping connections
+	proxy.reload_on_signal(cert_file, priv_key, priv_password);
+#endif
+
 	//This runs the proxy in blocking mode
 	proxy.run_block();
 
@@ -46,7 +55,11 @@ int main(int argc, char *args[])
 	//proxy.stop();
 	//proxy.join_thread();
 
-	//If you need to restart it (e.g. if the certificates changed) you need to do it like this
+	//If the certificates changed, they can be reloaded without a restart (see reload_on_signal):
+	//proxy.reload_certificates(cert_file, priv_key, priv_password);
+	//proxy.apply_config();
+
+	//If you need to restart it anyway you need to do it like this
 	//proxy.stop();
 	//proxy.restart_context();
 }
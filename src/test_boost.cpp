@@ -37,6 +37,12 @@ int main(int argc, char *args[])
 	//Create and start SSL proxy
 	SslProxy proxy(ssl_port, proxy_host, proxy_port, cert_file, priv_key, priv_password);
 	proxy.start();
+
+#ifndef _WIN32
+	//Reloads the certificate on SIGHUP (e.g. after it was renewed) without dropping connections
+	proxy.reload_on_signal(cert_file, priv_key, priv_password);
+#endif
+
 	proxy.run_block();
 }
 
@@ -22,6 +22,7 @@ int main(int argc, char *args[])
 	string cert_file = "cert.pem";
 	string priv_key = "key.pem";
 	string priv_password = "1234";
+	int redirect_port = 0;
 
 	if(argc > 1 && string(args[1]) == "--help")
 		return printHelp(args[0]);
@@ -32,6 +33,7 @@ int main(int argc, char *args[])
 	if(argc > 3)cert_file = args[3];
 	if(argc > 4)priv_key = args[4];
 	if(argc > 5)priv_password = args[5];
+	if(argc > 6)redirect_port = atoi(args[6]);
 
 	crow::SimpleApp app;
 
@@ -44,6 +46,7 @@ int main(int argc, char *args[])
 
 	//Create and start SSL proxy
 	SslProxy proxy(ssl_port, "127.0.0.1", port, cert_file, priv_key, priv_password);
+	if(redirect_port != 0)proxy.enable_http_redirect(static_cast<unsigned short>(redirect_port));
 	proxy.start();
 	proxy.start_thread();
 
@@ -56,7 +59,7 @@ int main(int argc, char *args[])
 int printHelp(const string &programName)
 {
 	cout<<"Usage:"<<endl;
-	cout<<programName<<" [sslport=443] [port=80] [cert_file=cert.pem] [priv_key=key.pem] [priv_password=1234]"<<endl;
+	cout<<programName<<" [sslport=443] [port=80] [cert_file=cert.pem] [priv_key=key.pem] [priv_password=1234] [redirect_port=0]"<<endl;
 	cout<<endl;
 	cout<<"\tsslport:"<<endl;
 	cout<<"\t\tThe port on which the ssl proxy should listen for encrypted connections"<<endl;
@@ -72,6 +75,10 @@ int printHelp(const string &programName)
 	cout<<endl;
 	cout<<"\tpriv_password:"<<endl;
 	cout<<"\t\tPassword of the SSL key"<<endl;
+	cout<<endl;
+	cout<<"\tredirect_port:"<<endl;
+	cout<<"\t\tIf set, the proxy answers plain HTTP on this port with redirects to https,"<<endl;
+	cout<<"\t\tonly /.well-known/acme-challenge/ is forwarded to crow"<<endl;
 
 	return 0;
 }
@@ -42,7 +42,7 @@ int main(int argc, char *args[])
 	string command;
 	while(command != "quit")
 	{
-		cout<<"Type \"quit\" to quit or \"restart\" to restart the SSL proxy"<<endl;
+		cout<<"Type \"quit\" to quit, \"reload\" to reload the certificate or \"restart\" to restart the SSL proxy"<<endl;
 		cin>>command;
 
 		if(command == "restart")
@@ -50,6 +50,19 @@ int main(int argc, char *args[])
 			proxy.stop();
 			proxy.restart_context();
 		}
+		else if(command == "reload")
+		{
+			//Running connections keep the old certificate
+			try
+			{
+				proxy.reload_certificates(cert_file, priv_key, priv_password);
+				proxy.apply_config();
+			}
+			catch(const std::exception &e)
+			{
+				cout<<"Keeping the old certificate: "<<e.what()<<endl;
+			}
+		}
 	}
 
 	proxy.stop();
@@ -0,0 +1,59 @@
+#pragma once
+
+//Minimal checks for the tests without a test framework.
+//A failed check is reported with its line and makes the test program fail
+#include <iostream>
+#include <string>
+#include <vector>
+
+inline int& failed_checks()
+{
+	static int count = 0;
+	return count;
+}
+
+#define CHECK(condition) \
+	do \
+	{ \
+		if(!(condition)) \
+		{ \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #condition ") failed" << std::endl; \
+			++failed_checks(); \
+		} \
+	} while(false)
+
+#define CHECK_EQUAL(actual, expected) \
+	do \
+	{ \
+		const auto& actual_value = (actual); \
+		const auto& expected_value = (expected); \
+		if(!(actual_value == expected_value)) \
+		{ \
+			std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK_EQUAL(" #actual ", " #expected ") failed: \"" \
+				<< actual_value << "\" != \"" << expected_value << "\"" << std::endl; \
+			++failed_checks(); \
+		} \
+	} while(false)
+
+//"9f02283b" -> { 0x9f, 0x02, 0x28, 0x3b }, spaces are skipped
+inline std::vector<unsigned char> from_hex(const std::string& hex)
+{
+	std::vector<unsigned char> bytes;
+	std::string digits;
+	for(char c : hex)
+	{
+		if(c != ' ') digits += c;
+	}
+	for(std::size_t i = 0; i + 1 < digits.length(); i += 2)
+	{
+		bytes.push_back(static_cast<unsigned char>(std::stoi(digits.substr(i, 2), nullptr, 16)));
+	}
+	return bytes;
+}
+
+inline int test_result(const char* name)
+{
+	if(failed_checks() == 0) std::cout << name << ": all checks passed" << std::endl;
+	else std::cout << name << ": " << failed_checks() << " checks failed" << std::endl;
+	return failed_checks() == 0 ? 0 : 1;
+}
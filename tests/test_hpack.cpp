@@ -0,0 +1,155 @@
+//Tests of the HPACK decoder and encoder with the examples of RFC 7541 Appendix C
+#define BOOST_ASIO
+#include "../include/sslproxy.hpp"
+#include "check.hpp"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+using Fields = std::vector<std::pair<std::string, std::string>>;
+
+//Decodes one header block of hex and compares it with the expected fields
+void check_block(Hpack& hpack, const std::string& hex, const Fields& expected)
+{
+	const std::vector<unsigned char> block = from_hex(hex);
+	std::vector<Hpack::Header> headers;
+	bool too_large = false;
+
+	CHECK(hpack.decode(reinterpret_cast<const char*>(block.data()), block.size(), headers, 65536, too_large));
+	CHECK(!too_large);
+	CHECK_EQUAL(headers.size(), expected.size());
+
+	for(std::size_t i = 0; i < headers.size() && i < expected.size(); ++i)
+	{
+		CHECK_EQUAL(headers[i].name, expected[i].first);
+		CHECK_EQUAL(headers[i].value, expected[i].second);
+	}
+}
+
+bool decodes(const std::string& hex)
+{
+	Hpack hpack;
+	const std::vector<unsigned char> block = from_hex(hex);
+	std::vector<Hpack::Header> headers;
+	bool too_large = false;
+	return hpack.decode(reinterpret_cast<const char*>(block.data()), block.size(), headers, 65536, too_large);
+}
+
+//C.2: the single representations
+void test_field_representations()
+{
+	Hpack with_indexing;
+	check_block(with_indexing, "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572", { { "custom-key", "custom-header" } });
+
+	Hpack without_indexing;
+	check_block(without_indexing, "040c 2f73 616d 706c 652f 7061 7468", { { ":path", "/sample/path" } });
+
+	Hpack never_indexed;
+	check_block(never_indexed, "1008 7061 7373 776f 7264 0673 6563 7265 74", { { "password", "secret" } });
+
+	Hpack indexed;
+	check_block(indexed, "82", { { ":method", "GET" } });
+}
+
+//C.3: requests on one connection, without Huffman coding
+void test_requests_without_huffman()
+{
+	Hpack hpack;
+	check_block(hpack, "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+		{ { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" } });
+	check_block(hpack, "8286 84be 5808 6e6f 2d63 6163 6865",
+		{ { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" }, { "cache-control", "no-cache" } });
+	check_block(hpack, "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+		{ { ":method", "GET" }, { ":scheme", "https" }, { ":path", "/index.html" }, { ":authority", "www.example.com" }, { "custom-key", "custom-value" } });
+}
+
+//C.4: the same requests with Huffman coding
+void test_requests_with_huffman()
+{
+	Hpack hpack;
+	check_block(hpack, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+		{ { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" } });
+	check_block(hpack, "8286 84be 5886 a8eb 1064 9cbf",
+		{ { ":method", "GET" }, { ":scheme", "http" }, { ":path", "/" }, { ":authority", "www.example.com" }, { "cache-control", "no-cache" } });
+	check_block(hpack, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+		{ { ":method", "GET" }, { ":scheme", "https" }, { ":path", "/index.html" }, { ":authority", "www.example.com" }, { "custom-key", "custom-value" } });
+}
+
+//C.5: responses with a dynamic table of 256 bytes, so entries get evicted. The examples assume
+//SETTINGS_HEADER_TABLE_SIZE 256, here the first block starts with a table size update instead
+void test_responses_with_eviction()
+{
+	const Fields first = { { ":status", "302" }, { "cache-control", "private" }, { "date", "Mon, 21 Oct 2013 20:13:21 GMT" }, { "location", "https://www.example.com" } };
+	const Fields second = { { ":status", "307" }, { "cache-control", "private" }, { "date", "Mon, 21 Oct 2013 20:13:21 GMT" }, { "location", "https://www.example.com" } };
+	const Fields third = { { ":status", "200" }, { "cache-control", "private" }, { "date", "Mon, 21 Oct 2013 20:13:22 GMT" }, { "location", "https://www.example.com" },
+		{ "content-encoding", "gzip" }, { "set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1" } };
+
+	Hpack hpack;
+	check_block(hpack, "3fe101 4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d", first);
+	check_block(hpack, "4803 3330 37c1 c0bf", second);
+	check_block(hpack, "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 7738 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b 2076 6572 7369 6f6e 3d31", third);
+
+	//C.6: the same with Huffman coding
+	Hpack huffman;
+	check_block(huffman, "3fe101 4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3", first);
+	check_block(huffman, "4883 640e ffc1 c0bf", second);
+	check_block(huffman, "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 65c0 03ed 4ee5 b106 3d50 07", third);
+}
+
+void test_decode_errors()
+{
+	//Index 0 and an index beyond both tables
+	CHECK(!decodes("80"));
+	CHECK(!decodes("ff 00"));
+
+	//A table size update above SETTINGS_HEADER_TABLE_SIZE
+	CHECK(!decodes("3fe21f"));
+
+	//A literal which is longer than the block
+	CHECK(!decodes("400a 6375 7374"));
+
+	//Huffman padding must be the most significant bits of EOS and shorter than 8 bits
+	CHECK(!decodes("4082 94e7 8100"));
+	CHECK(!decodes("4081 00 00"));
+}
+
+//The encoder writes literals without indexing, the decoder reads them back unchanged
+void test_encode_round_trip()
+{
+	std::string block;
+	Hpack::encode_status(block, 200);
+	Hpack::encode_status(block, 302);
+	Hpack::encode(block, "content-type", "text/html; charset=utf-8");
+	Hpack::encode(block, "x-custom", std::string(300, 'a'));
+
+	Hpack hpack;
+	std::vector<Hpack::Header> headers;
+	bool too_large = false;
+	CHECK(hpack.decode(block.data(), block.size(), headers, 65536, too_large));
+	CHECK_EQUAL(headers.size(), 4u);
+	if(headers.size() == 4)
+	{
+		CHECK_EQUAL(headers[0].value, "200");
+		CHECK_EQUAL(headers[1].value, "302");
+		CHECK_EQUAL(headers[2].name, "content-type");
+		CHECK_EQUAL(headers[2].value, "text/html; charset=utf-8");
+		CHECK_EQUAL(headers[3].value.size(), 300u);
+	}
+
+	//Too many headers for the limit are dropped but still decoded
+	headers.clear();
+	CHECK(hpack.decode(block.data(), block.size(), headers, 100, too_large));
+	CHECK(too_large);
+}
+
+int main()
+{
+	test_field_representations();
+	test_requests_without_huffman();
+	test_requests_with_huffman();
+	test_responses_with_eviction();
+	test_decode_errors();
+	test_encode_round_trip();
+	return test_result("test_hpack");
+}
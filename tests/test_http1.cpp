@@ -0,0 +1,259 @@
+//Tests of the HTTP/1.1 head parser, the body framing and the request smuggling checks
+#define BOOST_ASIO
+#include "../include/sslproxy.hpp"
+#include "check.hpp"
+
+#include <string>
+
+//Parses a complete head, or returns the error
+HttpHeadParser::Result parse(HttpHeadParser& parser, const std::string& head)
+{
+	return parser.parse(head.data(), head.length());
+}
+
+//Feeds body to a framing started with mode and returns the bytes it used.
+//The body is split at split, 0 feeds it at once
+std::size_t consume_split(HttpBodyFraming::Mode mode, std::size_t length, const std::string& body, std::size_t split, HttpBodyFraming& framing)
+{
+	framing.start(mode, length);
+	if(split == 0) return framing.consume(body.data(), body.length());
+
+	std::size_t used = framing.consume(body.data(), split);
+	if(used == split) used += framing.consume(body.data() + split, body.length() - split);
+	return used;
+}
+
+HttpMessageFraming::Decision frame_request(const std::string& head, HttpBodyFraming& body)
+{
+	HttpHeadParser parser(HttpHeadParser::Kind::request);
+	CHECK(parse(parser, head) == HttpHeadParser::Result::complete);
+	return HttpMessageFraming::start_request(parser, body);
+}
+
+HttpMessageFraming::Decision frame_response(const std::string& head, HttpBodyFraming& body)
+{
+	HttpHeadParser parser(HttpHeadParser::Kind::response);
+	CHECK(parse(parser, head) == HttpHeadParser::Result::complete);
+	return HttpMessageFraming::start_response(parser, HttpMessageFraming::Method::other, body);
+}
+
+bool rejected(const std::string& head)
+{
+	HttpBodyFraming body;
+	return frame_request(head, body).invalid;
+}
+
+//The bytes arrive in two reads, split anywhere: the result is the same as in one read
+void test_head_split_across_reads()
+{
+	const std::string head = "POST /upload?a=1 HTTP/1.1\r\nHost: example.com\r\nX-Empty:\r\nX-Spaces: \t value \t\r\nContent-Length: 4\r\n\r\n";
+	const std::string data = head + "BODY";
+
+	for(std::size_t split = 1; split < data.length(); ++split)
+	{
+		HttpHeadParser parser(HttpHeadParser::Kind::request);
+		const HttpHeadParser::Result first = parser.parse(data.data(), split);
+		CHECK(first == (split < head.length() ? HttpHeadParser::Result::incomplete : HttpHeadParser::Result::complete));
+
+		CHECK(parser.parse(data.data(), data.length()) == HttpHeadParser::Result::complete);
+		CHECK_EQUAL(parser.head_length(), head.length());
+		CHECK_EQUAL(parser.method(), "POST");
+		CHECK_EQUAL(parser.target(), "/upload?a=1");
+		CHECK_EQUAL(parser.version_minor(), 1);
+		CHECK_EQUAL(parser.header_count(), 4u);
+
+		std::string_view value;
+		CHECK(parser.find("x-spaces", value) && value == "value");
+		CHECK(parser.find("X-Empty", value) && value.empty());
+	}
+}
+
+//Byte by byte, with bare LF line ends
+void test_head_byte_by_byte()
+{
+	const std::string head = "HTTP/1.0 404 Not Found\nContent-Length: 0\n\n";
+
+	HttpHeadParser parser(HttpHeadParser::Kind::response);
+	for(std::size_t length = 1; length < head.length(); ++length)
+	{
+		CHECK(parser.parse(head.data(), length) == HttpHeadParser::Result::incomplete);
+	}
+	CHECK(parse(parser, head) == HttpHeadParser::Result::complete);
+	CHECK_EQUAL(parser.status_code(), 404);
+	CHECK_EQUAL(parser.reason(), "Not Found");
+	CHECK_EQUAL(parser.version_minor(), 0);
+}
+
+void test_head_errors()
+{
+	HttpHeadParser request(HttpHeadParser::Kind::request);
+	CHECK(parse(request, "GET / HTTP/1.1\r\nX-A: 1\r\n folded\r\n\r\n") == HttpHeadParser::Result::error);
+	CHECK(!request.too_large());
+
+	//Responses may still fold, the fold joins the value
+	HttpHeadParser response(HttpHeadParser::Kind::response);
+	CHECK(parse(response, "HTTP/1.1 200 OK\r\nX-A: 1\r\n folded\r\n\r\n") == HttpHeadParser::Result::complete);
+	std::string_view value;
+	CHECK(response.find("X-A", value) && value == "1\r\n folded");
+
+	request.reset();
+	CHECK(parse(request, "GET / HTTP/1.1\r\nContent-Length : 5\r\n\r\n") == HttpHeadParser::Result::error);
+	request.reset();
+	CHECK(parse(request, "GET / HTTP/1.1\r\nno colon\r\n\r\n") == HttpHeadParser::Result::error);
+	request.reset();
+	CHECK(parse(request, "GET /\r\n\r\n") == HttpHeadParser::Result::error);
+	CHECK(request.method().empty());
+
+	std::string many = "GET / HTTP/1.1\r\n";
+	for(int i = 0; i <= HttpHeadParser::max_headers; ++i) many += "X-" + std::to_string(i) + ": v\r\n";
+	request.reset();
+	CHECK(parse(request, many + "\r\n") == HttpHeadParser::Result::error);
+	CHECK(request.too_large());
+}
+
+void test_chunked_split_anywhere()
+{
+	const std::string body = "5;name=\"value\"\r\nhello\r\nA\r\n0123456789\r\n0\r\nTrailer: x\r\nOther: y\r\n\r\n";
+	const std::string data = body + "GET /next HTTP/1.1\r\n";
+
+	for(std::size_t split = 0; split < data.length(); ++split)
+	{
+		HttpBodyFraming framing;
+		CHECK_EQUAL(consume_split(HttpBodyFraming::Mode::chunked, 0, data, split, framing), body.length());
+		CHECK(framing.done());
+		CHECK(!framing.error());
+	}
+
+	std::string decoded_data = body;
+	HttpBodyFraming framing;
+	framing.start(HttpBodyFraming::Mode::chunked);
+	std::size_t decoded = 0;
+	CHECK_EQUAL(framing.decode(&decoded_data[0], decoded_data.length(), decoded), body.length());
+	CHECK_EQUAL(decoded_data.substr(0, decoded), "hello0123456789");
+}
+
+void test_chunked_edge_cases()
+{
+	HttpBodyFraming framing;
+
+	//The last chunk alone, also with bare LF
+	CHECK_EQUAL(consume_split(HttpBodyFraming::Mode::chunked, 0, "0\r\n\r\nX", 0, framing), 5u);
+	CHECK(framing.done());
+	CHECK_EQUAL(consume_split(HttpBodyFraming::Mode::chunked, 0, "0\n\nX", 0, framing), 3u);
+	CHECK(framing.done());
+
+	//Upper and lower case hex, leading zeros
+	CHECK_EQUAL(consume_split(HttpBodyFraming::Mode::chunked, 0, "000a\r\n0123456789\r\nB\r\n0123456789a\r\n0\r\n\r\n", 0, framing), 39u);
+	CHECK(framing.done() && !framing.error());
+
+	//Not a chunk size: everything else belongs to the body
+	consume_split(HttpBodyFraming::Mode::chunked, 0, "g\r\nxx", 0, framing);
+	CHECK(framing.error());
+	CHECK(framing.mode() == HttpBodyFraming::Mode::until_close);
+	consume_split(HttpBodyFraming::Mode::chunked, 0, "\r\n0\r\n\r\n", 0, framing);
+	CHECK(framing.error());
+	consume_split(HttpBodyFraming::Mode::chunked, 0, "-1\r\n", 0, framing);
+	CHECK(framing.error());
+
+	//A size which overflows
+	consume_split(HttpBodyFraming::Mode::chunked, 0, "10000000000000000\r\n", 0, framing);
+	CHECK(framing.error());
+
+	//The data must be followed by a line end
+	consume_split(HttpBodyFraming::Mode::chunked, 0, "5\r\nhelloX\r\n0\r\n\r\n", 0, framing);
+	CHECK(framing.error());
+
+	//An incomplete trailer keeps the body open
+	CHECK_EQUAL(consume_split(HttpBodyFraming::Mode::chunked, 0, "0\r\nTrailer: x", 0, framing), 13u);
+	CHECK(!framing.done() && !framing.error());
+
+	//Content-Length bodies end after the length, an empty one at once
+	CHECK_EQUAL(consume_split(HttpBodyFraming::Mode::length, 5, "helloGET", 2, framing), 5u);
+	CHECK(framing.done());
+	framing.start(HttpBodyFraming::Mode::length, 0);
+	CHECK(framing.done());
+}
+
+void test_request_smuggling()
+{
+	const std::string line = "POST / HTTP/1.1\r\nHost: x\r\n";
+
+	CHECK(rejected(line + "Content-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n"));
+	CHECK(rejected(line + "Transfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n"));
+	CHECK(rejected(line + "Content-Length: 5\r\nContent-Length: 6\r\n\r\n"));
+	CHECK(rejected(line + "Content-Length: 5, 6\r\n\r\n"));
+	CHECK(rejected(line + "Content-Length: +5\r\n\r\n"));
+	CHECK(rejected(line + "Content-Length: 0x5\r\n\r\n"));
+	CHECK(rejected(line + "Content-Length:\r\n\r\n"));
+	CHECK(rejected(line + "Transfer-Encoding: gzip\r\n\r\n"));
+	CHECK(rejected(line + "Transfer-Encoding: chunked, gzip\r\n\r\n"));
+	CHECK(rejected(line + "Transfer-Encoding: chunked\r\nTransfer-Encoding: identity\r\n\r\n"));
+	CHECK(rejected(line + "Transfer-Encoding: chunked\r\nTransfer-Encoding: chunked\r\n\r\n"));
+	CHECK(rejected(line + "Transfer-Encoding: xchunked\r\n\r\n"));
+	CHECK(rejected(line + "Transfer-Encoding:\r\n\r\n"));
+	CHECK(rejected("POST / HTTP/1.0\r\nTransfer-Encoding: chunked\r\n\r\n"));
+
+	HttpBodyFraming body;
+	HttpMessageFraming::Decision decision = frame_request(line + "Content-Length: 5\r\ncontent-length: 5\r\n\r\n", body);
+	CHECK(!decision.invalid && decision.reusable);
+	CHECK(body.mode() == HttpBodyFraming::Mode::length && body.remaining() == 5);
+
+	decision = frame_request(line + "Content-Length: 7, 7\r\n\r\n", body);
+	CHECK(!decision.invalid && body.remaining() == 7);
+
+	//Several Transfer-Encoding headers form one list
+	decision = frame_request(line + "Transfer-Encoding: gzip\r\nTransfer-Encoding: Chunked\r\n\r\n", body);
+	CHECK(!decision.invalid);
+	CHECK(body.mode() == HttpBodyFraming::Mode::chunked);
+
+	decision = frame_request("GET / HTTP/1.1\r\nHost: x\r\n\r\n", body);
+	CHECK(!decision.invalid && !decision.tunnel && decision.reusable && body.done());
+
+	decision = frame_request("CONNECT example.com:443 HTTP/1.1\r\nHost: example.com\r\n\r\n", body);
+	CHECK(decision.tunnel && !decision.reusable);
+
+	decision = frame_request("GET / HTTP/1.0\r\n\r\n", body);
+	CHECK(!decision.invalid && !decision.reusable);
+}
+
+void test_response_framing()
+{
+	HttpBodyFraming body;
+
+	//Transfer-Encoding wins, but the connection isn't reused
+	HttpMessageFraming::Decision decision = frame_response("HTTP/1.1 200 OK\r\nContent-Length: 5\r\nTransfer-Encoding: chunked\r\n\r\n", body);
+	CHECK(body.mode() == HttpBodyFraming::Mode::chunked);
+	CHECK(!decision.reusable);
+
+	decision = frame_response("HTTP/1.1 200 OK\r\nContent-Length: 5\r\nContent-Length: 6\r\n\r\n", body);
+	CHECK(body.mode() == HttpBodyFraming::Mode::until_close);
+	CHECK(!decision.reusable);
+
+	decision = frame_response("HTTP/1.1 200 OK\r\nTransfer-Encoding: gzip\r\n\r\n", body);
+	CHECK(body.mode() == HttpBodyFraming::Mode::until_close);
+
+	decision = frame_response("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n", body);
+	CHECK(body.mode() == HttpBodyFraming::Mode::length && decision.reusable);
+
+	decision = frame_response("HTTP/1.1 204 No Content\r\nContent-Length: 5\r\n\r\n", body);
+	CHECK(body.done() && decision.reusable);
+
+	decision = frame_response("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n\r\n", body);
+	CHECK(decision.tunnel && !decision.reusable);
+
+	CHECK(HttpMessageFraming::error_response(400).substr(0, 13) == "HTTP/1.1 400 ");
+	CHECK(HttpMessageFraming::error_response(431).substr(0, 13) == "HTTP/1.1 431 ");
+	CHECK(HttpMessageFraming::error_response(502).substr(0, 13) == "HTTP/1.1 502 ");
+}
+
+int main()
+{
+	test_head_split_across_reads();
+	test_head_byte_by_byte();
+	test_head_errors();
+	test_chunked_split_anywhere();
+	test_chunked_edge_cases();
+	test_request_smuggling();
+	test_response_framing();
+	return test_result("test_http1");
+}
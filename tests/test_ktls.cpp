@@ -0,0 +1,40 @@
+//Known answer tests of the TLS 1.3 key schedule used for kernel TLS
+#define BOOST_ASIO
+#include "../include/sslproxy.hpp"
+#include "check.hpp"
+
+#ifdef SSLPROXY_HAS_KTLS
+//RFC 8448 3. Simple 1-RTT Handshake, TLS_AES_128_GCM_SHA256
+void test_rfc8448_application_key()
+{
+	KtlsOffload::Keys server;
+	CHECK(KtlsOffload::derive_tls13(EVP_sha256(), from_hex("a1 1a f9 f0 55 31 f8 56 ad 47 11 6b 45 a9 50 32 82 04 b4 f4 4b fb 6b 3a 4b 4f 1f 3f cb 63 16 43"), 16, server));
+	CHECK(server.key == from_hex("9f 02 28 3b 6c 9c 07 ef c2 6b b9 f2 ac 92 e3 56"));
+	CHECK(server.iv == from_hex("cf 78 2b 88 dd 83 54 9a ad f1 e9 84"));
+}
+
+//RFC 8448 3. the handshake traffic secrets
+void test_rfc8448_handshake_keys()
+{
+	KtlsOffload::Keys server;
+	CHECK(KtlsOffload::derive_tls13(EVP_sha256(), from_hex("b6 7b 7d 69 0c c1 6c 4e 75 e5 42 13 cb 2d 37 b4 e9 c9 12 bc de d9 10 5d 42 be fd 59 d3 91 ad 38"), 16, server));
+	CHECK(server.key == from_hex("3f ce 51 60 09 c2 17 27 d0 f2 e4 e8 6e e4 03 bc"));
+	CHECK(server.iv == from_hex("5d 31 3e b2 67 12 76 ee 13 00 0b 30"));
+
+	KtlsOffload::Keys client;
+	CHECK(KtlsOffload::derive_tls13(EVP_sha256(), from_hex("b3 ed db 12 6e 06 7f 35 a7 80 b3 ab f4 5e 2d 8f 3b 1a 95 07 38 f5 2e 96 00 74 6a 0e 27 a5 5a 21"), 16, client));
+	CHECK(client.key == from_hex("db fa a6 93 d1 76 2c 5b 66 6a f5 d9 50 25 8d 01"));
+	CHECK(client.iv == from_hex("5b d3 c7 1b 83 6e 0b 76 bb 73 26 5f"));
+}
+#endif
+
+int main()
+{
+#ifdef SSLPROXY_HAS_KTLS
+	test_rfc8448_application_key();
+	test_rfc8448_handshake_keys();
+#else
+	std::cout << "test_ktls: kernel TLS is not available on this system" << std::endl;
+#endif
+	return test_result("test_ktls");
+}